@@ -0,0 +1,486 @@
+// whatmud-bench: microbenchmarks for the engine's hot paths.
+// Each benchmark is calibrated to run for at least --min-time seconds, then
+// repeated, reporting the median and spread of the time per operation. A
+// full garbage collection runs before each repetition so they start from the
+// same heap state. Compare runs of the same build type on the same machine.
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <fmt/core.h>
+#include <libtelnet.h>
+#include <uv.h>
+
+#include "connection.hpp"
+#include "engine.hpp"
+#include "lua/helpers.hpp"
+#include "uv/error.hpp"
+#include "uv/pipe.hpp"
+
+namespace whatmud::bench {
+
+// A game with one command, and one connection to send it to
+static const char INIT_LUA[] = R"(
+log_level = "warn"
+worker_threads = 0
+client_handler = "client_handler"
+commands.add("say", function(conn, args, rest)
+  conn:writeln("You say: ", rest)
+end)
+)";
+
+// Everything the benchmarks share
+struct Context {
+  Engine *engine;
+  lua_State *L;
+  Connection *conn;
+  // The client's end of the connection, read and thrown away
+  uv::Pipe *client;
+  char client_buf[65536];
+};
+
+// Run one loop iteration, letting connections handle input and flush output
+static void run_once(Context &ctx) {
+  uv_run(ctx.engine->getLoop(), UV_RUN_NOWAIT);
+}
+
+// A small type for the userdata benchmarks
+struct Point {
+  double x;
+  double y;
+};
+
+// Runs `iterations` operations
+using BenchFn = void (*)(Context &ctx, std::uint64_t iterations);
+
+struct Benchmark {
+  const char *name;
+  BenchFn fn;
+};
+
+// Input
+
+static void bench_input_framing(Context &ctx, std::uint64_t iterations) {
+  // Blank lines are framed and sanitised but don't run a command
+  static const char line[] = "      \r\n";
+  for (std::uint64_t i = 0; i < iterations; ++i) {
+    telnet_recv(ctx.conn->getTelnet(), line, sizeof(line) - 1);
+    if (i % 64 == 63) {
+      run_once(ctx);
+    }
+  }
+  run_once(ctx);
+}
+
+static void bench_input_telnet(Context &ctx, std::uint64_t iterations) {
+  // Telnet commands mixed into an otherwise blank line
+  static const char data[] = "  \xff\xf1  \xff\xf1  \xff\xf1  \r\n";
+  for (std::uint64_t i = 0; i < iterations; ++i) {
+    telnet_recv(ctx.conn->getTelnet(), data, sizeof(data) - 1);
+    if (i % 64 == 63) {
+      run_once(ctx);
+    }
+  }
+  run_once(ctx);
+}
+
+static void bench_input_command(Context &ctx, std::uint64_t iterations) {
+  static const char line[] = "say hello there\r\n";
+  for (std::uint64_t i = 0; i < iterations; ++i) {
+    telnet_recv(ctx.conn->getTelnet(), line, sizeof(line) - 1);
+    // Commands run one at a time, each on the loop iteration after the last
+    run_once(ctx);
+  }
+}
+
+// Output
+
+static void bench_output_send(Context &ctx, std::uint64_t iterations) {
+  static const std::string text(78, 'x');
+  for (std::uint64_t i = 0; i < iterations; ++i) {
+    ctx.conn->send(text);
+    ctx.conn->send("\r\n");
+    if (i % 64 == 63) {
+      run_once(ctx);
+    }
+  }
+  run_once(ctx);
+}
+
+static void bench_output_send_iac(Context &ctx, std::uint64_t iterations) {
+  // Every 0xff has to be escaped
+  static const std::string text(80, '\xff');
+  for (std::uint64_t i = 0; i < iterations; ++i) {
+    ctx.conn->send(text);
+    if (i % 64 == 63) {
+      run_once(ctx);
+    }
+  }
+  run_once(ctx);
+}
+
+static void bench_output_lua_value(Context &ctx, std::uint64_t iterations) {
+  lua_State *L = ctx.L;
+  lua_createtable(L, 3, 0);
+  lua::push(L, "You say: ");
+  lua_rawseti(L, -2, 1);
+  lua::push(L, "hello there");
+  lua_rawseti(L, -2, 2);
+  lua::push(L, "\r\n");
+  lua_rawseti(L, -2, 3);
+  for (std::uint64_t i = 0; i < iterations; ++i) {
+    ctx.conn->sendLuaValue(L, -1);
+    if (i % 64 == 63) {
+      run_once(ctx);
+    }
+  }
+  lua_pop(L, 1);
+  run_once(ctx);
+}
+
+// Lua stack helpers
+
+static void bench_push_get_integer(Context &ctx, std::uint64_t iterations) {
+  lua_State *L = ctx.L;
+  lua_Integer sum = 0;
+  for (std::uint64_t i = 0; i < iterations; ++i) {
+    lua::push(L, static_cast<lua_Integer>(i));
+    lua_Integer val;
+    sum += lua::get(L, -1, val);
+    lua_pop(L, 1);
+  }
+  if (sum == -1) {
+    std::abort(); // Keep the loop from being optimised away
+  }
+}
+
+static void bench_push_get_string(Context &ctx, std::uint64_t iterations) {
+  lua_State *L = ctx.L;
+  std::string_view text = "a short string";
+  std::size_t sum = 0;
+  for (std::uint64_t i = 0; i < iterations; ++i) {
+    lua::push(L, text);
+    std::string_view val;
+    sum += lua::get(L, -1, val).size();
+    lua_pop(L, 1);
+  }
+  if (sum == 1) {
+    std::abort();
+  }
+}
+
+static void bench_get_std_string(Context &ctx, std::uint64_t iterations) {
+  lua_State *L = ctx.L;
+  lua::push(L, "a string too long for the small string optimisation");
+  std::size_t sum = 0;
+  for (std::uint64_t i = 0; i < iterations; ++i) {
+    std::string val;
+    sum += lua::get(L, -1, val).size();
+  }
+  lua_pop(L, 1);
+  if (sum == 1) {
+    std::abort();
+  }
+}
+
+static void bench_arg(Context &ctx, std::uint64_t iterations) {
+  lua_State *L = ctx.L;
+  int base = lua_gettop(L);
+  lua::push(L, "look");
+  lua::push(L, static_cast<lua_Integer>(42));
+  std::size_t sum = 0;
+  for (std::uint64_t i = 0; i < iterations; ++i) {
+    std::string_view str;
+    lua_Integer num;
+    sum += lua::arg(L, base + 1, str).size();
+    sum += static_cast<std::size_t>(lua::arg(L, base + 2, num));
+  }
+  lua_settop(L, base);
+  if (sum == 1) {
+    std::abort();
+  }
+}
+
+// Userdata
+
+static void bench_new_userdata(Context &ctx, std::uint64_t iterations) {
+  lua_State *L = ctx.L;
+  for (std::uint64_t i = 0; i < iterations; ++i) {
+    lua::new_userdata_uv<Point>(L, 1, Point{1, 2});
+    lua_pop(L, 1);
+  }
+}
+
+static void bench_check_userdata(Context &ctx, std::uint64_t iterations) {
+  lua_State *L = ctx.L;
+  lua::new_userdata<Point>(L, Point{1, 2});
+  double sum = 0;
+  for (std::uint64_t i = 0; i < iterations; ++i) {
+    sum += lua::check_userdata<Point>(L, -1)->x;
+  }
+  lua_pop(L, 1);
+  if (sum == -1) {
+    std::abort();
+  }
+}
+
+// Connections
+
+static void bench_make_environment(Context &ctx, std::uint64_t iterations) {
+  lua_State *L = ctx.L;
+  // What Connection::create() does for each new client, minus the socket
+  for (std::uint64_t i = 0; i < iterations; ++i) {
+    lua_State *co = lua_newthread(L);
+    lua_pushboolean(co, true); // Stands in for the connection
+    Connection::makeEnvironment(co);
+    lua_pop(L, 1);
+  }
+}
+
+static const Benchmark BENCHMARKS[]{
+    {"input/framing", bench_input_framing},
+    {"input/telnet", bench_input_telnet},
+    {"input/command", bench_input_command},
+    {"output/send", bench_output_send},
+    {"output/send_iac", bench_output_send_iac},
+    {"output/lua_value", bench_output_lua_value},
+    {"lua/push_get_integer", bench_push_get_integer},
+    {"lua/push_get_string", bench_push_get_string},
+    {"lua/get_std_string", bench_get_std_string},
+    {"lua/arg", bench_arg},
+    {"userdata/new_userdata_uv", bench_new_userdata},
+    {"userdata/check_userdata", bench_check_userdata},
+    {"connection/make_environment", bench_make_environment},
+};
+
+struct Result {
+  const char *name;
+  std::uint64_t iterations;
+  // Nanoseconds per operation of each repetition, sorted
+  std::vector<double> ns_per_op;
+
+  double median() const {
+    std::size_t n = ns_per_op.size();
+    return n % 2 ? ns_per_op[n / 2]
+                 : (ns_per_op[n / 2 - 1] + ns_per_op[n / 2]) / 2;
+  }
+  double mean() const {
+    double sum = 0;
+    for (double ns : ns_per_op) {
+      sum += ns;
+    }
+    return sum / ns_per_op.size();
+  }
+  double stddev() const {
+    double m = mean();
+    double sum = 0;
+    for (double ns : ns_per_op) {
+      sum += (ns - m) * (ns - m);
+    }
+    return std::sqrt(sum / ns_per_op.size());
+  }
+};
+
+static std::uint64_t time_run(Context &ctx, const Benchmark &bench,
+                              std::uint64_t iterations) {
+  lua_gc(ctx.L, LUA_GCCOLLECT);
+  std::uint64_t start = uv_hrtime();
+  bench.fn(ctx, iterations);
+  return uv_hrtime() - start;
+}
+
+static Result run(Context &ctx, const Benchmark &bench, double min_time,
+                  unsigned repetitions) {
+  // Find how many iterations fill min_time, which also warms up
+  auto target = static_cast<std::uint64_t>(min_time * 1e9);
+  std::uint64_t iterations = 1;
+  for (;;) {
+    std::uint64_t ns = time_run(ctx, bench, iterations);
+    if (ns >= target) {
+      break;
+    }
+    if (ns < target / 100) {
+      iterations *= 10;
+    } else {
+      // Aim a little over, so the next run usually makes it
+      iterations = static_cast<std::uint64_t>(
+          iterations * 1.2 * target / std::max<std::uint64_t>(ns, 1)) + 1;
+    }
+  }
+
+  Result result{bench.name, iterations, {}};
+  for (unsigned i = 0; i < repetitions; ++i) {
+    std::uint64_t ns = time_run(ctx, bench, iterations);
+    result.ns_per_op.push_back(static_cast<double>(ns) / iterations);
+  }
+  std::sort(result.ns_per_op.begin(), result.ns_per_op.end());
+  return result;
+}
+
+// Create a throwaway game directory for the engine
+static std::filesystem::path make_game_dir() {
+  std::string dir = (std::filesystem::temp_directory_path() /
+                     "whatmud-bench-XXXXXX")
+                        .string();
+  if (mkdtemp(dir.data()) == nullptr) {
+    throw std::runtime_error("Could not create a temporary game directory");
+  }
+  std::filesystem::path path(dir);
+  auto write = [&](const char *name, std::string_view text) {
+    FILE *file = std::fopen((path / name).c_str(), "w");
+    if (file == nullptr ||
+        std::fwrite(text.data(), 1, text.size(), file) != text.size() ||
+        std::fclose(file) != 0) {
+      throw std::runtime_error(fmt::format("Could not write {}", name));
+    }
+  };
+  write("init.lua", INIT_LUA);
+  write("client_handler.lua", "");
+  return path;
+}
+
+// Connect a Connection to one end of a socket pair, as a copyover would
+static void connect(Context &ctx) {
+  uv_os_sock_t socks[2];
+  int res = uv_socketpair(SOCK_STREAM, 0, socks, 0, 0);
+  uv::check_error(res, "Could not create a socket pair");
+
+  lua_State *L = ctx.L;
+  ctx.conn = Connection::create(ctx.engine, L);
+  lua_pop(L, 1); // Coroutine
+  lua_createtable(L, 0, 3);
+  lua::push(L, static_cast<lua_Integer>(socks[0]));
+  lua_setfield(L, -2, "fd");
+  lua_pushboolean(L, true);
+  lua_setfield(L, -2, "utf8");
+  lua::push(L, static_cast<lua_Integer>(ColourDepth::ANSI16));
+  lua_setfield(L, -2, "colour");
+  ctx.conn->adopt(L, -1);
+  lua_pop(L, 1);
+
+  ctx.client = new uv::Pipe(ctx.engine->getLoop());
+  ctx.client->open(socks[1]);
+  ctx.client->setData(&ctx);
+  ctx.client->readStart(
+      [](uv_handle_t *handle, std::size_t, uv_buf_t *buf) {
+        Context *ctx = static_cast<Context *>(handle->data);
+        *buf = uv_buf_init(ctx->client_buf, sizeof(ctx->client_buf));
+      },
+      [](uv_stream_t *, ssize_t, const uv_buf_t *) {});
+}
+
+} // namespace whatmud::bench
+
+namespace bench = whatmud::bench;
+
+[[noreturn]] static void usage(char *argv[], const char *errmsg) {
+  const char *prog = argv[0] ? argv[0] : "whatmud-bench";
+  fmt::print(stderr, "Error: {}\n", errmsg);
+  fmt::print(stderr,
+             "Usage: {} [options] [filter]\n"
+             "  --list             list benchmarks and exit\n"
+             "  --json             print the results as JSON\n"
+             "  --repetitions <n>  timed runs of each benchmark (5)\n"
+             "  --min-time <s>     minimum length of each run (0.1)\n"
+             "Only benchmarks whose names contain the filter are run\n",
+             prog);
+  std::exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+  argv = uv_setup_args(argc, argv);
+
+  bool json = false;
+  unsigned repetitions = 5;
+  double min_time = 0.1;
+  std::string_view filter;
+  for (int i = 1; i < argc; ++i) {
+    std::string_view arg(argv[i]);
+    if (arg == "--list") {
+      for (const bench::Benchmark &bench : bench::BENCHMARKS) {
+        fmt::print("{}\n", bench.name);
+      }
+      return EXIT_SUCCESS;
+    } else if (arg == "--json") {
+      json = true;
+    } else if (arg == "--repetitions" || arg == "--min-time") {
+      if (++i == argc) {
+        usage(argv, "Missing option value");
+      }
+      char *end;
+      double value = std::strtod(argv[i], &end);
+      if (*end != '\0' || value <= 0) {
+        usage(argv, "Expected a positive number");
+      }
+      if (arg == "--repetitions") {
+        repetitions = static_cast<unsigned>(std::max(value, 1.0));
+      } else {
+        min_time = value;
+      }
+    } else if (filter.empty() && !arg.starts_with("-")) {
+      filter = arg;
+    } else {
+      usage(argv, "Unknown argument");
+    }
+  }
+
+  std::vector<bench::Result> results;
+  try {
+    std::filesystem::path game_dir = bench::make_game_dir();
+    // The engine is never destroyed, its handles are never closed
+    bench::Context *ctx = new bench::Context();
+    ctx->engine = new whatmud::Engine(game_dir.c_str(), true);
+    ctx->L = ctx->engine->getLuaState();
+    bench::connect(*ctx);
+    std::filesystem::remove_all(game_dir);
+
+    for (const bench::Benchmark &bench : bench::BENCHMARKS) {
+      if (std::string_view(bench.name).find(filter) == std::string::npos) {
+        continue;
+      }
+      results.push_back(bench::run(*ctx, bench, min_time, repetitions));
+      if (!json) {
+        const bench::Result &result = results.back();
+        fmt::print("{:<30} {:>10.1f} ns/op  min {:>8.1f}  max {:>8.1f}  "
+                   "sd {:.1f}%  ({} iterations)\n",
+                   result.name, result.median(), result.ns_per_op.front(),
+                   result.ns_per_op.back(),
+                   100 * result.stddev() / result.mean(), result.iterations);
+      }
+    }
+  } catch (const std::exception &e) {
+    fmt::print(stderr, "Error: {}\n", e.what());
+    return EXIT_FAILURE;
+  }
+
+  if (json) {
+#ifdef NDEBUG
+    const char *build = "release";
+#else
+    const char *build = "debug";
+#endif
+    std::string benchmarks;
+    for (const bench::Result &result : results) {
+      benchmarks += fmt::format(
+          "{}{{\"name\":\"{}\",\"iterations\":{},\"repetitions\":{},"
+          "\"ns_per_op\":{{\"median\":{:.3f},\"mean\":{:.3f},\"min\":{:.3f},"
+          "\"max\":{:.3f},\"stddev\":{:.3f}}}}}",
+          benchmarks.empty() ? "" : ",", result.name, result.iterations,
+          result.ns_per_op.size(), result.median(), result.mean(),
+          result.ns_per_op.front(), result.ns_per_op.back(),
+          result.stddev());
+    }
+    fmt::print("{{\"context\":{{\"build\":\"{}\",\"lua\":\"{}\","
+               "\"libuv\":\"{}\",\"min_time\":{}}},\"benchmarks\":[{}]}}\n",
+               build, LUA_RELEASE, uv_version_string(), min_time, benchmarks);
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,536 @@
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <cstdint>
+#include <sstream>
+#include <stdexcept>
+#include <system_error>
+
+#include <fmt/format.h>
+#ifndef _WIN32
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "admin_socket.hpp"
+#include "connection.hpp"
+#include "engine.hpp"
+#include "log.hpp"
+#include "lua/helpers.hpp"
+#include "uv/error.hpp"
+
+namespace whatmud {
+
+// One admin's connection, deleted once its handle has closed
+struct AdminSocket::Client {
+  Client(AdminSocket *socket)
+      : pipe(socket->m_engine->getLoop()), socket(socket) {
+    pipe.setData(this);
+  }
+
+  void close() {
+    if (!pipe.isClosing()) {
+      pipe.close([](uv_handle_t *handle) {
+        delete static_cast<Client *>(handle->data);
+      });
+    }
+  }
+
+  void send(std::string data);
+
+  uv::Pipe pipe;
+  AdminSocket *socket;
+  // Input not yet ending in a newline
+  std::string input;
+  char buf[1024];
+};
+
+namespace {
+
+// The request owns the buffer's memory until the write completes
+struct WriteReq {
+  uv_write_t req;
+  std::string data;
+};
+
+} // namespace
+
+void AdminSocket::Client::send(std::string data) {
+  WriteReq *wr = new WriteReq{{}, std::move(data)};
+  uv_buf_t out = uv_buf_init(wr->data.data(), wr->data.size());
+  try {
+    pipe.write(&wr->req, &out, [](uv_write_t *req, int) {
+      delete reinterpret_cast<WriteReq *>(req);
+    });
+  } catch (const uv::Error &) {
+    delete wr;
+    close();
+  }
+}
+
+AdminSocket::AdminSocket(Engine *engine, std::string path)
+    : Pipe(engine->getLoop()), m_log(log::get("admin")), m_engine(engine),
+      m_path(std::move(path)) {
+  setData(this);
+
+#ifdef _WIN32
+  // A named pipe, which isn't a file and goes away with its last handle
+  bind(m_path.c_str());
+#else
+  // A socket left behind by a previous run that didn't exit cleanly, or by
+  // the process before a copyover, stops us binding
+  struct stat st;
+  if (lstat(m_path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) {
+    unlink(m_path.c_str());
+  }
+  bind(m_path.c_str());
+  // Nobody can connect until we listen, so there's no window where the
+  // socket is open to everyone
+  if (chmod(m_path.c_str(), S_IRUSR | S_IWUSR) < 0) {
+    int err = errno;
+    unlink(m_path.c_str());
+    throw std::system_error(err, std::generic_category(),
+                            "Could not restrict access to " + m_path);
+  }
+#endif
+}
+
+AdminSocket::~AdminSocket() {
+#ifndef _WIN32
+  unlink(m_path.c_str());
+#endif
+}
+
+void AdminSocket::listen() {
+  m_log->info("Admin socket listening on {}", m_path);
+
+  Pipe::listen(4, [](uv_stream_t *handle, int status) {
+    AdminSocket *socket = reinterpret_cast<AdminSocket *>(handle->data);
+    if (status < 0) {
+      socket->m_log->warn("Could not accept admin connection: {}",
+                          uv_strerror(status));
+      return;
+    }
+    socket->onNewConnection();
+  });
+}
+
+void AdminSocket::onNewConnection() {
+  Client *client = new Client(this);
+  int res = uv_accept(asStream(), client->pipe.asStream());
+  if (res < 0) {
+    m_log->warn("Could not accept admin connection: {}", uv_strerror(res));
+    client->close();
+    return;
+  }
+  m_log->info("Admin connected");
+
+  client->pipe.readStart(
+      [](uv_handle_t *handle, std::size_t suggested_size, uv_buf_t *buf) {
+        (void)suggested_size;
+        Client *client = static_cast<Client *>(handle->data);
+        *buf = uv_buf_init(client->buf, sizeof(client->buf));
+      },
+      [](uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf) {
+        Client *client = static_cast<Client *>(stream->data);
+        if (nread == 0) {
+          return; // EAGAIN
+        } else if (nread < 0) {
+          client->close(); // EOF or a read error
+          return;
+        }
+        client->input.append(buf->base, static_cast<std::size_t>(nread));
+
+        std::size_t start = 0;
+        std::size_t end;
+        while ((end = client->input.find('\n', start)) != std::string::npos) {
+          std::string_view line(client->input.data() + start, end - start);
+          start = end + 1;
+          bool quit = false;
+          client->send(client->socket->execute(line, quit));
+          if (quit) {
+            client->pipe.readStop();
+            client->close();
+            return;
+          }
+        }
+        client->input.erase(0, start);
+        if (client->input.size() > MAX_LINE) {
+          client->send("error: line too long\n");
+          client->close();
+        }
+      });
+}
+
+const AdminSocket::Command AdminSocket::COMMANDS[]{
+    {"help", "", "List commands", &AdminSocket::cmdHelp},
+    {"connections", "",
+     "List connections with their client, queues, traffic and coroutine",
+     &AdminSocket::cmdConnections},
+    {"handles", "", "List every libuv handle on the loop",
+     &AdminSocket::cmdHandles},
+    {"listeners", "", "List listeners and how many clients they've accepted",
+     &AdminSocket::cmdListeners},
+    {"lua", "", "Show Lua memory use", &AdminSocket::cmdLua},
+    {"gc", "", "Run a full garbage collection", &AdminSocket::cmdGc},
+    {"kick", "<id> [message]", "Disconnect a client, sending it a message",
+     &AdminSocket::cmdKick},
+    {"trace", "<id> [on|off]",
+     "Log the latency of every line from a client, or show recent lines",
+     &AdminSocket::cmdTrace},
+    {"profile", "start [interval ms] | stop | reset | report [limit]",
+     "Control the Lua profiler", &AdminSocket::cmdProfile},
+    {"census", "[diff] [limit]",
+     "Show Lua memory by type, module and owner, or what changed since the "
+     "last census",
+     &AdminSocket::cmdCensus},
+    {"capture", "start [path] | stop",
+     "Record client input to a capture file, for replaying with "
+     "whatmud-replay",
+     &AdminSocket::cmdCapture},
+    {"quit", "", "Close this connection", nullptr},
+};
+
+std::string AdminSocket::execute(std::string_view line, bool &quit) {
+  if (!line.empty() && line.back() == '\r') {
+    line.remove_suffix(1);
+  }
+  Args args;
+  std::size_t pos = 0;
+  while (pos < line.size()) {
+    std::size_t start = line.find_first_not_of(" \t", pos);
+    if (start == std::string_view::npos) {
+      break;
+    }
+    pos = line.find_first_of(" \t", start);
+    args.push_back(line.substr(start, pos - start));
+  }
+  if (args.empty()) {
+    return {};
+  }
+
+  std::ostringstream out;
+  const Command *command = nullptr;
+  for (const Command &cmd : COMMANDS) {
+    if (args[0] == cmd.name) {
+      command = &cmd;
+      break;
+    }
+  }
+  if (command == nullptr) {
+    out << "error: unknown command " << args[0] << ", try help\n";
+    return out.str();
+  }
+  if (command->handler == nullptr) {
+    quit = true;
+    out << "ok\n";
+    return out.str();
+  }
+
+  m_log->info("Admin command: {}", line);
+  lua_State *L = m_engine->getLuaState();
+  int top = lua_gettop(L);
+  try {
+    (this->*command->handler)(out, args);
+    out << "ok\n";
+  } catch (const std::exception &e) {
+    out << "error: " << e.what() << "\n";
+  }
+  lua_settop(L, top);
+  return out.str();
+}
+
+Connection *AdminSocket::findConnection(std::string_view id) {
+  if (id.substr(0, 2) == "0x") {
+    id.remove_prefix(2);
+  }
+  std::uintptr_t address = 0;
+  auto [end, ec] =
+      std::from_chars(id.data(), id.data() + id.size(), address, 16);
+  if (ec != std::errc() || end != id.data() + id.size()) {
+    throw std::runtime_error("bad connection ID");
+  }
+
+  // The table is keyed by the connection's address, so looking up one that
+  // doesn't exist is harmless
+  lua_State *L = m_engine->getLuaState();
+  m_engine->getConnections().push(L);
+  lua_rawgetp(L, -1, reinterpret_cast<void *>(address));
+  Connection *conn = lua::test_userdata<Connection>(L, -1);
+  lua_pop(L, 2);
+  if (conn == nullptr || !conn->isOpen()) {
+    throw std::runtime_error("no such connection");
+  }
+  return conn;
+}
+
+// Like coroutine.status(), telling idle coroutines apart from dead ones
+static const char *coroutine_status(lua_State *co) {
+  lua_Debug ar;
+  switch (lua_status(co)) {
+  case LUA_YIELD:
+    return "suspended";
+  case LUA_OK:
+    if (lua_getstack(co, 0, &ar)) {
+      return "running";
+    }
+    return lua_gettop(co) == 0 ? "dead" : "idle";
+  default:
+    return "error";
+  }
+}
+
+static const char *colour_name(ColourDepth depth) {
+  switch (depth) {
+  case ColourDepth::NONE:
+    return "none";
+  case ColourDepth::ANSI16:
+    return "ansi16";
+  case ColourDepth::XTERM256:
+    return "xterm256";
+  case ColourDepth::TRUECOLOUR:
+    return "truecolour";
+  }
+  return "unknown";
+}
+
+void AdminSocket::cmdHelp(std::ostream &out, const Args &args) {
+  (void)args;
+  for (const Command &cmd : COMMANDS) {
+    out << fmt::format("{:<12} {}\n", cmd.name, cmd.help);
+    if (*cmd.usage != '\0') {
+      out << fmt::format("{:<12} usage: {} {}\n", "", cmd.name, cmd.usage);
+    }
+  }
+}
+
+void AdminSocket::cmdConnections(std::ostream &out, const Args &args) {
+  (void)args;
+  lua_State *L = m_engine->getLuaState();
+  std::size_t count = 0;
+  m_engine->getConnections().push(L);
+  lua_pushnil(L);
+  while (lua_next(L, -2)) {
+    Connection *conn = lua::test_userdata<Connection>(L, -1);
+    if (conn != nullptr) {
+      ++count;
+      lua_getiuservalue(L, -1, 1);
+      lua_State *co = lua_tothread(L, -1);
+      lua_pop(L, 1);
+
+      const Features &features = conn->getFeatures();
+      std::string peer = conn->getPeerAddress();
+      out << fmt::format(
+          "{} {} utf8={} colour={} ttype=\"{}\" queued={} pending={}B "
+          "recv={}B sent={}B co={}{} idle={:.1f}s{}{}\n",
+          fmt::ptr(conn), peer.empty() ? "-" : peer, features.utf8 == 1,
+          colour_name(features.colour), conn->getTerminalType(),
+          conn->getQueuedLines(), conn->getPendingOutput(),
+          conn->getBytesReceived(), conn->getBytesSent(),
+          co != nullptr ? coroutine_status(co) : "none",
+          conn->isCommandRunning() ? " (command running)" : "",
+          conn->getIdleTime() / 1e3, conn->isTracing() ? " tracing" : "",
+          conn->isOpen() ? "" : " closing");
+    }
+    lua_pop(L, 1);
+  }
+  lua_pop(L, 1);
+  out << count << " connections\n";
+}
+
+void AdminSocket::cmdHandles(std::ostream &out, const Args &args) {
+  (void)args;
+  struct Walk {
+    std::ostream &out;
+    std::size_t count;
+  } walk{out, 0};
+  uv_walk(
+      m_engine->getLoop(),
+      [](uv_handle_t *handle, void *arg) {
+        Walk *walk = static_cast<Walk *>(arg);
+        walk->out << uv::HandleView(handle) << "\n";
+        ++walk->count;
+      },
+      &walk);
+  out << walk.count << " handles, " << uv_loop_alive(m_engine->getLoop())
+      << " keeping the loop alive\n";
+}
+
+void AdminSocket::cmdListeners(std::ostream &out, const Args &args) {
+  (void)args;
+  for (const std::unique_ptr<Listener> &listener :
+       m_engine->getListeners()) {
+    out << fmt::format("telnet {}:{}", listener->getListenIP(),
+                       listener->getListenPort());
+    if (auto *tcp = dynamic_cast<const TcpListener *>(listener.get())) {
+      out << fmt::format(" accepted={} failed={}", tcp->getAccepted(),
+                         tcp->getFailed());
+    }
+    out << "\n";
+  }
+  if (const Listener *metrics = m_engine->getMetricsListener()) {
+    out << fmt::format("metrics http://{}:{}/metrics\n",
+                       metrics->getListenIP(), metrics->getListenPort());
+  }
+  out << "admin " << m_path << "\n";
+}
+
+// Bytes in use by Lua
+static std::size_t lua_memory(lua_State *L) {
+  return static_cast<std::size_t>(lua_gc(L, LUA_GCCOUNT)) * 1024 +
+         static_cast<std::size_t>(lua_gc(L, LUA_GCCOUNTB));
+}
+
+void AdminSocket::cmdLua(std::ostream &out, const Args &args) {
+  (void)args;
+  lua_State *L = m_engine->getLuaState();
+  out << fmt::format("memory {:.1f} KiB\n", lua_memory(L) / 1024.0);
+  out << fmt::format("gc {}\n", lua_gc(L, LUA_GCISRUNNING) ? "running"
+                                                            : "stopped");
+}
+
+void AdminSocket::cmdGc(std::ostream &out, const Args &args) {
+  (void)args;
+  lua_State *L = m_engine->getLuaState();
+  std::size_t before = lua_memory(L);
+  std::uint64_t start = uv_hrtime();
+  lua_gc(L, LUA_GCCOLLECT);
+  double ms = (uv_hrtime() - start) / 1e6;
+  std::size_t after = lua_memory(L);
+  out << fmt::format("freed {:.1f} KiB in {:.1f} ms, {:.1f} KiB in use\n",
+                     (before - std::min(before, after)) / 1024.0, ms,
+                     after / 1024.0);
+}
+
+void AdminSocket::cmdKick(std::ostream &out, const Args &args) {
+  if (args.size() < 2) {
+    throw std::runtime_error("usage: kick <id> [message]");
+  }
+  Connection *conn = findConnection(args[1]);
+  if (args.size() > 2) {
+    // Rejoin the message from the original line
+    const char *begin = args[2].data();
+    const char *end = args.back().data() + args.back().size();
+    conn->send(std::string_view(begin, end - begin));
+    conn->send("\r\n");
+    // Usually written straight away, closing cancels it otherwise
+    conn->flush();
+  }
+  std::string peer = conn->getPeerAddress();
+  m_log->warn("Kicking {} by admin request", peer);
+  conn->disconnect();
+  out << "kicked " << peer << "\n";
+}
+
+void AdminSocket::cmdTrace(std::ostream &out, const Args &args) {
+  if (args.size() < 2) {
+    throw std::runtime_error("usage: trace <id> [on|off]");
+  }
+  Connection *conn = findConnection(args[1]);
+  if (args.size() > 2) {
+    if (args[2] != "on" && args[2] != "off") {
+      throw std::runtime_error("usage: trace <id> [on|off]");
+    }
+    conn->setTracing(args[2] == "on");
+  }
+  out << "tracing " << (conn->isTracing() ? "on" : "off") << "\n";
+  // Milliseconds spent in each stage of the line's trip
+  auto ms = [](std::uint64_t from, std::uint64_t to) {
+    return (to - from) / 1e6;
+  };
+  for (const Connection::LineTrace &trace : conn->getTraces()) {
+    out << fmt::format("parse={:.3f} queue={:.3f} handle={:.3f} "
+                       "write={:.3f} total={:.3f} ms\n",
+                       ms(trace.read_at, trace.parsed_at),
+                       ms(trace.parsed_at, trace.started_at),
+                       ms(trace.started_at, trace.handled_at),
+                       ms(trace.handled_at, trace.written_at),
+                       ms(trace.read_at, trace.written_at));
+  }
+}
+
+void AdminSocket::cmdProfile(std::ostream &out, const Args &args) {
+  Profiler *profiler = m_engine->getProfiler();
+  std::string_view action = args.size() > 1 ? args[1] : "";
+  auto number = [&](double def) {
+    if (args.size() < 3) {
+      return def;
+    }
+    double value;
+    auto [end, ec] = std::from_chars(
+        args[2].data(), args[2].data() + args[2].size(), value);
+    if (ec != std::errc() || end != args[2].data() + args[2].size() ||
+        value <= 0) {
+      throw std::runtime_error("expected a positive number");
+    }
+    return value;
+  };
+
+  if (action == "start") {
+    profiler->start(static_cast<std::uint64_t>(number(1) * 1e6));
+  } else if (action == "stop") {
+    profiler->stop();
+  } else if (action == "reset") {
+    profiler->reset();
+  } else if (action == "report") {
+    std::size_t limit = static_cast<std::size_t>(number(20));
+    std::vector<Profiler::FunctionStats> functions =
+        profiler->getFunctions();
+    out << fmt::format("{} samples, {:.1f} ms\n", profiler->getSamples(),
+                       profiler->getSampledTime() / 1e3);
+    out << fmt::format("{:>10} {:>10}  function\n", "self ms", "total ms");
+    for (std::size_t i = 0; i < functions.size() && i < limit; ++i) {
+      out << fmt::format("{:>10.1f} {:>10.1f}  {}\n",
+                         functions[i].self_us / 1e3,
+                         functions[i].total_us / 1e3, functions[i].name);
+    }
+  } else if (!action.empty()) {
+    throw std::runtime_error(
+        "usage: profile start [interval ms] | stop | reset | report [limit]");
+  }
+  out << "profiler " << (profiler->isRunning() ? "running" : "stopped")
+      << "\n";
+}
+
+void AdminSocket::cmdCensus(std::ostream &out, const Args &args) {
+  bool diff = args.size() > 1 && args[1] == "diff";
+  std::size_t limit_arg = diff ? 2 : 1;
+  std::size_t limit = 10;
+  if (args.size() > limit_arg) {
+    std::string_view arg = args[limit_arg];
+    auto [end, ec] =
+        std::from_chars(arg.data(), arg.data() + arg.size(), limit);
+    if (ec != std::errc() || end != arg.data() + arg.size()) {
+      throw std::runtime_error("usage: census [diff] [limit]");
+    }
+  }
+  if (diff && !m_census) {
+    throw std::runtime_error("no census to compare with, run census first");
+  }
+
+  Census census = Census::take(m_engine->getLuaState());
+  out << (diff ? Census::diff(*m_census, census, limit)
+               : census.report(limit));
+  m_census = std::move(census);
+}
+
+void AdminSocket::cmdCapture(std::ostream &out, const Args &args) {
+  std::string_view action = args.size() > 1 ? args[1] : "";
+  if (action == "start" && args.size() <= 3) {
+    m_engine->startCapture(args.size() > 2 ? args[2] : "");
+  } else if (action == "stop" && args.size() == 2) {
+    m_engine->stopCapture();
+  } else if (!action.empty()) {
+    throw std::runtime_error("usage: capture start [path] | stop");
+  }
+
+  if (const CaptureWriter *capture = m_engine->getCapture()) {
+    out << fmt::format("capturing to {}, {} connections, {} bytes\n",
+                       capture->getPath(), capture->getConnections(),
+                       capture->getSize());
+  } else {
+    out << "not capturing\n";
+  }
+}
+
+} // namespace whatmud
@@ -0,0 +1,93 @@
+#ifndef WHATMUD_ADMIN_SOCKET_HPP
+#define WHATMUD_ADMIN_SOCKET_HPP
+
+#include <cstddef>
+#include <memory>
+#include <optional>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <spdlog/spdlog.h>
+
+#include "census.hpp"
+#include "uv/pipe.hpp"
+
+namespace whatmud {
+
+// Forward declarations:
+class Connection;
+class Engine;
+
+/**
+ * A local control socket for looking into a running engine without attaching
+ * a debugger or restarting it, E.G. with `socat - UNIX-CONNECT:admin.sock`.
+ * Clients send one command per line, and each reply ends with a line reading
+ * `ok` or `error: <message>`. `help` lists the commands.
+ *
+ * Anyone who can connect has full control of the game, so the socket is only
+ * accessible by the user running the engine.
+ */
+class AdminSocket : protected uv::Pipe {
+public:
+  // Clients sending longer lines are disconnected
+  static constexpr std::size_t MAX_LINE = 4096;
+
+  AdminSocket(Engine *engine, std::string path);
+  // Removes the socket file
+  ~AdminSocket();
+
+  // No copy
+  AdminSocket(const AdminSocket &) = delete;
+  AdminSocket &operator=(const AdminSocket &) = delete;
+
+  void listen();
+
+  const std::string &getPath() const { return m_path; }
+
+private:
+  struct Client;
+
+  using Args = std::vector<std::string_view>;
+  // Commands write their output to `out`, and throw to report an error
+  using Handler = void (AdminSocket::*)(std::ostream &out, const Args &args);
+
+  struct Command {
+    const char *name;
+    const char *usage;
+    const char *help;
+    Handler handler;
+  };
+  static const Command COMMANDS[];
+
+  void onNewConnection();
+  // Run one command line, returning the whole reply
+  std::string execute(std::string_view line, bool &quit);
+
+  // Find an open connection by the ID `connections` lists it with
+  Connection *findConnection(std::string_view id);
+
+  void cmdHelp(std::ostream &out, const Args &args);
+  void cmdConnections(std::ostream &out, const Args &args);
+  void cmdHandles(std::ostream &out, const Args &args);
+  void cmdListeners(std::ostream &out, const Args &args);
+  void cmdLua(std::ostream &out, const Args &args);
+  void cmdGc(std::ostream &out, const Args &args);
+  void cmdKick(std::ostream &out, const Args &args);
+  void cmdTrace(std::ostream &out, const Args &args);
+  void cmdProfile(std::ostream &out, const Args &args);
+  void cmdCensus(std::ostream &out, const Args &args);
+  void cmdCapture(std::ostream &out, const Args &args);
+
+private:
+  std::shared_ptr<spdlog::logger> m_log;
+  Engine *m_engine;
+  std::string m_path;
+  // The last census taken, for `census diff` to compare against
+  std::optional<Census> m_census;
+};
+
+} // namespace whatmud
+
+#endif
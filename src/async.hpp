@@ -0,0 +1,77 @@
+#ifndef WHATMUD_ASYNC_HPP
+#define WHATMUD_ASYNC_HPP
+
+#include <memory>
+#include <utility>
+
+#include <lua.hpp>
+#include <uv.h>
+
+#include "engine.hpp"
+#include "lua/ref.hpp"
+
+namespace whatmud {
+
+/**
+ * Run `work()` on libuv's thread pool, suspending the calling coroutine until
+ * it finishes. Then `done(L, status)` is called on the loop thread with the
+ * main Lua state; whatever it pushes is returned to the coroutine.
+ * `work` must not touch Lua. Use as `return yield_work(L, ...);` from a Lua C
+ * function, moving everything the callbacks need into them: the function's
+ * own C++ objects are never destroyed once the coroutine yields.
+ */
+template <class Work, class Done>
+int yield_work(lua_State *L, Work work, Done done) {
+  struct Req {
+    uv_work_t req;
+    Engine *engine;
+    lua::Ref co;
+    Work work;
+    Done done;
+  };
+
+  // Taken over first, so nothing in this frame owns anything when an error
+  // is raised
+  Engine *engine = Engine::fromLua(L);
+  auto *req = new Req{{}, engine, lua::Ref(), std::move(work),
+                      std::move(done)};
+  req->req.data = req;
+  if (!lua_isyieldable(L)) {
+    delete req;
+    return luaL_error(L, "must be called from a coroutine");
+  }
+  int res = uv_queue_work(
+      engine->getLoop(), &req->req,
+      [](uv_work_t *r) { static_cast<Req *>(r->data)->work(); },
+      [](uv_work_t *r, int status) {
+        std::unique_ptr<Req> req(static_cast<Req *>(r->data));
+        lua_State *L = req->engine->getLuaState();
+        req->co.push(L); // Keeps the coroutine alive until it's resumed
+        lua_State *co = lua_tothread(L, -1);
+        int top = lua_gettop(L);
+        req->done(L, status);
+        int nresults = lua_gettop(L) - top;
+        lua_xmove(L, co, nresults);
+        Engine *engine = req->engine;
+        req.reset();
+        engine->resume(co, nresults);
+        lua_pop(L, 1); // Pop coroutine
+      });
+  if (res < 0) {
+    delete req;
+    return luaL_error(L, "could not queue work: %s", uv_strerror(res));
+  }
+  lua_pushthread(L);
+  req->co = lua::Ref(L);
+
+  lua_settop(L, 0);
+  return lua_yieldk(L, 0, 0, [](lua_State *L, int status, lua_KContext ctx) {
+    (void)status;
+    (void)ctx;
+    return lua_gettop(L);
+  });
+}
+
+} // namespace whatmud
+
+#endif
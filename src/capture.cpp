@@ -0,0 +1,285 @@
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <stdexcept>
+#include <string_view>
+#include <system_error>
+#include <utility>
+
+#include <fmt/core.h>
+#include <uv.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "capture.hpp"
+#include "connection.hpp"
+#include "log.hpp"
+
+namespace whatmud {
+
+namespace {
+
+// Thrown when the capture ends part way through a record
+struct Truncated {};
+
+} // namespace
+
+std::shared_ptr<spdlog::logger> CaptureWriter::m_log = log::get("capture");
+
+// Captures hold everything players typed, passwords included. On Windows
+// the file gets the game directory's ACL
+static std::FILE *create_capture(const std::string &path) {
+#ifdef _WIN32
+  return std::fopen(path.c_str(), "wb");
+#else
+  int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    return nullptr;
+  }
+  std::FILE *file = fdopen(fd, "wb");
+  if (file == nullptr) {
+    int err = errno;
+    close(fd);
+    errno = err;
+  }
+  return file;
+#endif
+}
+
+CaptureWriter::CaptureWriter(std::string path)
+    : m_path(std::move(path)), m_file(create_capture(m_path)), m_buf(),
+      m_started_at(uv_hrtime()), m_flushed_at(m_started_at),
+      m_connections() {
+  if (m_file == nullptr) {
+    throw std::system_error(errno, std::generic_category(),
+                            "Could not create capture " + m_path);
+  }
+  m_buf.reserve(BUFFER_SIZE);
+  m_buf.append(CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC) - 1);
+  m_size = m_buf.size();
+  m_thread = std::thread([this] { run(); });
+  m_log->info("Capturing client input to {}", m_path);
+}
+
+CaptureWriter::~CaptureWriter() {
+  handOff();
+  {
+    std::lock_guard lock(m_mutex);
+    m_stopping = true;
+  }
+  m_ready.notify_one();
+  m_thread.join();
+  if (std::fclose(m_file) != 0 && !m_failed) {
+    m_log->error("Could not finish capture {}: {}", m_path,
+                 std::generic_category().message(errno));
+  }
+  m_log->info("Stopped capturing to {}, {} bytes", m_path, m_size);
+}
+
+void CaptureWriter::onOpen(const Connection *conn, bool joined) {
+  std::uint32_t id = m_next_id++;
+  m_connections[conn] = Tracked{id, conn->getBytesSent()};
+  beginRecord(CaptureRecord::Kind::OPEN, id);
+  m_buf += static_cast<char>(joined ? 1 : 0);
+  ++m_size;
+}
+
+void CaptureWriter::onData(const Connection *conn, const char *buf,
+                           std::size_t size) {
+  auto it = m_connections.find(conn);
+  if (it == m_connections.end()) {
+    return;
+  }
+  beginRecord(CaptureRecord::Kind::DATA, it->second.id);
+  putVarint(size);
+  m_buf.append(buf, size);
+  m_size += size;
+}
+
+void CaptureWriter::onClose(const Connection *conn) {
+  auto it = m_connections.find(conn);
+  if (it == m_connections.end()) {
+    return;
+  }
+  beginRecord(CaptureRecord::Kind::CLOSE, it->second.id);
+  putVarint(conn->getBytesSent() - it->second.sent_at_open);
+  m_connections.erase(it);
+}
+
+void CaptureWriter::flush() {
+  handOff();
+  // Don't hang on a stuck disk
+  std::unique_lock lock(m_mutex);
+  m_drained.wait_for(lock, std::chrono::seconds(1),
+                     [this] { return m_pending.empty() && !m_writing; });
+}
+
+void CaptureWriter::handOff() {
+  m_flushed_at = uv_hrtime();
+  if (m_buf.empty()) {
+    return;
+  }
+  if (m_failed) {
+    m_buf.clear();
+    return;
+  }
+  {
+    std::lock_guard lock(m_mutex);
+    if (m_pending.size() >= MAX_PENDING) {
+      m_log->error("Capture {} fell too far behind, abandoning it", m_path);
+      m_failed = true;
+      m_buf.clear();
+      return;
+    }
+    m_pending.push_back(std::move(m_buf));
+  }
+  m_ready.notify_one();
+  m_buf = std::string();
+  m_buf.reserve(BUFFER_SIZE);
+}
+
+void CaptureWriter::run() {
+  std::unique_lock lock(m_mutex);
+  for (;;) {
+    m_ready.wait(lock, [this] { return !m_pending.empty() || m_stopping; });
+    if (m_pending.empty()) {
+      return; // Stopping, and everything has been written
+    }
+    std::string buf = std::move(m_pending.front());
+    m_pending.pop_front();
+    m_writing = true;
+    lock.unlock();
+
+    if (!m_failed &&
+        (std::fwrite(buf.data(), 1, buf.size(), m_file) != buf.size() ||
+         std::fflush(m_file) != 0)) {
+      m_log->error("Could not write capture {}, abandoning it: {}", m_path,
+                   std::generic_category().message(errno));
+      m_failed = true;
+    }
+
+    lock.lock();
+    m_writing = false;
+    if (m_pending.empty()) {
+      m_drained.notify_all();
+    }
+  }
+}
+
+void CaptureWriter::beginRecord(CaptureRecord::Kind kind, std::uint32_t id) {
+  std::uint64_t now = uv_hrtime();
+  if (m_buf.size() >= BUFFER_SIZE ||
+      now - m_flushed_at >= FLUSH_INTERVAL_NS) {
+    handOff();
+  }
+  std::uint64_t time = (now - m_started_at) / 1000;
+  m_buf += static_cast<char>(kind);
+  ++m_size;
+  putVarint(time - m_last_record);
+  putVarint(id);
+  m_last_record = time;
+}
+
+void CaptureWriter::putVarint(std::uint64_t value) {
+  std::size_t start = m_buf.size();
+  while (value >= 0x80) {
+    m_buf += static_cast<char>((value & 0x7f) | 0x80);
+    value >>= 7;
+  }
+  m_buf += static_cast<char>(value);
+  m_size += m_buf.size() - start;
+}
+
+CaptureReader::CaptureReader(const std::string &path)
+    : m_path(path), m_file(std::fopen(path.c_str(), "rb")) {
+  if (m_file == nullptr) {
+    throw std::system_error(errno, std::generic_category(),
+                            "Could not open capture " + path);
+  }
+  char magic[sizeof(CAPTURE_MAGIC) - 1];
+  if (std::fread(magic, 1, sizeof(magic), m_file) != sizeof(magic) ||
+      std::string_view(magic, sizeof(magic)) != CAPTURE_MAGIC) {
+    std::fclose(m_file);
+    throw std::runtime_error(path + " is not a capture file");
+  }
+}
+
+CaptureReader::~CaptureReader() { std::fclose(m_file); }
+
+bool CaptureReader::next(CaptureRecord &record) {
+  int kind = std::getc(m_file);
+  if (kind == EOF) {
+    return false;
+  }
+  try {
+    readRecord(static_cast<CaptureRecord::Kind>(kind), record);
+  } catch (const Truncated &) {
+    // Whatever had been written when the engine stopped is still usable
+    m_truncated = true;
+    return false;
+  }
+  return true;
+}
+
+void CaptureReader::readRecord(CaptureRecord::Kind kind,
+                               CaptureRecord &record) {
+  m_time += getVarint();
+  std::uint64_t id = getVarint();
+  if (id > UINT32_MAX) {
+    corrupt();
+  }
+  record.kind = kind;
+  record.time = m_time;
+  record.connection = static_cast<std::uint32_t>(id);
+
+  switch (record.kind) {
+  case CaptureRecord::Kind::OPEN: {
+    int flags = std::getc(m_file);
+    if (flags == EOF) {
+      throw Truncated();
+    }
+    record.joined = flags & 1;
+    break;
+  }
+  case CaptureRecord::Kind::DATA: {
+    std::uint64_t size = getVarint();
+    if (size > CaptureWriter::BUFFER_SIZE * 16) {
+      corrupt();
+    }
+    record.data.resize(size);
+    if (std::fread(record.data.data(), 1, size, m_file) != size) {
+      throw Truncated();
+    }
+    break;
+  }
+  case CaptureRecord::Kind::CLOSE:
+    record.bytes_sent = getVarint();
+    break;
+  default:
+    corrupt();
+  }
+}
+
+std::uint64_t CaptureReader::getVarint() {
+  std::uint64_t value = 0;
+  for (unsigned shift = 0; shift < 64; shift += 7) {
+    int byte = std::getc(m_file);
+    if (byte == EOF) {
+      throw Truncated();
+    }
+    value |= static_cast<std::uint64_t>(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      return value;
+    }
+  }
+  corrupt();
+}
+
+void CaptureReader::corrupt() const {
+  throw std::runtime_error(fmt::format("Capture {} is corrupt at byte {}",
+                                       m_path, std::ftell(m_file)));
+}
+
+} // namespace whatmud
@@ -0,0 +1,174 @@
+#ifndef WHATMUD_CAPTURE_HPP
+#define WHATMUD_CAPTURE_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+#include <spdlog/spdlog.h>
+
+namespace whatmud {
+
+// Forward declarations:
+class Connection;
+
+/**
+ * Capture files hold everything clients sent, as the raw bytes read from
+ * their sockets, so real traffic can be replayed against another build with
+ * whatmud-replay.
+ *
+ * A capture starts with CAPTURE_MAGIC, followed by records. Each record is a
+ * kind byte, then as varints (7 bits per byte, least significant first) the
+ * microseconds since the previous record and the connection's ID, then:
+ *
+ * - OPEN: a flags byte, bit 0 set if the connection was already open when
+ *   the capture started
+ * - DATA: a varint length and that many bytes
+ * - CLOSE: a varint of the bytes sent to the client while it was captured
+ */
+inline constexpr char CAPTURE_MAGIC[] = "WMCAP1\n";
+
+struct CaptureRecord {
+  enum class Kind : std::uint8_t {
+    OPEN = 1,
+    DATA = 2,
+    CLOSE = 3,
+  };
+
+  Kind kind = Kind::OPEN;
+  // Microseconds since the capture started
+  std::uint64_t time = 0;
+  std::uint32_t connection = 0;
+  // OPEN: the connection opened before the capture started, so its telnet
+  // negotiation is missing
+  bool joined = false;
+  // DATA: the bytes read
+  std::string data;
+  // CLOSE: the bytes sent to the client while it was captured
+  std::uint64_t bytes_sent = 0;
+};
+
+/**
+ * Records connections' input to a capture file. Records are buffered and
+ * handed to a background thread to write once the buffer fills, or by the
+ * first record more than a second after the last hand-off, so the loop never
+ * waits on the disk. If the file can't be written, or the thread falls too
+ * far behind, the error is logged and the rest of the capture is dropped, the
+ * game carries on.
+ */
+class CaptureWriter {
+public:
+  static constexpr std::size_t BUFFER_SIZE = 65536;
+  static constexpr std::uint64_t FLUSH_INTERVAL_NS = 1'000'000'000;
+  // Most full buffers waiting for the background thread
+  static constexpr std::size_t MAX_PENDING = 64;
+
+  // Create or truncate the file at `path`, readable only by its owner.
+  // Throws std::system_error
+  explicit CaptureWriter(std::string path);
+  // Writes anything still buffered and stops the background thread
+  ~CaptureWriter();
+
+  // No copy
+  CaptureWriter(const CaptureWriter &) = delete;
+  CaptureWriter &operator=(const CaptureWriter &) = delete;
+
+  // `joined` if the connection opened before the capture started
+  void onOpen(const Connection *conn, bool joined);
+  void onData(const Connection *conn, const char *buf, std::size_t size);
+  void onClose(const Connection *conn);
+
+  // Write everything recorded so far, waiting up to a second for it. For
+  // when the process is about to be replaced
+  void flush();
+
+  const std::string &getPath() const { return m_path; }
+  // Connections open in the capture
+  std::size_t getConnections() const { return m_connections.size(); }
+  // Size of the capture so far, including anything buffered
+  std::uint64_t getSize() const { return m_size; }
+
+private:
+  struct Tracked {
+    std::uint32_t id;
+    // Connection::getBytesSent() when the capture started following it
+    std::uint64_t sent_at_open;
+  };
+
+  // Start a record for `id`, handing the buffer off first if it's time to
+  void beginRecord(CaptureRecord::Kind kind, std::uint32_t id);
+  void putVarint(std::uint64_t value);
+  // Queue the buffer for the background thread
+  void handOff();
+  // Runs on the background thread
+  void run();
+
+private:
+  static std::shared_ptr<spdlog::logger> m_log;
+  std::string m_path;
+  std::FILE *m_file;
+  std::string m_buf;
+  // Whether a write failed and the capture was abandoned
+  std::atomic<bool> m_failed = false;
+  std::uint64_t m_size = 0;
+  // uv_hrtime() when the capture started, and of the last record and write
+  std::uint64_t m_started_at;
+  std::uint64_t m_last_record = 0;
+  std::uint64_t m_flushed_at;
+  std::uint32_t m_next_id = 1;
+  std::unordered_map<const Connection *, Tracked> m_connections;
+
+  // Guards the queue
+  std::mutex m_mutex;
+  std::condition_variable m_ready;
+  std::condition_variable m_drained;
+  std::deque<std::string> m_pending;
+  // Whether the background thread is writing a buffer it has taken
+  bool m_writing = false;
+  bool m_stopping = false;
+  std::thread m_thread;
+};
+
+// Reads the records of a capture file in order
+class CaptureReader {
+public:
+  // Open the capture at `path`. Throws std::system_error, or
+  // std::runtime_error if it isn't a capture
+  explicit CaptureReader(const std::string &path);
+  ~CaptureReader();
+
+  // No copy
+  CaptureReader(const CaptureReader &) = delete;
+  CaptureReader &operator=(const CaptureReader &) = delete;
+
+  // Read the next record, returning false at the end of the capture. Throws
+  // std::runtime_error if the capture is corrupt
+  bool next(CaptureRecord &record);
+
+  // Whether the capture ended part way through a record, E.G. because the
+  // engine crashed while writing it
+  bool isTruncated() const { return m_truncated; }
+
+private:
+  void readRecord(CaptureRecord::Kind kind, CaptureRecord &record);
+  std::uint64_t getVarint();
+  [[noreturn]] void corrupt() const;
+
+private:
+  std::string m_path;
+  std::FILE *m_file;
+  std::uint64_t m_time = 0;
+  bool m_truncated = false;
+};
+
+} // namespace whatmud
+
+#endif
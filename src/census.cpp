@@ -0,0 +1,648 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <iterator>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include <fmt/format.h>
+
+#include "census.hpp"
+#include "connection.hpp"
+#include "engine.hpp"
+#include "lua/helpers.hpp"
+
+namespace whatmud {
+
+namespace {
+
+// Rough sizes of Lua 5.4's objects on a 64 bit platform
+constexpr std::uint64_t TABLE_SIZE = 56;
+constexpr std::uint64_t ARRAY_SLOT_SIZE = 16;
+constexpr std::uint64_t NODE_SIZE = 32;
+constexpr std::uint64_t STRING_SIZE = 24;
+constexpr std::uint64_t USERDATA_SIZE = 40;
+constexpr std::uint64_t USER_VALUE_SIZE = 16;
+constexpr std::uint64_t LUA_CLOSURE_SIZE = 32;
+// A Lua closure's upvalue pointer and the upvalue it points to
+constexpr std::uint64_t LUA_UPVALUE_SIZE = 48;
+constexpr std::uint64_t C_CLOSURE_SIZE = 32;
+constexpr std::uint64_t C_UPVALUE_SIZE = 16;
+constexpr std::uint64_t THREAD_SIZE = 200;
+constexpr std::uint64_t STACK_SLOT_SIZE = 16;
+
+// What an object is counted towards, as indices into the walker's names
+struct Label {
+  std::size_t owner;
+  std::size_t module;
+};
+
+/**
+ * Walks the heap breadth first, so objects are counted for the closest root
+ * that reaches them. Queued objects are kept alive in a Lua table, alongside
+ * their labels in m_labels.
+ */
+class Walker {
+public:
+  Walker(lua_State *L, Census &census) : L(L), m_census(census) {
+    lua_newtable(L);
+    m_queue = lua_gettop(L);
+    visit(m_queue);
+  }
+
+  std::size_t owner(std::string name) {
+    return intern(m_owners, m_owner_ids, std::move(name));
+  }
+  std::size_t module(std::string name) {
+    return intern(m_modules, m_module_ids, std::move(name));
+  }
+
+  // Mark the object at `index` as seen, returning whether it's new
+  bool visit(int index) {
+    return m_visited.insert(lua_topointer(L, index)).second;
+  }
+  // Mark the value at `index` as a root to be walked in its own phase, so
+  // nothing walked earlier counts it first
+  void claim(int index);
+  // Count the value on top of the stack if it's a claimed root or hasn't
+  // been seen, along with everything it reaches first, popping it
+  void walk(Label label);
+
+  // Queue the value on top of the stack if it hasn't been seen, popping it
+  void add(Label label);
+  // Count the object on top of the stack and queue everything it refers to,
+  // popping it
+  void expand(Label label);
+  // Count the table at `index` without queuing its contents
+  void countTable(int index, Label label);
+  // Expand everything queued, and everything they queue in turn
+  void drain();
+
+private:
+  static std::size_t intern(std::vector<std::string> &names,
+                            std::unordered_map<std::string, std::size_t> &ids,
+                            std::string name) {
+    auto [it, added] = ids.emplace(std::move(name), names.size());
+    if (added) {
+      names.push_back(it->first);
+    }
+    return it->second;
+  }
+
+  void record(const std::string &type, std::uint64_t bytes, Label label);
+  std::uint64_t tableSize(int index, std::uint64_t entries);
+
+private:
+  lua_State *L;
+  Census &m_census;
+  int m_queue;
+  lua_Integer m_head = 0;
+  lua_Integer m_tail = 0;
+  std::deque<Label> m_labels;
+  std::unordered_set<const void *> m_visited;
+  // Claimed roots that haven't been walked yet
+  std::unordered_set<const void *> m_roots;
+  std::vector<std::string> m_owners;
+  std::unordered_map<std::string, std::size_t> m_owner_ids;
+  std::vector<std::string> m_modules;
+  std::unordered_map<std::string, std::size_t> m_module_ids;
+};
+
+void Walker::add(Label label) {
+  int type = lua_type(L, -1);
+  bool collectable = type == LUA_TSTRING || type == LUA_TTABLE ||
+                     type == LUA_TUSERDATA || type == LUA_TTHREAD ||
+                     type == LUA_TFUNCTION;
+  // C functions without upvalues aren't objects
+  if (type == LUA_TFUNCTION && lua_iscfunction(L, -1)) {
+    collectable = lua_getupvalue(L, -1, 1) != nullptr;
+    if (collectable) {
+      lua_pop(L, 1);
+    }
+  }
+  if (!collectable || !visit(-1)) {
+    lua_pop(L, 1);
+    return;
+  }
+  if (type == LUA_TSTRING) {
+    // Nothing to walk, so there's no need to queue it
+    std::size_t len;
+    lua_tolstring(L, -1, &len);
+    record("string", STRING_SIZE + len + 1, label);
+    lua_pop(L, 1);
+    return;
+  }
+  lua_rawseti(L, m_queue, ++m_tail);
+  m_labels.push_back(label);
+}
+
+void Walker::claim(int index) {
+  int type = lua_type(L, index);
+  if (type != LUA_TTABLE && type != LUA_TUSERDATA && type != LUA_TTHREAD &&
+      (type != LUA_TFUNCTION || lua_iscfunction(L, index))) {
+    return;
+  }
+  if (visit(index)) {
+    m_roots.insert(lua_topointer(L, index));
+  }
+}
+
+void Walker::walk(Label label) {
+  if (m_roots.erase(lua_topointer(L, -1)) > 0) {
+    expand(label);
+  } else {
+    add(label);
+  }
+  drain();
+}
+
+void Walker::drain() {
+  while (m_head < m_tail) {
+    lua_rawgeti(L, m_queue, ++m_head);
+    // The queue no longer needs to keep it alive
+    lua_pushnil(L);
+    lua_rawseti(L, m_queue, m_head);
+    Label label = m_labels.front();
+    m_labels.pop_front();
+    expand(label);
+  }
+}
+
+void Walker::expand(Label label) {
+  // take() reserved enough stack, expanding never nests
+  int index = lua_gettop(L);
+  switch (lua_type(L, index)) {
+  case LUA_TTABLE: {
+    bool weak_keys = false;
+    bool weak_values = false;
+    if (lua_getmetatable(L, index)) {
+      lua_pushliteral(L, "__mode");
+      if (lua_rawget(L, -2) == LUA_TSTRING) {
+        const char *mode = lua_tostring(L, -1);
+        weak_keys = std::strchr(mode, 'k') != nullptr;
+        weak_values = std::strchr(mode, 'v') != nullptr;
+      }
+      lua_pop(L, 1);
+      add(label);
+    }
+    std::uint64_t entries = 0;
+    lua_pushnil(L);
+    while (lua_next(L, index)) {
+      ++entries;
+      if (!weak_keys) {
+        lua_pushvalue(L, -2);
+        add(label);
+      }
+      if (!weak_values) {
+        lua_pushvalue(L, -1);
+        add(label);
+      }
+      lua_pop(L, 1);
+    }
+    record("table", tableSize(index, entries), label);
+    break;
+  }
+
+  case LUA_TUSERDATA: {
+    std::string type = "userdata";
+    if (lua_getmetatable(L, index)) {
+      lua_pushliteral(L, "__name");
+      if (lua_rawget(L, -2) == LUA_TSTRING) {
+        type += ':';
+        type += lua_tostring(L, -1);
+      }
+      lua_pop(L, 1);
+      add(label);
+    }
+    std::uint64_t values = 0;
+    while (lua_getiuservalue(L, index, static_cast<int>(values + 1)) !=
+           LUA_TNONE) {
+      ++values;
+      add(label);
+    }
+    lua_pop(L, 1);
+    record(type,
+           USERDATA_SIZE + lua_rawlen(L, index) + values * USER_VALUE_SIZE,
+           label);
+    break;
+  }
+
+  case LUA_TFUNCTION: {
+    bool is_c = lua_iscfunction(L, index);
+    if (!is_c) {
+      // Everything the function refers to is counted towards its file
+      lua_Debug ar;
+      lua_pushvalue(L, index);
+      lua_getinfo(L, ">S", &ar);
+      label.module = module(ar.short_src);
+    }
+    std::uint64_t upvalues = 0;
+    while (lua_getupvalue(L, index, static_cast<int>(upvalues + 1))) {
+      ++upvalues;
+      add(label);
+    }
+    record(is_c ? "cfunction" : "function",
+           is_c ? C_CLOSURE_SIZE + upvalues * C_UPVALUE_SIZE
+                : LUA_CLOSURE_SIZE + upvalues * LUA_UPVALUE_SIZE,
+           label);
+    break;
+  }
+
+  case LUA_TTHREAD: {
+    lua_State *co = lua_tothread(L, index);
+    std::uint64_t slots = 0;
+    if (co == L || lua_checkstack(co, 2)) {
+      // Each frame's function and locals
+      lua_Debug ar;
+      for (int level = 0; lua_getstack(co, level, &ar); ++level) {
+        lua_getinfo(co, "f", &ar);
+        lua_xmove(co, L, 1);
+        add(label);
+        for (int n = 1; lua_getlocal(co, &ar, n) != nullptr; ++n) {
+          lua_xmove(co, L, 1);
+          add(label);
+          ++slots;
+        }
+        for (int n = -1; lua_getlocal(co, &ar, n) != nullptr; --n) {
+          lua_xmove(co, L, 1);
+          add(label);
+          ++slots;
+        }
+      }
+      // Values passed to a coroutine that hasn't started, or yielded by one
+      // that has
+      int top = co == L ? index - 1 : lua_gettop(co);
+      for (int i = 1; i <= top; ++i) {
+        lua_pushvalue(co, i);
+        lua_xmove(co, L, 1);
+        add(label);
+      }
+      slots += static_cast<std::uint64_t>(top);
+    }
+    record("thread", THREAD_SIZE + slots * STACK_SLOT_SIZE, label);
+    break;
+  }
+  }
+  lua_settop(L, index - 1);
+}
+
+void Walker::countTable(int index, Label label) {
+  std::uint64_t entries = 0;
+  lua_pushnil(L);
+  while (lua_next(L, index)) {
+    ++entries;
+    lua_pop(L, 1);
+  }
+  record("table", tableSize(index, entries), label);
+}
+
+std::uint64_t Walker::tableSize(int index, std::uint64_t entries) {
+  // Entries past the array part's border are in the hash part, which is
+  // sized to a power of two
+  std::uint64_t array = std::min<std::uint64_t>(lua_rawlen(L, index), entries);
+  std::uint64_t hash = entries - array;
+  std::uint64_t nodes = 1;
+  while (nodes < hash) {
+    nodes *= 2;
+  }
+  return TABLE_SIZE + array * ARRAY_SLOT_SIZE + (hash ? nodes : 0) * NODE_SIZE;
+}
+
+void Walker::record(const std::string &type, std::uint64_t bytes,
+                    Label label) {
+  auto add_to = [bytes](Census::Group &group) {
+    ++group.count;
+    group.bytes += bytes;
+  };
+  add_to(m_census.total);
+  add_to(m_census.types[type]);
+  add_to(m_census.modules[m_modules[label.module]]);
+  add_to(m_census.owners[m_owners[label.owner]]);
+}
+
+} // namespace
+
+Census Census::take(lua_State *L, int ignore) {
+  luaL_checkstack(L, 32, "taking a census");
+  Census census;
+  Engine *engine = Engine::fromLua(L);
+  int top = lua_gettop(L);
+  if (ignore != 0) {
+    ignore = lua::absindex(L, ignore);
+  }
+  Walker walker(L, census);
+  std::size_t shared = walker.owner("(shared)");
+  if (ignore != 0 && lua_istable(L, ignore)) {
+    // Never expanded, so only what's also reachable elsewhere is counted
+    walker.visit(ignore);
+  }
+
+  // Roots are walked by their own phase, with their own labels, so nothing
+  // else may reach into them first
+  lua_pushvalue(L, LUA_REGISTRYINDEX);
+  int registry = lua_gettop(L);
+  walker.visit(registry);
+  lua_rawgeti(L, registry, LUA_RIDX_GLOBALS);
+  int globals = lua_gettop(L);
+  walker.visit(globals);
+  lua_getfield(L, registry, LUA_LOADED_TABLE);
+  int loaded = lua_gettop(L);
+  engine->getConnections().push(L);
+  int connections = lua_gettop(L);
+  walker.visit(connections);
+  lua_pushnil(L);
+  while (lua_next(L, registry)) {
+    if (lua_type(L, -2) == LUA_TSTRING && lua_istable(L, -1)) {
+      walker.visit(-1);
+    }
+    lua_pop(L, 1);
+  }
+  // Modules and globals are walked after the connections, but what they are
+  // is theirs even if a connection's handler refers to it
+  if (lua_istable(L, loaded)) {
+    lua_pushnil(L);
+    while (lua_next(L, loaded)) {
+      walker.claim(-1);
+      lua_pop(L, 1);
+    }
+  }
+  lua_pushnil(L);
+  while (lua_next(L, globals)) {
+    walker.claim(-1);
+    lua_pop(L, 1);
+  }
+
+  // Each connection's own data
+  std::size_t module = walker.module("(connections)");
+  walker.countTable(connections, {shared, module});
+  lua_pushnil(L);
+  while (lua_next(L, connections)) {
+    Connection *conn = lua::test_userdata<Connection>(L, -1);
+    std::size_t owner = shared;
+    if (conn != nullptr) {
+      std::string peer = conn->getPeerAddress();
+      owner = walker.owner(
+          fmt::format("{} {}", fmt::ptr(conn), peer.empty() ? "-" : peer));
+    }
+    walker.add({owner, module});
+    walker.drain();
+  }
+
+  // Modules, then globals not belonging to one
+  if (lua_istable(L, loaded)) {
+    walker.countTable(loaded, {shared, walker.module("(registry)")});
+    lua_pushnil(L);
+    while (lua_next(L, loaded)) {
+      module = walker.module(lua_type(L, -2) == LUA_TSTRING
+                                 ? lua_tostring(L, -2)
+                                 : "(modules)");
+      walker.walk({shared, module});
+    }
+  }
+  walker.countTable(globals, {shared, walker.module("(globals)")});
+  lua_pushnil(L);
+  while (lua_next(L, globals)) {
+    module = walker.module(lua_type(L, -2) == LUA_TSTRING
+                               ? fmt::format("_G.{}", lua_tostring(L, -2))
+                               : std::string("(globals)"));
+    lua_pushvalue(L, -2);
+    walker.add({shared, module});
+    walker.walk({shared, module});
+  }
+
+  // Everything else: metatables, references held by C++ and the main thread
+  module = walker.module("(registry)");
+  walker.countTable(registry, {shared, module});
+  lua_pushnil(L);
+  while (lua_next(L, registry)) {
+    if (lua_type(L, -2) == LUA_TSTRING && lua_istable(L, -1)) {
+      std::string_view name = lua_tostring(L, -2);
+      if (lua_rawequal(L, -1, loaded)) {
+        lua_pop(L, 1);
+        continue;
+      }
+      lua_pushvalue(L, -2);
+      walker.add({shared, module});
+      walker.expand({shared, walker.module(fmt::format("registry.{}", name))});
+    } else {
+      walker.add({shared, module});
+    }
+    walker.drain();
+  }
+
+  lua_settop(L, top);
+  return census;
+}
+
+// Push a table of {count = ..., bytes = ...} groups
+static void push_groups(lua_State *L, const Census::Groups &groups) {
+  lua_createtable(L, 0, static_cast<int>(groups.size()));
+  for (const auto &[name, group] : groups) {
+    lua_createtable(L, 0, 2);
+    lua::push(L, static_cast<lua_Integer>(group.count));
+    lua_setfield(L, -2, "count");
+    lua::push(L, static_cast<lua_Integer>(group.bytes));
+    lua_setfield(L, -2, "bytes");
+    lua_setfield(L, -2, name.c_str());
+  }
+}
+
+void Census::push(lua_State *L) const {
+  lua_createtable(L, 0, 5);
+  lua::push(L, static_cast<lua_Integer>(total.count));
+  lua_setfield(L, -2, "count");
+  lua::push(L, static_cast<lua_Integer>(total.bytes));
+  lua_setfield(L, -2, "bytes");
+  push_groups(L, types);
+  lua_setfield(L, -2, "types");
+  push_groups(L, modules);
+  lua_setfield(L, -2, "modules");
+  push_groups(L, owners);
+  lua_setfield(L, -2, "owners");
+}
+
+// Read a group, treating anything missing as zero
+static Census::Group get_group(lua_State *L, int index) {
+  Census::Group group;
+  if (lua_istable(L, index)) {
+    lua_getfield(L, index, "count");
+    group.count = static_cast<std::uint64_t>(lua_tointeger(L, -1));
+    lua_getfield(L, index, "bytes");
+    group.bytes = static_cast<std::uint64_t>(lua_tointeger(L, -1));
+    lua_pop(L, 2);
+  }
+  return group;
+}
+
+static void get_groups(lua_State *L, int index, const char *field,
+                       Census::Groups &groups) {
+  if (lua_getfield(L, index, field) == LUA_TTABLE) {
+    lua_pushnil(L);
+    while (lua_next(L, -2)) {
+      if (lua_type(L, -2) == LUA_TSTRING) {
+        std::string name;
+        lua::get(L, -2, name);
+        groups[std::move(name)] = get_group(L, lua_gettop(L));
+      }
+      lua_pop(L, 1);
+    }
+  }
+  lua_pop(L, 1);
+}
+
+Census Census::get(lua_State *L, int index) {
+  index = lua::absindex(L, index);
+  Census census;
+  census.total = get_group(L, index);
+  get_groups(L, index, "types", census.types);
+  get_groups(L, index, "modules", census.modules);
+  get_groups(L, index, "owners", census.owners);
+  return census;
+}
+
+static std::string format_bytes(double bytes) {
+  const char *units[]{"B", "KiB", "MiB", "GiB"};
+  std::size_t unit = 0;
+  while (std::abs(bytes) >= 1024 && unit + 1 < std::size(units)) {
+    bytes /= 1024;
+    ++unit;
+  }
+  return unit == 0 ? fmt::format("{:.0f} B", bytes)
+                   : fmt::format("{:.1f} {}", bytes, units[unit]);
+}
+
+// The kinds of group, in the order they're reported
+static const std::pair<const char *, Census::Groups Census::*> GROUP_KINDS[]{
+    {"type", &Census::types},
+    {"module", &Census::modules},
+    {"owner", &Census::owners},
+};
+
+std::string Census::report(std::size_t limit) const {
+  std::string out = fmt::format("{} objects, {} (estimated)\n", total.count,
+                                format_bytes(total.bytes));
+  for (const auto &[kind, member] : GROUP_KINDS) {
+    std::vector<std::pair<std::string, Group>> sorted((this->*member).begin(),
+                                                      (this->*member).end());
+    std::sort(sorted.begin(), sorted.end(), [](const auto &a, const auto &b) {
+      return a.second.bytes > b.second.bytes;
+    });
+    out += fmt::format("\nBy {}:\n", kind);
+    for (std::size_t i = 0; i < sorted.size() && i < limit; ++i) {
+      out += fmt::format("{:>12} {:>10}  {}\n",
+                         format_bytes(sorted[i].second.bytes),
+                         sorted[i].second.count, sorted[i].first);
+    }
+  }
+  return out;
+}
+
+std::string Census::diff(const Census &before, const Census &after,
+                         std::size_t limit) {
+  struct Change {
+    std::string name;
+    std::int64_t count;
+    std::int64_t bytes;
+  };
+  auto delta = [](std::uint64_t from, std::uint64_t to) {
+    return static_cast<std::int64_t>(to) - static_cast<std::int64_t>(from);
+  };
+
+  std::string out = fmt::format(
+      "{:+} objects, {}{} (estimated)\n",
+      delta(before.total.count, after.total.count),
+      after.total.bytes >= before.total.bytes ? "+" : "",
+      format_bytes(static_cast<double>(
+          delta(before.total.bytes, after.total.bytes))));
+  for (const auto &[kind, member] : GROUP_KINDS) {
+    const Groups &from = before.*member;
+    const Groups &to = after.*member;
+    std::vector<Change> changes;
+    for (const auto &[name, group] : to) {
+      auto it = from.find(name);
+      Group old = it != from.end() ? it->second : Group{};
+      changes.push_back({name, delta(old.count, group.count),
+                         delta(old.bytes, group.bytes)});
+    }
+    for (const auto &[name, group] : from) {
+      if (to.find(name) == to.end()) {
+        changes.push_back({name, delta(group.count, 0),
+                           delta(group.bytes, 0)});
+      }
+    }
+    std::sort(changes.begin(), changes.end(),
+              [](const Change &a, const Change &b) {
+                return std::abs(a.bytes) > std::abs(b.bytes);
+              });
+    out += fmt::format("\nBy {}:\n", kind);
+    for (std::size_t i = 0; i < changes.size() && i < limit; ++i) {
+      if (changes[i].bytes == 0 && changes[i].count == 0) {
+        break;
+      }
+      out += fmt::format(
+          "{:>13} {:>+10}  {}\n",
+          (changes[i].bytes >= 0 ? "+" : "") +
+              format_bytes(static_cast<double>(changes[i].bytes)),
+          changes[i].count, changes[i].name);
+    }
+  }
+  return out;
+}
+
+// Lua library
+
+// census.take([ignore]) -> census
+// Walks the Lua heap, blocking the game while it does. The census is a plain
+// table: {count, bytes, types, modules, owners}, where each of the last
+// three maps a name to {count, bytes}. The table `ignore`, E.G. an earlier
+// census, and anything only it refers to aren't counted
+int Census::l_take(lua_State *L) {
+  {
+    Census census = take(L, lua_istable(L, 1) ? 1 : 0);
+    census.push(L);
+  }
+  return 1;
+}
+
+// census.report(census[, limit]) -> string
+// The limit (default 10) largest groups of each kind
+int Census::l_report(lua_State *L) {
+  luaL_checktype(L, 1, LUA_TTABLE);
+  lua_Integer limit = luaL_optinteger(L, 2, 10);
+  {
+    std::string report =
+        get(L, 1).report(static_cast<std::size_t>(std::max<lua_Integer>(
+            limit, 0)));
+    lua::push(L, report);
+  }
+  return 1;
+}
+
+// census.diff(before, after[, limit]) -> string
+// The limit (default 10) groups of each kind that changed the most
+int Census::l_diff(lua_State *L) {
+  luaL_checktype(L, 1, LUA_TTABLE);
+  luaL_checktype(L, 2, LUA_TTABLE);
+  lua_Integer limit = luaL_optinteger(L, 3, 10);
+  {
+    std::string report =
+        diff(get(L, 1), get(L, 2),
+             static_cast<std::size_t>(std::max<lua_Integer>(limit, 0)));
+    lua::push(L, report);
+  }
+  return 1;
+}
+
+int Census::luaopen(lua_State *L) {
+  static const luaL_Reg funcs[]{{"take", l_take},
+                                {"report", l_report},
+                                {"diff", l_diff},
+                                {nullptr, nullptr}};
+  luaL_newlib(L, funcs);
+  return 1;
+}
+
+} // namespace whatmud
@@ -0,0 +1,75 @@
+#ifndef WHATMUD_CENSUS_HPP
+#define WHATMUD_CENSUS_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+
+#include <lua.hpp>
+
+namespace whatmud {
+
+/**
+ * A count of everything alive in the Lua heap, for finding out what memory
+ * is being used by and spotting leaks by comparing two censuses.
+ *
+ * Taking a census walks everything reachable from, in order, each connection,
+ * each module in package.loaded, each global and finally the rest of the
+ * registry, including every coroutine's stack and every function's upvalues.
+ * Each object is counted once, for whatever reached it first, so the data
+ * only one connection can reach is counted towards it. Modules and globals
+ * themselves are always counted towards their own names, even when a
+ * connection's code refers to them. Objects are grouped:
+ *
+ * - by type, with userdata named after their metatable's __name
+ * - by module: the file defining the nearest function the object was reached
+ *   through, otherwise the module, global (`_G.name`) or registry entry it
+ *   was reached from
+ * - by owner: the connection it was reached from, or `(shared)`
+ *
+ * Lua doesn't expose object sizes, so sizes are estimated from their
+ * contents. The walk runs on the loop and allocates about as much again as
+ * the heap has objects, so it's for occasional use.
+ */
+class Census {
+public:
+  struct Group {
+    std::uint64_t count = 0;
+    std::uint64_t bytes = 0;
+  };
+  using Groups = std::unordered_map<std::string, Group>;
+
+  Group total;
+  Groups types;
+  Groups modules;
+  Groups owners;
+
+  // Walk the heap of the state that owns L. The table at `ignore`, if it's
+  // not 0, is left out along with anything only it refers to, so keeping an
+  // earlier census to diff against doesn't count as growth
+  static Census take(lua_State *L, int ignore = 0);
+
+  // Push the census as a plain table, which get() turns back into a Census
+  void push(lua_State *L) const;
+  static Census get(lua_State *L, int index);
+
+  // The `limit` largest groups of each kind
+  std::string report(std::size_t limit) const;
+  // The `limit` groups of each kind that changed the most between two
+  // censuses
+  static std::string diff(const Census &before, const Census &after,
+                          std::size_t limit);
+
+  // Register the `census` library in Lua
+  static int luaopen(lua_State *L);
+
+private:
+  static int l_take(lua_State *L);
+  static int l_report(lua_State *L);
+  static int l_diff(lua_State *L);
+};
+
+} // namespace whatmud
+
+#endif
@@ -0,0 +1,252 @@
+#include <algorithm>
+#include <cctype>
+
+#include "commands.hpp"
+#include "engine.hpp"
+#include "lua/helpers.hpp"
+
+namespace whatmud {
+
+static unsigned char fold(char c) {
+  return static_cast<unsigned char>(
+      std::tolower(static_cast<unsigned char>(c)));
+}
+
+static bool equalFolded(std::string_view a, std::string_view b) {
+  return std::equal(a.begin(), a.end(), b.begin(), b.end(),
+                    [](char x, char y) { return fold(x) == fold(y); });
+}
+
+static bool isSpace(char c) {
+  return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+static std::string_view trim(std::string_view str) {
+  while (!str.empty() && isSpace(str.front())) {
+    str.remove_prefix(1);
+  }
+  while (!str.empty() && isSpace(str.back())) {
+    str.remove_suffix(1);
+  }
+  return str;
+}
+
+void CommandTable::add(std::string name, std::vector<std::string> aliases,
+                       int priority, lua::Ref handler) {
+  remove(name);
+  m_commands.push_back(Command{std::move(name), std::move(aliases), priority,
+                               std::move(handler), m_next_order++});
+  m_trie.clear();
+}
+
+bool CommandTable::remove(std::string_view name) {
+  auto it = std::find_if(m_commands.begin(), m_commands.end(),
+                         [&](const Command &c) {
+                           return equalFolded(c.name, name);
+                         });
+  if (it == m_commands.end()) {
+    return false;
+  }
+  m_commands.erase(it);
+  m_trie.clear();
+  return true;
+}
+
+bool CommandTable::beats(std::uint32_t a, std::uint32_t b) const {
+  if (b == NONE) {
+    return true;
+  }
+  const Command &ca = m_commands[a], &cb = m_commands[b];
+  return ca.priority > cb.priority ||
+         (ca.priority == cb.priority && ca.order < cb.order);
+}
+
+void CommandTable::insert(std::string_view word, std::uint32_t command) {
+  std::uint32_t node = 0;
+  for (char c : word) {
+    unsigned char key = fold(c);
+    auto &children = m_trie[node].children;
+    auto it = std::lower_bound(
+        children.begin(), children.end(), key,
+        [](const auto &child, unsigned char k) { return child.first < k; });
+    if (it == children.end() || it->first != key) {
+      auto next = static_cast<std::uint32_t>(m_trie.size());
+      it = children.emplace(it, key, next);
+      // May reallocate m_trie, invalidating `children`
+      m_trie.emplace_back();
+    }
+    node = it->second;
+    if (beats(command, m_trie[node].best)) {
+      m_trie[node].best = command;
+    }
+  }
+  if (beats(command, m_trie[node].exact)) {
+    m_trie[node].exact = command;
+  }
+}
+
+void CommandTable::compile() {
+  m_trie.clear();
+  m_trie.emplace_back(); // Root
+  for (std::uint32_t i = 0; i < m_commands.size(); ++i) {
+    insert(m_commands[i].name, i);
+    for (const auto &alias : m_commands[i].aliases) {
+      insert(alias, i);
+    }
+  }
+}
+
+const CommandTable::Command *CommandTable::resolve(std::string_view word) {
+  if (word.empty()) {
+    return nullptr;
+  }
+  if (m_trie.empty()) {
+    compile();
+  }
+  std::uint32_t node = 0;
+  for (char c : word) {
+    unsigned char key = fold(c);
+    const auto &children = m_trie[node].children;
+    auto it =
+        std::find_if(children.begin(), children.end(),
+                     [&](const auto &child) { return child.first == key; });
+    if (it == children.end()) {
+      return nullptr;
+    }
+    node = it->second;
+  }
+  std::uint32_t found =
+      m_trie[node].exact != NONE ? m_trie[node].exact : m_trie[node].best;
+  return found == NONE ? nullptr : &m_commands[found];
+}
+
+std::pair<std::string_view, std::string_view>
+CommandTable::splitVerb(std::string_view line) {
+  line = trim(line);
+  if (line.empty()) {
+    return {};
+  }
+  std::size_t end = 1;
+  if (std::isalnum(static_cast<unsigned char>(line[0]))) {
+    while (end < line.size() && !isSpace(line[end])) {
+      ++end;
+    }
+  }
+  return {line.substr(0, end), trim(line.substr(end))};
+}
+
+// Lua library
+
+// Read a list of non-empty strings from the table at `index`
+static std::vector<std::string> checkStrings(lua_State *L, int index) {
+  // Check everything first, so no vector is alive if luaL_error() longjmps
+  lua_Integer len = luaL_len(L, index);
+  for (lua_Integer i = 1; i <= len; ++i) {
+    if (lua_geti(L, index, i) != LUA_TSTRING || luaL_len(L, -1) == 0) {
+      luaL_error(L, "aliases must be non-empty strings");
+    }
+    lua_pop(L, 1);
+  }
+
+  std::vector<std::string> strings;
+  strings.reserve(static_cast<std::size_t>(len));
+  for (lua_Integer i = 1; i <= len; ++i) {
+    std::size_t size;
+    lua_geti(L, index, i);
+    const char *str = lua_tolstring(L, -1, &size);
+    strings.emplace_back(str, size);
+    lua_pop(L, 1);
+  }
+  return strings;
+}
+
+// commands.add(name, handler[, {aliases = {...}, priority = 0}])
+// Handlers are called on their own coroutine as
+// handler(connection, args, rest, verb), where args is the rest of the line
+// split into words
+int CommandTable::l_add(lua_State *L) {
+  std::string_view name;
+  lua::arg(L, 1, name);
+  luaL_argcheck(L, !name.empty(), 1, "command name must not be empty");
+  luaL_checktype(L, 2, LUA_TFUNCTION);
+  lua_Integer priority = 0;
+  bool has_aliases = false;
+  if (!lua_isnoneornil(L, 3)) {
+    luaL_checktype(L, 3, LUA_TTABLE);
+    if (lua_getfield(L, 3, "priority") != LUA_TNIL) {
+      priority = luaL_checkinteger(L, -1);
+    }
+    has_aliases = lua_getfield(L, 3, "aliases") == LUA_TTABLE;
+  }
+
+  std::vector<std::string> aliases;
+  if (has_aliases) {
+    aliases = checkStrings(L, lua_gettop(L));
+  }
+  lua_pushvalue(L, 2);
+  lua::Ref handler(L);
+  Engine::fromLua(L)->getCommands().add(std::string(name), std::move(aliases),
+                                        static_cast<int>(priority),
+                                        std::move(handler));
+  return 0;
+}
+
+// commands.remove(name) -> whether it existed
+int CommandTable::l_remove(lua_State *L) {
+  std::string_view name;
+  lua::arg(L, 1, name);
+  lua_pushboolean(L, Engine::fromLua(L)->getCommands().remove(name));
+  return 1;
+}
+
+// commands.fallback(fn)
+// fn is called like a command handler for unknown verbs; nil removes it
+int CommandTable::l_fallback(lua_State *L) {
+  CommandTable &commands = Engine::fromLua(L)->getCommands();
+  if (lua_isnoneornil(L, 1)) {
+    commands.setFallback(lua::Ref());
+    return 0;
+  }
+  luaL_checktype(L, 1, LUA_TFUNCTION);
+  lua_settop(L, 1);
+  commands.setFallback(lua::Ref(L));
+  return 0;
+}
+
+// commands.resolve(word) -> command name, handler or nil
+int CommandTable::l_resolve(lua_State *L) {
+  std::string_view word;
+  lua::arg(L, 1, word);
+  const Command *cmd = Engine::fromLua(L)->getCommands().resolve(word);
+  if (cmd == nullptr) {
+    lua_pushnil(L);
+    return 1;
+  }
+  lua::push(L, cmd->name);
+  cmd->handler.push(L);
+  return 2;
+}
+
+// commands.list() -> {name...} in registration order
+int CommandTable::l_list(lua_State *L) {
+  const auto &cmds = Engine::fromLua(L)->getCommands().getCommands();
+  lua_createtable(L, static_cast<int>(cmds.size()), 0);
+  for (std::size_t i = 0; i < cmds.size(); ++i) {
+    lua::push(L, cmds[i].name);
+    lua_rawseti(L, -2, static_cast<lua_Integer>(i + 1));
+  }
+  return 1;
+}
+
+int CommandTable::luaopen(lua_State *L) {
+  static const luaL_Reg funcs[]{{"add", l_add},
+                                {"remove", l_remove},
+                                {"fallback", l_fallback},
+                                {"resolve", l_resolve},
+                                {"list", l_list},
+                                {nullptr, nullptr}};
+  luaL_newlib(L, funcs);
+  return 1;
+}
+
+} // namespace whatmud
@@ -0,0 +1,96 @@
+#ifndef WHATMUD_COMMANDS_HPP
+#define WHATMUD_COMMANDS_HPP
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <lua.hpp>
+
+#include "lua/ref.hpp"
+
+namespace whatmud {
+
+/**
+ * The registry of player commands.
+ * Verbs and their aliases are compiled into a prefix trie, so resolving a
+ * word costs O(len(word)) however many commands there are. A word resolves to
+ * the command it names exactly, otherwise to the highest priority command it
+ * abbreviates, with ties going to the command registered first. This gives
+ * the usual MUD abbreviations: with "north" at a high priority, "n" and "nor"
+ * both mean north.
+ */
+class CommandTable {
+public:
+  struct Command {
+    std::string name;
+    std::vector<std::string> aliases;
+    int priority;
+    lua::Ref handler;
+    // Registration order, used to break priority ties
+    std::uint64_t order;
+  };
+
+  /**
+   * Add a command, replacing any existing command with the same name.
+   * Names and aliases are matched case insensitively.
+   */
+  void add(std::string name, std::vector<std::string> aliases, int priority,
+           lua::Ref handler);
+  // Remove a command by name, matched case insensitively
+  bool remove(std::string_view name);
+
+  // The command a word resolves to, or null if it doesn't match any
+  const Command *resolve(std::string_view word);
+
+  // Called for lines that don't match a command
+  const lua::Ref &getFallback() const { return m_fallback; }
+  void setFallback(lua::Ref fn) { m_fallback = std::move(fn); }
+
+  const std::vector<Command> &getCommands() const { return m_commands; }
+
+  // Split a line into its first word and the rest, with surrounding
+  // whitespace removed. A leading punctuation character is a word by itself,
+  // so "'hello" is the verb "'" with "hello" as the rest
+  static std::pair<std::string_view, std::string_view>
+  splitVerb(std::string_view line);
+
+  // Register the `commands` library in Lua
+  static int luaopen(lua_State *L);
+
+private:
+  static constexpr std::uint32_t NONE = UINT32_MAX;
+
+  struct Node {
+    // Sorted by character. Nodes rarely have more than a handful of
+    // children, so a linear scan beats a map
+    std::vector<std::pair<unsigned char, std::uint32_t>> children;
+    // Command named exactly by the path to this node
+    std::uint32_t exact = NONE;
+    // Best command whose name or alias starts with the path to this node
+    std::uint32_t best = NONE;
+  };
+
+  void compile();
+  void insert(std::string_view word, std::uint32_t command);
+  // Whether command `a` should win over command `b`
+  bool beats(std::uint32_t a, std::uint32_t b) const;
+
+  static int l_add(lua_State *L);
+  static int l_remove(lua_State *L);
+  static int l_fallback(lua_State *L);
+  static int l_resolve(lua_State *L);
+  static int l_list(lua_State *L);
+
+  std::vector<Command> m_commands;
+  // Empty when it needs recompiling
+  std::vector<Node> m_trie;
+  lua::Ref m_fallback;
+  std::uint64_t m_next_order = 0;
+};
+
+} // namespace whatmud
+
+#endif
@@ -1,9 +1,23 @@
+#include <cassert>
+#include <cctype>
+#include <charconv>
+#include <cstring>
 #include <stdexcept>
+#include <tuple>
 
-#include <spdlog/sinks/stdout_color_sinks.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include <fmt/args.h>
+#include <fmt/format.h>
 
+#include "commands.hpp"
 #include "connection.hpp"
+#include "log.hpp"
 #include "lua/helpers.hpp"
+#include "markup.hpp"
 #include "uv/error.hpp"
 
 // Telnet charset negotiation, not yet in libtelnet
@@ -22,19 +36,71 @@ void onRead(uv_stream_t *handle, ssize_t nread, const uv_buf_t *buf);
 static void allocBuffer(uv_handle_t *handle, std::size_t suggested_size,
                         uv_buf_t *buf);
 static int l_print(lua_State *L);
+static int l_write(lua_State *L);
+static int l_writeln(lua_State *L);
+static int l_writef(lua_State *L);
+static int l_alias(lua_State *L);
+static int l_aliases(lua_State *L);
+static int l_colour(lua_State *L);
+static int l_trace(lua_State *L);
+static int l_traces(lua_State *L);
 
 // Logger for all connection objects
 std::shared_ptr<spdlog::logger> Connection::m_log =
-    spdlog::stderr_color_mt("connection");
+    log::get("connection");
 
 // Telnet options we support, terminated by -1
 static const telnet_telopt_t TELNET_OPTS[]{
-    {TELNET_TELOPT_CHARSET, TELNET_WILL, TELNET_DONT}, {-1, 0, 0}};
+    {TELNET_TELOPT_CHARSET, TELNET_WILL, TELNET_DONT},
+    {TELNET_TELOPT_TTYPE, TELNET_WONT, TELNET_DO},
+    {-1, 0, 0}};
+
+// Terminal types to request before giving up on reaching an MTTS bitfield
+static constexpr unsigned MAX_TTYPE_REQUESTS = 3;
+// Deepest nesting of fragment tables sendLuaValue() will follow, which also
+// stops it at tables that contain themselves
+static constexpr int MAX_FRAGMENT_DEPTH = 16;
+
+static const char *const STAGE_METRIC = "whatmud_line_stage_seconds";
+static const char *const STAGE_HELP =
+    "Time input lines spent in each stage: telnet parsing, waiting to be "
+    "handled, running their command and writing its output";
+
+ConnectionStats::ConnectionStats(Metrics &metrics)
+    : bytes_received(metrics.counter("whatmud_received_bytes_total",
+                                     "Bytes received from clients")),
+      bytes_sent(metrics.counter("whatmud_sent_bytes_total",
+                                 "Bytes written to client sockets")),
+      lines_received(metrics.counter("whatmud_received_lines_total",
+                                     "Input lines received from clients")),
+      connections(
+          metrics.gauge("whatmud_connections", "Clients currently connected")),
+      parse_time(
+          metrics.histogram(STAGE_METRIC, STAGE_HELP, "stage=\"parse\"")),
+      queue_time(
+          metrics.histogram(STAGE_METRIC, STAGE_HELP, "stage=\"queue\"")),
+      handle_time(
+          metrics.histogram(STAGE_METRIC, STAGE_HELP, "stage=\"handle\"")),
+      write_time(
+          metrics.histogram(STAGE_METRIC, STAGE_HELP, "stage=\"write\"")),
+      line_latency(metrics.histogram(
+          "whatmud_line_latency_seconds",
+          "Time from an input line arriving to its output being written")) {}
+
+// The request owns the buffer's memory until the write completes
+struct Connection::WriteReq {
+  uv_write_t req;
+  std::string data;
+  // Lines whose output finishes with this write
+  std::vector<LineTrace> lines;
+};
 
 Connection::Connection(Engine *engine)
     : uv::TCP(engine->getLoop()), m_recv_buf(std::ios::in | std::ios::out),
-      m_msg_proc(engine->getLoop()), m_engine(engine),
-      m_telnet(telnet_init(TELNET_OPTS, forwardEvent, 0, this)) {
+      m_msg_proc(engine->getLoop()), m_send_buf(),
+      m_flusher(engine->getLoop()), m_engine(engine),
+      m_telnet(telnet_init(TELNET_OPTS, forwardEvent, 0, this)),
+      m_stats(engine->getConnectionStats()) {
   if (m_telnet == nullptr) {
     throw std::runtime_error("Could not create telnet state tracker");
   }
@@ -46,14 +112,48 @@ Connection::Connection(Engine *engine)
   // or fail EOF will occur frequently, and is handled directly by the message
   // processor
   m_recv_buf.exceptions(std::stringstream::badbit);
-  // Give the message processor a reference to this object
+  // Give the message processor and flusher a reference to this object
   m_msg_proc.setData(this);
+  m_flusher.setData(this);
+  m_last_input = uv_now(engine->getLoop());
 }
 
 void Connection::accept(uv_stream_t *server_sock) {
   int res = uv_accept(server_sock, asStream());
+  if (res < 0) {
+    // Drop the connection from the connections table
+    onEof();
+  }
   uv::check_error(res, "Could not accept client connection");
+  start();
+}
+
+// Close a socket no handle owns yet
+static void closeSocket(uv_os_sock_t sock) {
+#ifdef _WIN32
+  closesocket(sock);
+#else
+  ::close(sock);
+#endif
+}
+
+void Connection::accept(uv_os_sock_t sock) {
+  try {
+    open(sock);
+  } catch (const uv::Error &) {
+    // The handle doesn't own the socket yet
+    closeSocket(sock);
+    onEof();
+    throw;
+  }
+  start();
+}
+
+void Connection::start() {
   readStart(allocBuffer, onRead);
+  if (CaptureWriter *capture = m_engine->getCapture()) {
+    capture->onOpen(this, false);
+  }
 
   // Initial negotiation
   for (const telnet_telopt_t *opt = TELNET_OPTS; opt->telopt != -1; ++opt) {
@@ -66,6 +166,172 @@ void Connection::accept(uv_stream_t *server_sock) {
   }
 }
 
+Connection *Connection::create(Engine *engine, lua_State *L) {
+  // Get the connections table
+  engine->getConnections().push(L);
+
+  // Create a new Connection object
+  Connection *conn = lua::new_userdata_uv<Connection>(L, 1, engine);
+
+  // Create the coroutine on which the client handler runs
+  lua_State *co = lua_newthread(L);
+
+  // Set the coroutine's extra-space to point to the Connection object for
+  // convenience
+  auto **extraspace = reinterpret_cast<Connection **>(lua_getextraspace(co));
+  *extraspace = conn;
+
+  // Set the coroutine as the Connection's first uservalue
+  lua_pushvalue(L, -1);
+  lua_setiuservalue(L, -3, 1);
+
+  // Create the Connection's _ENV table
+  // makeEnvironment() expects the Connection object to be ontop of the stack
+  lua_pushvalue(L, -2);
+  lua_xmove(L, co, 1);
+  // 1 = connection
+  makeEnvironment(co);
+  // 1 = _ENV
+
+  // Add the Connection to the connections table to keep it alive
+  lua_pushlightuserdata(L, conn);
+  lua_pushvalue(L, -3);
+  lua_rawset(L, -5);
+  conn->m_stats.connections.add(1);
+
+  // Leave just the coroutine
+  lua_replace(L, -3);
+  lua_pop(L, 1);
+  return conn;
+}
+
+void Connection::startClientHandler(lua_State *L) {
+  lua_State *co = lua_tothread(L, -1);
+  // 1 = _ENV
+  m_engine->getClientHandler().push(co);
+  lua_insert(co, 1);
+  //  1 = handler function, 2 = _ENV
+  assert(lua_isfunction(co, 1));
+  // Set the environment
+  const char *upval_name = lua_setupvalue(co, 1, 1);
+  assert(std::strcmp(upval_name, "_ENV") == 0);
+  // 1 = handler function
+  // Start the handler
+  m_engine->resume(co, 0);
+
+  lua_pop(L, 1); // Pop coroutine
+}
+
+// Copyover hands sockets to the new process by descriptor number across
+// exec(), which only exists on POSIX
+#ifndef _WIN32
+
+void Connection::adopt(lua_State *L, int index) {
+  index = lua::absindex(L, index);
+  lua_getfield(L, index, "fd");
+  auto sock = static_cast<uv_os_sock_t>(lua_tointeger(L, -1));
+  lua_pop(L, 1);
+  try {
+    open(sock);
+  } catch (const uv::Error &) {
+    // The handle doesn't own the socket yet
+    closeSocket(sock);
+    onEof();
+    throw;
+  }
+  // The copyover let the socket survive exec(), don't let it leak into
+  // anything else this process runs
+  int flags = fcntl(sock, F_GETFD);
+  if (flags >= 0) {
+    fcntl(sock, F_SETFD, flags | FD_CLOEXEC);
+  }
+  // Input carried over from the old process is timed from now
+  m_read_at = uv_hrtime();
+  readStart(allocBuffer, onRead);
+  if (CaptureWriter *capture = m_engine->getCapture()) {
+    capture->onOpen(this, true);
+  }
+
+  lua_getfield(L, index, "utf8");
+  m_features.utf8 = lua_toboolean(L, -1);
+  lua_getfield(L, index, "colour");
+  m_features.colour = static_cast<ColourDepth>(lua_tointeger(L, -1) & 3);
+  lua_getfield(L, index, "ttype_requests");
+  m_ttype_requests = static_cast<unsigned>(lua_tointeger(L, -1));
+  if (lua_getfield(L, index, "terminal_type") == LUA_TSTRING) {
+    lua::get(L, -1, m_terminal_type);
+  }
+  lua_pop(L, 4);
+
+  if (lua_getfield(L, index, "aliases") == LUA_TTABLE) {
+    lua_pushnil(L);
+    while (lua_next(L, -2)) {
+      if (lua_type(L, -2) == LUA_TSTRING && lua_type(L, -1) == LUA_TSTRING) {
+        std::string word, expansion;
+        lua::get(L, -2, word);
+        lua::get(L, -1, expansion);
+        m_aliases.emplace(std::move(word), std::move(expansion));
+      }
+      lua_pop(L, 1);
+    }
+  }
+  lua_pop(L, 1);
+
+  // Input that arrived before the copyover but wasn't a full line yet
+  if (lua_getfield(L, index, "input") == LUA_TSTRING) {
+    std::string_view input;
+    lua::get(L, -1, input);
+    onRecv(input.data(), input.size());
+  }
+  lua_pop(L, 1);
+}
+
+void Connection::saveState(lua_State *L) {
+  uv_os_fd_t fd;
+  int res = uv_fileno(asHandle(), &fd);
+  uv::check_error(res, "Could not get connection socket");
+
+  lua_createtable(L, 0, 8);
+  lua::push(L, static_cast<lua_Integer>(fd));
+  lua_setfield(L, -2, "fd");
+  lua_pushboolean(L, m_features.utf8);
+  lua_setfield(L, -2, "utf8");
+  lua::push(L, static_cast<lua_Integer>(m_features.colour));
+  lua_setfield(L, -2, "colour");
+  lua::push(L, m_terminal_type);
+  lua_setfield(L, -2, "terminal_type");
+  lua::push(L, static_cast<lua_Integer>(m_ttype_requests));
+  lua_setfield(L, -2, "ttype_requests");
+
+  lua_createtable(L, 0, static_cast<int>(m_aliases.size()));
+  for (const auto &[word, expansion] : m_aliases) {
+    lua::push(L, expansion);
+    lua_setfield(L, -2, word.c_str());
+  }
+  lua_setfield(L, -2, "aliases");
+
+  m_recv_buf.clear();
+  std::streamoff read_pos = m_recv_buf.tellg();
+  std::string buffered = m_recv_buf.str();
+  if (read_pos > 0) {
+    buffered.erase(0, static_cast<std::size_t>(read_pos));
+  }
+  lua::push(L, buffered);
+  lua_setfield(L, -2, "input");
+}
+
+#else
+
+void Connection::adopt(lua_State *, int) {
+  throw std::runtime_error("Copyover is not supported on this platform");
+}
+
+void Connection::saveState(lua_State *) {
+  throw std::runtime_error("Copyover is not supported on this platform");
+}
+
+#endif
+
 Connection::~Connection() {
   if (m_telnet) {
     telnet_free(m_telnet);
@@ -110,6 +376,11 @@ void Connection::onEvent(telnet_event_t &ev) {
     onClientSubNegotiate(ev.sub.telopt,
                          std::string_view(ev.sub.buffer, ev.sub.size));
     break;
+  case TELNET_EV_TTYPE:
+    if (ev.ttype.cmd == TELNET_TTYPE_IS) {
+      onClientTerminalType(ev.ttype.name);
+    }
+    break;
 
   default: // Unknown event
     m_log->debug("Ignoring telnet event with type {}", ev.type);
@@ -118,18 +389,26 @@ void Connection::onEvent(telnet_event_t &ev) {
 }
 
 void Connection::onEof() {
-  m_log->info("Closing connection");
+  static log::RateLimiter limiter(20);
+  limiter.log(m_log, spdlog::level::info, "Closing connection");
+  if (CaptureWriter *capture = m_engine->getCapture()) {
+    capture->onClose(this);
+  }
+  // Our other handles live inside this object, so they must be closed before
+  // it is garbage collected
+  m_msg_proc.close();
+  m_flusher.close();
   close([](uv_handle_t *handle) {
     Connection *conn = reinterpret_cast<Connection *>(handle->data);
     // Set the connection object as disconnected
     conn->m_connected = false;
+    conn->m_stats.connections.add(-1);
 
     // Remove it from the table of connections so it will be garbage collected
     // when there are no more references
     lua_State *L = conn->m_engine->getLuaState();
     // Get connections table
-    lua_pushliteral(L, "connections");
-    lua_rawget(L, LUA_REGISTRYINDEX);
+    conn->m_engine->getConnections().push(L);
     // Set this Connection to nil
     lua_pushlightuserdata(L, conn);
     lua_pushnil(L);
@@ -139,37 +418,253 @@ void Connection::onEof() {
   });
 }
 
+void Connection::disconnect() {
+  if (isClosing()) {
+    return;
+  }
+  readStop();
+  onEof();
+}
+
+std::string Connection::getPeerAddress() const {
+  struct sockaddr_storage addr;
+  char ip[INET6_ADDRSTRLEN];
+  try {
+    getPeerName((struct sockaddr *)&addr);
+  } catch (const uv::Error &) {
+    return {}; // Not connected any more
+  }
+  if (uv_ip_name((struct sockaddr *)&addr, ip, sizeof(ip)) < 0) {
+    return {};
+  }
+  int port = addr.ss_family == AF_INET6
+                 ? ntohs(((struct sockaddr_in6 *)&addr)->sin6_port)
+                 : ntohs(((struct sockaddr_in *)&addr)->sin_port);
+  return fmt::format("{}:{}", ip, port);
+}
+
+std::uint64_t Connection::getIdleTime() const {
+  return uv_now(m_engine->getLoop()) - m_last_input;
+}
+
 void Connection::onSend(const char *buf, std::size_t size) {
-  // Copy the data into a libuv buffer
-  uv_buf_t writebuf = uv_buf_init(new char[size], size);
-  std::memcpy(writebuf.base, buf, size);
-
-  // Start a write request
-  // `req` is deleted by the write callback, as is the buffer memory
-  uv_write_t *req = new uv_write_t;
-  req->data = writebuf.base;
-  write(req, &writebuf, [](uv_write_t *req, int status) {
-    char *writebuf = reinterpret_cast<char *>(req->data);
-    // Free the no longer needed buffer memory
-    delete[] writebuf;
-    // Destroy the request
-    delete req;
+  if (isClosing()) {
+    return; // Nowhere to send it
+  }
+  if (m_send_buf.empty()) {
+    m_flusher.start([](uv_prepare_t *handle) {
+      Connection *conn = reinterpret_cast<Connection *>(handle->data);
+      conn->flush();
+    });
+  }
+  m_send_buf.append(buf, size);
+}
+
+void Connection::flush() {
+  m_flusher.stop();
+  if (m_send_buf.empty() || isClosing()) {
+    return;
+  }
+
+  WriteReq *wr =
+      new WriteReq{{}, std::move(m_send_buf), std::move(m_unwritten)};
+  m_send_buf.clear(); // Moved-from containers are valid but unspecified
+  m_unwritten.clear();
+  uv_buf_t writebuf = uv_buf_init(wr->data.data(), wr->data.size());
+  m_stats.bytes_sent.inc(wr->data.size());
+  m_bytes_sent += wr->data.size();
+  write(&wr->req, &writebuf, [](uv_write_t *req, int status) {
+    WriteReq *wr = reinterpret_cast<WriteReq *>(req);
+    // Cancelled writes still complete before the connection is closed
+    Connection *conn = reinterpret_cast<Connection *>(req->handle->data);
+    if (conn->m_last_write == wr) {
+      conn->m_last_write = nullptr;
+    }
+    if (status >= 0 && !wr->lines.empty()) {
+      std::uint64_t now = uv_hrtime();
+      for (LineTrace &trace : wr->lines) {
+        trace.written_at = now;
+        conn->recordLine(trace);
+      }
+    }
+    delete wr;
+    if (status == UV_ECANCELED) {
+      return; // The connection was closed with writes still queued
+    }
     // Throw any errors
     uv::check_error(status, "Write error");
   });
+  m_last_write = wr;
+}
+
+void Connection::startLine() {
+  std::uint64_t now = uv_hrtime();
+  if (!m_queued_lines.empty()) {
+    m_line = m_queued_lines.front();
+    m_queued_lines.pop_front();
+  } else {
+    m_line = LineTrace{now, now};
+  }
+  m_line.started_at = now;
+  m_line_active = true;
+}
+
+void Connection::finishLine() {
+  if (!m_line_active) {
+    return;
+  }
+  m_line_active = false;
+  m_line.handled_at = uv_hrtime();
+  if (!m_send_buf.empty()) {
+    m_unwritten.push_back(m_line); // Goes out with the next flush
+  } else if (m_last_write != nullptr) {
+    m_last_write->lines.push_back(m_line); // Already handed to libuv
+  } else {
+    m_line.written_at = m_line.handled_at; // Nothing left to write
+    recordLine(m_line);
+  }
+}
+
+void Connection::recordLine(const LineTrace &trace) {
+  // Not timed from when it was read
+  if (trace.read_at == 0) {
+    return;
+  }
+  m_stats.parse_time.observe(trace.parsed_at - trace.read_at);
+  m_stats.queue_time.observe(trace.started_at - trace.parsed_at);
+  m_stats.handle_time.observe(trace.handled_at - trace.started_at);
+  m_stats.write_time.observe(trace.written_at - trace.handled_at);
+  m_stats.line_latency.observe(trace.written_at - trace.read_at);
+  if (!m_tracing) {
+    return;
+  }
+  m_log->info("Line took {:.3f} ms: parse {:.3f}, queue {:.3f}, handle {:.3f}, "
+              "write {:.3f}",
+              (trace.written_at - trace.read_at) / 1e6,
+              (trace.parsed_at - trace.read_at) / 1e6,
+              (trace.started_at - trace.parsed_at) / 1e6,
+              (trace.handled_at - trace.started_at) / 1e6,
+              (trace.written_at - trace.handled_at) / 1e6);
+  m_traces.push_back(trace);
+  if (m_traces.size() > TRACE_HISTORY) {
+    m_traces.pop_front();
+  }
+}
+
+void Connection::setTracing(bool tracing) {
+  m_tracing = tracing;
+  if (!tracing) {
+    m_traces.clear();
+  }
+}
+
+void Connection::sendLuaValue(lua_State *L, int index, int depth) {
+  // Big enough for any integer or %.14g float
+  char numbuf[64];
+  switch (lua_type(L, index)) {
+  case LUA_TSTRING: {
+    std::string_view str;
+    lua::get(L, index, str);
+    send(str);
+    break;
+  }
+  case LUA_TNUMBER: {
+    fmt::format_to_n_result<char *> res;
+    if (lua_isinteger(L, index)) {
+      res = fmt::format_to_n(numbuf, sizeof(numbuf), "{}",
+                             lua_tointeger(L, index));
+    } else {
+      // Match Lua's own number formatting, including the ".0" suffix on
+      // integral floats
+      res = fmt::format_to_n(numbuf, sizeof(numbuf), "{:.14g}",
+                             lua_tonumber(L, index));
+      std::string_view num(numbuf, res.size);
+      if (num.find_first_of(".eEin") == std::string_view::npos) {
+        *res.out++ = '.';
+        *res.out++ = '0';
+        res.size += 2;
+      }
+    }
+    send(numbuf, res.size);
+    break;
+  }
+  case LUA_TBOOLEAN:
+    send(lua_toboolean(L, index) ? "true" : "false");
+    break;
+  case LUA_TNIL:
+    send("nil");
+    break;
+  case LUA_TTABLE:
+    luaL_checkstack(L, 3, "fragments nested too deeply");
+    if (!luaL_getmetafield(L, index, "__tostring")) {
+      // A list of fragments, gathered straight into the output buffer
+      if (depth >= MAX_FRAGMENT_DEPTH) {
+        luaL_error(L, "fragments nested more than %d deep",
+                   MAX_FRAGMENT_DEPTH);
+      }
+      index = lua::absindex(L, index);
+      lua_Integer len = luaL_len(L, index);
+      for (lua_Integer i = 1; i <= len; ++i) {
+        lua_rawgeti(L, index, i);
+        sendLuaValue(L, -1, depth + 1);
+        lua_pop(L, 1);
+      }
+      break;
+    }
+    lua_pop(L, 1); // Pop __tostring
+    [[fallthrough]];
+  default: {
+    if (Markup *markup = lua::test_userdata<Markup>(L, index)) {
+      send(markup->render(m_features));
+      break;
+    }
+    // Anything else goes through tostring() semantics
+    std::size_t len;
+    const char *str = luaL_tolstring(L, index, &len);
+    send(str, len);
+    lua_pop(L, 1);
+    break;
+  }
+  }
+}
+
+void Connection::sendTransliterated(const char *buf, std::size_t size) {
+  std::string ascii;
+  transliterate_ascii(std::string_view(buf, size), ascii);
+  telnet_send(m_telnet, ascii.data(), ascii.size());
 }
 
 void Connection::onRecv(const char *buf, std::size_t size) {
   // Buffer the received data so it can be read line by line
   m_recv_buf.write(buf, size);
+  // Start timing each line it completes
+  std::uint64_t now = uv_hrtime();
+  for (const char *end = buf + size;
+       (buf = static_cast<const char *>(std::memchr(buf, '\n', end - buf)));
+       ++buf) {
+    m_queued_lines.push_back(LineTrace{m_read_at, now});
+  }
   // We likely have new messages to process
   m_msg_proc.start([](uv_check_t *handle) {
     Connection *conn = reinterpret_cast<Connection *>(handle->data);
 
+    // Keep checking each iteration until the running command finishes
+    if (conn->isCommandRunning()) {
+      return;
+    }
+    conn->finishLine();
+
     // Process messages line by line
     std::string msg;
     while (!std::getline(conn->m_recv_buf, msg).eof()) {
+      conn->m_stats.lines_received.inc();
+      conn->startLine();
+      sanitize_input(msg, conn->m_features.utf8);
       conn->onMessage(msg);
+      if (conn->isCommandRunning()) {
+        return;
+      }
+      conn->finishLine();
     }
 
     conn->m_recv_buf.clear(); // Clear EOF flag
@@ -177,13 +672,105 @@ void Connection::onRecv(const char *buf, std::size_t size) {
   });
 }
 
+static std::string lowercase(std::string_view str) {
+  std::string lower(str);
+  for (char &c : lower) {
+    c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+  }
+  return lower;
+}
+
 void Connection::onMessage(const std::string &msg) {
-  m_log->info("Got message: {}", msg);
-  send(msg + '\n'); // Echo the message
+  m_log->debug("Got message: {}", msg);
+  auto [verb, rest] = CommandTable::splitVerb(msg);
+  if (verb.empty()) {
+    return;
+  }
+
+  // Expand the connection's aliases
+  std::string expanded;
+  if (!m_aliases.empty()) {
+    auto alias = m_aliases.find(lowercase(verb));
+    if (alias != m_aliases.end()) {
+      expanded = alias->second;
+      if (!rest.empty()) {
+        expanded += ' ';
+        expanded += rest;
+      }
+      std::tie(verb, rest) = CommandTable::splitVerb(expanded);
+    }
+  }
+
+  CommandTable &commands = m_engine->getCommands();
+  const CommandTable::Command *cmd = commands.resolve(verb);
+  const lua::Ref &handler = cmd ? cmd->handler : commands.getFallback();
+  if (!handler) {
+    send("Unknown command.\n");
+    return;
+  }
+
+  // Run the handler on its own coroutine, so it can yield
+  lua_State *L = m_engine->getLuaState();
+  lua_State *co = lua_newthread(L);
+  *reinterpret_cast<Connection **>(lua_getextraspace(co)) = this;
+  handler.push(co);
+  // handler(connection, args, rest, verb)
+  m_engine->getConnections().push(co);
+  lua_rawgetp(co, -1, this);
+  lua_remove(co, -2);
+  lua_newtable(co);
+  lua_Integer nargs = 0;
+  for (std::size_t pos = 0;;) {
+    pos = rest.find_first_not_of(" \t", pos);
+    if (pos == std::string_view::npos) {
+      break;
+    }
+    std::size_t end = rest.find_first_of(" \t", pos);
+    lua::push(co, rest.substr(pos, end - pos));
+    lua_rawseti(co, -2, ++nargs);
+    pos = end;
+  }
+  lua::push(co, rest);
+  lua::push(co, cmd ? std::string_view(cmd->name) : verb);
+
+  if (m_engine->resume(co, 4) == LUA_YIELD) {
+    m_command_co = lua::Ref(L); // Pops the coroutine
+  } else {
+    lua_pop(L, 1);
+  }
+}
+
+bool Connection::isCommandRunning() {
+  if (!m_command_co) {
+    return false;
+  }
+  lua_State *L = m_engine->getLuaState();
+  m_command_co.push(L);
+  int status = lua_status(lua_tothread(L, -1));
+  lua_pop(L, 1);
+  if (status == LUA_YIELD) {
+    return true;
+  }
+  m_command_co.reset();
+  return false;
+}
+
+void Connection::setAlias(std::string word, std::string expansion) {
+  m_aliases.insert_or_assign(lowercase(word), std::move(expansion));
+}
+
+bool Connection::removeAlias(const std::string &word) {
+  return m_aliases.erase(lowercase(word)) > 0;
 }
 
 void Connection::onClientWill(unsigned char telopt) {
   m_log->debug("Client will use telnet option {}", telopt);
+  switch (telopt) {
+  case TELNET_TELOPT_TTYPE:
+    telnet_ttype_send(m_telnet);
+    ++m_ttype_requests;
+    break;
+  }
 }
 
 void Connection::onClientWont(unsigned char telopt) {
@@ -222,6 +809,43 @@ void Connection::onClientSubNegotiate(unsigned char telopt,
   }
 }
 
+void Connection::onClientTerminalType(std::string_view name) {
+  m_log->debug("Client terminal type: {}", name);
+  // Mud Terminal Type Standard bitfield
+  if (name.starts_with("MTTS ")) {
+    unsigned flags = 0;
+    std::from_chars(name.data() + 5, name.data() + name.size(), flags);
+    if (flags & 256) {
+      m_features.colour = ColourDepth::TRUECOLOUR;
+    } else if (flags & 8) {
+      m_features.colour = ColourDepth::XTERM256;
+    } else if (flags & 1) {
+      m_features.colour = ColourDepth::ANSI16;
+    } else {
+      m_features.colour = ColourDepth::NONE;
+    }
+    return;
+  }
+
+  std::string upper(name);
+  for (char &c : upper) {
+    c = static_cast<char>(std::toupper(static_cast<unsigned char>(c)));
+  }
+  if (upper.find("TRUECOLOR") != upper.npos) {
+    m_features.colour = ColourDepth::TRUECOLOUR;
+  } else if (upper.find("256COLOR") != upper.npos &&
+             m_features.colour < ColourDepth::XTERM256) {
+    m_features.colour = ColourDepth::XTERM256;
+  }
+
+  // The same name twice means the client has nothing more to tell us
+  if (upper != m_terminal_type && m_ttype_requests < MAX_TTYPE_REQUESTS) {
+    m_terminal_type = std::move(upper);
+    telnet_ttype_send(m_telnet);
+    ++m_ttype_requests;
+  }
+}
+
 void forwardEvent(telnet_t *telnet, telnet_event_t *event, void *user_data) {
   (void)telnet;
   Connection *conn = reinterpret_cast<Connection *>(user_data);
@@ -241,6 +865,13 @@ void onRead(uv_stream_t *handle, ssize_t nread, const uv_buf_t *buf) {
     throw uv::Error((int)nread, "Read error");
   } else {
     // Process input with libtelnet
+    conn->m_stats.bytes_received.inc(static_cast<std::uint64_t>(nread));
+    conn->m_bytes_received += static_cast<std::uint64_t>(nread);
+    conn->m_last_input = uv_now(handle->loop);
+    conn->m_read_at = uv_hrtime();
+    if (CaptureWriter *capture = conn->m_engine->getCapture()) {
+      capture->onData(conn, buf->base, static_cast<std::size_t>(nread));
+    }
     telnet_recv(conn->getTelnet(), buf->base, nread);
 
     // Free the buffer
@@ -262,7 +893,7 @@ void Connection::makeEnvironment(lua_State *L) {
   lua_insert(L, 1);
   lua_setfield(L, 1, "connection");
 
-  // print() function that outputs using Connection::send()
+  // print() function that outputs using Connection::sendLuaValue()
   lua_pushliteral(L, "print");
   lua_pushcfunction(L, l_print);
   lua_rawset(L, -3);
@@ -281,25 +912,186 @@ void Connection::makeEnvironment(lua_State *L) {
 }
 
 static int l_print(lua_State *L) {
-  std::string output;
-  std::string_view arg;
-  for (int i = 1; i <= lua_gettop(L); ++i) {
-    if (!(lua_isstring(L, i) || lua_isnumber(L, i))) {
-      // Convert to a string
-      lua_getglobal(L, "tostring");
-      lua_pushvalue(L, i);
-      lua_call(L, 1, 1);
-      lua_replace(L, i); // value at index i is now a string
+  auto *conn = *reinterpret_cast<Connection **>(lua_getextraspace(L));
+  int nargs = lua_gettop(L);
+  for (int i = 1; i <= nargs; ++i) {
+    if (i > 1) {
+      conn->send("\t");
     }
-    lua::get(L, i, arg);
-    output += arg;
-    output += '\t';
+    conn->sendLuaValue(L, i);
   }
-  output[output.size() - 1] = '\n';
+  conn->send("\n");
+  return 0;
+}
 
-  auto *conn = *reinterpret_cast<Connection **>(lua_getextraspace(L));
-  conn->send(output);
+const luaL_Reg Connection::LUA_METHODS[]{{"write", l_write},
+                                         {"writeln", l_writeln},
+                                         {"writef", l_writef},
+                                         {"alias", l_alias},
+                                         {"aliases", l_aliases},
+                                         {"colour", l_colour},
+                                         {"trace", l_trace},
+                                         {"traces", l_traces},
+                                         {nullptr, nullptr}};
+
+// connection:write(...)
+// Writes each argument with no separators. Table arguments are lists of
+// fragments
+static int l_write(lua_State *L) {
+  Connection *conn = lua::check_userdata<Connection>(L, 1);
+  int nargs = lua_gettop(L);
+  for (int i = 2; i <= nargs; ++i) {
+    conn->sendLuaValue(L, i);
+  }
   return 0;
 }
 
+// connection:writeln(...)
+// Same as write(), followed by a newline
+static int l_writeln(lua_State *L) {
+  l_write(L);
+  Connection *conn = lua::check_userdata<Connection>(L, 1);
+  conn->send("\n");
+  return 0;
+}
+
+// connection:writef(fmt, ...)
+// Formats the arguments with {fmt} syntax, E.G. "{} has {:>5} hp"
+static int l_writef(lua_State *L) {
+  Connection *conn = lua::check_userdata<Connection>(L, 1);
+  std::string_view format;
+  lua::arg(L, 2, format);
+
+  // Convert everything that isn't a number or boolean to a string up front,
+  // since __tostring may raise an error
+  int nargs = lua_gettop(L);
+  for (int i = 3; i <= nargs; ++i) {
+    int type = lua_type(L, i);
+    if (type != LUA_TNUMBER && type != LUA_TBOOLEAN) {
+      luaL_tolstring(L, i, nullptr);
+      lua_replace(L, i);
+    }
+  }
+
+  {
+    fmt::dynamic_format_arg_store<fmt::format_context> args;
+    args.reserve(nargs - 2, 0);
+    for (int i = 3; i <= nargs; ++i) {
+      switch (lua_type(L, i)) {
+      case LUA_TNUMBER:
+        if (lua_isinteger(L, i)) {
+          args.push_back(lua_tointeger(L, i));
+        } else {
+          args.push_back(lua_tonumber(L, i));
+        }
+        break;
+      case LUA_TBOOLEAN:
+        args.push_back(static_cast<bool>(lua_toboolean(L, i)));
+        break;
+      default: {
+        // Referenced in place, the strings stay alive on the stack
+        std::string_view str;
+        args.push_back(lua::get(L, i, str));
+        break;
+      }
+      }
+    }
+
+    fmt::memory_buffer out;
+    try {
+      fmt::vformat_to(std::back_inserter(out), format, args);
+      conn->send(out.data(), out.size());
+      return 0;
+    } catch (const fmt::format_error &e) {
+      lua_pushstring(L, e.what());
+    }
+  }
+  // Raised outside the scope above so the formatter's memory is released
+  return luaL_error(L, "bad format string: %s", lua_tostring(L, -1));
+}
+
+// connection:alias(word, expansion)
+// Expands `word` at the start of this connection's input. A nil expansion
+// removes the alias
+static int l_alias(lua_State *L) {
+  Connection *conn = lua::check_userdata<Connection>(L, 1);
+  std::string_view word;
+  lua::arg(L, 2, word);
+  if (lua_isnoneornil(L, 3)) {
+    lua_pushboolean(L, conn->removeAlias(std::string(word)));
+    return 1;
+  }
+  std::string_view expansion;
+  lua::arg(L, 3, expansion);
+  luaL_argcheck(L, !word.empty() && word.find_first_of(" \t") == word.npos,
+                2, "alias must be a single word");
+  conn->setAlias(std::string(word), std::string(expansion));
+  return 0;
+}
+
+// connection:aliases() -> {word = expansion}
+static int l_aliases(lua_State *L) {
+  Connection *conn = lua::check_userdata<Connection>(L, 1);
+  const auto &aliases = conn->getAliases();
+  lua_createtable(L, 0, static_cast<int>(aliases.size()));
+  for (const auto &[word, expansion] : aliases) {
+    lua::push(L, expansion);
+    lua_setfield(L, -2, word.c_str());
+  }
+  return 1;
+}
+
+// connection:colour([depth]) -> depth
+// Gets or overrides the colours the client is assumed to support: "none",
+// "16", "256" or "truecolour"
+static int l_colour(lua_State *L) {
+  static const char *const DEPTHS[]{"none", "16", "256", "truecolour",
+                                    nullptr};
+  Connection *conn = lua::check_userdata<Connection>(L, 1);
+  if (!lua_isnoneornil(L, 2)) {
+    conn->setColourDepth(
+        static_cast<ColourDepth>(luaL_checkoption(L, 2, nullptr, DEPTHS)));
+  }
+  lua_pushstring(L,
+                 DEPTHS[static_cast<unsigned>(conn->getFeatures().colour)]);
+  return 1;
+}
+
+// connection:trace([on]) -> on
+// Gets or sets whether the timing of each line from this client is logged and
+// kept for connection:traces()
+static int l_trace(lua_State *L) {
+  Connection *conn = lua::check_userdata<Connection>(L, 1);
+  if (!lua_isnoneornil(L, 2)) {
+    conn->setTracing(lua_toboolean(L, 2));
+  }
+  lua_pushboolean(L, conn->isTracing());
+  return 1;
+}
+
+// connection:traces() -> {{parse, queue, handle, write, total}, ...}
+// The latest lines traced, oldest first. Times are in milliseconds: telnet
+// parsing, waiting to be handled, running the command and writing its output
+static int l_traces(lua_State *L) {
+  Connection *conn = lua::check_userdata<Connection>(L, 1);
+  const auto &traces = conn->getTraces();
+  lua_createtable(L, static_cast<int>(traces.size()), 0);
+  lua_Integer i = 0;
+  for (const Connection::LineTrace &trace : traces) {
+    lua_createtable(L, 0, 5);
+    lua_pushnumber(L, (trace.parsed_at - trace.read_at) / 1e6);
+    lua_setfield(L, -2, "parse");
+    lua_pushnumber(L, (trace.started_at - trace.parsed_at) / 1e6);
+    lua_setfield(L, -2, "queue");
+    lua_pushnumber(L, (trace.handled_at - trace.started_at) / 1e6);
+    lua_setfield(L, -2, "handle");
+    lua_pushnumber(L, (trace.written_at - trace.handled_at) / 1e6);
+    lua_setfield(L, -2, "write");
+    lua_pushnumber(L, (trace.written_at - trace.read_at) / 1e6);
+    lua_setfield(L, -2, "total");
+    lua_rawseti(L, -2, ++i);
+  }
+  return 1;
+}
+
 } // namespace whatmud
@@ -1,12 +1,16 @@
 #ifndef WHATMUD_CONNECTION_HPP
 #define WHATMUD_CONNECTION_HPP
 
+#include <cstdint>
 #include <cstring>
+#include <deque>
 #include <sstream>
 #include <stddef.h>
 #include <string>
 #include <string_view>
+#include <unordered_map>
 #include <utility>
+#include <vector>
 
 #include <fmt/core.h>
 #include <libtelnet.h>
@@ -14,42 +18,168 @@
 
 #include "engine.hpp"
 #include "features.hpp"
+#include "lua/ref.hpp"
+#include "metrics.hpp"
+#include "text.hpp"
 #include "uv/check.hpp"
+#include "uv/prepare.hpp"
 #include "uv/tcp.hpp"
 
 namespace whatmud {
 
+// Metrics shared by every connection, owned by the Engine
+struct ConnectionStats {
+  explicit ConnectionStats(Metrics &metrics);
+
+  Counter &bytes_received;
+  Counter &bytes_sent;
+  Counter &lines_received;
+  Gauge &connections;
+  // Time each input line spent in each stage, and in all of them
+  Histogram &parse_time;
+  Histogram &queue_time;
+  Histogram &handle_time;
+  Histogram &write_time;
+  Histogram &line_latency;
+};
+
 class Connection : protected uv::TCP {
 public:
+  // Line traces kept for connections being traced
+  static constexpr std::size_t TRACE_HISTORY = 50;
+
+  // Timestamps of one input line's trip through the connection, on the
+  // uv_hrtime() clock
+  struct LineTrace {
+    // The bytes ending the line arrived in onRead()
+    std::uint64_t read_at = 0;
+    // Telnet parsing finished and the line was buffered
+    std::uint64_t parsed_at = 0;
+    // The message processor took the line from the buffer
+    std::uint64_t started_at = 0;
+    // The line's command handler finished
+    std::uint64_t handled_at = 0;
+    // Output sent while handling the line finished writing
+    std::uint64_t written_at = 0;
+  };
+
   Connection(Engine *engine);
   ~Connection();
 
+  /**
+   * Create a Connection and the coroutine its handlers run on, and add it to
+   * the engine's connections table. The coroutine's stack holds the
+   * connection's _ENV table. Leaves the coroutine on top of L's stack.
+   */
+  static Connection *create(Engine *engine, lua_State *L);
+
+  // Accept a client from a listening socket. If that fails the connection is
+  // closed and removed from the connections table
   void accept(uv_stream_t *server_sock);
+  // Take over a socket connected to a new client. Closes the socket if it
+  // can't be used
+  void accept(uv_os_sock_t sock);
+  // Run the client handler on the coroutine create() left on top of L's
+  // stack, and pop it
+  void startClientHandler(lua_State *L);
+
+  /**
+   * Take over a client socket inherited across a copyover, restoring the
+   * state saved by saveState() from the table at `index`. Nothing is
+   * renegotiated, the client already has its options set.
+   */
+  void adopt(lua_State *L, int index);
+  // Push a table with everything adopt() needs to take over this connection
+  // in a new process. The socket, in field `fd`, is still close-on-exec
+  void saveState(lua_State *L);
+
+  // Whether the client is connected and the connection isn't closing
+  bool isOpen() const { return m_connected && !isClosing(); }
+  // Close the connection from our end, discarding unsent output
+  void disconnect();
+
+  // The client's address as ip:port, or empty if it can't be found
+  std::string getPeerAddress() const;
+  // Output not yet written to the socket, in bytes
+  std::size_t getPendingOutput() {
+    return m_send_buf.size() + getWriteQueueSize();
+  }
 
   telnet_t *getTelnet() { return m_telnet; }
   const telnet_t *getTelnet() const { return m_telnet; }
 
+  const Features &getFeatures() const { return m_features; }
+  void setColourDepth(ColourDepth depth) { m_features.colour = depth; }
+  const std::string &getTerminalType() const { return m_terminal_type; }
+
+  // Traffic through this connection, in bytes after telnet escaping
+  std::uint64_t getBytesReceived() const { return m_bytes_received; }
+  std::uint64_t getBytesSent() const { return m_bytes_sent; }
+  // Milliseconds since the client last sent anything
+  std::uint64_t getIdleTime() const;
+  // Complete input lines waiting to be handled
+  std::size_t getQueuedLines() const { return m_queued_lines.size(); }
+
+  // Whether a command handler started by this connection is still suspended.
+  // Further input waits until it finishes, so commands run in order
+  bool isCommandRunning();
+
   /**
    * Send data to the client.
-   * Data is sent asynchronously by libuv.
+   * Data is appended to the output buffer, which is flushed to libuv once per
+   * loop iteration. Clients that don't use UTF-8 get it transliterated to
+   * ASCII.
    */
   void send(const char *buf, std::size_t size) {
+    if (!m_features.utf8 && !is_ascii(std::string_view(buf, size))) {
+      sendTransliterated(buf, size);
+      return;
+    }
     telnet_send(m_telnet, buf, size);
   }
   void send(const char *str) { send(str, std::strlen(str)); }
   void send(const std::string &str) { send(str.c_str(), str.size()); }
   void send(std::string_view str) { send(str.data(), str.size()); }
 
+  // Write a Lua value at the given index without creating intermediate Lua
+  // strings. Tables without a __tostring metamethod are treated as arrays of
+  // fragments, and Markup is rendered for this client. Raises a Lua error if
+  // fragment tables are nested too deeply, E.G. one that contains itself
+  void sendLuaValue(lua_State *L, int index, int depth = 0);
+
+  // Hand buffered output to libuv as a single write request
+  void flush();
+
+  /**
+   * Make `word` at the start of a line expand to `expansion`, before the
+   * command is looked up. Only for this connection; words are matched case
+   * insensitively and aliases don't expand recursively.
+   */
+  void setAlias(std::string word, std::string expansion);
+  bool removeAlias(const std::string &word);
+  const std::unordered_map<std::string, std::string> &getAliases() const {
+    return m_aliases;
+  }
+
+  /**
+   * Log the timing of every line from this client, and keep the last
+   * TRACE_HISTORY. Every line is timed into the engine's metrics either way;
+   * this is for looking into one laggy client.
+   */
+  void setTracing(bool tracing);
+  bool isTracing() const { return m_tracing; }
+  const std::deque<LineTrace> &getTraces() const { return m_traces; }
+
 protected: // Event handlers
            // Called for each libtelnet event
   void onEvent(telnet_event_t &ev);
   // Called when the client closes the connection
   void onEof();
-  // Called when data needs to be sent to the client
+  // Called when escaped data needs to be sent to the client
   void onSend(const char *buf, std::size_t size);
   // Called when data is received from the client
   void onRecv(const char *buf, std::size_t size);
-  // Called for each message line
+  // Called for each message line, dispatches it to a command handler
   void onMessage(const std::string &msg);
 
   // Called when the client requests to turn on a feature
@@ -63,26 +193,78 @@ protected: // Event handlers
 
   // Called when the client sends subnegotiation data
   void onClientSubNegotiate(unsigned char telopt, std::string_view data);
+  // Called when the client reports its terminal type
+  void onClientTerminalType(std::string_view name);
 
 private:
+  struct WriteReq;
+
+  void sendTransliterated(const char *buf, std::size_t size);
+
+  // Start reading from a newly connected client and negotiate options
+  void start();
+
+  // Start timing the next buffered line, as it's taken for handling
+  void startLine();
+  // The current line's handler has finished. It's done once any output it
+  // sent has been written
+  void finishLine();
+  // Record a line's timings once its output has been written
+  void recordLine(const LineTrace &trace);
+
   // Receive buffer, used to buffer message lines
   std::stringstream m_recv_buf;
   // Message processor, checks for and handles messages
   // We do this in a check handler instead of when data is received for more
   // fair distribution of CPU time per client
   uv::Check m_msg_proc;
+  // Output buffer, holding telnet-escaped data not yet handed to libuv
+  std::string m_send_buf;
+  // Flushes the output buffer just before the loop polls for IO, coalescing
+  // everything sent during an iteration into one write
+  uv::Prepare m_flusher;
   // Pointer back to the Engine
   Engine *m_engine;
   // Libtelnet state tracker
   telnet_t *m_telnet;
   // Features supported by this client
   Features m_features{};
+  // Last terminal type reported, and how many times we've asked. Clients
+  // cycle through their names on each request, ending with an MTTS bitfield
+  std::string m_terminal_type;
+  unsigned m_ttype_requests = 0;
+  // Per-connection command aliases, from a word to the text replacing it
+  std::unordered_map<std::string, std::string> m_aliases;
+  // Coroutine of the last command handler, while it may still be suspended
+  lua::Ref m_command_co;
+  // When the data being parsed was read
+  std::uint64_t m_read_at = 0;
+  // Buffered lines not yet handled, oldest first
+  std::deque<LineTrace> m_queued_lines;
+  // The line being handled, if m_line_active
+  LineTrace m_line;
+  bool m_line_active = false;
+  // Handled lines waiting for their output to be flushed
+  std::vector<LineTrace> m_unwritten;
+  // The newest write handed to libuv, until it completes
+  WriteReq *m_last_write = nullptr;
+  std::deque<LineTrace> m_traces;
+  bool m_tracing = false;
+  std::uint64_t m_bytes_received = 0;
+  std::uint64_t m_bytes_sent = 0;
+  // uv_now() when the client last sent anything
+  std::uint64_t m_last_input = 0;
+  // Shared by every connection
+  ConnectionStats &m_stats;
   // Whether this client is still connected
   bool m_connected : 1 = true;
 
   static std::shared_ptr<spdlog::logger> m_log;
 
 public:
+  // Methods available on Connection objects in Lua
+  static const luaL_Reg LUA_METHODS[];
+
   // Make the environment table for a Lua Connection coroutine, and leave it
   // ontop of the stack
   static void makeEnvironment(lua_State *L);
@@ -0,0 +1,424 @@
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <stdexcept>
+#include <system_error>
+
+#include <fmt/core.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "connection.hpp"
+#include "copyover.hpp"
+#include "db/object_store.hpp"
+#include "engine.hpp"
+#include "log.hpp"
+#include "lua/error.hpp"
+#include "lua/helpers.hpp"
+#include "lua/serialize.hpp"
+#include "uv/error.hpp"
+
+namespace whatmud {
+
+#ifndef _WIN32
+// Set or clear close-on-exec on `fd`, returning whether it worked
+static bool set_cloexec(int fd, bool cloexec) {
+  int flags = fcntl(fd, F_GETFD);
+  if (flags < 0) {
+    return false;
+  }
+  flags = cloexec ? flags | FD_CLOEXEC : flags & ~FD_CLOEXEC;
+  return fcntl(fd, F_SETFD, flags) == 0;
+}
+#endif
+
+Copyover::Copyover(Engine *engine)
+    : m_log(log::get("copyover")), m_engine(engine),
+      m_timer(engine->getLoop()) {
+  m_timer.setData(this);
+}
+
+bool Copyover::isOutputPending() {
+  bool pending = false;
+  lua_State *L = m_engine->getLuaState();
+  m_engine->getConnections().push(L);
+  lua_pushnil(L);
+  while (lua_next(L, -2)) {
+    Connection *conn = lua::test_userdata<Connection>(L, -1);
+    if (conn != nullptr && conn->isOpen()) {
+      conn->flush();
+      pending |= conn->getPendingOutput() > 0;
+    }
+    lua_pop(L, 1);
+  }
+  lua_pop(L, 1);
+  return pending;
+}
+
+bool Copyover::isSaving() {
+  bool saving = false;
+  if (db::ObjectStore *store = m_engine->getObjectStore()) {
+    if (store->getDirtyCount() > 0 && !store->isFlushing()) {
+      store->flushAll();
+    }
+    saving |= store->isFlushing();
+  }
+  if (db::Database *db = m_engine->getDatabase()) {
+    saving |= db->getBusy() > 0 || db->getQueued() > 0;
+  }
+  return saving || m_engine->getSnapshotter()->isRunning();
+}
+
+void Copyover::onTimer() {
+  bool saving = isSaving();
+  bool output = isOutputPending();
+  bool timed_out = uv_now(m_engine->getLoop()) >= m_deadline;
+  if (saving && !timed_out) {
+    return;
+  }
+  if (output && !timed_out) {
+    return;
+  }
+  m_timer.stop();
+
+  std::string error;
+  if (saving) {
+    // Restarting now would lose data
+    error = "timed out waiting for saves to finish";
+  } else {
+    if (output) {
+      m_log->warn("Restarting with output still unsent to some clients");
+    }
+    lua_State *L = m_engine->getLuaState();
+    int top = lua_gettop(L);
+    try {
+      execute();
+    } catch (const std::exception &e) {
+      error = e.what();
+    }
+    lua_settop(L, top);
+  }
+
+  m_log->error("Copyover failed: {}", error);
+  lua::Ref co = std::move(m_co);
+  lua_State *L = m_engine->getLuaState();
+  co.push(L); // Keeps the coroutine alive until it's been resumed
+  lua_State *thread = lua_tothread(L, -1);
+  lua_pushboolean(thread, false);
+  lua::push(thread, error);
+  m_engine->resume(thread, 2);
+  lua_pop(L, 1); // Pop coroutine
+}
+
+// Handing sockets over needs exec() and inheritable descriptors, POSIX only
+#ifndef _WIN32
+
+void Copyover::execute() {
+  lua_State *L = m_engine->getLuaState();
+  int top = lua_gettop(L);
+  lua_createtable(L, 0, 2);
+  int state = lua_gettop(L);
+  lua::push(L, STATE_VERSION);
+  lua_setfield(L, state, "version");
+
+  // Save every open connection, along with the game's data for it
+  lua_newtable(L);
+  int list = lua_gettop(L);
+  lua_Integer count = 0;
+  std::vector<int> fds;
+  m_engine->getConnections().push(L);
+  lua_pushnil(L);
+  while (lua_next(L, -2)) {
+    Connection *conn = lua::test_userdata<Connection>(L, -1);
+    if (conn != nullptr && conn->isOpen()) {
+      conn->saveState(L);
+      lua_getfield(L, -1, "fd");
+      fds.push_back(static_cast<int>(lua_tointeger(L, -1)));
+      lua_pop(L, 1);
+      if (m_on_save) {
+        lua_pushcfunction(L, lua::traceback);
+        m_on_save.push(L);
+        lua_pushvalue(L, -4); // Connection
+        if (lua_pcall(L, 1, 1, -3) != LUA_OK) {
+          std::string err;
+          lua::get(L, -1, err);
+          lua_settop(L, top);
+          throw std::runtime_error("copyover.on_save failed: " + err);
+        }
+        lua_setfield(L, -3, "data");
+        lua_pop(L, 1); // Pop traceback
+      }
+      lua_rawseti(L, list, ++count);
+    }
+    lua_pop(L, 1);
+  }
+  lua_pop(L, 1); // Pop connections table
+  lua_setfield(L, state, "connections");
+
+  // The hooks may have changed persisted objects, which would be lost
+  if (db::ObjectStore *store = m_engine->getObjectStore()) {
+    if (store->isFlushing()) {
+      lua_settop(L, top);
+      throw std::runtime_error("Persisted objects are still being written");
+    }
+    store->saveAll();
+    if (store->getDirtyCount() > 0) {
+      lua_settop(L, top);
+      throw std::runtime_error("Could not save every persisted object");
+    }
+  }
+
+  std::string data;
+  if (!lua::serialize(L, state, 1, data)) {
+    std::string err;
+    lua::get(L, -1, err);
+    lua_settop(L, top);
+    throw std::runtime_error("Could not save copyover state: " + err);
+  }
+  lua_settop(L, top);
+
+  std::string path =
+      fmt::format("{}/{}", m_engine->getGameDir(), STATE_FILE);
+  FILE *file = std::fopen(path.c_str(), "wb");
+  if (file == nullptr) {
+    throw std::system_error(errno, std::generic_category(),
+                            "Could not write " + path);
+  }
+  bool written =
+      std::fwrite(data.data(), 1, data.size(), file) == data.size();
+  if (std::fclose(file) != 0 || !written) {
+    int err = errno;
+    std::remove(path.c_str());
+    throw std::system_error(err, std::generic_category(),
+                            "Could not write " + path);
+  }
+
+  // Past here a failure must leave things as they were: the sockets
+  // close-on-exec again, and no state file for a later start to adopt
+  try {
+    char exe[PATH_MAX];
+    std::size_t exe_size = sizeof(exe);
+    int res = uv_exepath(exe, &exe_size);
+    uv::check_error(res, "Could not find the whatmud binary");
+    std::vector<char *> argv{exe};
+    for (std::string &arg : m_args) {
+      argv.push_back(arg.data());
+    }
+    std::string flag("--copyover");
+    argv.push_back(flag.data());
+    argv.push_back(path.data());
+    argv.push_back(nullptr);
+
+    m_log->info("Restarting {} with {} connections", exe, count);
+    if (CaptureWriter *capture = m_engine->getCapture()) {
+      capture->flush();
+    }
+    spdlog::apply_all([](std::shared_ptr<spdlog::logger> logger) {
+      logger->flush();
+    });
+    // libuv opens sockets close-on-exec, let the clients' survive
+    for (int fd : fds) {
+      if (!set_cloexec(fd, false)) {
+        throw std::system_error(errno, std::generic_category(),
+                                "Could not keep connection socket open");
+      }
+    }
+    execv(exe, argv.data());
+    throw std::system_error(errno, std::generic_category(),
+                            fmt::format("Could not execute {}", exe));
+  } catch (...) {
+    for (int fd : fds) {
+      set_cloexec(fd, true);
+    }
+    std::remove(path.c_str());
+    throw;
+  }
+}
+
+void Copyover::closeInherited() {
+  // Only the saved client sockets are inherited without close-on-exec
+  int max = static_cast<int>(sysconf(_SC_OPEN_MAX));
+  for (int fd = 3; fd < max; ++fd) {
+    struct stat st;
+    int flags = fcntl(fd, F_GETFD);
+    if (flags < 0 || (flags & FD_CLOEXEC) || fstat(fd, &st) != 0 ||
+        !S_ISSOCK(st.st_mode)) {
+      continue;
+    }
+    m_log->warn("Closing inherited connection socket {}", fd);
+    close(fd);
+  }
+}
+
+void Copyover::restore(const std::string &path) {
+  std::string data;
+  FILE *file = std::fopen(path.c_str(), "rb");
+  if (file == nullptr) {
+    m_log->error("Could not open copyover state {}", path);
+    closeInherited();
+    return;
+  }
+  char buf[1 << 14];
+  std::size_t n;
+  while ((n = std::fread(buf, 1, sizeof(buf), file)) > 0) {
+    data.append(buf, n);
+  }
+  std::fclose(file);
+  // Don't adopt the same sockets again if the game is restarted by hand
+  std::remove(path.c_str());
+
+  lua_State *L = m_engine->getLuaState();
+  int top = lua_gettop(L);
+  int nvalues = lua::deserialize(L, data);
+  if (nvalues < 1 || !lua_istable(L, top + 1)) {
+    m_log->error("Could not read copyover state: {}",
+                 nvalues < 0 ? lua_tostring(L, -1) : "no state");
+    lua_settop(L, top);
+    closeInherited();
+    return;
+  }
+  int state = top + 1;
+  lua_getfield(L, state, "version");
+  if (lua_tointeger(L, -1) != STATE_VERSION) {
+    m_log->error("Copyover state has unknown version {}",
+                 lua_tointeger(L, -1));
+    lua_settop(L, top);
+    closeInherited();
+    return;
+  }
+  lua_pop(L, 1);
+
+  lua_getfield(L, state, "connections");
+  int list = lua_gettop(L);
+  lua_Integer len = lua_istable(L, list) ? luaL_len(L, list) : 0;
+  lua_Integer restored = 0;
+  for (lua_Integer i = 1; i <= len; ++i) {
+    lua_rawgeti(L, list, i);
+    int entry = lua_gettop(L);
+    Connection *conn = Connection::create(m_engine, L);
+    lua_State *co = lua_tothread(L, -1);
+    try {
+      conn->adopt(L, entry);
+    } catch (const std::exception &e) {
+      m_log->warn("Could not adopt connection: {}", e.what());
+      lua_settop(L, entry - 1);
+      continue;
+    }
+    ++restored;
+
+    if (m_on_restore) {
+      // on_restore(connection, data) runs on the connection's coroutine, in
+      // place of the client handler, above the _ENV create() left for it
+      m_on_restore.push(co);
+      m_engine->getConnections().push(co);
+      lua_rawgetp(co, -1, conn);
+      lua_remove(co, -2);
+      lua_getfield(L, entry, "data");
+      lua_xmove(L, co, 1);
+      m_engine->resume(co, 2);
+    }
+    lua_settop(L, entry - 1);
+  }
+  lua_settop(L, top);
+  m_log->info("Restored {} of {} connections", restored, len);
+}
+
+#else
+
+void Copyover::execute() {
+  throw std::runtime_error("Copyover is not supported on this platform");
+}
+
+void Copyover::restore(const std::string &path) {
+  m_log->error("Copyover is not supported on this platform, ignoring {}",
+               path);
+  std::remove(path.c_str());
+}
+
+#endif
+
+// Lua library
+
+#ifndef _WIN32
+static int afterRestart(lua_State *L, int status, lua_KContext ctx) {
+  (void)status;
+  (void)ctx;
+  // Only resumed if the restart failed: 1 = false, 2 = error
+  return lua_error(L);
+}
+#endif
+
+// copyover.restart()
+// Drains output and pending saves, then restarts into the current whatmud
+// binary keeping every connection. Only returns, by raising an error, if the
+// restart fails
+int Copyover::l_restart(lua_State *L) {
+#ifdef _WIN32
+  return luaL_error(L, "copyover is not supported on this platform");
+#else
+  Copyover *copyover = Engine::fromLua(L)->getCopyover();
+  if (copyover->isPending()) {
+    return luaL_error(L, "a copyover is already in progress");
+  }
+  if (!lua_isyieldable(L)) {
+    return luaL_error(L, "copyover.restart must be called from a coroutine");
+  }
+  lua_pushthread(L);
+  copyover->m_co = lua::Ref(L);
+  copyover->m_deadline =
+      uv_now(copyover->m_engine->getLoop()) + DRAIN_TIMEOUT_MS;
+  copyover->m_timer.start(
+      [](uv_timer_t *handle) {
+        static_cast<Copyover *>(handle->data)->onTimer();
+      },
+      0, 10);
+
+  lua_settop(L, 0);
+  return lua_yieldk(L, 0, 0, afterRestart);
+#endif
+}
+
+// copyover.on_save(fn)
+// fn(connection) is called for each connection just before the restart, and
+// returns data to hand to on_restore. Data is serialized, so it can only hold
+// plain values and tables. nil removes the hook
+int Copyover::l_on_save(lua_State *L) {
+  Copyover *copyover = Engine::fromLua(L)->getCopyover();
+  if (lua_isnoneornil(L, 1)) {
+    copyover->m_on_save.reset();
+    return 0;
+  }
+  luaL_checktype(L, 1, LUA_TFUNCTION);
+  lua_settop(L, 1);
+  copyover->m_on_save = lua::Ref(L);
+  return 0;
+}
+
+// copyover.on_restore(fn)
+// fn(connection, data) is called on each adopted connection's coroutine in
+// the new process, instead of the client handler. nil removes the hook
+int Copyover::l_on_restore(lua_State *L) {
+  Copyover *copyover = Engine::fromLua(L)->getCopyover();
+  if (lua_isnoneornil(L, 1)) {
+    copyover->m_on_restore.reset();
+    return 0;
+  }
+  luaL_checktype(L, 1, LUA_TFUNCTION);
+  lua_settop(L, 1);
+  copyover->m_on_restore = lua::Ref(L);
+  return 0;
+}
+
+int Copyover::luaopen(lua_State *L) {
+  static const luaL_Reg funcs[]{{"restart", l_restart},
+                                {"on_save", l_on_save},
+                                {"on_restore", l_on_restore},
+                                {nullptr, nullptr}};
+  luaL_newlib(L, funcs);
+  return 1;
+}
+
+} // namespace whatmud
@@ -0,0 +1,91 @@
+#ifndef WHATMUD_COPYOVER_HPP
+#define WHATMUD_COPYOVER_HPP
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <lua.hpp>
+#include <spdlog/spdlog.h>
+
+#include "lua/ref.hpp"
+#include "uv/timer.hpp"
+
+namespace whatmud {
+
+// Forward declarations:
+class Engine;
+
+/**
+ * Restart into a new binary without disconnecting anyone.
+ * Output is drained, then every open connection's socket, negotiated
+ * features and Lua session data are written to a state file and the process
+ * exec()s itself with `--copyover <file>`. The new process adopts the sockets
+ * once the game is loaded and hands each one to the restore hook.
+ *
+ * libtelnet's option state can't be saved, so the new process starts it
+ * fresh. Anything that was negotiated is kept in the connection's Features.
+ */
+class Copyover {
+public:
+  static constexpr lua_Integer STATE_VERSION = 1;
+  // The state file, in the game directory
+  static constexpr const char *STATE_FILE = "copyover.state";
+  // Longest to wait for output, saves and snapshots to finish before exec()
+  static constexpr std::uint64_t DRAIN_TIMEOUT_MS = 5000;
+
+  Copyover(Engine *engine);
+
+  // No copy
+  Copyover(const Copyover &) = delete;
+  Copyover &operator=(const Copyover &) = delete;
+
+  // Arguments to exec() the new binary with, without argv[0]
+  void setArguments(std::vector<std::string> args) {
+    m_args = std::move(args);
+  }
+
+  bool isPending() const { return m_co.isValid(); }
+
+  // Adopt the connections saved in a state file, then delete it. Called once
+  // the game is loaded, before the loop starts
+  void restore(const std::string &path);
+
+  // Register the `copyover` library in Lua
+  static int luaopen(lua_State *L);
+
+private:
+  // Called until everything is drained, then restarts
+  void onTimer();
+  // Flush output to every connection, returning whether any is still unsent
+  bool isOutputPending();
+  // Whether database work or a snapshot is still in flight. Starts writing
+  // any dirty persisted objects
+  bool isSaving();
+  // Write the state file and exec(). Only returns by throwing
+  void execute();
+  // Close the client sockets a copyover handed over, when they can't be
+  // adopted, so the clients are disconnected rather than left hanging
+  void closeInherited();
+
+  static int l_restart(lua_State *L);
+  static int l_on_save(lua_State *L);
+  static int l_on_restore(lua_State *L);
+
+private:
+  std::shared_ptr<spdlog::logger> m_log;
+  Engine *m_engine;
+  uv::Timer m_timer;
+  std::vector<std::string> m_args;
+  // Coroutine waiting in copyover.restart(), resumed if it fails
+  lua::Ref m_co;
+  std::uint64_t m_deadline = 0;
+  // on_save(connection) -> data, on_restore(connection, data)
+  lua::Ref m_on_save;
+  lua::Ref m_on_restore;
+};
+
+} // namespace whatmud
+
+#endif
@@ -0,0 +1,496 @@
+#include <cstring>
+
+#include <fmt/core.h>
+
+#include "db/database.hpp"
+#include "engine.hpp"
+#include "lua/helpers.hpp"
+#include "uv/error.hpp"
+
+namespace whatmud::db {
+
+Error::Error(sqlite3 *db, std::string_view context)
+    : std::runtime_error(fmt::format("{}: {}", context, sqlite3_errmsg(db))) {}
+
+// Session
+
+Session::Session(const std::string &path) {
+  int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_NOMUTEX;
+  if (sqlite3_open_v2(path.c_str(), &m_db, flags, nullptr) != SQLITE_OK) {
+    Error err(m_db, fmt::format("Could not open database {}", path));
+    sqlite3_close_v2(m_db);
+    throw err;
+  }
+  // WAL lets readers carry on while another session writes. Writers queue
+  // behind each other for up to the busy timeout
+  sqlite3_busy_timeout(m_db, 5000);
+  exec("PRAGMA journal_mode = WAL;"
+       "PRAGMA synchronous = NORMAL;"
+       "PRAGMA foreign_keys = ON;");
+}
+
+Session::~Session() {
+  for (auto &[sql, cached] : m_statements) {
+    sqlite3_finalize(cached.stmt);
+  }
+  sqlite3_close_v2(m_db);
+}
+
+static bool isBlank(const char *str) {
+  for (; *str; ++str) {
+    if (!std::strchr(" \t\r\n;", *str)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+sqlite3_stmt *Session::prepare(const std::string &sql) {
+  auto it = m_statements.find(sql);
+  if (it != m_statements.end()) {
+    m_cache_hits.fetch_add(1, std::memory_order_relaxed);
+    m_lru.splice(m_lru.begin(), m_lru, it->second.lru);
+    return it->second.stmt;
+  }
+  m_cache_misses.fetch_add(1, std::memory_order_relaxed);
+
+  sqlite3_stmt *stmt;
+  const char *tail;
+  int res = sqlite3_prepare_v3(m_db, sql.c_str(),
+                               static_cast<int>(sql.size() + 1),
+                               SQLITE_PREPARE_PERSISTENT, &stmt, &tail);
+  if (res != SQLITE_OK) {
+    throw Error(m_db, "Could not prepare statement");
+  }
+  if (stmt == nullptr) {
+    throw Error("No SQL statement to run");
+  }
+  if (!isBlank(tail)) {
+    sqlite3_finalize(stmt);
+    throw Error("Queries can only contain one statement, use db.script() "
+                "for several");
+  }
+
+  if (m_statements.size() >= STATEMENT_CACHE_SIZE) {
+    auto oldest = m_statements.find(m_lru.back());
+    sqlite3_finalize(oldest->second.stmt);
+    m_statements.erase(oldest);
+    m_lru.pop_back();
+  }
+  m_lru.push_front(sql);
+  m_statements.emplace(sql, CachedStatement{stmt, m_lru.begin()});
+  return stmt;
+}
+
+void Session::bind(sqlite3_stmt *stmt, const std::vector<Value> &params) {
+  sqlite3_reset(stmt);
+  sqlite3_clear_bindings(stmt);
+  int nparams = sqlite3_bind_parameter_count(stmt);
+  if (params.size() > static_cast<std::size_t>(nparams)) {
+    throw Error(fmt::format("Too many parameters, the statement takes {}",
+                            nparams));
+  }
+  for (std::size_t i = 0; i < params.size(); ++i) {
+    int index = static_cast<int>(i + 1);
+    int res = std::visit(
+        [&](const auto &val) {
+          using T = std::decay_t<decltype(val)>;
+          if constexpr (std::is_same_v<T, std::monostate>) {
+            return sqlite3_bind_null(stmt, index);
+          } else if constexpr (std::is_same_v<T, lua_Integer>) {
+            return sqlite3_bind_int64(stmt, index, val);
+          } else if constexpr (std::is_same_v<T, lua_Number>) {
+            return sqlite3_bind_double(stmt, index, val);
+          } else {
+            return sqlite3_bind_text64(stmt, index, val.data(), val.size(),
+                                       SQLITE_STATIC, SQLITE_UTF8);
+          }
+        },
+        params[i]);
+    if (res != SQLITE_OK) {
+      throw Error(m_db, "Could not bind parameter");
+    }
+  }
+}
+
+void Session::exec(const char *sql) {
+  char *errmsg = nullptr;
+  if (sqlite3_exec(m_db, sql, nullptr, nullptr, &errmsg) != SQLITE_OK) {
+    std::string msg(errmsg ? errmsg : sqlite3_errmsg(m_db));
+    sqlite3_free(errmsg);
+    throw Error(msg);
+  }
+}
+
+// Database
+
+Database::Database(Engine *engine, const std::string &path,
+                   std::size_t sessions)
+    : m_engine(engine), m_path(path), m_sessions(), m_idle(), m_queue() {
+  for (std::size_t i = 0; i < sessions; ++i) {
+    m_sessions.emplace_back(std::make_unique<Session>(path));
+    m_idle.push_back(m_sessions.back().get());
+  }
+
+  Metrics &metrics = engine->getMetrics();
+  metrics.addGauge("whatmud_db_tasks_queued",
+                   "Database tasks waiting for a free session",
+                   [this] { return static_cast<double>(getQueued()); });
+  metrics.addGauge("whatmud_db_sessions_busy",
+                   "Database sessions running a task",
+                   [this] { return static_cast<double>(getBusy()); });
+  metrics.addHistogram("whatmud_db_wait_seconds",
+                       "Time database tasks spent waiting for a session",
+                       m_wait_time);
+  metrics.addHistogram("whatmud_db_run_seconds",
+                       "Time database tasks spent running", m_run_time);
+}
+
+Database::~Database() {
+  for (Task *task : m_queue) {
+    delete task;
+  }
+}
+
+void Database::submit(std::unique_ptr<Task> task) {
+  task->m_db = this;
+  task->m_queued_at = uv_hrtime();
+  m_queue.push_back(task.release());
+  dispatch();
+}
+
+void Database::dispatch() {
+  while (!m_idle.empty() && !m_queue.empty()) {
+    Task *task = m_queue.front();
+    m_queue.pop_front();
+    task->m_session = m_idle.back();
+    m_idle.pop_back();
+    task->m_req.data = task;
+    int res =
+        uv_queue_work(m_engine->getLoop(), &task->m_req, runTask, finishTask);
+    uv::check_error(res, "Could not queue database task");
+  }
+}
+
+void Database::runTask(uv_work_t *req) {
+  Task *task = static_cast<Task *>(req->data);
+  task->m_started_at = uv_hrtime();
+  task->m_ok = task->run(*task->m_session);
+  task->m_finished_at = uv_hrtime();
+}
+
+void Database::finishTask(uv_work_t *req, int status) {
+  std::unique_ptr<Task> task(static_cast<Task *>(req->data));
+  Database *db = task->m_db;
+  db->m_idle.push_back(task->m_session);
+  bool cancelled = status == UV_ECANCELED;
+  if (!cancelled) {
+    db->m_wait_time.observe(task->m_started_at - task->m_queued_at);
+    db->m_run_time.observe(task->m_finished_at - task->m_started_at);
+  }
+  if (!cancelled && task->m_ok) {
+    ++db->m_completed;
+  } else {
+    ++db->m_failed;
+  }
+  // Start the next task before running more Lua, which may queue others
+  db->dispatch();
+  task->finish(cancelled);
+}
+
+// Lua library
+
+namespace {
+
+// A query from Lua, resuming the calling coroutine with (ok, results...)
+class LuaQuery : public Database::Task {
+public:
+  enum Kind { QUERY, EXEC, SCRIPT };
+
+  LuaQuery(Database *db, Kind kind, lua::Ref co)
+      : m_database(db), m_kind(kind), m_co(std::move(co)) {}
+
+  bool run(Session &session) override;
+  void finish(bool cancelled) override;
+
+  // Read the SQL and parameters from the arguments at `first` onwards
+  void setArgs(lua_State *L, int first);
+
+private:
+  Database *m_database;
+  Kind m_kind;
+  lua::Ref m_co;
+  std::string m_sql;
+  std::vector<Value> m_params;
+  // Results
+  std::vector<std::string> m_columns;
+  // Row-major, m_columns.size() values per row
+  std::vector<Value> m_values;
+  lua_Integer m_changes = 0;
+  lua_Integer m_last_insert_id = 0;
+  std::string m_error;
+};
+
+} // namespace
+
+void LuaQuery::setArgs(lua_State *L, int first) {
+  std::string_view sql;
+  lua::get(L, first, sql);
+  m_sql.assign(sql);
+  int top = lua_gettop(L);
+  m_params.reserve(static_cast<std::size_t>(top - first));
+  for (int i = first + 1; i <= top; ++i) {
+    switch (lua_type(L, i)) {
+    case LUA_TNIL:
+      m_params.emplace_back(std::monostate());
+      break;
+    case LUA_TBOOLEAN:
+      m_params.emplace_back(lua_Integer(lua_toboolean(L, i)));
+      break;
+    case LUA_TNUMBER:
+      if (lua_isinteger(L, i)) {
+        m_params.emplace_back(lua_tointeger(L, i));
+      } else {
+        m_params.emplace_back(lua_tonumber(L, i));
+      }
+      break;
+    case LUA_TSTRING: {
+      std::string_view str;
+      lua::get(L, i, str);
+      m_params.emplace_back(std::string(str));
+      break;
+    }
+    default:
+      throw Error(fmt::format("Can't bind a {} to parameter {}",
+                              luaL_typename(L, i), i - first));
+    }
+  }
+}
+
+bool LuaQuery::run(Session &session) {
+  sqlite3_stmt *stmt = nullptr;
+  try {
+    if (m_kind == SCRIPT) {
+      session.exec(m_sql.c_str());
+      return true;
+    }
+
+    stmt = session.prepare(m_sql);
+    session.bind(stmt, m_params);
+    int ncols = sqlite3_column_count(stmt);
+    if (m_kind == QUERY) {
+      for (int i = 0; i < ncols; ++i) {
+        m_columns.emplace_back(sqlite3_column_name(stmt, i));
+      }
+    }
+    int res;
+    while ((res = sqlite3_step(stmt)) == SQLITE_ROW) {
+      if (m_kind != QUERY) {
+        continue;
+      }
+      for (int i = 0; i < ncols; ++i) {
+        switch (sqlite3_column_type(stmt, i)) {
+        case SQLITE_INTEGER:
+          m_values.emplace_back(lua_Integer(sqlite3_column_int64(stmt, i)));
+          break;
+        case SQLITE_FLOAT:
+          m_values.emplace_back(sqlite3_column_double(stmt, i));
+          break;
+        case SQLITE_NULL:
+          m_values.emplace_back(std::monostate());
+          break;
+        default: { // Text and blobs are both Lua strings
+          auto *data =
+              static_cast<const char *>(sqlite3_column_blob(stmt, i));
+          int size = sqlite3_column_bytes(stmt, i);
+          m_values.emplace_back(std::string(data ? data : "", size));
+          break;
+        }
+        }
+      }
+    }
+    if (res != SQLITE_DONE) {
+      Error err(session.get(), "Query failed");
+      sqlite3_reset(stmt);
+      throw err;
+    }
+    m_changes = sqlite3_changes(session.get());
+    m_last_insert_id = sqlite3_last_insert_rowid(session.get());
+    // Don't hold read locks or bound strings past the end of the query
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    return true;
+  } catch (const Error &e) {
+    m_error = e.what();
+    return false;
+  } catch (const std::exception &e) {
+    // Such as bad_alloc collecting the rows. Drop what was collected, and
+    // reset the statement so it doesn't hold a read lock
+    m_columns.clear();
+    m_values.clear();
+    if (stmt != nullptr) {
+      sqlite3_reset(stmt);
+    }
+    m_error = fmt::format("Query failed: {}", e.what());
+    return false;
+  }
+}
+
+static void pushValue(lua_State *L, const Value &val) {
+  std::visit(
+      [&](const auto &v) {
+        using T = std::decay_t<decltype(v)>;
+        if constexpr (std::is_same_v<T, std::monostate>) {
+          lua_pushnil(L);
+        } else {
+          lua::push(L, v);
+        }
+      },
+      val);
+}
+
+void LuaQuery::finish(bool cancelled) {
+  lua_State *L = m_database->getEngine()->getLuaState();
+  m_co.push(L); // Keeps the coroutine alive until it's been resumed
+  lua_State *co = lua_tothread(L, -1);
+  bool ok = !cancelled && m_error.empty();
+  lua_pushboolean(co, ok);
+  int nresults = 1;
+  if (cancelled) {
+    lua_pushliteral(co, "query was cancelled");
+    ++nresults;
+  } else if (!ok) {
+    lua::push(co, m_error);
+    ++nresults;
+  } else if (m_kind == QUERY) {
+    // {{column = value, ...}, ...}
+    std::size_t ncols = m_columns.size();
+    std::size_t nrows = ncols ? m_values.size() / ncols : 0;
+    lua_createtable(co, static_cast<int>(nrows), 0);
+    for (std::size_t row = 0; row < nrows; ++row) {
+      lua_createtable(co, 0, static_cast<int>(ncols));
+      for (std::size_t col = 0; col < ncols; ++col) {
+        pushValue(co, m_values[row * ncols + col]);
+        lua_setfield(co, -2, m_columns[col].c_str());
+      }
+      lua_rawseti(co, -2, static_cast<lua_Integer>(row + 1));
+    }
+    ++nresults;
+  } else if (m_kind == EXEC) {
+    lua_pushinteger(co, m_changes);
+    lua_pushinteger(co, m_last_insert_id);
+    nresults += 2;
+  }
+  m_database->getEngine()->resume(co, nresults);
+  lua_pop(L, 1); // Pop coroutine
+}
+
+// Continuation for queries, called when the coroutine is resumed with
+// (ok, results...)
+static int afterQuery(lua_State *L, int status, lua_KContext ctx) {
+  (void)status;
+  (void)ctx;
+  if (!lua_toboolean(L, 1)) {
+    return lua_error(L);
+  }
+  return lua_gettop(L) - 1;
+}
+
+// Queue a query using the arguments on the stack, and suspend the coroutine
+static int startQuery(lua_State *L, LuaQuery::Kind kind) {
+  luaL_checkstring(L, 1);
+  if (!lua_isyieldable(L)) {
+    return luaL_error(L, "database queries must be made from a coroutine");
+  }
+  Database *db = Engine::fromLua(L)->getDatabase();
+  if (db == nullptr) {
+    return luaL_error(L, "no database, set `database` in init.lua");
+  }
+
+  bool ok = true;
+  {
+    lua_pushthread(L);
+    auto query = std::make_unique<LuaQuery>(db, kind, lua::Ref(L));
+    std::string error;
+    try {
+      query->setArgs(L, 1);
+    } catch (const Error &e) {
+      error = e.what();
+      ok = false;
+    }
+    if (ok) {
+      db->submit(std::move(query));
+    } else {
+      lua::push(L, error);
+    }
+  }
+  // Raised outside the block so no C++ objects are alive
+  if (!ok) {
+    return lua_error(L);
+  }
+  lua_settop(L, 0);
+  return lua_yieldk(L, 0, 0, afterQuery);
+}
+
+// db.query(sql, ...) -> {{column = value, ...}, ...}
+// Runs a single statement with ? parameters bound to the extra arguments, and
+// returns its rows. The coroutine is suspended until the query completes
+int Database::l_query(lua_State *L) { return startQuery(L, LuaQuery::QUERY); }
+
+// db.exec(sql, ...) -> rows changed, last inserted row ID
+int Database::l_exec(lua_State *L) { return startQuery(L, LuaQuery::EXEC); }
+
+// db.script(sql)
+// Runs several statements, such as a schema, with no parameters
+int Database::l_script(lua_State *L) {
+  lua_settop(L, 1);
+  return startQuery(L, LuaQuery::SCRIPT);
+}
+
+// db.stats() -> table describing the database
+int Database::l_stats(lua_State *L) {
+  Database *db = Engine::fromLua(L)->getDatabase();
+  if (db == nullptr) {
+    lua_pushnil(L);
+    return 1;
+  }
+  std::uint64_t hits = 0, misses = 0;
+  for (const auto &session : db->m_sessions) {
+    hits += session->getCacheHits();
+    misses += session->getCacheMisses();
+  }
+  lua_createtable(L, 0, 9);
+  lua::push(L, db->m_path);
+  lua_setfield(L, -2, "path");
+  lua::push(L, static_cast<lua_Integer>(db->getSize()));
+  lua_setfield(L, -2, "sessions");
+  lua::push(L, static_cast<lua_Integer>(db->getBusy()));
+  lua_setfield(L, -2, "busy");
+  lua::push(L, static_cast<lua_Integer>(db->getQueued()));
+  lua_setfield(L, -2, "queued");
+  lua::push(L, static_cast<lua_Integer>(db->m_completed));
+  lua_setfield(L, -2, "completed");
+  lua::push(L, static_cast<lua_Integer>(db->m_failed));
+  lua_setfield(L, -2, "failed");
+  lua::push(L, static_cast<lua_Integer>(hits));
+  lua_setfield(L, -2, "statement_cache_hits");
+  lua::push(L, static_cast<lua_Integer>(misses));
+  lua_setfield(L, -2, "statement_cache_misses");
+  push_stats(L, db->m_wait_time);
+  lua_setfield(L, -2, "wait_time");
+  push_stats(L, db->m_run_time);
+  lua_setfield(L, -2, "run_time");
+  return 1;
+}
+
+int Database::luaopen(lua_State *L) {
+  static const luaL_Reg funcs[]{{"query", l_query},
+                                {"exec", l_exec},
+                                {"script", l_script},
+                                {"stats", l_stats},
+                                {nullptr, nullptr}};
+  luaL_newlib(L, funcs);
+  return 1;
+}
+
+} // namespace whatmud::db
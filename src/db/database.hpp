@@ -0,0 +1,180 @@
+#ifndef WHATMUD_DB_DATABASE_HPP
+#define WHATMUD_DB_DATABASE_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <list>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <variant>
+#include <vector>
+
+#include <lua.hpp>
+#include <sqlite3.h>
+#include <uv.h>
+
+#include "histogram.hpp"
+#include "lua/ref.hpp"
+
+namespace whatmud {
+
+// Forward declarations:
+class Engine;
+
+namespace db {
+
+// An error reported by SQLite
+class Error : public std::runtime_error {
+public:
+  Error(sqlite3 *db, std::string_view context);
+  Error(const std::string &msg) : std::runtime_error(msg) {}
+};
+
+// A value bound to or read from a statement
+using Value =
+    std::variant<std::monostate, lua_Integer, lua_Number, std::string>;
+
+/**
+ * One open SQLite connection and its prepared statement cache.
+ * A session is only used by one thread at a time.
+ */
+class Session {
+public:
+  static constexpr std::size_t STATEMENT_CACHE_SIZE = 64;
+
+  Session(const std::string &path);
+  ~Session();
+
+  // No copy
+  Session(const Session &) = delete;
+  Session &operator=(const Session &) = delete;
+
+  sqlite3 *get() { return m_db; }
+
+  /**
+   * Get a prepared statement for a single SQL statement, reset with no
+   * bindings. Statements are cached, so preparing the same SQL again is a
+   * hash lookup.
+   */
+  sqlite3_stmt *prepare(const std::string &sql);
+  // Reset a statement and bind parameters to it. Strings aren't copied, so
+  // `params` must outlive stepping the statement
+  void bind(sqlite3_stmt *stmt, const std::vector<Value> &params);
+  // Run SQL that may contain several statements, without caching
+  void exec(const char *sql);
+
+  // Safe to read from the loop thread while a pool thread uses the session
+  std::uint64_t getCacheHits() const {
+    return m_cache_hits.load(std::memory_order_relaxed);
+  }
+  std::uint64_t getCacheMisses() const {
+    return m_cache_misses.load(std::memory_order_relaxed);
+  }
+
+private:
+  struct CachedStatement {
+    sqlite3_stmt *stmt;
+    std::list<std::string>::iterator lru;
+  };
+
+  sqlite3 *m_db = nullptr;
+  std::unordered_map<std::string, CachedStatement> m_statements;
+  // Most recently used SQL at the front
+  std::list<std::string> m_lru;
+  std::atomic<std::uint64_t> m_cache_hits = 0;
+  std::atomic<std::uint64_t> m_cache_misses = 0;
+};
+
+/**
+ * A pool of SQLite sessions used from libuv's thread pool.
+ * Tasks are queued on the loop thread and handed a free session on a pool
+ * thread, so the loop never waits on the disk. Like the WorkerPool, sessions
+ * are only handed out and returned on the loop thread, so the pool itself
+ * needs no locking.
+ */
+class Database {
+public:
+  class Task {
+  public:
+    virtual ~Task() = default;
+    // Called on a pool thread with a session to itself. Returns false if the
+    // task failed
+    virtual bool run(Session &session) = 0;
+    // Called on the loop thread once the task has run, or if it was
+    // cancelled before it could
+    virtual void finish(bool cancelled) = 0;
+
+  private:
+    friend class Database;
+    uv_work_t m_req;
+    Database *m_db;
+    Session *m_session;
+    std::uint64_t m_queued_at;
+    std::uint64_t m_started_at;
+    std::uint64_t m_finished_at;
+    bool m_ok;
+  };
+
+  Database(Engine *engine, const std::string &path, std::size_t sessions);
+  ~Database();
+
+  // No copy
+  Database(const Database &) = delete;
+  Database &operator=(const Database &) = delete;
+
+  Engine *getEngine() { return m_engine; }
+  const std::string &getPath() const { return m_path; }
+
+  // Queue a task, it will run when a session is free
+  void submit(std::unique_ptr<Task> task);
+
+  // Run SQL or a task on a session straight away, blocking the loop. Only for
+  // startup and shutdown, while no queued tasks can be running
+  void execNow(const char *sql) { m_sessions.front()->exec(sql); }
+  bool runNow(Task &task) { return task.run(*m_sessions.front()); }
+
+  std::size_t getSize() const { return m_sessions.size(); }
+  std::size_t getBusy() const { return getSize() - m_idle.size(); }
+  // Tasks waiting for a free session
+  std::size_t getQueued() const { return m_queue.size(); }
+
+  // Register the `db` library in Lua
+  static int luaopen(lua_State *L);
+
+private:
+  // Start queued tasks on any idle sessions
+  void dispatch();
+
+  // Called on a pool thread
+  static void runTask(uv_work_t *req);
+  // Called on the loop thread once a task has finished
+  static void finishTask(uv_work_t *req, int status);
+
+  static int l_query(lua_State *L);
+  static int l_exec(lua_State *L);
+  static int l_script(lua_State *L);
+  static int l_stats(lua_State *L);
+
+private:
+  Engine *m_engine;
+  std::string m_path;
+  std::vector<std::unique_ptr<Session>> m_sessions;
+  std::vector<Session *> m_idle;
+  std::deque<Task *> m_queue;
+  // Time spent waiting for a session, and running on one
+  Histogram m_wait_time;
+  Histogram m_run_time;
+  std::uint64_t m_completed = 0;
+  std::uint64_t m_failed = 0;
+};
+
+} // namespace db
+
+} // namespace whatmud
+
+#endif
@@ -0,0 +1,890 @@
+#include <algorithm>
+
+#include "db/database.hpp"
+#include "db/object_store.hpp"
+#include "engine.hpp"
+#include "log.hpp"
+#include "lua/helpers.hpp"
+#include "lua/serialize.hpp"
+
+namespace whatmud::db {
+
+static const char *const SCHEMA =
+    "CREATE TABLE IF NOT EXISTS objects ("
+    "  kind TEXT NOT NULL,"
+    "  id NOT NULL,"
+    "  data BLOB NOT NULL,"
+    "  saved_at INTEGER NOT NULL,"
+    "  PRIMARY KEY (kind, id)"
+    ") WITHOUT ROWID;";
+
+std::size_t ObjectStore::KeyHash::operator()(const Key &key) const {
+  std::size_t h = std::hash<std::string>()(key.kind);
+  return h ^ (std::hash<Id>()(key.id) + 0x9e3779b97f4a7c15 + (h << 6) +
+              (h >> 2));
+}
+
+/**
+ * A batch of serialized objects, written in one transaction.
+ * Values are only touched on the loop thread; the pool thread only sees the
+ * serialized data.
+ */
+class ObjectStore::FlushTask : public Database::Task {
+public:
+  struct Record {
+    Key key;
+    // Kept so the object can be marked dirty again if the flush fails
+    lua::Ref value;
+    std::uint64_t since;
+    // Empty for deletions
+    std::string data;
+  };
+
+  FlushTask(ObjectStore *store) : m_store(store) {}
+
+  bool run(Session &session) override;
+  void finish(bool cancelled) override {
+    (void)cancelled;
+    m_store->onFlushed(*this, m_committed);
+  }
+
+  ObjectStore *m_store;
+  std::vector<Record> m_records;
+  std::size_t m_bytes = 0;
+  // Coroutines to resume once this flush is done
+  std::vector<lua::Ref> m_waiters;
+  std::uint64_t m_duration = 0;
+  bool m_committed = false;
+  std::string m_error;
+};
+
+// Bind an object ID to parameter `index`
+static int bindId(sqlite3_stmt *stmt, int index, const ObjectStore::Id &id) {
+  if (auto *num = std::get_if<lua_Integer>(&id)) {
+    return sqlite3_bind_int64(stmt, index, *num);
+  }
+  const auto &str = std::get<std::string>(id);
+  return sqlite3_bind_text64(stmt, index, str.data(), str.size(),
+                             SQLITE_STATIC, SQLITE_UTF8);
+}
+
+// Push an object ID
+static void pushId(lua_State *L, const ObjectStore::Id &id) {
+  if (auto *num = std::get_if<lua_Integer>(&id)) {
+    lua_pushinteger(L, *num);
+  } else {
+    lua::push(L, std::get<std::string>(id));
+  }
+}
+
+bool ObjectStore::FlushTask::run(Session &session) {
+  std::uint64_t start = uv_hrtime();
+  sqlite3 *db = session.get();
+  try {
+    session.exec("BEGIN IMMEDIATE");
+    sqlite3_stmt *save = session.prepare(
+        "INSERT OR REPLACE INTO objects (kind, id, data, saved_at) "
+        "VALUES (?, ?, ?, strftime('%s', 'now'))");
+    sqlite3_stmt *remove =
+        session.prepare("DELETE FROM objects WHERE kind = ? AND id = ?");
+    for (const Record &record : m_records) {
+      bool deleting = !record.value.isValid();
+      sqlite3_stmt *stmt = deleting ? remove : save;
+      session.bind(stmt, {});
+      sqlite3_bind_text64(stmt, 1, record.key.kind.data(),
+                          record.key.kind.size(), SQLITE_STATIC, SQLITE_UTF8);
+      bindId(stmt, 2, record.key.id);
+      if (!deleting) {
+        sqlite3_bind_blob64(stmt, 3, record.data.data(), record.data.size(),
+                            SQLITE_STATIC);
+      }
+      if (sqlite3_step(stmt) != SQLITE_DONE) {
+        Error err(db, "Could not save object");
+        sqlite3_reset(stmt);
+        throw err;
+      }
+      sqlite3_reset(stmt);
+    }
+    session.exec("COMMIT");
+    m_committed = true;
+  } catch (const Error &e) {
+    m_error = e.what();
+    if (!sqlite3_get_autocommit(db)) {
+      sqlite3_exec(db, "ROLLBACK", nullptr, nullptr, nullptr);
+    }
+    m_committed = false;
+  }
+  m_duration = uv_hrtime() - start;
+  return m_committed;
+}
+
+// Reads one object's serialized data
+class ObjectStore::LoadTask : public Database::Task {
+public:
+  LoadTask(ObjectStore *store, Key key)
+      : m_store(store), m_key(std::move(key)) {}
+
+  bool run(Session &session) override;
+  void finish(bool cancelled) override {
+    (void)cancelled;
+    m_store->onLoaded(*this, m_loaded);
+  }
+
+  ObjectStore *m_store;
+  Key m_key;
+  std::uint64_t m_started_at = uv_hrtime();
+  bool m_found = false;
+  std::string m_data;
+  bool m_loaded = false;
+  std::string m_error;
+};
+
+bool ObjectStore::LoadTask::run(Session &session) {
+  try {
+    sqlite3_stmt *stmt =
+        session.prepare("SELECT data FROM objects WHERE kind = ? AND id = ?");
+    session.bind(stmt, {});
+    sqlite3_bind_text64(stmt, 1, m_key.kind.data(), m_key.kind.size(),
+                        SQLITE_STATIC, SQLITE_UTF8);
+    bindId(stmt, 2, m_key.id);
+    int res = sqlite3_step(stmt);
+    if (res == SQLITE_ROW) {
+      auto *data = static_cast<const char *>(sqlite3_column_blob(stmt, 0));
+      m_data.assign(data,
+                    static_cast<std::size_t>(sqlite3_column_bytes(stmt, 0)));
+      m_found = true;
+    } else if (res != SQLITE_DONE) {
+      Error err(session.get(), "Could not load object");
+      sqlite3_reset(stmt);
+      throw err;
+    }
+    sqlite3_reset(stmt);
+    m_loaded = true;
+  } catch (const Error &e) {
+    m_error = e.what();
+  }
+  return m_loaded;
+}
+
+ObjectStore::ObjectStore(Engine *engine, Database *db)
+    : m_log(log::get("persist")), m_engine(engine), m_db(db),
+      m_timer(engine->getLoop()) {
+  m_timer.setData(this);
+  // Flushing on its own shouldn't keep the loop running
+  m_timer.unref();
+  db->execNow(SCHEMA);
+
+  lua_State *L = engine->getLuaState();
+  lua_newtable(L);
+  m_loaded = lua::Ref(L);
+
+  Metrics &metrics = engine->getMetrics();
+  metrics.addGauge("whatmud_persist_dirty_objects",
+                   "Persisted objects changed since they were last saved",
+                   [this] { return static_cast<double>(getDirtyCount()); });
+  metrics.addHistogram("whatmud_persist_flush_seconds",
+                       "Time taken to write each batch of dirty objects",
+                       m_flush_duration);
+  metrics.addHistogram(
+      "whatmud_persist_save_delay_seconds",
+      "Time from an object becoming dirty to its save being committed",
+      m_save_delay);
+}
+
+ObjectStore::~ObjectStore() {
+  if (!m_dirty.empty()) {
+    m_log->warn("{} objects were never saved", m_dirty.size());
+  }
+}
+
+void ObjectStore::setInterval(double seconds) {
+  m_interval_ms = static_cast<std::uint64_t>(std::max(seconds, 0.001) * 1000);
+  if (m_timer.isActive()) {
+    start();
+  }
+}
+
+void ObjectStore::setBudget(std::size_t objects, std::size_t bytes) {
+  m_max_objects = std::max<std::size_t>(objects, 1);
+  m_max_bytes = bytes;
+}
+
+void ObjectStore::setCacheSize(std::size_t bytes) {
+  m_max_cache_bytes = bytes;
+  while (m_cache_bytes > m_max_cache_bytes && !m_lru.empty()) {
+    uncache(m_lru.back());
+    ++m_evictions;
+  }
+}
+
+void ObjectStore::start() {
+  m_timer.start(
+      [](uv_timer_t *handle) {
+        static_cast<ObjectStore *>(handle->data)->flush(false);
+      },
+      m_interval_ms, m_interval_ms);
+}
+
+void ObjectStore::stop() { m_timer.stop(); }
+
+void ObjectStore::markDirty(Key key, lua::Ref value) {
+  remember(key, value);
+  // Dirty objects are resident, the cache only holds clean ones
+  uncache(key);
+  auto it = m_dirty.find(key);
+  if (it != m_dirty.end()) {
+    it->second.value = std::move(value);
+    return;
+  }
+  auto order = m_order.insert(m_order.end(), key);
+  m_dirty.emplace(std::move(key), Dirty{std::move(value), uv_hrtime(), order});
+}
+
+std::uint64_t ObjectStore::getOldestDirtyAge() const {
+  if (m_order.empty()) {
+    return 0;
+  }
+  return uv_hrtime() - m_dirty.at(m_order.front()).since;
+}
+
+std::unique_ptr<ObjectStore::FlushTask> ObjectStore::takeBatch(bool all) {
+  auto task = std::make_unique<FlushTask>(this);
+  if (all) {
+    task->m_waiters = std::move(m_waiters);
+    m_waiters.clear();
+  }
+
+  // Serialize the oldest objects, up to the write budget
+  lua_State *L = m_engine->getLuaState();
+  std::vector<FlushTask::Record> failed;
+  while (!m_order.empty() &&
+         (all || task->m_records.empty() ||
+          (task->m_records.size() < m_max_objects &&
+           task->m_bytes < m_max_bytes))) {
+    Key key = std::move(m_order.front());
+    m_order.pop_front();
+    auto it = m_dirty.find(key);
+    FlushTask::Record record{std::move(key), std::move(it->second.value),
+                             it->second.since, std::string()};
+    m_dirty.erase(it);
+
+    if (record.value.isValid()) {
+      record.value.push(L);
+      if (!lua::serialize(L, lua_gettop(L), 1, record.data)) {
+        m_log->error("Could not save {} object: {}", record.key.kind,
+                     lua_tostring(L, -1));
+        lua_pop(L, 2);
+        failed.emplace_back(std::move(record));
+        continue;
+      }
+      lua_pop(L, 1);
+      // Loads see it until it's cached or dirty again
+      record.value.push(L);
+      m_writing.insert_or_assign(record.key, lua::Ref(L));
+    } else {
+      m_writing.insert_or_assign(record.key, lua::Ref());
+    }
+    task->m_bytes += record.data.size();
+    task->m_records.emplace_back(std::move(record));
+  }
+
+  // Keep what couldn't be serialized dirty, to try again on the next flush
+  for (auto it = failed.rbegin(); it != failed.rend(); ++it) {
+    m_order.push_front(it->key);
+    m_dirty.emplace(std::move(it->key),
+                    Dirty{std::move(it->value), it->since, m_order.begin()});
+  }
+  return task;
+}
+
+void ObjectStore::flush(bool all) {
+  if (m_flushing) {
+    m_flush_all_pending |= all;
+    return;
+  }
+  std::unique_ptr<FlushTask> task = takeBatch(all);
+  // Still run an empty batch if coroutines are waiting on it
+  if (task->m_records.empty() && task->m_waiters.empty()) {
+    return;
+  }
+  m_flushing = true;
+  m_db->submit(std::move(task));
+}
+
+void ObjectStore::saveAll() {
+  if (m_flushing || m_dirty.empty()) {
+    return;
+  }
+  m_log->info("Saving {} objects", m_dirty.size());
+  std::unique_ptr<FlushTask> task = takeBatch(true);
+  m_flushing = true;
+  onFlushed(*task, m_db->runNow(*task));
+}
+
+void ObjectStore::onFlushed(FlushTask &task, bool ok) {
+  m_flushing = false;
+  // Each record is about to be cached or dirty again
+  for (const auto &record : task.m_records) {
+    m_writing.erase(record.key);
+  }
+  std::uint64_t now = uv_hrtime();
+  if (ok) {
+    ++m_flushes;
+    m_objects_written += task.m_records.size();
+    m_bytes_written += task.m_bytes;
+    m_last_objects = task.m_records.size();
+    m_last_bytes = task.m_bytes;
+    m_flush_duration.observe(task.m_duration);
+    for (auto &record : task.m_records) {
+      m_save_delay.observe(now - record.since);
+      // Now clean, unless it was marked again while being written
+      if (record.value.isValid() && !m_dirty.count(record.key)) {
+        cache(record.key, std::move(record.value), record.data.size());
+      }
+    }
+  } else {
+    ++m_failed_flushes;
+    m_log->error("Could not save {} objects: {}", task.m_records.size(),
+                 task.m_error.empty() ? "flush was cancelled" : task.m_error);
+    // Put them back at the front, keeping their age. Objects marked again
+    // since keep their newer value
+    for (auto it = task.m_records.rbegin(); it != task.m_records.rend(); ++it) {
+      auto found = m_dirty.find(it->key);
+      if (found != m_dirty.end()) {
+        found->second.since = it->since;
+        m_order.splice(m_order.begin(), m_order, found->second.order);
+        continue;
+      }
+      m_order.push_front(it->key);
+      m_dirty.emplace(std::move(it->key),
+                      Dirty{std::move(it->value), it->since, m_order.begin()});
+    }
+  }
+
+  // Ask for the next flush before resuming Lua, which may want another
+  if (m_flush_all_pending || !m_waiters.empty()) {
+    m_flush_all_pending = false;
+    flush(true);
+  }
+
+  lua_State *L = m_engine->getLuaState();
+  for (auto &waiter : task.m_waiters) {
+    waiter.push(L);
+    lua_State *co = lua_tothread(L, -1);
+    lua_pushboolean(co, ok);
+    if (!ok) {
+      lua::push(co, task.m_error.empty() ? std::string("flush was cancelled")
+                                         : task.m_error);
+    }
+    m_engine->resume(co, ok ? 1 : 2);
+    lua_pop(L, 1);
+  }
+}
+
+void ObjectStore::cache(const Key &key, lua::Ref value, std::size_t bytes) {
+  remember(key, value);
+  uncache(key);
+  if (bytes > m_max_cache_bytes) {
+    return;
+  }
+  auto lru = m_lru.insert(m_lru.begin(), key);
+  m_cache.emplace(key, Cached{std::move(value), bytes, lru});
+  m_cache_bytes += bytes;
+  while (m_cache_bytes > m_max_cache_bytes) {
+    uncache(m_lru.back());
+    ++m_evictions;
+  }
+}
+
+void ObjectStore::uncache(const Key &key) {
+  auto it = m_cache.find(key);
+  if (it == m_cache.end()) {
+    return;
+  }
+  m_cache_bytes -= it->second.bytes;
+  m_lru.erase(it->second.lru);
+  m_cache.erase(it);
+}
+
+void ObjectStore::remember(const Key &key, const lua::Ref &value) {
+  lua_State *L = m_engine->getLuaState();
+  m_loaded.push(L);
+  lua::push(L, key.kind);
+  if (lua_rawget(L, -2) != LUA_TTABLE) {
+    lua_pop(L, 1);
+    lua_newtable(L);
+    lua_newtable(L);
+    lua_pushliteral(L, "v");
+    lua_setfield(L, -2, "__mode");
+    lua_setmetatable(L, -2);
+    lua::push(L, key.kind);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, -4);
+  }
+  pushId(L, key.id);
+  if (value.isValid()) {
+    value.push(L);
+  } else {
+    lua_pushnil(L);
+  }
+  // Other values have no identity to share, and would never be collected
+  if (!lua_istable(L, -1) && lua_type(L, -1) != LUA_TUSERDATA) {
+    lua_pop(L, 1);
+    lua_pushnil(L);
+  }
+  lua_rawset(L, -3);
+  lua_pop(L, 2);
+}
+
+bool ObjectStore::pushRemembered(lua_State *L, const Key &key) {
+  m_loaded.push(L);
+  lua::push(L, key.kind);
+  if (lua_rawget(L, -2) != LUA_TTABLE) {
+    lua_pop(L, 2);
+    return false;
+  }
+  pushId(L, key.id);
+  if (lua_rawget(L, -2) == LUA_TNIL) {
+    lua_pop(L, 3);
+    return false;
+  }
+  lua_replace(L, -3);
+  lua_pop(L, 1);
+  return true;
+}
+
+bool ObjectStore::pushResident(lua_State *L, const Key &key) {
+  if (auto dirty = m_dirty.find(key); dirty != m_dirty.end()) {
+    if (dirty->second.value.isValid()) {
+      dirty->second.value.push(L);
+    } else {
+      lua_pushnil(L);
+    }
+    return true;
+  }
+  if (auto writing = m_writing.find(key); writing != m_writing.end()) {
+    if (writing->second.isValid()) {
+      writing->second.push(L);
+    } else {
+      lua_pushnil(L);
+    }
+    return true;
+  }
+  auto cached = m_cache.find(key);
+  if (cached == m_cache.end()) {
+    // Evicted, but game code still holds it
+    if (pushRemembered(L, key)) {
+      ++m_cache_hits;
+      return true;
+    }
+    return false;
+  }
+  ++m_cache_hits;
+  m_lru.splice(m_lru.begin(), m_lru, cached->second.lru);
+  cached->second.value.push(L);
+  return true;
+}
+
+void ObjectStore::startLoad(lua_State *L, const Key &key) {
+  lua_pushthread(L);
+  auto &waiters = m_loading[key];
+  waiters.emplace_back(L);
+  // Later requests for the same object share the first load
+  if (waiters.size() == 1) {
+    ++m_cache_misses;
+    m_db->submit(std::make_unique<LoadTask>(this, key));
+  }
+}
+
+void ObjectStore::onLoaded(LoadTask &task, bool ok) {
+  std::vector<lua::Ref> waiters;
+  if (auto it = m_loading.find(task.m_key); it != m_loading.end()) {
+    waiters = std::move(it->second);
+    m_loading.erase(it);
+  }
+  if (!ok && task.m_error.empty()) {
+    task.m_error = "load was cancelled";
+  }
+  if (ok) {
+    m_load_time.observe(uv_hrtime() - task.m_started_at);
+  }
+
+  // Pushes (ok, value or error) onto the main stack
+  lua_State *L = m_engine->getLuaState();
+  lua_pushboolean(L, ok);
+  if (!ok) {
+    m_log->error("Could not load {} object: {}", task.m_key.kind,
+                 task.m_error);
+    lua::push(L, task.m_error);
+  } else if (pushResident(L, task.m_key)) {
+    // Marked while it was loading, which is newer than what's stored
+  } else if (!task.m_found) {
+    lua_pushnil(L);
+  } else {
+    int top = lua_gettop(L); // ok
+    if (lua::deserialize(L, task.m_data) < 0) {
+      lua_pushboolean(L, false);
+      lua_replace(L, top);
+      lua_copy(L, -1, top + 1); // Error message
+      lua_settop(L, top + 1);
+    } else {
+      lua_settop(L, top + 1); // Only the first value
+      lua_pushvalue(L, -1);
+      cache(task.m_key, lua::Ref(L), task.m_data.size());
+    }
+  }
+
+  for (auto &waiter : waiters) {
+    waiter.push(L);
+    lua_State *co = lua_tothread(L, -1);
+    lua_pushvalue(L, -3);
+    lua_pushvalue(L, -3);
+    lua_xmove(L, co, 2);
+    m_engine->resume(co, 2);
+    lua_pop(L, 1); // Pop coroutine
+  }
+  lua_pop(L, 2);
+}
+
+// Lua library
+
+// Check the arguments at `index` are a (kind, id) key
+static void checkKey(lua_State *L, int index) {
+  luaL_checktype(L, index, LUA_TSTRING);
+  luaL_argexpected(L,
+                   lua_isinteger(L, index + 1) ||
+                       lua_type(L, index + 1) == LUA_TSTRING,
+                   index + 1, "integer or string");
+}
+
+// Read a key checked by checkKey()
+static ObjectStore::Key toKey(lua_State *L, int index) {
+  std::string_view kind;
+  lua::get(L, index, kind);
+  ObjectStore::Key key{std::string(kind), lua_Integer(0)};
+  if (lua_type(L, index + 1) == LUA_TSTRING) {
+    std::string_view id;
+    lua::get(L, index + 1, id);
+    key.id = std::string(id);
+  } else {
+    key.id = lua_tointeger(L, index + 1);
+  }
+  return key;
+}
+
+static ObjectStore *getStore(lua_State *L) {
+  ObjectStore *store = Engine::fromLua(L)->getObjectStore();
+  if (store == nullptr) {
+    luaL_error(L, "no database, set `database` in init.lua");
+  }
+  return store;
+}
+
+// persist.mark(kind, id, value)
+// Saves value on a later flush, replacing what's stored for (kind, id). A nil
+// value deletes it instead. Tables are saved as they are when flushed
+int ObjectStore::l_mark(lua_State *L) {
+  ObjectStore *store = getStore(L);
+  checkKey(L, 1);
+  lua_settop(L, 3);
+  lua::Ref value;
+  if (!lua_isnil(L, 3)) {
+    value = lua::Ref(L);
+  }
+  store->markDirty(toKey(L, 1), std::move(value));
+  return 0;
+}
+
+// persist.dirty(kind, id) -> whether there are unsaved changes
+int ObjectStore::l_dirty(lua_State *L) {
+  ObjectStore *store = getStore(L);
+  checkKey(L, 1);
+  lua_pushboolean(L, store->isDirty(toKey(L, 1)));
+  return 1;
+}
+
+// Continue with (ok, value or error) on top of the stack, either straight away
+// if the object was resident or once the coroutine is resumed
+static int withObject(lua_State *L, bool resident, lua_KFunction k) {
+  if (!resident) {
+    return lua_yieldk(L, 0, 0, k);
+  }
+  lua_pushboolean(L, true);
+  lua_insert(L, -2);
+  return k(L, LUA_OK, 0);
+}
+
+// Push an object, or start loading it if the caller can wait. Raises if it
+// isn't resident and the caller can't yield
+static bool fetch(lua_State *L, ObjectStore *store,
+                  const ObjectStore::Key &key) {
+  if (store->pushResident(L, key)) {
+    return true;
+  }
+  if (!lua_isyieldable(L)) {
+    luaL_error(L, "persisted objects can only be loaded from a coroutine");
+  }
+  store->startLoad(L, key);
+  return false;
+}
+
+static int afterLoad(lua_State *L, int status, lua_KContext ctx) {
+  (void)status;
+  (void)ctx;
+  // -2 = ok, -1 = value or error
+  if (!lua_toboolean(L, -2)) {
+    return lua_error(L);
+  }
+  return 1;
+}
+
+// persist.load(kind, id) -> value or nil
+// Returns an object's latest state, loading it if it isn't resident. Loading
+// suspends the calling coroutine
+int ObjectStore::l_load(lua_State *L) {
+  ObjectStore *store = getStore(L);
+  checkKey(L, 1);
+  lua_settop(L, 2);
+  bool resident;
+  {
+    ObjectStore::Key key = toKey(L, 1);
+    resident = store->pushResident(L, key);
+    if (!resident && lua_isyieldable(L)) {
+      store->startLoad(L, key);
+    }
+  }
+  if (!resident && !lua_isyieldable(L)) {
+    return luaL_error(L, "persist.load must be called from a coroutine");
+  }
+  return withObject(L, resident, afterLoad);
+}
+
+// persist.proxy(kind, id) -> proxy
+// Makes a proxy that loads the object when it's first used
+int ObjectStore::l_proxy(lua_State *L) {
+  getStore(L);
+  checkKey(L, 1);
+  lua::new_userdata<ObjectProxy>(L, toKey(L, 1));
+  return 1;
+}
+
+// Proxy metamethods. Each fetches the object, then continues once it's
+// available with (ok, value) after its arguments
+
+static int afterProxyIndex(lua_State *L, int status, lua_KContext ctx) {
+  (void)status;
+  (void)ctx;
+  // 1 = proxy, 2 = key, 3 = ok, 4 = object
+  if (!lua_toboolean(L, 3)) {
+    return lua_error(L);
+  }
+  if (lua_isnil(L, 4)) {
+    return 1;
+  }
+  lua_pushvalue(L, 2);
+  lua_gettable(L, 4);
+  return 1;
+}
+
+static int l_proxy_index(lua_State *L) {
+  auto *proxy = lua::check_userdata<ObjectProxy>(L, 1);
+  lua_settop(L, 2);
+  return withObject(L, fetch(L, getStore(L), proxy->getKey()),
+                    afterProxyIndex);
+}
+
+static int afterProxyNewindex(lua_State *L, int status, lua_KContext ctx) {
+  (void)status;
+  (void)ctx;
+  // 1 = proxy, 2 = key, 3 = value, 4 = ok, 5 = object
+  if (!lua_toboolean(L, 4)) {
+    return lua_error(L);
+  }
+  if (lua_isnil(L, 5)) {
+    // Assigning to an object that doesn't exist yet creates it
+    lua_newtable(L);
+    lua_replace(L, 5);
+  }
+  lua_pushvalue(L, 2);
+  lua_pushvalue(L, 3);
+  lua_settable(L, 5);
+
+  auto *proxy = lua::check_userdata<ObjectProxy>(L, 1);
+  lua_settop(L, 5);
+  getStore(L)->markDirty(proxy->getKey(), lua::Ref(L));
+  return 0;
+}
+
+static int l_proxy_newindex(lua_State *L) {
+  auto *proxy = lua::check_userdata<ObjectProxy>(L, 1);
+  lua_settop(L, 3);
+  return withObject(L, fetch(L, getStore(L), proxy->getKey()),
+                    afterProxyNewindex);
+}
+
+static int afterProxyLen(lua_State *L, int status, lua_KContext ctx) {
+  (void)status;
+  (void)ctx;
+  // 1 = proxy, 2 = ok, 3 = object
+  if (!lua_toboolean(L, 2)) {
+    return lua_error(L);
+  }
+  if (lua_isnil(L, 3)) {
+    lua_pushinteger(L, 0);
+    return 1;
+  }
+  lua_len(L, 3);
+  return 1;
+}
+
+static int l_proxy_len(lua_State *L) {
+  auto *proxy = lua::check_userdata<ObjectProxy>(L, 1);
+  lua_settop(L, 1);
+  return withObject(L, fetch(L, getStore(L), proxy->getKey()), afterProxyLen);
+}
+
+static int l_next(lua_State *L) {
+  luaL_checktype(L, 1, LUA_TTABLE);
+  lua_settop(L, 2);
+  if (lua_next(L, 1)) {
+    return 2;
+  }
+  lua_pushnil(L);
+  return 1;
+}
+
+static int afterProxyPairs(lua_State *L, int status, lua_KContext ctx) {
+  (void)status;
+  (void)ctx;
+  // 1 = proxy, 2 = ok, 3 = object
+  if (!lua_toboolean(L, 2)) {
+    return lua_error(L);
+  }
+  if (!lua_istable(L, 3)) {
+    lua_newtable(L);
+    lua_replace(L, 3);
+  }
+  lua_pushcfunction(L, l_next);
+  lua_pushvalue(L, 3);
+  lua_pushnil(L);
+  return 3;
+}
+
+static int l_proxy_pairs(lua_State *L) {
+  auto *proxy = lua::check_userdata<ObjectProxy>(L, 1);
+  lua_settop(L, 1);
+  return withObject(L, fetch(L, getStore(L), proxy->getKey()),
+                    afterProxyPairs);
+}
+
+static int l_proxy_eq(lua_State *L) {
+  auto *a = lua::test_userdata<ObjectProxy>(L, 1);
+  auto *b = lua::test_userdata<ObjectProxy>(L, 2);
+  lua_pushboolean(L, a && b && a->getKey() == b->getKey());
+  return 1;
+}
+
+static int l_proxy_tostring(lua_State *L) {
+  auto *proxy = lua::check_userdata<ObjectProxy>(L, 1);
+  const ObjectStore::Key &key = proxy->getKey();
+  lua_pushfstring(L, "persist.proxy(%s, ", key.kind.c_str());
+  if (auto *num = std::get_if<lua_Integer>(&key.id)) {
+    lua_pushfstring(L, "%I)", *num);
+  } else {
+    lua_pushfstring(L, "\"%s\")", std::get<std::string>(key.id).c_str());
+  }
+  lua_concat(L, 2);
+  return 1;
+}
+
+const luaL_Reg ObjectProxy::LUA_METAMETHODS[]{
+    {"__index", l_proxy_index},   {"__newindex", l_proxy_newindex},
+    {"__len", l_proxy_len},       {"__pairs", l_proxy_pairs},
+    {"__eq", l_proxy_eq},         {"__tostring", l_proxy_tostring},
+    {nullptr, nullptr}};
+
+static int afterFlush(lua_State *L, int status, lua_KContext ctx) {
+  (void)status;
+  (void)ctx;
+  // 1 = ok, 2 = error
+  if (!lua_toboolean(L, 1)) {
+    return lua_error(L);
+  }
+  return 1;
+}
+
+// persist.flush() -> true
+// Saves every dirty object, ignoring the write budget. Suspends the calling
+// coroutine until they're committed
+int ObjectStore::l_flush(lua_State *L) {
+  ObjectStore *store = getStore(L);
+  if (store->m_dirty.empty() && !store->m_flushing) {
+    lua_pushboolean(L, true);
+    return 1;
+  }
+  if (!lua_isyieldable(L)) {
+    return luaL_error(L, "persist.flush must be called from a coroutine");
+  }
+  lua_pushthread(L);
+  store->m_waiters.emplace_back(L);
+  store->flush(true);
+  lua_settop(L, 0);
+  return lua_yieldk(L, 0, 0, afterFlush);
+}
+
+// persist.stats() -> table of flush and crash window statistics
+int ObjectStore::l_stats(lua_State *L) {
+  ObjectStore *store = getStore(L);
+  lua_createtable(L, 0, 18);
+  lua::push(L, static_cast<lua_Integer>(store->getDirtyCount()));
+  lua_setfield(L, -2, "dirty");
+  lua::push(L, store->getOldestDirtyAge() / 1e6);
+  lua_setfield(L, -2, "oldest_dirty_ms");
+  lua_pushboolean(L, store->m_flushing);
+  lua_setfield(L, -2, "flushing");
+  lua::push(L, static_cast<lua_Integer>(store->m_flushes));
+  lua_setfield(L, -2, "flushes");
+  lua::push(L, static_cast<lua_Integer>(store->m_failed_flushes));
+  lua_setfield(L, -2, "failed_flushes");
+  lua::push(L, static_cast<lua_Integer>(store->m_objects_written));
+  lua_setfield(L, -2, "objects_written");
+  lua::push(L, static_cast<lua_Integer>(store->m_bytes_written));
+  lua_setfield(L, -2, "bytes_written");
+  lua::push(L, static_cast<lua_Integer>(store->m_last_objects));
+  lua_setfield(L, -2, "last_flush_objects");
+  lua::push(L, static_cast<lua_Integer>(store->m_last_bytes));
+  lua_setfield(L, -2, "last_flush_bytes");
+  push_stats(L, store->m_flush_duration);
+  lua_setfield(L, -2, "flush_duration");
+  push_stats(L, store->m_save_delay);
+  lua_setfield(L, -2, "save_delay");
+  lua::push(L, static_cast<lua_Integer>(store->m_cache.size()));
+  lua_setfield(L, -2, "cached");
+  lua::push(L, static_cast<lua_Integer>(store->m_cache_bytes));
+  lua_setfield(L, -2, "cache_bytes");
+  lua::push(L, static_cast<lua_Integer>(store->m_cache_hits));
+  lua_setfield(L, -2, "cache_hits");
+  lua::push(L, static_cast<lua_Integer>(store->m_cache_misses));
+  lua_setfield(L, -2, "cache_misses");
+  lua::push(L, static_cast<lua_Integer>(store->m_evictions));
+  lua_setfield(L, -2, "evictions");
+  lua::push(L, static_cast<lua_Integer>(store->m_loading.size()));
+  lua_setfield(L, -2, "loading");
+  push_stats(L, store->m_load_time);
+  lua_setfield(L, -2, "load_time");
+  return 1;
+}
+
+int ObjectStore::luaopen(lua_State *L) {
+  static const luaL_Reg funcs[]{{"load", l_load},
+                                {"proxy", l_proxy},
+                                {"mark", l_mark},
+                                {"dirty", l_dirty},
+                                {"flush", l_flush},
+                                {"stats", l_stats},
+                                {nullptr, nullptr}};
+  luaL_newlib(L, funcs);
+  return 1;
+}
+
+} // namespace whatmud::db
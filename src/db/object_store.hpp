@@ -0,0 +1,226 @@
+#ifndef WHATMUD_DB_OBJECT_STORE_HPP
+#define WHATMUD_DB_OBJECT_STORE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <variant>
+#include <vector>
+
+#include <lua.hpp>
+#include <spdlog/spdlog.h>
+
+#include "histogram.hpp"
+#include "lua/ref.hpp"
+#include "uv/timer.hpp"
+
+namespace whatmud {
+
+// Forward declarations:
+class Engine;
+
+namespace db {
+
+class Database;
+
+/**
+ * Write-behind persistence for Lua objects.
+ * Lua marks objects dirty as they change; that only records a reference.
+ * On a fixed cadence the oldest dirty objects, up to a write budget, are
+ * serialized and written to the `objects` table in one transaction on a
+ * database session. Objects changed many times between flushes are written
+ * once, with their latest state.
+ *
+ * Objects are loaded on demand on a database session, and kept in an LRU
+ * cache bounded by their serialized size. Dirty objects and those being
+ * written are always resident, so a load never sees older data than what's
+ * waiting to be saved. Every object in memory is also remembered weakly, so
+ * while game code still holds one, loading it again returns that table
+ * instead of a second copy. The cache only decides what's kept alive when
+ * nothing else uses it.
+ */
+class ObjectStore {
+public:
+  using Id = std::variant<lua_Integer, std::string>;
+  struct Key {
+    std::string kind;
+    Id id;
+    bool operator==(const Key &) const = default;
+  };
+  struct KeyHash {
+    std::size_t operator()(const Key &key) const;
+  };
+
+  ObjectStore(Engine *engine, Database *db);
+  ~ObjectStore();
+
+  // No copy
+  ObjectStore(const ObjectStore &) = delete;
+  ObjectStore &operator=(const ObjectStore &) = delete;
+
+  // Seconds between flushes
+  void setInterval(double seconds);
+  // Most objects and serialized bytes to write in one flush. At least one
+  // object is always written
+  void setBudget(std::size_t objects, std::size_t bytes);
+
+  void start();
+  void stop();
+
+  // Start writing every dirty object, ignoring the write budget
+  void flushAll() { flush(true); }
+  // Most serialized bytes of clean objects to keep cached
+  void setCacheSize(std::size_t bytes);
+
+  // Write every dirty object straight away, blocking the loop. Only for
+  // shutdown, once the loop has stopped, and just before a copyover
+  void saveAll();
+
+  /**
+   * Mark an object dirty, so its state will be saved on a later flush. An
+   * invalid Ref deletes the object instead. An object stays as old as the
+   * first change that hasn't been saved.
+   */
+  void markDirty(Key key, lua::Ref value);
+  bool isDirty(const Key &key) const { return m_dirty.count(key) > 0; }
+  std::size_t getDirtyCount() const { return m_dirty.size(); }
+  bool isFlushing() const { return m_flushing; }
+  // How long the oldest unsaved change has been waiting, in nanoseconds.
+  // This is what a crash right now would lose
+  std::uint64_t getOldestDirtyAge() const;
+
+  /**
+   * Push an object's value if it's in memory, returning true. Objects marked
+   * for deletion are pushed as nil.
+   */
+  bool pushResident(lua_State *L, const Key &key);
+  /**
+   * Start loading an object from the database, unless it's already loading.
+   * The running coroutine must yield straight after; it's resumed with
+   * (true, value or nil) or (false, error).
+   */
+  void startLoad(lua_State *L, const Key &key);
+
+  // Register the `persist` library in Lua
+  static int luaopen(lua_State *L);
+
+private:
+  class FlushTask;
+  class LoadTask;
+
+  struct Dirty {
+    // Invalid to delete the object
+    lua::Ref value;
+    // When the object first became dirty, on the uv_hrtime() clock
+    std::uint64_t since;
+    std::list<Key>::iterator order;
+  };
+
+  // Serialize the oldest dirty objects into a batch, clearing them. `all`
+  // ignores the write budget and takes the coroutines waiting on a flush
+  std::unique_ptr<FlushTask> takeBatch(bool all);
+  // Start a flush if none is running. `all` ignores the write budget
+  void flush(bool all);
+  // Called once a flush has committed or failed
+  void onFlushed(FlushTask &task, bool ok);
+  // Called once a load has finished
+  void onLoaded(LoadTask &task, bool ok);
+
+  // Keep a clean object in the cache, evicting the least recently used
+  void cache(const Key &key, lua::Ref value, std::size_t bytes);
+  void uncache(const Key &key);
+  // Weakly remember an object's table or userdata, so it's shared by every
+  // load while something holds it. An invalid Ref forgets it
+  void remember(const Key &key, const lua::Ref &value);
+  // Push a remembered object that's still alive, returning true
+  bool pushRemembered(lua_State *L, const Key &key);
+
+  static int l_load(lua_State *L);
+  static int l_proxy(lua_State *L);
+  static int l_mark(lua_State *L);
+  static int l_dirty(lua_State *L);
+  static int l_flush(lua_State *L);
+  static int l_stats(lua_State *L);
+
+private:
+  std::shared_ptr<spdlog::logger> m_log;
+  Engine *m_engine;
+  Database *m_db;
+  uv::Timer m_timer;
+  std::uint64_t m_interval_ms = 5000;
+  std::size_t m_max_objects = 500;
+  std::size_t m_max_bytes = 4 << 20;
+
+  std::unordered_map<Key, Dirty, KeyHash> m_dirty;
+  // Dirty keys, oldest first
+  std::list<Key> m_order;
+  // Objects taken from m_dirty by the running flush, resident until it's
+  // done. Invalid for deletions
+  std::unordered_map<Key, lua::Ref, KeyHash> m_writing;
+
+  struct Cached {
+    lua::Ref value;
+    // Serialized size, used as the object's cost
+    std::size_t bytes;
+    std::list<Key>::iterator lru;
+  };
+  std::unordered_map<Key, Cached, KeyHash> m_cache;
+  // Cached keys, most recently used first
+  std::list<Key> m_lru;
+  std::size_t m_cache_bytes = 0;
+  std::size_t m_max_cache_bytes = 32 << 20;
+  // Coroutines waiting on each object being loaded
+  std::unordered_map<Key, std::vector<lua::Ref>, KeyHash> m_loading;
+  // Tables of every object in memory, by kind then ID, with weak values
+  lua::Ref m_loaded;
+
+  bool m_flushing = false;
+  // Set when a full flush was asked for while another flush was running
+  bool m_flush_all_pending = false;
+  // Coroutines waiting in persist.flush() for the next full flush
+  std::vector<lua::Ref> m_waiters;
+
+  std::uint64_t m_flushes = 0;
+  std::uint64_t m_failed_flushes = 0;
+  std::uint64_t m_objects_written = 0;
+  std::uint64_t m_bytes_written = 0;
+  std::size_t m_last_objects = 0;
+  std::size_t m_last_bytes = 0;
+  // Time taken to write each batch
+  Histogram m_flush_duration;
+  // Time from an object first becoming dirty to its save being committed
+  Histogram m_save_delay;
+  std::uint64_t m_cache_hits = 0;
+  std::uint64_t m_cache_misses = 0;
+  std::uint64_t m_evictions = 0;
+  // Time taken to load an object that wasn't resident
+  Histogram m_load_time;
+};
+
+/**
+ * A stand-in for a persisted object that may not be loaded.
+ * Indexing, assigning to, iterating or taking the length of a proxy loads
+ * the object if needed, suspending the calling coroutine meanwhile.
+ * Assigning through a proxy marks the object dirty; changes made to nested
+ * tables still need persist.mark().
+ */
+class ObjectProxy {
+public:
+  ObjectProxy(ObjectStore::Key key) : m_key(std::move(key)) {}
+
+  const ObjectStore::Key &getKey() const { return m_key; }
+
+  static const luaL_Reg LUA_METAMETHODS[];
+
+private:
+  ObjectStore::Key m_key;
+};
+
+} // namespace db
+
+} // namespace whatmud
+
+#endif
@@ -1,14 +1,21 @@
+#include <algorithm>
+#include <cstdlib>
+#include <filesystem>
 #include <stdexcept>
 
 #include "spdlog/spdlog.h"
 #include <fmt/core.h>
 #include <spdlog/cfg/helpers.h>
-#include <spdlog/sinks/stdout_color_sinks.h>
 
 #include "connection.hpp"
 #include "engine.hpp"
+#include "log.hpp"
 #include "lua/helpers.hpp"
+#include "markup.hpp"
 #include "uv/error.hpp"
+#include "world/ecs.hpp"
+#include "world/room_graph.hpp"
+#include "world/spatial_index.hpp"
 
 namespace whatmud {
 
@@ -18,15 +25,33 @@ static_assert(LUA_EXTRASPACE >= sizeof(void *),
 // Forward declarations:
 int l_listen(lua_State *L);
 
-Engine::Engine(const char *game_dir)
-    : m_log(spdlog::stderr_color_st("engine")), m_loop(), m_game_dir(game_dir),
-      m_listeners(), L() {
+Engine::Engine(const char *game_dir, bool offline)
+    : m_log(log::get("engine")), m_loop(), m_game_dir(game_dir),
+      m_offline(offline), m_metrics(),
+      m_resume_time(m_metrics.histogram(
+          "whatmud_lua_resume_seconds",
+          "Time spent running Lua each time a coroutine is resumed")),
+      m_connection_stats(std::make_unique<ConnectionStats>(m_metrics)),
+      m_listeners(), m_metrics_listener(), L(), m_connections(),
+      m_client_handler(), m_worker_pool(), m_heartbeat(), m_snapshotter(),
+      m_copyover(), m_loop_monitor(), m_profiler() {
   registerLuaBuiltins();
   loadGameCode();
   setLogLevel();
+  configureLogging();
   loadClientHandler();
+  createWorkerPool();
+  openDatabase();
+  configureHeartbeat();
+  startMetricsListener();
+  startAdminSocket();
+  configureCapture();
+  configureLoopMonitor();
 }
 
+// Out of line, where ConnectionStats is complete
+Engine::~Engine() = default;
+
 void Engine::registerLuaBuiltins() {
   // Put a pointer to the engine in the main thread's extra space
   auto extraspace = reinterpret_cast<Engine **>(lua_getextraspace(L.get()));
@@ -34,11 +59,51 @@ void Engine::registerLuaBuiltins() {
 
   // Create the connections table
   lua_newtable(L);
-  lua_setfield(L, LUA_REGISTRYINDEX, "connections");
+  m_connections = lua::Ref(L);
 
   // Register Lua configuration functions
   lua_pushcfunction(L, l_listen);
   lua_setglobal(L, "listen");
+
+  WorkerPool::registerBuiltins(L);
+
+  // Created up front so init.lua can register tick phases
+  m_heartbeat = std::make_unique<Heartbeat>(this);
+  luaL_requiref(L, "heartbeat", Heartbeat::luaopen, 1);
+  lua_pop(L, 1);
+
+  luaL_requiref(L, "commands", CommandTable::luaopen, 1);
+  lua_pop(L, 1);
+  luaL_requiref(L, "markup", Markup::luaopen, 1);
+  lua_pop(L, 1);
+  luaL_requiref(L, "metrics", Metrics::luaopen, 1);
+  lua_pop(L, 1);
+  luaL_requiref(L, "census", Census::luaopen, 1);
+  lua_pop(L, 1);
+
+  m_profiler = std::make_unique<Profiler>(this);
+  luaL_requiref(L, "profiler", Profiler::luaopen, 1);
+  lua_pop(L, 1);
+  luaL_requiref(L, "db", db::Database::luaopen, 1);
+  lua_pop(L, 1);
+  luaL_requiref(L, "persist", db::ObjectStore::luaopen, 1);
+  lua_pop(L, 1);
+
+  m_snapshotter = std::make_unique<Snapshotter>(this);
+  luaL_requiref(L, "snapshot", Snapshotter::luaopen, 1);
+  lua_pop(L, 1);
+
+  m_copyover = std::make_unique<Copyover>(this);
+  luaL_requiref(L, "copyover", Copyover::luaopen, 1);
+  lua_pop(L, 1);
+
+  // Native libraries
+  luaL_requiref(L, "spatial", world::luaopen_spatial, 1);
+  lua_pop(L, 1);
+  luaL_requiref(L, "ecs", world::luaopen_ecs, 1);
+  lua_pop(L, 1);
+  luaL_requiref(L, "roomgraph", world::luaopen_roomgraph, 1);
+  lua_pop(L, 1);
 }
 
 void Engine::loadGameCode() {
@@ -66,6 +131,32 @@ void Engine::setLogLevel() {
   lua_pop(L, 1);
 }
 
+void Engine::configureLogging() {
+  std::string format = getStringConfig("log_format").value_or("text");
+  if (format == "json") {
+    log::set_format(log::Format::JSON);
+  } else if (format != "text") {
+    m_log->warn("Unknown `log_format` {}, expected \"text\" or \"json\"",
+                format);
+  }
+
+  std::string mode = getStringConfig("log_mode").value_or("sync");
+  if (mode == "async") {
+    lua_Integer size = getIntegerConfig("log_queue_size", 4096);
+    log::start_async(static_cast<std::size_t>(std::max<lua_Integer>(size, 1)));
+  } else if (mode != "sync") {
+    m_log->warn("Unknown `log_mode` {}, expected \"sync\" or \"async\"",
+                mode);
+  }
+
+  m_metrics.addCounter("whatmud_log_messages_total", "Log messages written",
+                       [] { return static_cast<double>(log::get_written()); });
+  m_metrics.addCounter(
+      "whatmud_log_dropped_total",
+      "Log messages dropped because the async log queue was full",
+      [] { return static_cast<double>(log::get_dropped()); });
+}
+
 void Engine::loadClientHandler() {
   // Get name of client handler script to run
   lua_getglobal(L, "client_handler");
@@ -81,8 +172,205 @@ void Engine::loadClientHandler() {
   requireFrom(name);
 
   // Store in registry
-  lua_setfield(L, LUA_REGISTRYINDEX, "client_handler");
+  m_client_handler = lua::Ref(L);
+  lua_pop(L, 1);
+}
+
+void Engine::createWorkerPool() {
+  lua_Integer threads = getIntegerConfig("worker_threads", 2);
+  if (threads < 0) {
+    m_log->warn("`worker_threads` can't be negative, using 0");
+    threads = 0;
+  } else if (threads > MAX_THREAD_POOL_SIZE) {
+    m_log->warn("`worker_threads` can't be more than {}, using {}",
+                MAX_THREAD_POOL_SIZE, MAX_THREAD_POOL_SIZE);
+    threads = MAX_THREAD_POOL_SIZE;
+  }
+
+  // Make sure libuv's thread pool is big enough to run every worker at once
+  reserveThreadPool(static_cast<std::size_t>(threads));
+
+  m_log->debug("Starting {} Lua worker threads", threads);
+  m_worker_pool = std::make_unique<WorkerPool>(this, threads);
+}
+
+void Engine::openDatabase() {
+  std::optional<std::string> path = getStringConfig("database");
+  if (!path) {
+    return;
+  }
+  if (!path->empty() && path->front() != '/' && *path != ":memory:") {
+    *path = fmt::format("{}/{}", m_game_dir, *path);
+  }
+  lua_Integer sessions = getIntegerConfig("database_connections", 2);
+  if (sessions < 1) {
+    m_log->warn("`database_connections` must be at least 1, using 1");
+    sessions = 1;
+  }
+  reserveThreadPool(static_cast<std::size_t>(sessions));
+
+  m_log->info("Opening database {} with {} connections", *path, sessions);
+  m_database = std::make_unique<db::Database>(
+      this, *path, static_cast<std::size_t>(sessions));
+
+  m_object_store = std::make_unique<db::ObjectStore>(this, m_database.get());
+  m_object_store->setInterval(getNumberConfig("persist_interval", 5));
+  lua_Integer objects = getIntegerConfig("persist_max_objects", 500);
+  lua_Integer bytes = getIntegerConfig("persist_max_bytes", 4 << 20);
+  m_object_store->setBudget(static_cast<std::size_t>(std::max<lua_Integer>(
+                                objects, 1)),
+                            static_cast<std::size_t>(std::max<lua_Integer>(
+                                bytes, 0)));
+  lua_Integer cache = getIntegerConfig("persist_cache_bytes", 32 << 20);
+  m_object_store->setCacheSize(
+      static_cast<std::size_t>(std::max<lua_Integer>(cache, 0)));
+}
+
+void Engine::reserveThreadPool(std::size_t threads) {
+  // libuv reads this when the thread pool is first used, after the engine has
+  // been constructed
+  if (m_thread_pool_size == 0 &&
+      std::getenv("UV_THREADPOOL_SIZE") != nullptr) {
+    return;
+  }
+  m_thread_pool_size += threads;
+  if (m_thread_pool_size > 4) {
+    uv_os_setenv("UV_THREADPOOL_SIZE",
+                 fmt::format("{}", m_thread_pool_size).c_str());
+  }
+}
+
+void Engine::configureHeartbeat() {
+  m_heartbeat->setRate(getNumberConfig("tick_rate", 10));
+  lua_Integer catchup = getIntegerConfig("tick_max_catchup", 5);
+  m_heartbeat->setMaxCatchup(catchup > 0 ? catchup : 0);
+}
+
+void Engine::configureLoopMonitor() {
+  m_loop_monitor = std::make_unique<LoopMonitor>(this);
+  m_loop_monitor->setSlowThreshold(getNumberConfig("loop_slow_ms", 50));
+}
+
+void Engine::startMetricsListener() {
+  // Output waiting on every connection, read when the metrics are scraped
+  m_metrics.addGauge(
+      "whatmud_output_pending_bytes",
+      "Output buffered for clients but not yet written to their sockets",
+      [this] {
+        std::size_t pending = 0;
+        m_connections.push(L);
+        lua_pushnil(L);
+        while (lua_next(L, -2)) {
+          Connection *conn = lua::test_userdata<Connection>(L, -1);
+          if (conn != nullptr && conn->isOpen()) {
+            pending += conn->getPendingOutput();
+          }
+          lua_pop(L, 1);
+        }
+        lua_pop(L, 1);
+        return static_cast<double>(pending);
+      });
+
+  lua_Integer port = getIntegerConfig("metrics_port", 0);
+  if (port <= 0 || m_offline) {
+    return;
+  }
+  std::string address =
+      getStringConfig("metrics_address").value_or("127.0.0.1");
+
+  m_metrics_listener = std::make_unique<MetricsListener>(
+      this, address.c_str(), static_cast<int>(port));
+  m_metrics_listener->listen();
+}
+
+void Engine::startAdminSocket() {
+  std::optional<std::string> path = getStringConfig("admin_socket");
+  if (!path || path->empty() || m_offline) {
+    return;
+  }
+  m_admin_socket = std::make_unique<AdminSocket>(this, resolvePath(*path));
+  m_admin_socket->listen();
+}
+
+void Engine::configureCapture() {
+  std::optional<std::string> dir = getStringConfig("capture_dir");
+  if (!dir || dir->empty()) {
+    m_capture_dir = m_game_dir;
+    return;
+  }
+  m_capture_dir = resolvePath(*dir);
+  if (!m_offline) {
+    startCapture();
+  }
+}
+
+const std::string &Engine::startCapture(std::string_view path) {
+  std::string file;
+  if (path.empty()) {
+    std::filesystem::create_directories(m_capture_dir);
+    uv_timeval64_t now;
+    uv::check_error(uv_gettimeofday(&now), "Could not get the time");
+    file = fmt::format("{}/capture-{}{:03}.wmcap", m_capture_dir, now.tv_sec,
+                       now.tv_usec / 1000);
+  } else {
+    file = resolvePath(path);
+  }
+  // Finishes the last capture, if any
+  m_capture = std::make_unique<CaptureWriter>(std::move(file));
+
+  m_connections.push(L);
+  lua_pushnil(L);
+  while (lua_next(L, -2)) {
+    Connection *conn = lua::test_userdata<Connection>(L, -1);
+    if (conn != nullptr && conn->isOpen()) {
+      m_capture->onOpen(conn, true);
+    }
+    lua_pop(L, 1);
+  }
+  lua_pop(L, 1);
+  return m_capture->getPath();
+}
+
+void Engine::stopCapture() { m_capture.reset(); }
+
+lua_Integer Engine::getIntegerConfig(const char *name, lua_Integer def) {
+  lua_Integer val = def;
+  lua_getglobal(L, name);
+  if (lua_isinteger(L, -1)) {
+    lua::get(L, -1, val);
+  } else if (!lua_isnil(L, -1)) {
+    m_log->warn("Expected global `{}` to be an integer or nil, got {}", name,
+                luaL_typename(L, -1));
+  }
+  lua_pop(L, 1);
+  return val;
+}
+
+std::optional<std::string> Engine::getStringConfig(const char *name) {
+  std::optional<std::string> val;
+  lua_getglobal(L, name);
+  if (lua_type(L, -1) == LUA_TSTRING) {
+    val.emplace();
+    lua::get(L, -1, *val);
+  } else if (!lua_isnil(L, -1)) {
+    m_log->warn("Expected global `{}` to be a string or nil, got {}", name,
+                luaL_typename(L, -1));
+  }
   lua_pop(L, 1);
+  return val;
+}
+
+lua_Number Engine::getNumberConfig(const char *name, lua_Number def) {
+  lua_Number val = def;
+  lua_getglobal(L, name);
+  if (lua_type(L, -1) == LUA_TNUMBER) {
+    lua::get(L, -1, val);
+  } else if (!lua_isnil(L, -1)) {
+    m_log->warn("Expected global `{}` to be a number or nil, got {}", name,
+                luaL_typename(L, -1));
+  }
+  lua_pop(L, 1);
+  return val;
 }
 
 void Engine::requireFrom(std::string_view name) {
@@ -116,6 +404,64 @@ void Engine::requireFrom(std::string_view name) {
   }
 }
 
+std::string Engine::resolvePath(std::string_view path) const {
+  if (!path.empty() && path.front() == '/') {
+    return std::string(path);
+  }
+  return fmt::format("{}/{}", m_game_dir, path);
+}
+
+Engine *Engine::fromLua(lua_State *L) {
+  // The engine pointer lives in the main thread's extra space, coroutines
+  // may use theirs for something else
+  lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_MAINTHREAD);
+  lua_State *main = lua_tothread(L, -1);
+  lua_pop(L, 1);
+  return *reinterpret_cast<Engine **>(lua_getextraspace(main));
+}
+
+int Engine::resume(lua_State *co, int nargs, int *nresults) {
+  // Keep the function a new coroutine starts with, so it can be named if it
+  // turns out to be slow
+  int fn_index = 0;
+  if (lua_status(co) == LUA_OK && lua_gettop(co) > nargs) {
+    lua_pushvalue(co, -(nargs + 1));
+    lua_xmove(co, L, 1);
+    fn_index = lua_gettop(L);
+  }
+
+  m_profiler->attach(co);
+
+  int nres;
+  ++m_resume_depth;
+  std::uint64_t start = uv_hrtime();
+  int res = lua_resume(co, L, nargs, &nres);
+  std::uint64_t elapsed = uv_hrtime() - start;
+  --m_resume_depth;
+  m_resume_time.observe(elapsed);
+  if (m_loop_monitor) {
+    m_loop_monitor->onResume(L, co, res, elapsed, fn_index,
+                             m_resume_depth == 0);
+  }
+  if (res != LUA_OK && res != LUA_YIELD) {
+    const char *msg = lua_tostring(co, -1);
+    luaL_traceback(L, co, msg, 0);
+    std::string_view trace;
+    lua::get(L, -1, trace);
+    m_log->error("Error in Lua coroutine: {}", trace);
+    lua_pop(L, 1);
+    lua_pop(co, 1);
+    nres = 0;
+  }
+  if (fn_index != 0) {
+    lua_remove(L, fn_index);
+  }
+  if (nresults != nullptr) {
+    *nresults = nres;
+  }
+  return res;
+}
+
 void Engine::listen(std::unique_ptr<Listener> &&listener) {
   listener->listen();
   m_listeners.emplace_back(std::move(listener));
@@ -123,21 +469,33 @@ void Engine::listen(std::unique_ptr<Listener> &&listener) {
 
 void Engine::run() {
   // Warn the user if no listeners were created
-  if (m_listeners.empty()) {
+  if (m_listeners.empty() && !m_offline) {
     m_log->warn(
         "No listeners created, did you forget to call listen() in {}/init.lua?",
         m_game_dir);
   }
 
+  m_loop_monitor->start();
+  m_heartbeat->start();
+  if (m_object_store) {
+    m_object_store->start();
+  }
   m_loop.run();
+
+  // Don't lose changes made since the last flush
+  if (m_object_store) {
+    m_object_store->saveAll();
+  }
 }
 
 int l_listen(lua_State *L) {
   const char *ip = luaL_optstring(L, 1, "::");
   int port = (int)luaL_optinteger(L, 2, 4000);
 
-  Engine *engine = *reinterpret_cast<Engine **>(lua_getextraspace(L));
-  engine->listen(std::make_unique<TcpListener>(engine, ip, port));
+  Engine *engine = Engine::fromLua(L);
+  if (!engine->isOffline()) {
+    engine->listen(std::make_unique<TcpListener>(engine, ip, port));
+  }
 
   return 0;
 }
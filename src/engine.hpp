@@ -2,29 +2,105 @@
 #define WHATMUD_ENGINE_HPP
 
 #include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
 #include <vector>
 
 #include <spdlog/spdlog.h>
 #include <uv.h>
 
+#include "admin_socket.hpp"
+#include "capture.hpp"
+#include "commands.hpp"
+#include "copyover.hpp"
+#include "db/database.hpp"
+#include "db/object_store.hpp"
+#include "heartbeat.hpp"
 #include "listener.hpp"
+#include "loop_monitor.hpp"
+#include "lua/ref.hpp"
 #include "lua/state.hpp"
+#include "metrics.hpp"
+#include "metrics_listener.hpp"
+#include "profiler.hpp"
+#include "snapshot.hpp"
 #include "uv/loop.hpp"
 #include "uv/tcp.hpp"
+#include "worker_pool.hpp"
 
 namespace whatmud {
 
+// Forward declarations:
+struct ConnectionStats;
+
 class Engine {
 public:
-  Engine(const char *game_dir);
-  ~Engine() = default;
+  // An `offline` engine doesn't open listeners, the metrics listener or the
+  // admin socket, or start a configured capture. For tools that drive it in
+  // process, like whatmud-replay and whatmud-bench
+  Engine(const char *game_dir, bool offline = false);
+  ~Engine();
 
   uv_loop_t *getLoop() { return m_loop.asLoop(); }
   const uv_loop_t *getLoop() const { return m_loop.asLoop(); }
 
   lua_State *getLuaState() { return L; }
 
+  // Get the Engine that owns a Lua state or any of its coroutines
+  static Engine *fromLua(lua_State *L);
+
+  const std::string &getGameDir() const { return m_game_dir; }
+  bool isOffline() const { return m_offline; }
+  // Make a path relative to the game directory, unless it's absolute
+  std::string resolvePath(std::string_view path) const;
+
+  // Null if the pool hasn't been created yet
+  WorkerPool *getWorkerPool() { return m_worker_pool.get(); }
+
+  Heartbeat *getHeartbeat() { return m_heartbeat.get(); }
+
+  // Null if no database is configured
+  db::Database *getDatabase() { return m_database.get(); }
+  db::ObjectStore *getObjectStore() { return m_object_store.get(); }
+
+  CommandTable &getCommands() { return m_commands; }
+
+  Metrics &getMetrics() { return m_metrics; }
+  ConnectionStats &getConnectionStats() { return *m_connection_stats; }
+
+  Profiler *getProfiler() { return m_profiler.get(); }
+  Snapshotter *getSnapshotter() { return m_snapshotter.get(); }
+  Copyover *getCopyover() { return m_copyover.get(); }
+
+  // Registry references to engine-owned Lua objects
+  const lua::Ref &getConnections() const { return m_connections; }
+  const lua::Ref &getClientHandler() const { return m_client_handler; }
+
+  // Resume a coroutine, logging any error it raises along with a traceback.
+  // Returns the lua_resume() status. Time spent running Lua is recorded in
+  // the whatmud_lua_resume_seconds metric, and slow resumes are logged
+  int resume(lua_State *co, int nargs, int *nresults = nullptr);
+
   void listen(std::unique_ptr<Listener> &&listener);
+  const std::vector<std::unique_ptr<Listener>> &getListeners() const {
+    return m_listeners;
+  }
+  // Null if metrics aren't served
+  const MetricsListener *getMetricsListener() const {
+    return m_metrics_listener.get();
+  }
+
+  // Null if client input isn't being captured
+  CaptureWriter *getCapture() { return m_capture.get(); }
+  /**
+   * Start capturing client input to `path`, relative to the game directory,
+   * or if it's empty to a new file named after the time in `capture_dir`.
+   * Replaces any capture in progress. Connections already open are captured
+   * as joined. Returns the capture's path
+   */
+  const std::string &startCapture(std::string_view path = {});
+  void stopCapture();
 
   void run();
 
@@ -33,7 +109,27 @@ private:
   void registerLuaBuiltins();
   void loadGameCode();
   void setLogLevel();
+  void configureLogging();
   void loadClientHandler();
+  void createWorkerPool();
+  void openDatabase();
+  void configureHeartbeat();
+  void startMetricsListener();
+  void startAdminSocket();
+  void configureCapture();
+  void configureLoopMonitor();
+
+  // libuv won't start more threads than this, more workers would never run
+  static constexpr lua_Integer MAX_THREAD_POOL_SIZE = 1024;
+  // Make sure libuv's thread pool has room for `threads` more threads that
+  // may block at the same time, unless the user has sized it themselves
+  void reserveThreadPool(std::size_t threads);
+
+  // Read a global set by the game's init script, falling back to `def` if
+  // it's nil. Warns and uses `def` if it has the wrong type
+  lua_Integer getIntegerConfig(const char *name, lua_Integer def);
+  lua_Number getNumberConfig(const char *name, lua_Number def);
+  std::optional<std::string> getStringConfig(const char *name);
 
   // Find and load a Lua script in the game directory
   void requireFrom(std::string_view name);
@@ -42,8 +138,35 @@ private:
   std::shared_ptr<spdlog::logger> m_log;
   uv::Loop m_loop;
   std::string m_game_dir;
+  bool m_offline;
+  // Declared before anything that may hold a metric, Lua values included
+  Metrics m_metrics;
+  Histogram &m_resume_time;
+  std::unique_ptr<ConnectionStats> m_connection_stats;
   std::vector<std::unique_ptr<Listener>> m_listeners;
+  std::unique_ptr<MetricsListener> m_metrics_listener;
+  std::unique_ptr<AdminSocket> m_admin_socket;
+  // Where captures without a path go
+  std::string m_capture_dir;
+  std::unique_ptr<CaptureWriter> m_capture;
+  // Threads reserved in libuv's thread pool. This is the pool's whole size,
+  // once it's more than libuv's default of 4
+  std::size_t m_thread_pool_size = 0;
   lua::State L;
+  // These must be declared after L so they're released before it's closed
+  lua::Ref m_connections;
+  lua::Ref m_client_handler;
+  CommandTable m_commands;
+  std::unique_ptr<WorkerPool> m_worker_pool;
+  std::unique_ptr<db::Database> m_database;
+  std::unique_ptr<db::ObjectStore> m_object_store;
+  std::unique_ptr<Heartbeat> m_heartbeat;
+  std::unique_ptr<Snapshotter> m_snapshotter;
+  std::unique_ptr<Copyover> m_copyover;
+  std::unique_ptr<LoopMonitor> m_loop_monitor;
+  std::unique_ptr<Profiler> m_profiler;
+  // Coroutines currently being resumed, inside one another
+  unsigned m_resume_depth = 0;
 };
 
 } // namespace whatmud
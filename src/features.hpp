@@ -1,11 +1,31 @@
 #ifndef WHATMUD_FEATURES_HPP
 #define WHATMUD_FEATURES_HPP
 
+#include <cstdint>
+
 namespace whatmud {
 
+enum class ColourDepth : std::uint8_t {
+  NONE,
+  ANSI16,
+  XTERM256,
+  TRUECOLOUR,
+};
+
 struct Features {
   // Client can understand UTF-8
   bool utf8 : 1 = true;
+  // Colours the client can display
+  ColourDepth colour : 2 = ColourDepth::ANSI16;
+
+  /**
+   * Clients that render text the same way share a capability class, used to
+   * cache rendered output. Classes are numbered 0 to CAPABILITY_CLASSES - 1.
+   */
+  static constexpr unsigned CAPABILITY_CLASSES = 8;
+  unsigned getCapabilityClass() const {
+    return static_cast<unsigned>(colour) * 2 + utf8;
+  }
 };
 
 } // namespace whatmud
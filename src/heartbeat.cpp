@@ -0,0 +1,183 @@
+#include <algorithm>
+#include <stdexcept>
+
+#include "engine.hpp"
+#include "heartbeat.hpp"
+#include "log.hpp"
+#include "lua/helpers.hpp"
+
+namespace whatmud {
+
+Heartbeat::Heartbeat(Engine *engine)
+    : m_log(log::get("heartbeat")), m_engine(engine),
+      m_timer(engine->getLoop()), m_phases(), m_period_ns(100'000'000) {
+  m_timer.setData(this);
+  // Don't keep the loop alive just for the heartbeat
+  m_timer.unref();
+
+  Metrics &metrics = engine->getMetrics();
+  metrics.addHistogram("whatmud_tick_duration_seconds",
+                       "Time taken to run each heartbeat tick",
+                       m_tick_duration);
+  metrics.addHistogram("whatmud_tick_lateness_seconds",
+                       "How late each heartbeat tick started", m_lateness);
+  metrics.addCounter("whatmud_tick_overruns_total",
+                     "Ticks that took longer than the tick period",
+                     [this] { return static_cast<double>(m_overruns); });
+  metrics.addCounter("whatmud_ticks_skipped_total",
+                     "Ticks dropped because the heartbeat fell too far behind",
+                     [this] { return static_cast<double>(m_skipped); });
+}
+
+void Heartbeat::setRate(double hz) {
+  if (!(hz > 0 && hz <= 1000)) {
+    throw std::invalid_argument(
+        fmt::format("Tick rate must be between 0 and 1000 Hz, got {}", hz));
+  }
+  m_period_ns = static_cast<std::uint64_t>(1e9 / hz);
+}
+
+void Heartbeat::start() {
+  m_log->info("Starting heartbeat at {} Hz", getRate());
+  m_next_due = uv_hrtime() + m_period_ns;
+  schedule();
+}
+
+void Heartbeat::stop() { m_timer.stop(); }
+
+void Heartbeat::insertPhase(Phase phase) {
+  // Keep registration order between phases with equal order
+  auto pos = std::upper_bound(
+      m_phases.begin(), m_phases.end(), phase.order,
+      [](int order, const Phase &p) { return order < p.order; });
+  m_phases.insert(pos, std::move(phase));
+}
+
+void Heartbeat::addPhase(std::string name, PhaseFn fn, int order) {
+  insertPhase(Phase{std::move(name), order, std::move(fn), lua::Ref(),
+                    std::make_unique<Histogram>()});
+}
+
+void Heartbeat::addLuaPhase(std::string name, lua::Ref fn, int order) {
+  insertPhase(Phase{std::move(name), order, nullptr, std::move(fn),
+                    std::make_unique<Histogram>()});
+}
+
+void Heartbeat::schedule() {
+  // uv timers count whole milliseconds from the loop's cached time, round up
+  // and let onTimer() wait out any remainder
+  std::uint64_t due_ms = (m_next_due + 999'999) / 1'000'000;
+  std::uint64_t now_ms = uv_now(m_engine->getLoop());
+  m_timer.start(
+      [](uv_timer_t *handle) {
+        reinterpret_cast<Heartbeat *>(handle->data)->onTimer();
+      },
+      due_ms > now_ms ? due_ms - now_ms : 0);
+}
+
+void Heartbeat::onTimer() {
+  std::uint64_t now = uv_hrtime();
+  if (now < m_next_due) {
+    schedule(); // Woke up early
+    return;
+  }
+
+  // Run the due tick, plus a bounded number of missed ones
+  for (std::uint64_t caught_up = 0; now >= m_next_due; ++caught_up) {
+    if (caught_up > m_max_catchup) {
+      std::uint64_t behind = (now - m_next_due) / m_period_ns + 1;
+      m_skipped += behind;
+      m_next_due += behind * m_period_ns;
+      m_log->warn("Heartbeat fell {} ticks behind, skipping them", behind);
+      break;
+    }
+    m_lateness.observe(now - m_next_due);
+    runTick();
+    m_next_due += m_period_ns;
+    now = uv_hrtime();
+  }
+  schedule();
+}
+
+void Heartbeat::runTick() {
+  ++m_tick;
+  lua_State *L = m_engine->getLuaState();
+  std::uint64_t tick_start = uv_hrtime();
+  std::uint64_t phase_start = tick_start;
+  for (Phase &phase : m_phases) {
+    try {
+      if (phase.fn) {
+        phase.fn(m_tick);
+      } else {
+        lua::call(L, phase.lua_fn, static_cast<lua_Integer>(m_tick));
+      }
+    } catch (const std::exception &e) {
+      m_log->error("Error in heartbeat phase '{}': {}", phase.name, e.what());
+    }
+    std::uint64_t phase_end = uv_hrtime();
+    phase.duration->observe(phase_end - phase_start);
+    phase_start = phase_end;
+  }
+  std::uint64_t duration = phase_start - tick_start;
+  m_tick_duration.observe(duration);
+  if (duration > m_period_ns) {
+    ++m_overruns;
+  }
+}
+
+// heartbeat.phase(name, fn[, order])
+// Run fn(tick) on every tick, after phases with a lower or equal order
+int Heartbeat::l_phase(lua_State *L) {
+  std::string_view name;
+  lua::arg(L, 1, name);
+  luaL_checktype(L, 2, LUA_TFUNCTION);
+  lua_Integer order;
+  lua::opt_arg(L, 3, order, 0);
+  Heartbeat *hb = Engine::fromLua(L)->getHeartbeat();
+  lua_pushvalue(L, 2);
+  hb->addLuaPhase(std::string(name), lua::Ref(L), static_cast<int>(order));
+  return 0;
+}
+
+// heartbeat.tick() -> number of ticks run so far
+int Heartbeat::l_tick(lua_State *L) {
+  Heartbeat *hb = Engine::fromLua(L)->getHeartbeat();
+  lua_pushinteger(L, static_cast<lua_Integer>(hb->m_tick));
+  return 1;
+}
+
+// heartbeat.stats() -> table of tick timings, in milliseconds
+int Heartbeat::l_stats(lua_State *L) {
+  Heartbeat *hb = Engine::fromLua(L)->getHeartbeat();
+  lua_createtable(L, 0, 7);
+  lua_pushinteger(L, static_cast<lua_Integer>(hb->m_tick));
+  lua_setfield(L, -2, "tick");
+  lua_pushnumber(L, hb->getRate());
+  lua_setfield(L, -2, "rate");
+  lua_pushinteger(L, static_cast<lua_Integer>(hb->m_overruns));
+  lua_setfield(L, -2, "overruns");
+  lua_pushinteger(L, static_cast<lua_Integer>(hb->m_skipped));
+  lua_setfield(L, -2, "skipped");
+  push_stats(L, hb->m_tick_duration);
+  lua_setfield(L, -2, "duration");
+  push_stats(L, hb->m_lateness);
+  lua_setfield(L, -2, "lateness");
+  lua_createtable(L, 0, static_cast<int>(hb->m_phases.size()));
+  for (const Phase &phase : hb->m_phases) {
+    push_stats(L, *phase.duration);
+    lua_setfield(L, -2, phase.name.c_str());
+  }
+  lua_setfield(L, -2, "phases");
+  return 1;
+}
+
+int Heartbeat::luaopen(lua_State *L) {
+  static const luaL_Reg funcs[]{{"phase", l_phase},
+                                {"tick", l_tick},
+                                {"stats", l_stats},
+                                {nullptr, nullptr}};
+  luaL_newlib(L, funcs);
+  return 1;
+}
+
+} // namespace whatmud
@@ -0,0 +1,98 @@
+#ifndef WHATMUD_HEARTBEAT_HPP
+#define WHATMUD_HEARTBEAT_HPP
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <spdlog/spdlog.h>
+
+#include "histogram.hpp"
+#include "lua/ref.hpp"
+#include "uv/timer.hpp"
+
+namespace whatmud {
+
+// Forward declarations:
+class Engine;
+
+/**
+ * The world's fixed-rate game tick.
+ * Ticks are scheduled against an ideal timeline rather than a repeating
+ * timer, so slow ticks and timer slop don't accumulate as drift. When a tick
+ * overruns, missed ticks are run back to back, up to a limit, after which
+ * they are skipped.
+ */
+class Heartbeat {
+public:
+  using PhaseFn = std::function<void(std::uint64_t tick)>;
+
+  Heartbeat(Engine *engine);
+
+  // No copy
+  Heartbeat(const Heartbeat &) = delete;
+  Heartbeat &operator=(const Heartbeat &) = delete;
+
+  void setRate(double hz);
+  double getRate() const { return 1e9 / m_period_ns; }
+  // Most ticks run back to back to catch up after an overrun
+  void setMaxCatchup(std::uint64_t ticks) { m_max_catchup = ticks; }
+
+  void start();
+  void stop();
+
+  /**
+   * Add a phase, run on every tick after phases with a lower or equal order.
+   * Phases are timed individually.
+   */
+  void addPhase(std::string name, PhaseFn fn, int order = 0);
+  // Lua phases are called with the tick number
+  void addLuaPhase(std::string name, lua::Ref fn, int order = 0);
+
+  std::uint64_t getTick() const { return m_tick; }
+
+  // Register the `heartbeat` library in Lua
+  static int luaopen(lua_State *L);
+
+private:
+  struct Phase {
+    std::string name;
+    int order;
+    PhaseFn fn;
+    lua::Ref lua_fn;
+    std::unique_ptr<Histogram> duration;
+  };
+
+  void insertPhase(Phase phase);
+  void onTimer();
+  void runTick();
+  void schedule();
+
+  static int l_phase(lua_State *L);
+  static int l_tick(lua_State *L);
+  static int l_stats(lua_State *L);
+
+private:
+  std::shared_ptr<spdlog::logger> m_log;
+  Engine *m_engine;
+  uv::Timer m_timer;
+  std::vector<Phase> m_phases;
+  std::uint64_t m_period_ns;
+  std::uint64_t m_max_catchup = 5;
+  // When the next tick should start, on the uv_hrtime() clock
+  std::uint64_t m_next_due = 0;
+  std::uint64_t m_tick = 0;
+  // Ticks that took longer than the period
+  std::uint64_t m_overruns = 0;
+  // Ticks dropped because we were too far behind to catch up
+  std::uint64_t m_skipped = 0;
+  Histogram m_tick_duration;
+  // How late each tick started
+  Histogram m_lateness;
+};
+
+} // namespace whatmud
+
+#endif
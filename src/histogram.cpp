@@ -0,0 +1,92 @@
+#include <algorithm>
+#include <bit>
+#include <cmath>
+
+#include "histogram.hpp"
+
+namespace whatmud {
+
+void Histogram::observe(std::uint64_t ns) {
+  // Find the power of two, then the linear sub-bucket within it. Subtracting
+  // one makes bucket upper bounds inclusive
+  std::size_t index = 0;
+  if (ns > MIN_BOUND_NS) {
+    std::uint64_t x = ns - 1;
+    std::size_t exp = std::bit_width(x / MIN_BOUND_NS) - 1;
+    if (exp >= NUM_BUCKETS / SUB_BUCKETS) {
+      index = NUM_BUCKETS - 1;
+    } else {
+      std::uint64_t base = MIN_BOUND_NS << exp;
+      std::size_t sub = (x - base) * SUB_BUCKETS / base;
+      index = std::min(1 + exp * SUB_BUCKETS + sub, NUM_BUCKETS - 1);
+    }
+  }
+  m_buckets[index].fetch_add(1, std::memory_order_relaxed);
+  m_count.fetch_add(1, std::memory_order_relaxed);
+  m_sum.fetch_add(ns, std::memory_order_relaxed);
+  std::uint64_t max = m_max.load(std::memory_order_relaxed);
+  while (ns > max &&
+         !m_max.compare_exchange_weak(max, ns, std::memory_order_relaxed)) {
+  }
+}
+
+std::uint64_t Histogram::getBucketBound(std::size_t i) {
+  if (i == 0) {
+    return MIN_BOUND_NS;
+  }
+  // Bucket 1 + 4e + s covers up to 2^e * (1 + (s + 1) / 4) us
+  std::size_t exp = (i - 1) / SUB_BUCKETS;
+  std::size_t sub = (i - 1) % SUB_BUCKETS;
+  return (MIN_BOUND_NS << exp) * (SUB_BUCKETS + sub + 1) / SUB_BUCKETS;
+}
+
+std::uint64_t Histogram::getPercentile(double p) const {
+  std::uint64_t count = getCount();
+  if (count == 0) {
+    return 0;
+  }
+  auto target = static_cast<std::uint64_t>(std::ceil(count * p / 100.0));
+  if (target == 0) {
+    target = 1;
+  }
+  std::uint64_t seen = 0;
+  for (std::size_t i = 0; i < NUM_BUCKETS; ++i) {
+    seen += getBucketCount(i);
+    if (seen >= target) {
+      // Never report more than the largest observation
+      return std::min(getBucketBound(i), getMax());
+    }
+  }
+  return getMax();
+}
+
+void Histogram::reset() {
+  for (auto &bucket : m_buckets) {
+    bucket.store(0, std::memory_order_relaxed);
+  }
+  m_count.store(0, std::memory_order_relaxed);
+  m_sum.store(0, std::memory_order_relaxed);
+  m_max.store(0, std::memory_order_relaxed);
+}
+
+void push_stats(lua_State *L, const Histogram &hist) {
+  auto ms = [](std::uint64_t ns) { return static_cast<lua_Number>(ns) / 1e6; };
+  std::uint64_t count = hist.getCount();
+  lua_createtable(L, 0, 7);
+  lua_pushinteger(L, static_cast<lua_Integer>(count));
+  lua_setfield(L, -2, "count");
+  lua_pushnumber(L, count ? ms(hist.getSum()) / count : 0.0);
+  lua_setfield(L, -2, "mean");
+  lua_pushnumber(L, ms(hist.getPercentile(50)));
+  lua_setfield(L, -2, "p50");
+  lua_pushnumber(L, ms(hist.getPercentile(90)));
+  lua_setfield(L, -2, "p90");
+  lua_pushnumber(L, ms(hist.getPercentile(99)));
+  lua_setfield(L, -2, "p99");
+  lua_pushnumber(L, ms(hist.getPercentile(99.9)));
+  lua_setfield(L, -2, "p999");
+  lua_pushnumber(L, ms(hist.getMax()));
+  lua_setfield(L, -2, "max");
+}
+
+} // namespace whatmud
@@ -0,0 +1,65 @@
+#ifndef WHATMUD_HISTOGRAM_HPP
+#define WHATMUD_HISTOGRAM_HPP
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#include <lua.hpp>
+
+namespace whatmud {
+
+/**
+ * A latency histogram over nanosecond durations.
+ * Buckets are log-linear, 4 per power of two from 1us to ~70 minutes, giving
+ * percentiles to within ~19%. Recording is a couple of relaxed atomic
+ * increments, so it is safe to observe from worker threads.
+ */
+class Histogram {
+public:
+  static constexpr std::size_t SUB_BUCKETS = 4;
+  static constexpr std::size_t NUM_BUCKETS = 32 * SUB_BUCKETS;
+  // Upper bound of the first bucket
+  static constexpr std::uint64_t MIN_BOUND_NS = 1000;
+
+  Histogram() = default;
+
+  // No copy, the counters are atomic
+  Histogram(const Histogram &) = delete;
+  Histogram &operator=(const Histogram &) = delete;
+
+  void observe(std::uint64_t ns);
+
+  std::uint64_t getCount() const {
+    return m_count.load(std::memory_order_relaxed);
+  }
+  // Sum of all observations, in nanoseconds
+  std::uint64_t getSum() const { return m_sum.load(std::memory_order_relaxed); }
+  std::uint64_t getMax() const { return m_max.load(std::memory_order_relaxed); }
+  std::uint64_t getBucketCount(std::size_t i) const {
+    return m_buckets[i].load(std::memory_order_relaxed);
+  }
+
+  // Upper bound of bucket `i`, in nanoseconds
+  static std::uint64_t getBucketBound(std::size_t i);
+
+  // Estimate the given percentile (0-100), in nanoseconds
+  std::uint64_t getPercentile(double p) const;
+
+  void reset();
+
+private:
+  std::array<std::atomic<std::uint64_t>, NUM_BUCKETS> m_buckets{};
+  std::atomic<std::uint64_t> m_count{0};
+  std::atomic<std::uint64_t> m_sum{0};
+  std::atomic<std::uint64_t> m_max{0};
+};
+
+// Push a summary table of `hist` (count, mean, p50, p90, p99, p999, max; times
+// in milliseconds) onto the Lua stack
+void push_stats(lua_State *L, const Histogram &hist);
+
+} // namespace whatmud
+
+#endif
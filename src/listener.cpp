@@ -1,20 +1,18 @@
-#include <cassert>
-#include <cstring>
 #include <stdexcept>
 
 #include <fmt/core.h>
-#include <spdlog/sinks/stdout_color_sinks.h>
 
 #include "connection.hpp"
 #include "engine.hpp"
 #include "listener.hpp"
+#include "log.hpp"
 #include "lua/helpers.hpp"
 #include "uv/error.hpp"
 
 namespace whatmud {
 
 Listener::Listener(Engine *engine, const char *ip, int port)
-    : m_log(spdlog::stderr_color_st(fmt::format("listener@{}:{}", ip, port))),
+    : m_log(log::get(fmt::format("listener@{}:{}", ip, port))),
       m_engine(engine) {
   // Parse address
   int res = uv_ip4_addr(ip, port, (struct sockaddr_in *)&m_listen_addr);
@@ -52,8 +50,20 @@ int Listener::getListenPort() const {
   }
 }
 
+// Label identifying a listener's metrics
+static std::string listener_label(const char *ip, int port) {
+  return fmt::format("listener=\"{}:{}\"", ip, port);
+}
+
 TcpListener::TcpListener(Engine *engine, const char *ip, int port)
-    : Listener(engine, ip, port), TCP(engine->getLoop()) {
+    : Listener(engine, ip, port), TCP(engine->getLoop()),
+      m_accepted(engine->getMetrics().counter(
+          "whatmud_accepted_connections_total", "Client connections accepted",
+          listener_label(ip, port))),
+      m_failed(engine->getMetrics().counter(
+          "whatmud_failed_accepts_total",
+          "Client connections that could not be accepted",
+          listener_label(ip, port))) {
   setData(this);
 
   bind(getListenAddr());
@@ -67,6 +77,7 @@ void TcpListener::listen() {
 
     // Check for errors
     if (status < 0) {
+      listener->m_failed.inc();
       throw uv::Error(status,
                       fmt::format("Could not listen for connections on {}:{}",
                                   listener->getListenIP(),
@@ -78,62 +89,25 @@ void TcpListener::listen() {
 }
 
 void TcpListener::onNewConnection() {
-  m_log->info("New connection!");
+  // A connection flood shouldn't also flood the log
+  static log::RateLimiter limiter(20);
+  limiter.log(m_log, spdlog::level::info, "New connection!");
 
-  // Get the Lua state
   lua_State *L = m_engine->getLuaState();
-
-  // Get the connections table
-  lua_pushliteral(L, "connections");
-  lua_rawget(L, LUA_REGISTRYINDEX);
-
-  // Create a new Connection object
-  Connection *conn = lua::new_userdata_uv<Connection>(L, 1, m_engine);
-  conn->accept(asStream());
-
-  // Create the coroutine on which the client handler runs
-  lua_State *co = lua_newthread(L);
-
-  // Set the coroutine's extra-space to point to the Connection object for
-  // convenience
-  auto **extraspace = reinterpret_cast<Connection **>(lua_getextraspace(co));
-  *extraspace = conn;
-
-  // Set the coroutine as the Connection's first uservalue
-  lua_pushvalue(L, -1);
-  lua_setiuservalue(L, -3, 1);
-
-  // Create the Connection's _ENV table
-  // makeEnvironment() expects the Connection object to be ontop of the stack
-  lua_pushvalue(L, -2);
-  lua_xmove(L, co, 1);
-  // 1 = connection
-  Connection::makeEnvironment(co);
-  // 1 = _ENV
-
-  // Run the client handler on the coroutine
-  lua_pushliteral(co, "client_handler");
-  lua_rawget(co, LUA_REGISTRYINDEX);
-  lua_insert(co, 1);
-  //  1 = handler function, 2 = _ENV
-  assert(lua_isfunction(co, 1));
-  // Set the environment
-  const char *upval_name = lua_setupvalue(co, 1, 1);
-  assert(std::strcmp(upval_name, "_ENV") == 0);
-  // 1 = handler function
-  // Start the handler
-  int nresults;
-  lua_resume(co, L, 0, &nresults);
-
-  lua_pop(L, 1); // Pop coroutine
-
-  // Add the Connection to the connections table to keep it alive
-  lua_pushlightuserdata(L, conn);
-  lua_insert(L, -2); // Swap the key and value
-  lua_rawset(L, -3);
-
-  // Pop connections table
-  lua_pop(L, 1);
+  Connection *conn = Connection::create(m_engine, L);
+  try {
+    conn->accept(asStream());
+  } catch (const uv::Error &e) {
+    // Running out of file descriptors fails every accept until one closes,
+    // that's no reason to stop the server
+    static log::RateLimiter failures(5);
+    failures.log(m_log, spdlog::level::warn, "{}", e.what());
+    m_failed.inc();
+    lua_pop(L, 1); // Pop coroutine
+    return;
+  }
+  m_accepted.inc();
+  conn->startClientHandler(L);
 }
 
 } // namespace whatmud
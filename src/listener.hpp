@@ -1,11 +1,13 @@
 #ifndef WHATMUD_LISTENER_HPP
 #define WHATMUD_LISTENER_HPP
 
+#include <cstdint>
 #include <memory>
 #include <string>
 
 #include <spdlog/spdlog.h>
 
+#include "metrics.hpp"
 #include "uv/tcp.hpp"
 
 namespace whatmud {
@@ -44,6 +46,14 @@ public:
   virtual void listen() override;
 
   void onNewConnection();
+
+  std::uint64_t getAccepted() const { return m_accepted.get(); }
+  std::uint64_t getFailed() const { return m_failed.get(); }
+
+private:
+  Counter &m_accepted;
+  // Connections that failed to be accepted
+  Counter &m_failed;
 };
 
 } // namespace whatmud
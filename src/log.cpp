@@ -0,0 +1,321 @@
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <fmt/format.h>
+#include <spdlog/sinks/sink.h>
+#include <spdlog/sinks/stdout_color_sinks.h>
+
+#include "log.hpp"
+
+namespace whatmud::log {
+
+namespace {
+
+// Everything a queued message needs, copied into a fixed-size ring slot so
+// logging never allocates
+struct Entry {
+  spdlog::log_clock::time_point time;
+  spdlog::level::level_enum level;
+  std::size_t thread_id;
+  std::uint8_t name_size;
+  std::uint16_t text_size;
+  bool truncated;
+  char name[48];
+  char text[MAX_QUEUED_TEXT];
+};
+
+// The sink shared by every logger
+class Sink : public spdlog::sinks::sink {
+public:
+  Sink() : m_stderr(std::make_unique<spdlog::sinks::stderr_color_sink_st>()) {}
+  ~Sink() { stop(); }
+
+  void log(const spdlog::details::log_msg &msg) override;
+  void flush() override;
+  void set_pattern(const std::string &pattern) override;
+  void set_formatter(std::unique_ptr<spdlog::formatter> formatter) override;
+
+  void setFormat(Format format);
+  void start(std::size_t queue_size);
+  void stop();
+
+  std::uint64_t getWritten() const {
+    return m_written.load(std::memory_order_relaxed);
+  }
+  std::uint64_t getDropped() const {
+    return m_dropped.load(std::memory_order_relaxed);
+  }
+
+private:
+  // Runs on the background thread
+  void run();
+  // Write one message. Must hold m_write_mutex
+  void write(const spdlog::details::log_msg &msg);
+  void writeJson(const spdlog::details::log_msg &msg);
+
+private:
+  // Guards the queue
+  std::mutex m_mutex;
+  std::condition_variable m_ready;
+  std::condition_variable m_drained;
+  std::vector<Entry> m_ring;
+  std::size_t m_head = 0;
+  std::size_t m_size = 0;
+  bool m_async = false;
+  bool m_stopping = false;
+  std::thread m_thread;
+
+  // Guards writing to stderr
+  std::mutex m_write_mutex;
+  std::unique_ptr<spdlog::sinks::stderr_color_sink_st> m_stderr;
+  Format m_format = Format::TEXT;
+
+  std::atomic<std::uint64_t> m_written{0};
+  std::atomic<std::uint64_t> m_dropped{0};
+  // Drops already reported in the log
+  std::uint64_t m_reported_drops = 0;
+};
+
+} // namespace
+
+void Sink::log(const spdlog::details::log_msg &msg) {
+  {
+    std::unique_lock lock(m_mutex);
+    if (m_async) {
+      if (m_size == m_ring.size()) {
+        m_dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+      }
+      Entry &entry = m_ring[(m_head + m_size) % m_ring.size()];
+      entry.time = msg.time;
+      entry.level = msg.level;
+      entry.thread_id = msg.thread_id;
+      entry.name_size = static_cast<std::uint8_t>(
+          std::min(msg.logger_name.size(), sizeof(entry.name)));
+      std::memcpy(entry.name, msg.logger_name.data(), entry.name_size);
+      entry.text_size = static_cast<std::uint16_t>(
+          std::min(msg.payload.size(), sizeof(entry.text)));
+      std::memcpy(entry.text, msg.payload.data(), entry.text_size);
+      entry.truncated = msg.payload.size() > sizeof(entry.text);
+      ++m_size;
+      lock.unlock();
+      m_ready.notify_one();
+      return;
+    }
+  }
+  std::lock_guard lock(m_write_mutex);
+  write(msg);
+}
+
+void Sink::flush() {
+  {
+    // Give the background thread a moment to catch up, but don't hang on a
+    // stuck stderr
+    std::unique_lock lock(m_mutex);
+    m_drained.wait_for(lock, std::chrono::seconds(1),
+                       [this] { return m_size == 0; });
+  }
+  std::lock_guard lock(m_write_mutex);
+  m_stderr->flush();
+}
+
+void Sink::set_pattern(const std::string &pattern) {
+  std::lock_guard lock(m_write_mutex);
+  m_stderr->set_pattern(pattern);
+}
+
+void Sink::set_formatter(std::unique_ptr<spdlog::formatter> formatter) {
+  std::lock_guard lock(m_write_mutex);
+  m_stderr->set_formatter(std::move(formatter));
+}
+
+void Sink::setFormat(Format format) {
+  std::lock_guard lock(m_write_mutex);
+  m_format = format;
+}
+
+void Sink::start(std::size_t queue_size) {
+  std::lock_guard lock(m_mutex);
+  if (m_async) {
+    return;
+  }
+  m_ring.resize(std::max<std::size_t>(queue_size, 1));
+  m_head = 0;
+  m_size = 0;
+  m_stopping = false;
+  m_async = true;
+  m_thread = std::thread([this] { run(); });
+}
+
+void Sink::stop() {
+  {
+    std::lock_guard lock(m_mutex);
+    if (!m_async) {
+      return;
+    }
+    m_stopping = true;
+  }
+  m_ready.notify_one();
+  m_thread.join();
+  std::lock_guard lock(m_mutex);
+  m_async = false;
+  m_ring.clear();
+  m_ring.shrink_to_fit();
+}
+
+void Sink::run() {
+  std::unique_lock lock(m_mutex);
+  for (;;) {
+    m_ready.wait(lock, [this] { return m_size > 0 || m_stopping; });
+    if (m_size == 0) {
+      return; // Stopping, and everything has been written
+    }
+    // Producers only append past the end, so the taken entries can be read
+    // without the lock
+    std::size_t head = m_head;
+    std::size_t count = m_size;
+    std::uint64_t dropped = m_dropped.load(std::memory_order_relaxed);
+    lock.unlock();
+
+    {
+      std::lock_guard write_lock(m_write_mutex);
+      std::string text;
+      for (std::size_t i = 0; i < count; ++i) {
+        const Entry &entry = m_ring[(head + i) % m_ring.size()];
+        text.assign(entry.text, entry.text_size);
+        if (entry.truncated) {
+          text += " [truncated]";
+        }
+        spdlog::details::log_msg msg(
+            entry.time, spdlog::source_loc{},
+            spdlog::string_view_t(entry.name, entry.name_size), entry.level,
+            text);
+        msg.thread_id = entry.thread_id;
+        write(msg);
+      }
+      if (dropped > m_reported_drops) {
+        std::string warning =
+            fmt::format("Log queue full, dropped {} messages",
+                        dropped - m_reported_drops);
+        m_reported_drops = dropped;
+        write(spdlog::details::log_msg("log", spdlog::level::warn, warning));
+      }
+    }
+
+    lock.lock();
+    m_head = (head + count) % m_ring.size();
+    m_size -= count;
+    if (m_size == 0) {
+      m_drained.notify_all();
+    }
+  }
+}
+
+void Sink::write(const spdlog::details::log_msg &msg) {
+  m_written.fetch_add(1, std::memory_order_relaxed);
+  if (m_format == Format::JSON) {
+    writeJson(msg);
+  } else {
+    m_stderr->log(msg);
+  }
+}
+
+static void append_json_string(std::string &out, std::string_view str) {
+  out += '"';
+  for (char c : str) {
+    switch (c) {
+    case '"':
+      out += "\\\"";
+      break;
+    case '\\':
+      out += "\\\\";
+      break;
+    case '\n':
+      out += "\\n";
+      break;
+    case '\r':
+      out += "\\r";
+      break;
+    case '\t':
+      out += "\\t";
+      break;
+    default:
+      if (static_cast<unsigned char>(c) < 0x20) {
+        fmt::format_to(std::back_inserter(out), "\\u{:04x}", c);
+      } else {
+        out += c;
+      }
+      break;
+    }
+  }
+  out += '"';
+}
+
+void Sink::writeJson(const spdlog::details::log_msg &msg) {
+  std::string line;
+  double time = std::chrono::duration<double>(msg.time.time_since_epoch())
+                    .count();
+  fmt::format_to(std::back_inserter(line), "{{\"time\":{:.6f},\"level\":",
+                 time);
+  spdlog::string_view_t level = spdlog::level::to_string_view(msg.level);
+  append_json_string(line, std::string_view(level.data(), level.size()));
+  line += ",\"logger\":";
+  append_json_string(line, std::string_view(msg.logger_name.data(),
+                                            msg.logger_name.size()));
+  fmt::format_to(std::back_inserter(line), ",\"thread\":{},\"msg\":",
+                 msg.thread_id);
+  append_json_string(line,
+                     std::string_view(msg.payload.data(), msg.payload.size()));
+  line += "}\n";
+  std::fwrite(line.data(), 1, line.size(), stderr);
+}
+
+static const std::shared_ptr<Sink> &sink() {
+  static std::shared_ptr<Sink> sink = std::make_shared<Sink>();
+  return sink;
+}
+
+std::shared_ptr<spdlog::logger> get(const std::string &name) {
+  if (std::shared_ptr<spdlog::logger> logger = spdlog::get(name)) {
+    return logger;
+  }
+  auto logger = std::make_shared<spdlog::logger>(name, sink());
+  // Applies levels loaded from the config and registers it
+  spdlog::initialize_logger(logger);
+  return logger;
+}
+
+void set_format(Format format) { sink()->setFormat(format); }
+
+void start_async(std::size_t queue_size) { sink()->start(queue_size); }
+
+void stop_async() { sink()->stop(); }
+
+std::uint64_t get_written() { return sink()->getWritten(); }
+
+std::uint64_t get_dropped() { return sink()->getDropped(); }
+
+bool RateLimiter::allow(std::uint64_t &suppressed) {
+  auto now = std::chrono::steady_clock::now();
+  if (m_last != std::chrono::steady_clock::time_point{}) {
+    double elapsed = std::chrono::duration<double>(now - m_last).count();
+    m_tokens = std::min(m_burst, m_tokens + elapsed * m_rate);
+  }
+  m_last = now;
+  if (m_tokens < 1) {
+    ++m_suppressed;
+    return false;
+  }
+  m_tokens -= 1;
+  suppressed = m_suppressed;
+  m_suppressed = 0;
+  return true;
+}
+
+} // namespace whatmud::log
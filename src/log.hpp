@@ -0,0 +1,96 @@
+#ifndef WHATMUD_LOG_HPP
+#define WHATMUD_LOG_HPP
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
+
+#include <spdlog/spdlog.h>
+
+namespace whatmud::log {
+
+enum class Format {
+  // spdlog's coloured text
+  TEXT,
+  // One JSON object per line, for log shippers
+  JSON,
+};
+
+/**
+ * Get the logger called `name`, creating it if needed.
+ * Every logger writes to stderr through one shared sink. By default that
+ * happens synchronously, on the thread that logs; see start_async().
+ */
+std::shared_ptr<spdlog::logger> get(const std::string &name);
+
+void set_format(Format format);
+
+/**
+ * Queue messages in a preallocated ring of `queue_size` entries and have a
+ * background thread write them, so a slow stderr can't stall the loop.
+ * Messages logged while the queue is full are dropped and counted, and
+ * messages are cut off at MAX_QUEUED_TEXT bytes.
+ */
+void start_async(std::size_t queue_size);
+// Write everything queued and go back to logging synchronously
+void stop_async();
+
+// Longest message kept whole in the queue
+inline constexpr std::size_t MAX_QUEUED_TEXT = 512;
+
+// Messages written, and dropped because the queue was full
+std::uint64_t get_written();
+std::uint64_t get_dropped();
+
+/**
+ * Limits how often one logging site can log, for messages a client or a bug
+ * could make spam. Declare one per site:
+ *
+ *   static log::RateLimiter limiter(10);
+ *   limiter.log(m_log, spdlog::level::info, "Got {}", thing);
+ *
+ * Up to `burst` messages go through at once, refilling at `per_second`.
+ * Messages over the limit are counted, and the next one logged says how many
+ * were suppressed. Not thread safe, each site must log from one thread.
+ */
+class RateLimiter {
+public:
+  RateLimiter(double per_second, double burst = 0)
+      : m_rate(per_second), m_burst(burst > 0 ? burst : per_second),
+        m_tokens(m_burst) {}
+
+  template <class... Args>
+  void log(const std::shared_ptr<spdlog::logger> &logger,
+           spdlog::level::level_enum level,
+           spdlog::format_string_t<Args...> fmt, Args &&...args) {
+    if (!logger->should_log(level)) {
+      return;
+    }
+    std::uint64_t suppressed;
+    if (!allow(suppressed)) {
+      return;
+    }
+    if (suppressed > 0) {
+      logger->log(level, "({} similar messages suppressed)", suppressed);
+    }
+    logger->log(level, fmt, std::forward<Args>(args)...);
+  }
+
+  // Take a token if there's one. On success `suppressed` is set to the
+  // messages refused since the last one allowed
+  bool allow(std::uint64_t &suppressed);
+
+private:
+  double m_rate;
+  double m_burst;
+  double m_tokens;
+  std::chrono::steady_clock::time_point m_last{};
+  std::uint64_t m_suppressed = 0;
+};
+
+} // namespace whatmud::log
+
+#endif
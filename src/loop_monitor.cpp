@@ -0,0 +1,132 @@
+#include <fmt/core.h>
+
+#include "engine.hpp"
+#include "log.hpp"
+#include "loop_monitor.hpp"
+#include "lua/helpers.hpp"
+#include "uv/error.hpp"
+
+namespace whatmud {
+
+LoopMonitor::LoopMonitor(Engine *engine)
+    : m_log(log::get("loop")), m_engine(engine),
+      m_prepare(engine->getLoop()), m_check(engine->getLoop()),
+      m_slow_iterations(engine->getMetrics().counter(
+          "whatmud_loop_slow_iterations_total",
+          "Event loop iterations that spent longer than the slow threshold "
+          "in callbacks")),
+      m_slow_resumes(engine->getMetrics().counter(
+          "whatmud_lua_slow_resumes_total",
+          "Lua resumes that ran longer than the slow threshold")) {
+  m_prepare.setData(this);
+  m_check.setData(this);
+  // Only measure the loop, never keep it running
+  m_prepare.unref();
+  m_check.unref();
+
+  int res = uv_loop_configure(engine->getLoop(), UV_METRICS_IDLE_TIME);
+  uv::check_error(res, "Could not enable event loop idle time");
+
+  Metrics &metrics = engine->getMetrics();
+  metrics.addHistogram("whatmud_loop_busy_seconds",
+                       "Time each event loop iteration spent running "
+                       "callbacks rather than waiting for events",
+                       m_busy);
+  metrics.addHistogram("whatmud_loop_poll_wait_seconds",
+                       "Time each event loop iteration spent waiting for "
+                       "events",
+                       m_poll_wait);
+}
+
+void LoopMonitor::setSlowThreshold(double ms) {
+  m_slow_ns = static_cast<std::uint64_t>(ms > 0 ? ms * 1e6 : 0);
+}
+
+void LoopMonitor::start() {
+  m_check_at = uv_hrtime();
+  m_prepare.start([](uv_prepare_t *handle) {
+    static_cast<LoopMonitor *>(handle->data)->onPrepare();
+  });
+  m_check.start([](uv_check_t *handle) {
+    static_cast<LoopMonitor *>(handle->data)->onCheck();
+  });
+}
+
+void LoopMonitor::onPrepare() {
+  // Since the last check: the rest of the check phase, closing handles,
+  // timers, pending callbacks and the prepare phase so far
+  m_prepare_at = uv_hrtime();
+  m_idle_at = uv_metrics_idle_time(m_engine->getLoop());
+  m_outside_poll = m_prepare_at - m_check_at;
+}
+
+void LoopMonitor::onCheck() {
+  std::uint64_t now = uv_hrtime();
+  std::uint64_t poll = now - m_prepare_at;
+  std::uint64_t wait = uv_metrics_idle_time(m_engine->getLoop()) - m_idle_at;
+  // IO callbacks run inside the poll phase, so poll time isn't all waiting
+  std::uint64_t busy = m_outside_poll + (poll > wait ? poll - wait : 0);
+  m_check_at = now;
+  m_busy.observe(busy);
+  m_poll_wait.observe(wait);
+
+  std::uint64_t lua_ns = m_lua_ns;
+  m_lua_ns = 0;
+  if (m_slow_ns == 0 || busy < m_slow_ns) {
+    return;
+  }
+  m_slow_iterations.inc();
+  if (mayWarn(now)) {
+    m_log->warn("Event loop blocked for {:.1f} ms, {:.1f} ms of it running "
+                "Lua coroutines",
+                busy / 1e6, lua_ns / 1e6);
+  }
+}
+
+void LoopMonitor::onResume(lua_State *L, lua_State *co, int status,
+                           std::uint64_t ns, int fn_index, bool outermost) {
+  if (outermost) {
+    m_lua_ns += ns;
+  }
+  if (m_slow_ns == 0 || ns < m_slow_ns) {
+    return;
+  }
+  m_slow_resumes.inc();
+  if (!mayWarn(uv_hrtime())) {
+    return;
+  }
+
+  if (status != LUA_OK) {
+    // Still suspended or failed, so its stack shows where it got to
+    luaL_traceback(L, co, nullptr, 0);
+  } else if (fn_index != 0) {
+    // Finished: name the function it was started with
+    lua_Debug ar;
+    lua_pushvalue(L, fn_index);
+    lua_getinfo(L, ">S", &ar);
+    lua_pushfstring(L, "coroutine started at %s:%d, since finished",
+                    ar.short_src, ar.linedefined);
+  } else {
+    lua_pushliteral(L, "coroutine has since finished");
+  }
+  std::string_view where;
+  lua::get(L, -1, where);
+  m_log->warn("Lua coroutine ran for {:.1f} ms in one resume: {}", ns / 1e6,
+              where);
+  lua_pop(L, 1);
+}
+
+bool LoopMonitor::mayWarn(std::uint64_t now) {
+  if (m_last_warning != 0 && now - m_last_warning < WARN_INTERVAL_NS) {
+    ++m_suppressed;
+    return false;
+  }
+  if (m_suppressed > 0) {
+    m_log->warn("{} more slow warnings were suppressed", m_suppressed);
+    m_suppressed = 0;
+  }
+  m_last_warning = now;
+  return true;
+}
+
+} // namespace whatmud
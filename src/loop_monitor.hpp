@@ -0,0 +1,93 @@
+#ifndef WHATMUD_LOOP_MONITOR_HPP
+#define WHATMUD_LOOP_MONITOR_HPP
+
+#include <cstdint>
+#include <memory>
+#include <string_view>
+
+#include <lua.hpp>
+#include <spdlog/spdlog.h>
+
+#include "histogram.hpp"
+#include "metrics.hpp"
+#include "uv/check.hpp"
+#include "uv/prepare.hpp"
+
+namespace whatmud {
+
+// Forward declarations:
+class Engine;
+
+/**
+ * Measures where each event loop iteration spends its time.
+ * A prepare handle runs just before the loop polls for IO and a check handle
+ * just after, and libuv's idle time metric says how much of the poll was
+ * spent waiting in the kernel. Everything else is time spent in callbacks,
+ * during which no other client is served.
+ *
+ * Iterations and Lua resumes that run longer than the slow threshold are
+ * logged, resumes with a traceback of the coroutine responsible.
+ */
+class LoopMonitor {
+public:
+  // Least time between slow warnings, extra ones are counted and summarised
+  static constexpr std::uint64_t WARN_INTERVAL_NS = 1'000'000'000;
+
+  LoopMonitor(Engine *engine);
+
+  // No copy
+  LoopMonitor(const LoopMonitor &) = delete;
+  LoopMonitor &operator=(const LoopMonitor &) = delete;
+
+  void setSlowThreshold(double ms);
+
+  void start();
+
+  /**
+   * Called by Engine::resume() once `co` has run for `ns`. `fn_index` is the
+   * index on L of the function a new coroutine was started with, or 0.
+   * `outermost` is false for coroutines resumed from inside another resume,
+   * whose time has already been counted.
+   */
+  void onResume(lua_State *L, lua_State *co, int status, std::uint64_t ns,
+                int fn_index, bool outermost);
+
+private:
+  void onPrepare();
+  void onCheck();
+
+  // Whether a warning may be logged now. Counts the ones that can't
+  bool mayWarn(std::uint64_t now);
+
+private:
+  std::shared_ptr<spdlog::logger> m_log;
+  Engine *m_engine;
+  uv::Prepare m_prepare;
+  uv::Check m_check;
+  std::uint64_t m_slow_ns = 50'000'000;
+
+  // uv_hrtime() when the last check and prepare callbacks ran, and the
+  // loop's idle time at the last prepare
+  std::uint64_t m_check_at = 0;
+  std::uint64_t m_prepare_at = 0;
+  std::uint64_t m_idle_at = 0;
+  // Time spent outside the poll phase since the last check, and in Lua
+  // during this iteration
+  std::uint64_t m_outside_poll = 0;
+  std::uint64_t m_lua_ns = 0;
+
+  std::uint64_t m_last_warning = 0;
+  std::uint64_t m_suppressed = 0;
+
+  // Callback time per iteration, which is how long an event can wait
+  // before it's handled
+  Histogram m_busy;
+  // Time spent waiting for events per iteration
+  Histogram m_poll_wait;
+  Counter &m_slow_iterations;
+  Counter &m_slow_resumes;
+};
+
+} // namespace whatmud
+
+#endif
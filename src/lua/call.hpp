@@ -0,0 +1,67 @@
+#ifndef WHATMUD_LUA_CALL_HPP
+#define WHATMUD_LUA_CALL_HPP
+
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+#include <lua.hpp>
+
+#include "lua/error.hpp"
+#include "lua/ref.hpp"
+#include "lua/stack.hpp"
+
+namespace whatmud::lua {
+
+template <class... Args> void push_all(lua_State *L, Args &&...args) {
+  (push(L, std::forward<Args>(args)), ...);
+}
+
+/**
+ * Call the function referenced by `fn` with the given arguments in protected
+ * mode, and return its first result converted with get().
+ * Errors are rethrown as lua::Error, with a traceback.
+ */
+template <class R = void, class... Args>
+R call(lua_State *L, const Ref &fn, Args &&...args) {
+  // A string_view or C string would point into a value we're about to pop
+  static_assert(!std::is_same_v<R, std::string_view> &&
+                    !std::is_same_v<R, const char *>,
+                "Use std::string for string results");
+  constexpr int nresults = std::is_void_v<R> ? 0 : 1;
+
+  lua_pushcfunction(L, traceback);
+  int msgh = lua_gettop(L);
+  fn.push(L);
+  push_all(L, std::forward<Args>(args)...);
+  int res = lua_pcall(L, sizeof...(Args), nresults, msgh);
+  if (res != LUA_OK) {
+    Error err(L, "Error calling Lua function");
+    lua_pop(L, 2); // Pop error and message handler
+    throw err;
+  }
+
+  if constexpr (std::is_void_v<R>) {
+    lua_pop(L, 1); // Pop message handler
+  } else {
+    R val;
+    get(L, -1, val);
+    lua_pop(L, 2); // Pop result and message handler
+    return val;
+  }
+}
+
+/**
+ * Resume a coroutine with the given arguments. Returns the lua_resume()
+ * status, leaving the coroutine's results or error on its stack.
+ */
+template <class... Args>
+int resume(lua_State *co, lua_State *from, int &nresults, Args &&...args) {
+  push_all(co, std::forward<Args>(args)...);
+  return lua_resume(co, from, sizeof...(Args), &nresults);
+}
+
+} // namespace whatmud::lua
+
+#endif
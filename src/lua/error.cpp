@@ -29,4 +29,14 @@ int on_error(lua_State *L) {
   throw err;
 }
 
+int traceback(lua_State *L) {
+  const char *msg = lua_tostring(L, 1);
+  if (msg == nullptr) {
+    // Non-string error object, use its __tostring if it has one
+    msg = luaL_tolstring(L, 1, nullptr);
+  }
+  luaL_traceback(L, L, msg, 1);
+  return 1;
+}
+
 } // namespace whatmud::lua
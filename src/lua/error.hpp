@@ -21,6 +21,9 @@ private:
 
 int on_error(lua_State *L);
 
+// Message handler for lua_pcall(), appends a traceback to the error message
+int traceback(lua_State *L);
+
 } // namespace whatmud::lua
 
 #endif
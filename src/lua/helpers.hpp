@@ -3,8 +3,10 @@
 
 #include <lua.hpp>
 
+#include "lua/call.hpp"
 #include "lua/error.hpp"
 #include "lua/nil.hpp"
+#include "lua/ref.hpp"
 #include "lua/stack.hpp"
 #include "lua/state.hpp"
 #include "lua/table_view.hpp"
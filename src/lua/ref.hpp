@@ -0,0 +1,70 @@
+#ifndef WHATMUD_LUA_REF_HPP
+#define WHATMUD_LUA_REF_HPP
+
+#include <lua.hpp>
+
+namespace whatmud::lua {
+
+/**
+ * An owning reference to a Lua value, stored in the registry with luaL_ref.
+ * Pushing a Ref is a single array lookup, instead of hashing a string key
+ * every time an engine-owned Lua object is needed.
+ */
+class Ref {
+public:
+  Ref() : L(nullptr), m_ref(LUA_NOREF) {}
+  // Pops the value on top of the stack and takes a reference to it
+  explicit Ref(lua_State *state) : L(nullptr), m_ref(LUA_NOREF) {
+    // Hold on to the main thread, `state` may be a coroutine that dies first
+    lua_rawgeti(state, LUA_REGISTRYINDEX, LUA_RIDX_MAINTHREAD);
+    L = lua_tothread(state, -1);
+    lua_pop(state, 1);
+    m_ref = luaL_ref(state, LUA_REGISTRYINDEX);
+  }
+
+  // No copy
+  Ref(const Ref &) = delete;
+  Ref &operator=(const Ref &) = delete;
+
+  Ref(Ref &&r) : L(r.L), m_ref(r.m_ref) { r.m_ref = LUA_NOREF; }
+  Ref &operator=(Ref &&r) {
+    if (this != &r) {
+      reset();
+      L = r.L;
+      m_ref = r.m_ref;
+      r.m_ref = LUA_NOREF;
+    }
+    return *this;
+  }
+
+  ~Ref() { reset(); }
+
+  // Push the referenced value onto the stack of `state`, which must belong to
+  // the same Lua state the reference was created in
+  int push(lua_State *state) const {
+    return lua_rawgeti(state, LUA_REGISTRYINDEX, m_ref);
+  }
+
+  bool isValid() const { return m_ref != LUA_NOREF && m_ref != LUA_REFNIL; }
+  explicit operator bool() const { return isValid(); }
+
+  int get() const { return m_ref; }
+
+  // Release the reference, allowing the value to be garbage collected
+  void reset() {
+    if (L != nullptr && m_ref != LUA_NOREF) {
+      luaL_unref(L, LUA_REGISTRYINDEX, m_ref);
+    }
+    m_ref = LUA_NOREF;
+  }
+
+private:
+  lua_State *L;
+  int m_ref;
+};
+
+static inline void push(lua_State *L, const Ref &val) { val.push(L); }
+
+} // namespace whatmud::lua
+
+#endif
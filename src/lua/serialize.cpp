@@ -0,0 +1,249 @@
+#include <cstdint>
+#include <cstring>
+
+#include "lua/serialize.hpp"
+
+namespace whatmud::lua {
+
+// Nesting depth limit, protects the C stack from deeply nested tables
+static constexpr int MAX_DEPTH = 200;
+
+enum Tag : unsigned char {
+  TAG_NIL,
+  TAG_FALSE,
+  TAG_TRUE,
+  TAG_INTEGER,
+  TAG_FLOAT,
+  TAG_STRING,
+  TAG_TABLE,     // Followed by key / value pairs, then TAG_TABLE_END
+  TAG_TABLE_END,
+  TAG_TABLE_REF, // Reference to an already serialized table, by number
+};
+
+namespace {
+
+struct Writer {
+  std::string *out;
+  // Stack index of the table mapping already written tables to their number
+  int seen;
+  lua_Integer next_id;
+};
+
+struct Reader {
+  const char *pos;
+  const char *end;
+  // Stack index of the table mapping table numbers to tables
+  int seen;
+  lua_Integer next_id;
+};
+
+} // namespace
+
+static void writeVarint(std::string &out, std::uint64_t val) {
+  while (val >= 0x80) {
+    out += static_cast<char>((val & 0x7F) | 0x80);
+    val >>= 7;
+  }
+  out += static_cast<char>(val);
+}
+
+template <class T> static void writeRaw(std::string &out, T val) {
+  char buf[sizeof(T)];
+  std::memcpy(buf, &val, sizeof(T));
+  out.append(buf, sizeof(T));
+}
+
+static void writeValue(lua_State *L, Writer &w, int index, int depth) {
+  std::string &out = *w.out;
+  switch (lua_type(L, index)) {
+  case LUA_TNIL:
+    out += static_cast<char>(TAG_NIL);
+    break;
+  case LUA_TBOOLEAN:
+    out += static_cast<char>(lua_toboolean(L, index) ? TAG_TRUE : TAG_FALSE);
+    break;
+  case LUA_TNUMBER:
+    if (lua_isinteger(L, index)) {
+      out += static_cast<char>(TAG_INTEGER);
+      writeRaw(out, static_cast<std::int64_t>(lua_tointeger(L, index)));
+    } else {
+      out += static_cast<char>(TAG_FLOAT);
+      writeRaw(out, static_cast<double>(lua_tonumber(L, index)));
+    }
+    break;
+  case LUA_TSTRING: {
+    std::size_t len;
+    const char *str = lua_tolstring(L, index, &len);
+    out += static_cast<char>(TAG_STRING);
+    writeVarint(out, len);
+    out.append(str, len);
+    break;
+  }
+  case LUA_TTABLE: {
+    if (depth >= MAX_DEPTH) {
+      luaL_error(L, "cannot serialize: tables nested too deeply");
+    }
+    index = lua_absindex(L, index);
+    lua_pushvalue(L, index);
+    if (lua_rawget(L, w.seen) == LUA_TNUMBER) {
+      out += static_cast<char>(TAG_TABLE_REF);
+      writeVarint(out, lua_tointeger(L, -1));
+      lua_pop(L, 1);
+      break;
+    }
+    lua_pop(L, 1);
+    lua_pushvalue(L, index);
+    lua_pushinteger(L, w.next_id++);
+    lua_rawset(L, w.seen);
+
+    luaL_checkstack(L, 3, "cannot serialize: out of stack space");
+    out += static_cast<char>(TAG_TABLE);
+    lua_pushnil(L);
+    while (lua_next(L, index)) {
+      writeValue(L, w, -2, depth + 1);
+      writeValue(L, w, -1, depth + 1);
+      lua_pop(L, 1);
+    }
+    out += static_cast<char>(TAG_TABLE_END);
+    break;
+  }
+  default:
+    luaL_error(L, "cannot serialize a %s value", luaL_typename(L, index));
+  }
+}
+
+static std::uint64_t readVarint(lua_State *L, Reader &r) {
+  std::uint64_t val = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    if (r.pos == r.end) {
+      break;
+    }
+    auto byte = static_cast<unsigned char>(*r.pos++);
+    val |= static_cast<std::uint64_t>(byte & 0x7F) << shift;
+    if (!(byte & 0x80)) {
+      return val;
+    }
+  }
+  luaL_error(L, "cannot deserialize: truncated or invalid length");
+  return 0;
+}
+
+template <class T> static T readRaw(lua_State *L, Reader &r) {
+  if (static_cast<std::size_t>(r.end - r.pos) < sizeof(T)) {
+    luaL_error(L, "cannot deserialize: truncated number");
+  }
+  T val;
+  std::memcpy(&val, r.pos, sizeof(T));
+  r.pos += sizeof(T);
+  return val;
+}
+
+// Reads one value and pushes it. Returns false without pushing anything when
+// TAG_TABLE_END is read
+static bool readValue(lua_State *L, Reader &r, int depth) {
+  if (r.pos == r.end) {
+    luaL_error(L, "cannot deserialize: unexpected end of data");
+  }
+  if (depth >= MAX_DEPTH) {
+    luaL_error(L, "cannot deserialize: tables nested too deeply");
+  }
+  luaL_checkstack(L, 3, "cannot deserialize: out of stack space");
+  switch (static_cast<unsigned char>(*r.pos++)) {
+  case TAG_NIL:
+    lua_pushnil(L);
+    break;
+  case TAG_FALSE:
+    lua_pushboolean(L, false);
+    break;
+  case TAG_TRUE:
+    lua_pushboolean(L, true);
+    break;
+  case TAG_INTEGER:
+    lua_pushinteger(L, readRaw<std::int64_t>(L, r));
+    break;
+  case TAG_FLOAT:
+    lua_pushnumber(L, readRaw<double>(L, r));
+    break;
+  case TAG_STRING: {
+    std::uint64_t len = readVarint(L, r);
+    if (static_cast<std::uint64_t>(r.end - r.pos) < len) {
+      luaL_error(L, "cannot deserialize: truncated string");
+    }
+    lua_pushlstring(L, r.pos, len);
+    r.pos += len;
+    break;
+  }
+  case TAG_TABLE: {
+    lua_newtable(L);
+    lua_pushvalue(L, -1);
+    lua_rawseti(L, r.seen, r.next_id++);
+    while (readValue(L, r, depth + 1)) {
+      if (!readValue(L, r, depth + 1)) {
+        luaL_error(L, "cannot deserialize: table key without a value");
+      }
+      lua_rawset(L, -3);
+    }
+    break;
+  }
+  case TAG_TABLE_END:
+    return false;
+  case TAG_TABLE_REF:
+    if (lua_rawgeti(L, r.seen, readVarint(L, r)) != LUA_TTABLE) {
+      luaL_error(L, "cannot deserialize: bad table reference");
+    }
+    break;
+  default:
+    luaL_error(L, "cannot deserialize: unknown tag %d", (int)r.pos[-1]);
+  }
+  return true;
+}
+
+// Protected halves of serialize() and deserialize()
+// Upvalue 1 is the Writer / Reader, the stack holds the values to process
+static int doSerialize(lua_State *L) {
+  auto *w = static_cast<Writer *>(lua_touserdata(L, lua_upvalueindex(1)));
+  int count = lua_gettop(L);
+  lua_newtable(L);
+  w->seen = lua_gettop(L);
+  for (int i = 1; i <= count; ++i) {
+    writeValue(L, *w, i, 0);
+  }
+  return 0;
+}
+
+static int doDeserialize(lua_State *L) {
+  auto *r = static_cast<Reader *>(lua_touserdata(L, lua_upvalueindex(1)));
+  lua_newtable(L);
+  r->seen = lua_gettop(L);
+  while (r->pos != r->end) {
+    if (!readValue(L, *r, 0)) {
+      luaL_error(L, "cannot deserialize: unbalanced table end");
+    }
+  }
+  return lua_gettop(L) - r->seen;
+}
+
+bool serialize(lua_State *L, int first, int count, std::string &out) {
+  first = lua_absindex(L, first);
+  Writer w{&out, 0, 1};
+  luaL_checkstack(L, count + 2, "cannot serialize: too many values");
+  lua_pushlightuserdata(L, &w);
+  lua_pushcclosure(L, doSerialize, 1);
+  for (int i = 0; i < count; ++i) {
+    lua_pushvalue(L, first + i);
+  }
+  return lua_pcall(L, count, 0, 0) == LUA_OK;
+}
+
+int deserialize(lua_State *L, std::string_view data) {
+  Reader r{data.data(), data.data() + data.size(), 0, 1};
+  int top = lua_gettop(L);
+  lua_pushlightuserdata(L, &r);
+  lua_pushcclosure(L, doDeserialize, 1);
+  if (lua_pcall(L, 0, LUA_MULTRET, 0) != LUA_OK) {
+    return -1;
+  }
+  return lua_gettop(L) - top;
+}
+
+} // namespace whatmud::lua
@@ -0,0 +1,28 @@
+#ifndef WHATMUD_LUA_SERIALIZE_HPP
+#define WHATMUD_LUA_SERIALIZE_HPP
+
+#include <string>
+#include <string_view>
+
+#include <lua.hpp>
+
+namespace whatmud::lua {
+
+/**
+ * Serialize `count` values starting at stack index `first`, appending them to
+ * `out` in a compact binary format. Supports nil, booleans, numbers, strings
+ * and tables of those, including shared and cyclic table references.
+ * Runs in protected mode: on failure, returns false and leaves an error
+ * message on top of the stack.
+ */
+bool serialize(lua_State *L, int first, int count, std::string &out);
+
+/**
+ * Push every value serialized in `data`. Returns the number of values pushed,
+ * or -1 on failure with an error message on top of the stack.
+ */
+int deserialize(lua_State *L, std::string_view data);
+
+} // namespace whatmud::lua
+
+#endif
@@ -17,6 +17,18 @@ namespace whatmud::lua {
 // Todo: Determine this at configure-time?
 inline constexpr std::size_t MIN_USERDATA_ALIGNMENT = 16;
 
+// Types that want methods callable from Lua declare a `LUA_METHODS` array,
+// terminated by {nullptr, nullptr}, which is installed as the metatable's
+// __index
+template <class T>
+concept HasLuaMethods = requires { T::LUA_METHODS; };
+
+// Types can also declare `LUA_METAMETHODS`, set directly in the metatable.
+// These take precedence over LUA_METHODS, so a type defining __index handles
+// method lookup itself
+template <class T>
+concept HasLuaMetamethods = requires { T::LUA_METAMETHODS; };
+
 template <class T> constexpr std::string get_mt_name() {
   return fmt::format("mt.{}", whatmud::type_id<T>());
 }
@@ -50,6 +62,15 @@ template <class T> void make_metatable(lua_State *L) {
     });
     lua_rawset(L, -3);
   }
+  if constexpr (HasLuaMethods<T>) {
+    lua_pushliteral(L, "__index");
+    lua_newtable(L);
+    luaL_setfuncs(L, T::LUA_METHODS, 0);
+    lua_rawset(L, -3);
+  }
+  if constexpr (HasLuaMetamethods<T>) {
+    luaL_setfuncs(L, T::LUA_METAMETHODS, 0);
+  }
   // Todo: Add more metatable fields automatically (E.G. __add for types that
   // implement operator+(), etc)
 }
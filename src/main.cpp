@@ -1,5 +1,7 @@
 #include <cstdlib>
+#include <string>
 #include <string_view>
+#include <vector>
 
 #include <fmt/core.h>
 #include <spdlog/cfg/argv.h>
@@ -11,7 +13,9 @@ namespace lua = whatmud::lua;
 [[noreturn]] void usage(char *argv[], const char *errmsg) {
   const char *prog = argv[0] ? argv[0] : "whatmud";
   fmt::print(stderr, "Error: {}\n", errmsg);
-  fmt::print(stderr, "Usage: {} [SPDLOG_LEVEL=<log-level>] <game-directory>\n",
+  fmt::print(stderr,
+             "Usage: {} [SPDLOG_LEVEL=<log-level>] [--copyover <state-file>] "
+             "<game-directory>\n",
              prog);
   std::exit(EXIT_FAILURE);
 }
@@ -21,8 +25,19 @@ int main(int argc, char **argv) {
   argv = uv_setup_args(argc, argv);
 
   const char *game_dir = nullptr;
+  const char *copyover_state = nullptr;
+  // Arguments to restart with on copyover
+  std::vector<std::string> args;
   for (int i = 1; i < argc; ++i) {
     std::string_view arg(argv[i]);
+    if (arg == "--copyover") {
+      if (++i == argc) {
+        usage(argv, "--copyover needs a state file");
+      }
+      copyover_state = argv[i];
+      continue;
+    }
+    args.emplace_back(arg);
     if (arg.starts_with("SPDLOG_LEVEL=")) {
       continue;
     }
@@ -40,6 +55,10 @@ int main(int argc, char **argv) {
   // This has to happen after engine construction to ensure command line params
   // override the Lua config
   spdlog::cfg::load_argv_levels(argc, argv);
+  engine.getCopyover()->setArguments(std::move(args));
+  if (copyover_state != nullptr) {
+    engine.getCopyover()->restore(copyover_state);
+  }
   engine.run();
   return EXIT_SUCCESS;
 }
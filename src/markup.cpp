@@ -0,0 +1,330 @@
+#include <charconv>
+#include <limits>
+
+#include <fmt/format.h>
+
+#include "connection.hpp"
+#include "lua/helpers.hpp"
+#include "markup.hpp"
+#include "text.hpp"
+
+namespace whatmud {
+
+// xterm's default palette, used to approximate RGB colours
+static constexpr std::uint8_t PALETTE[16][3]{
+    {0, 0, 0},       {205, 0, 0},     {0, 205, 0},     {205, 205, 0},
+    {0, 0, 238},     {205, 0, 205},   {0, 205, 205},   {229, 229, 229},
+    {127, 127, 127}, {255, 0, 0},     {0, 255, 0},     {255, 255, 0},
+    {92, 92, 255},   {255, 0, 255},   {0, 255, 255},   {255, 255, 255}};
+
+static constexpr std::string_view COLOUR_NAMES[8]{
+    "black", "red", "green", "yellow", "blue", "magenta", "cyan", "white"};
+// Single letter codes, in palette order
+static constexpr std::string_view COLOUR_LETTERS = "krgybmcw";
+
+static int distanceSq(int r, int g, int b, int r2, int g2, int b2) {
+  return (r - r2) * (r - r2) + (g - g2) * (g - g2) + (b - b2) * (b - b2);
+}
+
+static std::uint8_t nearest16(const Markup::Colour &c) {
+  std::uint8_t best = 0;
+  int best_dist = std::numeric_limits<int>::max();
+  for (std::uint8_t i = 0; i < 16; ++i) {
+    int dist =
+        distanceSq(c.r, c.g, c.b, PALETTE[i][0], PALETTE[i][1], PALETTE[i][2]);
+    if (dist < best_dist) {
+      best = i;
+      best_dist = dist;
+    }
+  }
+  return best;
+}
+
+// Steps of the xterm 6x6x6 colour cube
+static constexpr std::uint8_t CUBE_STEPS[6]{0, 95, 135, 175, 215, 255};
+
+static int cubeIndex(std::uint8_t v) {
+  return v < 48 ? 0 : v < 115 ? 1 : (v - 35) / 40;
+}
+
+static std::uint8_t nearest256(const Markup::Colour &c) {
+  int r = cubeIndex(c.r), g = cubeIndex(c.g), b = cubeIndex(c.b);
+  int cube_dist = distanceSq(c.r, c.g, c.b, CUBE_STEPS[r], CUBE_STEPS[g],
+                             CUBE_STEPS[b]);
+  // The greyscale ramp, 232 - 255, is 8, 18 ... 238
+  int avg = (c.r + c.g + c.b) / 3;
+  int grey = avg > 238 ? 23 : avg < 8 ? 0 : (avg - 3) / 10;
+  int level = 8 + grey * 10;
+  int grey_dist = distanceSq(c.r, c.g, c.b, level, level, level);
+  if (grey_dist < cube_dist) {
+    return static_cast<std::uint8_t>(232 + grey);
+  }
+  return static_cast<std::uint8_t>(16 + 36 * r + 6 * g + b);
+}
+
+Markup::Markup(std::string_view source) { compile(source); }
+
+bool Markup::parseCode(std::string_view code, Token &token) {
+  token.type = Token::FG;
+  if (code.starts_with("bg:")) {
+    token.type = Token::BG;
+    code.remove_prefix(3);
+  }
+
+  if (code.size() == 7 && code[0] == '#') {
+    unsigned rgb;
+    auto res = std::from_chars(code.data() + 1, code.data() + 7, rgb, 16);
+    if (res.ec != std::errc() || res.ptr != code.data() + 7) {
+      return false;
+    }
+    token.colour = Colour{Colour::RGB, 0, static_cast<std::uint8_t>(rgb >> 16),
+                          static_cast<std::uint8_t>(rgb >> 8),
+                          static_cast<std::uint8_t>(rgb)};
+    return true;
+  }
+
+  if (token.type == Token::FG) {
+    if (code == "x" || code == "reset") {
+      token.type = Token::RESET;
+      return true;
+    } else if (code == "bold") {
+      token.type = Token::BOLD;
+      return true;
+    } else if (code == "underline") {
+      token.type = Token::UNDERLINE;
+      return true;
+    }
+  }
+
+  std::uint8_t bright = 0;
+  std::size_t index = std::string_view::npos;
+  if (code.size() == 1) {
+    char c = code[0];
+    if (c >= 'A' && c <= 'Z') {
+      bright = 8;
+      c = static_cast<char>(c - 'A' + 'a');
+    }
+    index = COLOUR_LETTERS.find(c);
+  } else {
+    if (code.starts_with("bright_")) {
+      bright = 8;
+      code.remove_prefix(7);
+    }
+    for (std::size_t i = 0; i < 8; ++i) {
+      if (code == COLOUR_NAMES[i]) {
+        index = i;
+      }
+    }
+  }
+  if (index == std::string_view::npos) {
+    return false;
+  }
+  std::uint8_t palette = static_cast<std::uint8_t>(index + bright);
+  token.colour = Colour{Colour::NAMED, palette, PALETTE[palette][0],
+                        PALETTE[palette][1], PALETTE[palette][2]};
+  return true;
+}
+
+void Markup::compile(std::string_view source) {
+  m_text.reserve(source.size());
+  std::size_t run_start = 0;
+  auto endRun = [&] {
+    if (m_text.size() > run_start) {
+      Token text{Token::TEXT, {}, static_cast<std::uint32_t>(run_start),
+                 static_cast<std::uint32_t>(m_text.size() - run_start)};
+      m_tokens.push_back(text);
+    }
+    run_start = m_text.size();
+  };
+
+  for (std::size_t i = 0; i < source.size();) {
+    std::size_t brace = source.find('{', i);
+    if (brace == std::string_view::npos) {
+      m_text.append(source.substr(i));
+      break;
+    }
+    m_text.append(source.substr(i, brace - i));
+    if (brace + 1 < source.size() && source[brace + 1] == '{') {
+      m_text += '{';
+      i = brace + 2;
+      continue;
+    }
+    std::size_t close = source.find('}', brace);
+    Token token{};
+    if (close == std::string_view::npos ||
+        !parseCode(source.substr(brace + 1, close - brace - 1), token)) {
+      m_text += '{';
+      i = brace + 1;
+      continue;
+    }
+    endRun();
+    m_tokens.push_back(token);
+    i = close + 1;
+  }
+  endRun();
+}
+
+const std::string &Markup::render(Features features) {
+  unsigned cls = features.getCapabilityClass();
+  if (!(m_rendered_mask & (1u << cls))) {
+    m_rendered[cls] = renderUncached(features);
+    m_rendered_mask |= static_cast<std::uint8_t>(1u << cls);
+  }
+  return m_rendered[cls];
+}
+
+// Append SGR parameters selecting a colour
+static void appendColour(std::string &params, const Markup::Colour &c,
+                         bool background, ColourDepth depth) {
+  if (!params.empty()) {
+    params += ';';
+  }
+  int base = background ? 40 : 30;
+  if (c.kind == Markup::Colour::NAMED || depth == ColourDepth::ANSI16) {
+    std::uint8_t index =
+        c.kind == Markup::Colour::NAMED ? c.index : nearest16(c);
+    fmt::format_to(std::back_inserter(params), "{}",
+                   index < 8 ? base + index : base + 60 + index - 8);
+  } else if (depth == ColourDepth::XTERM256) {
+    fmt::format_to(std::back_inserter(params), "{};5;{}", base + 8,
+                   nearest256(c));
+  } else {
+    fmt::format_to(std::back_inserter(params), "{};2;{};{};{}", base + 8, c.r,
+                   c.g, c.b);
+  }
+}
+
+// Append text, transliterated for clients that can't display UTF-8
+static void appendText(std::string &out, std::string_view text, bool utf8) {
+  if (utf8 || is_ascii(text)) {
+    out.append(text);
+  } else {
+    transliterate_ascii(text, out);
+  }
+}
+
+std::string Markup::renderUncached(Features features) const {
+  std::string out;
+  out.reserve(m_text.size() + m_tokens.size() * 8);
+  std::string params;
+  bool styled = false;
+  for (const Token &token : m_tokens) {
+    if (token.type == Token::TEXT) {
+      if (!params.empty()) {
+        fmt::format_to(std::back_inserter(out), "\x1b[{}m", params);
+        params.clear();
+      }
+      std::string_view text(m_text.data() + token.offset, token.length);
+      appendText(out, text, features.utf8);
+      continue;
+    }
+    if (features.colour == ColourDepth::NONE) {
+      continue;
+    }
+    switch (token.type) {
+    case Token::FG:
+    case Token::BG:
+      appendColour(params, token.colour, token.type == Token::BG,
+                   features.colour);
+      styled = true;
+      break;
+    case Token::BOLD:
+      params += params.empty() ? "1" : ";1";
+      styled = true;
+      break;
+    case Token::UNDERLINE:
+      params += params.empty() ? "4" : ";4";
+      styled = true;
+      break;
+    case Token::RESET:
+      // Earlier codes in the same sequence would be undone anyway
+      params = "0";
+      break;
+    case Token::TEXT:
+      break;
+    }
+  }
+  // Don't let colours bleed into whatever is sent next
+  if (styled) {
+    out += "\x1b[0m";
+  }
+  return out;
+}
+
+// Lua library
+
+// markup:render([connection]) -> string
+// Without a connection, renders for a 16 colour UTF-8 client
+static int l_render(lua_State *L) {
+  auto *markup = lua::check_userdata<Markup>(L, 1);
+  Features features;
+  if (!lua_isnoneornil(L, 2)) {
+    features = lua::check_userdata<Connection>(L, 2)->getFeatures();
+  }
+  lua::push(L, markup->render(features));
+  return 1;
+}
+
+// markup:text() -> the text without markup
+static int l_text(lua_State *L) {
+  auto *markup = lua::check_userdata<Markup>(L, 1);
+  lua::push(L, markup->getText());
+  return 1;
+}
+
+const luaL_Reg Markup::LUA_METHODS[]{
+    {"render", l_render}, {"text", l_text}, {nullptr, nullptr}};
+
+// #markup is the length of the plain text
+static int l_len(lua_State *L) {
+  auto *markup = lua::check_userdata<Markup>(L, 1);
+  lua_pushinteger(L, static_cast<lua_Integer>(markup->getText().size()));
+  return 1;
+}
+
+const luaL_Reg Markup::LUA_METAMETHODS[]{
+    {"__tostring", l_text}, {"__len", l_len}, {nullptr, nullptr}};
+
+// markup.compile(str) -> Markup
+// Compiled markup is interned, so compiling the same string again is a table
+// lookup and reuses its rendered output
+static int l_compile(lua_State *L) {
+  luaL_checkstring(L, 1);
+  lua_settop(L, 1);
+  lua_pushvalue(L, 1);
+  if (lua_rawget(L, lua_upvalueindex(1)) == LUA_TUSERDATA) {
+    return 1;
+  }
+  lua_pop(L, 1);
+  std::string_view source;
+  lua::get(L, 1, source);
+  lua::new_userdata_uv<Markup>(L, 0, source);
+  lua_pushvalue(L, 1);
+  lua_pushvalue(L, -2);
+  lua_rawset(L, lua_upvalueindex(1));
+  return 1;
+}
+
+// markup.strip(str) -> the text without markup
+static int l_strip(lua_State *L) {
+  std::string_view source;
+  lua::arg(L, 1, source);
+  lua::push(L, Markup(source).getText());
+  return 1;
+}
+
+int Markup::luaopen(lua_State *L) {
+  static const luaL_Reg funcs[]{
+      {"compile", l_compile}, {"strip", l_strip}, {nullptr, nullptr}};
+  luaL_newlibtable(L, funcs);
+  // Interned markup, collected once nothing else refers to it
+  lua_newtable(L);
+  lua_createtable(L, 0, 1);
+  lua_pushliteral(L, "v");
+  lua_setfield(L, -2, "__mode");
+  lua_setmetatable(L, -2);
+  luaL_setfuncs(L, funcs, 1);
+  return 1;
+}
+
+} // namespace whatmud
@@ -0,0 +1,84 @@
+#ifndef WHATMUD_MARKUP_HPP
+#define WHATMUD_MARKUP_HPP
+
+#include <array>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <lua.hpp>
+
+#include "features.hpp"
+
+namespace whatmud {
+
+/**
+ * Text with colour markup, compiled once into a token stream.
+ *
+ * Markup codes are written in braces:
+ *   {r} {g} {y} {b} {m} {c} {w} {k}   normal colours, {R}, {G}... for bright
+ *   {red} {bright_red} ...            the same colours by name
+ *   {#ff8800}                         any colour, approximated if need be
+ *   {bg:blue} {bg:#002040}            background colours
+ *   {bold} {underline}                text attributes
+ *   {x} {reset}                       back to plain text
+ * "{{" is a literal brace. Anything else in braces is left as it is.
+ *
+ * Rendered output is cached for each capability class, so static text like
+ * room descriptions and prompts is only rendered once per kind of client.
+ */
+class Markup {
+public:
+  struct Colour {
+    enum Kind : std::uint8_t { DEFAULT, NAMED, RGB };
+    Kind kind = DEFAULT;
+    // Palette index for named colours, 0 - 15
+    std::uint8_t index = 0;
+    std::uint8_t r = 0, g = 0, b = 0;
+  };
+
+  struct Token {
+    enum Type : std::uint8_t { TEXT, FG, BG, BOLD, UNDERLINE, RESET };
+    Type type;
+    Colour colour;
+    // Span of m_text, for TEXT tokens
+    std::uint32_t offset = 0, length = 0;
+  };
+
+  explicit Markup(std::string_view source);
+
+  // Render for a client, using the cached result if there is one
+  const std::string &render(Features features);
+  // Render without touching the cache
+  std::string renderUncached(Features features) const;
+
+  // The text with all markup removed
+  const std::string &getText() const { return m_text; }
+  const std::vector<Token> &getTokens() const { return m_tokens; }
+
+  // Register the `markup` library in Lua
+  static int luaopen(lua_State *L);
+
+  // Methods available on Markup objects in Lua
+  static const luaL_Reg LUA_METHODS[];
+  static const luaL_Reg LUA_METAMETHODS[];
+
+private:
+  void compile(std::string_view source);
+  // Parse the inside of a brace pair into a token. Returns false if it isn't
+  // a markup code
+  static bool parseCode(std::string_view code, Token &token);
+
+  // Plain text runs, concatenated
+  std::string m_text;
+  std::vector<Token> m_tokens;
+  std::array<std::string, Features::CAPABILITY_CLASSES> m_rendered;
+  // Bit n is set when m_rendered[n] is valid
+  std::uint8_t m_rendered_mask = 0;
+  static_assert(Features::CAPABILITY_CLASSES <= 8);
+};
+
+} // namespace whatmud
+
+#endif
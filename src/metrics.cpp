@@ -0,0 +1,467 @@
+#include <cmath>
+#include <limits>
+#include <map>
+#include <stdexcept>
+
+#include <fmt/format.h>
+
+#include "engine.hpp"
+#include "lua/helpers.hpp"
+#include "metrics.hpp"
+
+namespace whatmud {
+
+static bool is_valid_name(std::string_view name, bool label) {
+  if (name.empty()) {
+    return false;
+  }
+  for (std::size_t i = 0; i < name.size(); ++i) {
+    char c = name[i];
+    bool ok = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_' ||
+              (!label && c == ':') || (i > 0 && c >= '0' && c <= '9');
+    if (!ok) {
+      return false;
+    }
+  }
+  // Names starting with __ are reserved for Prometheus' own labels
+  return !label || !name.starts_with("__");
+}
+
+// Escape a HELP line or label value. Quotes only need escaping in labels
+static void append_escaped(std::string &out, std::string_view str,
+                           bool label) {
+  for (char c : str) {
+    switch (c) {
+    case '\\':
+      out += "\\\\";
+      break;
+    case '\n':
+      out += "\\n";
+      break;
+    case '"':
+      out += label ? "\\\"" : "\"";
+      break;
+    default:
+      out += c;
+      break;
+    }
+  }
+}
+
+static void append_value(std::string &out, double value) {
+  if (std::isnan(value)) {
+    out += "NaN";
+  } else if (std::isinf(value)) {
+    out += value > 0 ? "+Inf" : "-Inf";
+  } else {
+    fmt::format_to(std::back_inserter(out), "{}", value);
+  }
+}
+
+// Append `name{labels,extra} ` for one sample
+static void append_sample(std::string &out, std::string_view name,
+                          std::string_view suffix, std::string_view labels,
+                          std::string_view extra = {}) {
+  out += name;
+  out += suffix;
+  if (!labels.empty() || !extra.empty()) {
+    out += '{';
+    out += labels;
+    if (!labels.empty() && !extra.empty()) {
+      out += ',';
+    }
+    out += extra;
+    out += '}';
+  }
+  out += ' ';
+}
+
+Metrics::Series *Metrics::find(std::string_view name, std::string_view help,
+                               Type type, const std::string &labels,
+                               Family *&family) {
+  auto it = m_by_name.find(std::string(name));
+  if (it == m_by_name.end()) {
+    if (!is_valid_name(name, false)) {
+      throw std::invalid_argument(
+          fmt::format("Invalid metric name '{}'", name));
+    }
+    m_families.emplace_back(std::make_unique<Family>(
+        Family{std::string(name), std::string(help), type, {}}));
+    family = m_families.back().get();
+    m_by_name.emplace(family->name, family);
+    return nullptr;
+  }
+
+  family = it->second;
+  if (family->type != type) {
+    throw std::invalid_argument(fmt::format(
+        "Metric '{}' is already registered with a different type", name));
+  }
+  for (Series &series : family->series) {
+    if (series.labels == labels) {
+      return &series;
+    }
+  }
+  return nullptr;
+}
+
+void Metrics::add(std::string_view name, std::string_view help, Type type,
+                  std::string labels, Source source) {
+  Family *family;
+  if (Series *series = find(name, help, type, labels, family)) {
+    if (series->owned) {
+      throw std::invalid_argument(
+          fmt::format("Metric '{}' is already registered", name));
+    }
+    // Exporting the same value again replaces the old source
+    series->source = std::move(source);
+    return;
+  }
+  family->series.push_back({std::move(labels), std::move(source)});
+}
+
+Counter &Metrics::counter(std::string_view name, std::string_view help,
+                          std::string labels) {
+  Family *family;
+  if (Series *series = find(name, help, Type::COUNTER, labels, family)) {
+    if (series->owned) {
+      return *std::get<Counter *>(series->source);
+    }
+    throw std::invalid_argument(
+        fmt::format("Metric '{}' is exported from elsewhere", name));
+  }
+  Counter &counter = m_counters.emplace_back();
+  family->series.push_back({std::move(labels), &counter, true});
+  return counter;
+}
+
+Gauge &Metrics::gauge(std::string_view name, std::string_view help,
+                      std::string labels) {
+  Family *family;
+  if (Series *series = find(name, help, Type::GAUGE, labels, family)) {
+    if (series->owned) {
+      return *std::get<Gauge *>(series->source);
+    }
+    throw std::invalid_argument(
+        fmt::format("Metric '{}' is exported from elsewhere", name));
+  }
+  Gauge &gauge = m_gauges.emplace_back();
+  family->series.push_back({std::move(labels), &gauge, true});
+  return gauge;
+}
+
+Histogram &Metrics::histogram(std::string_view name, std::string_view help,
+                              std::string labels) {
+  Family *family;
+  if (Series *series = find(name, help, Type::HISTOGRAM, labels, family)) {
+    if (series->owned) {
+      // We created it, so it was never really const
+      return const_cast<Histogram &>(
+          *std::get<const Histogram *>(series->source));
+    }
+    throw std::invalid_argument(
+        fmt::format("Metric '{}' is exported from elsewhere", name));
+  }
+  Histogram &hist = m_histograms.emplace_back();
+  family->series.push_back({std::move(labels), &hist, true});
+  return hist;
+}
+
+void Metrics::addCounter(std::string_view name, std::string_view help,
+                         ValueFn fn, std::string labels) {
+  add(name, help, Type::COUNTER, std::move(labels), std::move(fn));
+}
+
+void Metrics::addGauge(std::string_view name, std::string_view help,
+                       ValueFn fn, std::string labels) {
+  add(name, help, Type::GAUGE, std::move(labels), std::move(fn));
+}
+
+void Metrics::addHistogram(std::string_view name, std::string_view help,
+                           const Histogram &hist, std::string labels) {
+  add(name, help, Type::HISTOGRAM, std::move(labels), &hist);
+}
+
+std::string Metrics::render() const {
+  static constexpr const char *TYPE_NAMES[]{"counter", "gauge", "histogram"};
+  std::string out;
+  for (const auto &family : m_families) {
+    out += "# HELP ";
+    out += family->name;
+    out += ' ';
+    append_escaped(out, family->help, false);
+    fmt::format_to(std::back_inserter(out), "\n# TYPE {} {}\n", family->name,
+                   TYPE_NAMES[static_cast<int>(family->type)]);
+
+    for (const Series &series : family->series) {
+      if (auto *counter = std::get_if<Counter *>(&series.source)) {
+        append_sample(out, family->name, "", series.labels);
+        fmt::format_to(std::back_inserter(out), "{}\n", (*counter)->get());
+      } else if (auto *gauge = std::get_if<Gauge *>(&series.source)) {
+        append_sample(out, family->name, "", series.labels);
+        append_value(out, (*gauge)->get());
+        out += '\n';
+      } else if (auto *fn = std::get_if<ValueFn>(&series.source)) {
+        append_sample(out, family->name, "", series.labels);
+        append_value(out, (*fn)());
+        out += '\n';
+      } else {
+        const Histogram &hist = *std::get<const Histogram *>(series.source);
+        // Only export bounds at powers of two, one in every SUB_BUCKETS. The
+        // counts are cumulative, so nothing is lost but resolution
+        std::uint64_t cumulative = 0;
+        std::string le;
+        for (std::size_t i = 0; i < Histogram::NUM_BUCKETS; ++i) {
+          cumulative += hist.getBucketCount(i);
+          if (i % Histogram::SUB_BUCKETS == 0) {
+            le = fmt::format("le=\"{}\"", Histogram::getBucketBound(i) / 1e9);
+            append_sample(out, family->name, "_bucket", series.labels, le);
+            fmt::format_to(std::back_inserter(out), "{}\n", cumulative);
+          }
+        }
+        // Read the count once, so +Inf and _count always agree
+        std::uint64_t count = std::max(cumulative, hist.getCount());
+        append_sample(out, family->name, "_bucket", series.labels,
+                      "le=\"+Inf\"");
+        fmt::format_to(std::back_inserter(out), "{}\n", count);
+        append_sample(out, family->name, "_sum", series.labels);
+        append_value(out, hist.getSum() / 1e9);
+        out += '\n';
+        append_sample(out, family->name, "_count", series.labels);
+        fmt::format_to(std::back_inserter(out), "{}\n", count);
+      }
+    }
+  }
+  return out;
+}
+
+// Lua library
+
+namespace {
+
+// Handles to metrics defined from Lua. The registry outlives the Lua state,
+// so they just point into it
+class LuaCounter {
+public:
+  LuaCounter(Counter *counter) : m_counter(counter) {}
+  Counter *get() { return m_counter; }
+  static const luaL_Reg LUA_METHODS[];
+
+private:
+  Counter *m_counter;
+};
+
+class LuaGauge {
+public:
+  LuaGauge(Gauge *gauge) : m_gauge(gauge) {}
+  Gauge *get() { return m_gauge; }
+  static const luaL_Reg LUA_METHODS[];
+
+private:
+  Gauge *m_gauge;
+};
+
+class LuaHistogram {
+public:
+  LuaHistogram(Histogram *hist) : m_hist(hist) {}
+  Histogram *get() { return m_hist; }
+  static const luaL_Reg LUA_METHODS[];
+
+private:
+  Histogram *m_hist;
+};
+
+} // namespace
+
+// Render the label table at `index` as `a="x",b="y"`, sorted by name so the
+// same labels always make the same series. Returns false with `error` set if
+// a label is invalid
+static bool render_labels(lua_State *L, int index, std::string &labels,
+                          std::string &error) {
+  if (lua_isnoneornil(L, index)) {
+    return true;
+  }
+  std::map<std::string, std::string> sorted;
+  lua_pushnil(L);
+  while (lua_next(L, index)) {
+    if (lua_type(L, -2) != LUA_TSTRING ||
+        !is_valid_name(lua_tostring(L, -2), true)) {
+      error = "label names must be identifiers not starting with __";
+      lua_pop(L, 2);
+      return false;
+    }
+    if (lua_type(L, -1) != LUA_TSTRING && lua_type(L, -1) != LUA_TNUMBER) {
+      error = fmt::format("label '{}' must be a string or number, got {}",
+                          lua_tostring(L, -2), luaL_typename(L, -1));
+      lua_pop(L, 2);
+      return false;
+    }
+    // Converting a number value in place is safe, only keys matter to next
+    sorted.emplace(lua_tostring(L, -2), lua_tostring(L, -1));
+    lua_pop(L, 1);
+  }
+  for (const auto &[name, value] : sorted) {
+    if (!labels.empty()) {
+      labels += ',';
+    }
+    labels += name;
+    labels += "=\"";
+    append_escaped(labels, value, true);
+    labels += '"';
+  }
+  return true;
+}
+
+// Shared by metrics.counter(), gauge() and histogram()
+template <class Handle, class Register>
+static int new_metric(lua_State *L, Register reg) {
+  const char *name = luaL_checkstring(L, 1);
+  const char *help = luaL_checkstring(L, 2);
+  if (!lua_isnoneornil(L, 3)) {
+    luaL_checktype(L, 3, LUA_TTABLE);
+  }
+  Metrics &metrics = Engine::fromLua(L)->getMetrics();
+  {
+    std::string labels;
+    std::string error;
+    if (render_labels(L, 3, labels, error)) {
+      try {
+        lua::new_userdata<Handle>(L, &reg(metrics, name, help,
+                                          std::move(labels)));
+        return 1;
+      } catch (const std::exception &e) {
+        error = e.what();
+      }
+    }
+    lua::push(L, error);
+  }
+  return lua_error(L);
+}
+
+// metrics.counter(name, help[, labels]) -> counter
+// Defines a counter, or gets the one already defined with the same name and
+// labels. labels is a table of label names to values
+int Metrics::l_counter(lua_State *L) {
+  return new_metric<LuaCounter>(
+      L, [](Metrics &m, const char *name, const char *help,
+            std::string labels) -> Counter & {
+        return m.counter(name, help, std::move(labels));
+      });
+}
+
+// metrics.gauge(name, help[, labels]) -> gauge
+int Metrics::l_gauge(lua_State *L) {
+  return new_metric<LuaGauge>(
+      L, [](Metrics &m, const char *name, const char *help,
+            std::string labels) -> Gauge & {
+        return m.gauge(name, help, std::move(labels));
+      });
+}
+
+// metrics.histogram(name, help[, labels]) -> histogram
+// Histograms hold durations, observed and exported in seconds
+int Metrics::l_histogram(lua_State *L) {
+  return new_metric<LuaHistogram>(
+      L, [](Metrics &m, const char *name, const char *help,
+            std::string labels) -> Histogram & {
+        return m.histogram(name, help, std::move(labels));
+      });
+}
+
+// metrics.render() -> string
+// Every metric in the Prometheus text format, as served over HTTP
+int Metrics::l_render(lua_State *L) {
+  {
+    std::string text = Engine::fromLua(L)->getMetrics().render();
+    lua::push(L, text);
+  }
+  return 1;
+}
+
+// counter:inc([n])
+static int l_counter_inc(lua_State *L) {
+  LuaCounter *counter = lua::check_userdata<LuaCounter>(L, 1);
+  lua_Integer n = luaL_optinteger(L, 2, 1);
+  luaL_argcheck(L, n >= 0, 2, "counters can't go down");
+  counter->get()->inc(static_cast<std::uint64_t>(n));
+  return 0;
+}
+
+// counter:get() -> integer
+static int l_counter_get(lua_State *L) {
+  LuaCounter *counter = lua::check_userdata<LuaCounter>(L, 1);
+  lua_pushinteger(L, static_cast<lua_Integer>(counter->get()->get()));
+  return 1;
+}
+
+const luaL_Reg LuaCounter::LUA_METHODS[]{
+    {"inc", l_counter_inc}, {"get", l_counter_get}, {nullptr, nullptr}};
+
+// gauge:set(value)
+static int l_gauge_set(lua_State *L) {
+  lua::check_userdata<LuaGauge>(L, 1)->get()->set(luaL_checknumber(L, 2));
+  return 0;
+}
+
+// gauge:inc([n])
+static int l_gauge_inc(lua_State *L) {
+  lua::check_userdata<LuaGauge>(L, 1)->get()->add(luaL_optnumber(L, 2, 1));
+  return 0;
+}
+
+// gauge:dec([n])
+static int l_gauge_dec(lua_State *L) {
+  lua::check_userdata<LuaGauge>(L, 1)->get()->add(-luaL_optnumber(L, 2, 1));
+  return 0;
+}
+
+// gauge:get() -> number
+static int l_gauge_get(lua_State *L) {
+  lua_pushnumber(L, lua::check_userdata<LuaGauge>(L, 1)->get()->get());
+  return 1;
+}
+
+const luaL_Reg LuaGauge::LUA_METHODS[]{{"set", l_gauge_set},
+                                       {"inc", l_gauge_inc},
+                                       {"dec", l_gauge_dec},
+                                       {"get", l_gauge_get},
+                                       {nullptr, nullptr}};
+
+// histogram:observe(seconds)
+static int l_histogram_observe(lua_State *L) {
+  LuaHistogram *hist = lua::check_userdata<LuaHistogram>(L, 1);
+  lua_Number seconds = luaL_checknumber(L, 2);
+  if (std::isnan(seconds) || seconds < 0) {
+    return luaL_argerror(L, 2, "durations can't be negative or NaN");
+  }
+  // Converting a double out of range is undefined, saturate instead
+  lua_Number ns = seconds * 1e9;
+  constexpr auto max = std::numeric_limits<std::uint64_t>::max();
+  hist->get()->observe(ns >= static_cast<lua_Number>(max)
+                           ? max
+                           : static_cast<std::uint64_t>(ns));
+  return 0;
+}
+
+// histogram:get() -> {count, mean, p50, p90, p99, p999, max}
+// Times are in milliseconds, like every other stats table
+static int l_histogram_get(lua_State *L) {
+  push_stats(L, *lua::check_userdata<LuaHistogram>(L, 1)->get());
+  return 1;
+}
+
+const luaL_Reg LuaHistogram::LUA_METHODS[]{{"observe", l_histogram_observe},
+                                           {"get", l_histogram_get},
+                                           {nullptr, nullptr}};
+
+int Metrics::luaopen(lua_State *L) {
+  static const luaL_Reg funcs[]{{"counter", l_counter},
+                                {"gauge", l_gauge},
+                                {"histogram", l_histogram},
+                                {"render", l_render},
+                                {nullptr, nullptr}};
+  luaL_newlib(L, funcs);
+  return 1;
+}
+
+} // namespace whatmud
@@ -0,0 +1,131 @@
+#ifndef WHATMUD_METRICS_HPP
+#define WHATMUD_METRICS_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <variant>
+#include <vector>
+
+#include <lua.hpp>
+
+#include "histogram.hpp"
+
+namespace whatmud {
+
+// A count that only goes up. Safe to increment from any thread
+class Counter {
+public:
+  void inc(std::uint64_t n = 1) {
+    m_value.fetch_add(n, std::memory_order_relaxed);
+  }
+  std::uint64_t get() const { return m_value.load(std::memory_order_relaxed); }
+
+private:
+  std::atomic<std::uint64_t> m_value{0};
+};
+
+// A value that can go up and down. Safe to update from any thread
+class Gauge {
+public:
+  void set(double value) { m_value.store(value, std::memory_order_relaxed); }
+  void add(double n) { m_value.fetch_add(n, std::memory_order_relaxed); }
+  double get() const { return m_value.load(std::memory_order_relaxed); }
+
+private:
+  std::atomic<double> m_value{0};
+};
+
+/**
+ * Named counters, gauges and histograms, rendered in the Prometheus text
+ * format.
+ * Metrics are registered once, usually at startup, and updated through the
+ * returned reference, so recording never touches the registry. Values kept
+ * elsewhere can be exported with a function read when the metrics are
+ * rendered. Histograms record nanoseconds and are exported in seconds.
+ *
+ * Labels are given rendered, E.G. `phase="world",kind="npc"`. Registering
+ * the same name and labels again returns the existing metric.
+ */
+class Metrics {
+public:
+  using ValueFn = std::function<double()>;
+
+  Metrics() = default;
+
+  // No copy
+  Metrics(const Metrics &) = delete;
+  Metrics &operator=(const Metrics &) = delete;
+
+  Counter &counter(std::string_view name, std::string_view help,
+                   std::string labels = {});
+  Gauge &gauge(std::string_view name, std::string_view help,
+               std::string labels = {});
+  Histogram &histogram(std::string_view name, std::string_view help,
+                       std::string labels = {});
+
+  // Export a value kept elsewhere, read on every render
+  void addCounter(std::string_view name, std::string_view help, ValueFn fn,
+                  std::string labels = {});
+  void addGauge(std::string_view name, std::string_view help, ValueFn fn,
+                std::string labels = {});
+  // Export a histogram owned elsewhere, which must outlive the registry
+  void addHistogram(std::string_view name, std::string_view help,
+                    const Histogram &hist, std::string labels = {});
+
+  // Render every metric in the Prometheus text exposition format
+  std::string render() const;
+
+  // Register the `metrics` library in Lua
+  static int luaopen(lua_State *L);
+
+private:
+  enum class Type { COUNTER, GAUGE, HISTOGRAM };
+
+  using Source =
+      std::variant<Counter *, Gauge *, const Histogram *, ValueFn>;
+
+  struct Series {
+    std::string labels;
+    Source source;
+    // Whether the source is one of ours, rather than exported from elsewhere
+    bool owned = false;
+  };
+
+  struct Family {
+    std::string name;
+    std::string help;
+    Type type;
+    std::vector<Series> series;
+  };
+
+  // Find or create the family `name`, checking it has the right type. Returns
+  // the series with `labels` if there is one, otherwise null
+  Series *find(std::string_view name, std::string_view help, Type type,
+               const std::string &labels, Family *&family);
+  void add(std::string_view name, std::string_view help, Type type,
+           std::string labels, Source source);
+
+  static int l_counter(lua_State *L);
+  static int l_gauge(lua_State *L);
+  static int l_histogram(lua_State *L);
+  static int l_render(lua_State *L);
+
+private:
+  // Families in registration order
+  std::vector<std::unique_ptr<Family>> m_families;
+  std::unordered_map<std::string, Family *> m_by_name;
+  // Deques don't move their elements, so references stay valid
+  std::deque<Counter> m_counters;
+  std::deque<Gauge> m_gauges;
+  std::deque<Histogram> m_histograms;
+};
+
+} // namespace whatmud
+
+#endif
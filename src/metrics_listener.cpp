@@ -0,0 +1,165 @@
+#include <fmt/core.h>
+
+#include "engine.hpp"
+#include "metrics_listener.hpp"
+#include "uv/error.hpp"
+#include "uv/timer.hpp"
+
+namespace whatmud {
+
+// One scraper's connection, deleted once both its handles have closed
+struct MetricsListener::Client {
+  Client(MetricsListener *listener)
+      : tcp(listener->m_engine->getLoop()),
+        timer(listener->m_engine->getLoop()), listener(listener) {
+    tcp.setData(this);
+    timer.setData(this);
+    req.data = this;
+  }
+
+  // Safe to call more than once, the timeout can race the response
+  void close() {
+    if (closing) {
+      return;
+    }
+    closing = true;
+    auto on_close = [](uv_handle_t *handle) {
+      Client *client = static_cast<Client *>(handle->data);
+      if (--client->open_handles == 0) {
+        delete client;
+      }
+    };
+    timer.close(on_close);
+    tcp.close(on_close);
+  }
+
+  uv::TCP tcp;
+  // Closes a client that never finishes its request, or never reads the
+  // response
+  uv::Timer timer;
+  int open_handles = 2;
+  bool closing = false;
+  MetricsListener *listener;
+  std::string request;
+  std::string response;
+  uv_write_t req;
+  char buf[1024];
+};
+
+MetricsListener::MetricsListener(Engine *engine, const char *ip, int port)
+    : Listener(engine, ip, port), TCP(engine->getLoop()) {
+  setData(this);
+
+  bind(getListenAddr());
+}
+
+void MetricsListener::listen() {
+  m_log->info("Serving metrics on http://{}:{}/metrics", getListenIP(),
+              getListenPort());
+
+  TCP::listen(8, [](uv_stream_t *handle, int status) {
+    MetricsListener *listener =
+        reinterpret_cast<MetricsListener *>(handle->data);
+    if (status < 0) {
+      listener->m_log->warn("Could not accept metrics connection: {}",
+                            uv_strerror(status));
+      return;
+    }
+    listener->onNewConnection();
+  });
+}
+
+void MetricsListener::onNewConnection() {
+  Client *client = new Client(this);
+  int res = uv_accept(asStream(), client->tcp.asStream());
+  if (res < 0) {
+    m_log->warn("Could not accept metrics connection: {}", uv_strerror(res));
+    client->close();
+    return;
+  }
+
+  client->timer.start(
+      [](uv_timer_t *handle) { static_cast<Client *>(handle->data)->close(); },
+      REQUEST_TIMEOUT_MS);
+  client->tcp.readStart(
+      [](uv_handle_t *handle, std::size_t suggested_size, uv_buf_t *buf) {
+        (void)suggested_size;
+        Client *client = static_cast<Client *>(handle->data);
+        *buf = uv_buf_init(client->buf, sizeof(client->buf));
+      },
+      [](uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf) {
+        Client *client = static_cast<Client *>(stream->data);
+        if (nread == 0) {
+          return; // EAGAIN
+        } else if (nread < 0) {
+          client->close(); // EOF before a whole request, or a read error
+          return;
+        }
+        client->request.append(buf->base, static_cast<std::size_t>(nread));
+        // Be lenient and accept bare newlines, for testing by hand
+        if (client->request.find("\r\n\r\n") == std::string::npos &&
+            client->request.find("\n\n") == std::string::npos) {
+          if (client->request.size() > MAX_REQUEST_SIZE) {
+            client->close();
+          }
+          return;
+        }
+
+        client->tcp.readStop();
+        client->response = client->listener->respond(client->request);
+        uv_buf_t out = uv_buf_init(client->response.data(),
+                                   client->response.size());
+        try {
+          client->tcp.write(&client->req, &out, [](uv_write_t *req, int) {
+            // Closing the connection ends the response
+            static_cast<Client *>(req->data)->close();
+          });
+        } catch (const uv::Error &) {
+          client->close();
+        }
+      });
+}
+
+std::string MetricsListener::respond(std::string_view request) {
+  // Request line: METHOD SP target SP version
+  std::string_view line = request.substr(0, request.find_first_of("\r\n"));
+  std::size_t space = line.find(' ');
+  std::string_view method = line.substr(0, space);
+  std::string_view path;
+  if (space != std::string_view::npos) {
+    path = line.substr(space + 1);
+    path = path.substr(0, path.find(' '));
+    path = path.substr(0, path.find('?'));
+  }
+
+  const char *status = "200 OK";
+  const char *type = "text/plain; version=0.0.4; charset=utf-8";
+  const char *extra = "";
+  std::string body;
+  if (method != "GET" && method != "HEAD") {
+    status = "405 Method Not Allowed";
+    type = "text/plain; charset=utf-8";
+    extra = "Allow: GET, HEAD\r\n";
+    body = "Method not allowed\n";
+  } else if (path != "/metrics") {
+    status = "404 Not Found";
+    type = "text/plain; charset=utf-8";
+    body = "Metrics are served at /metrics\n";
+  } else {
+    body = m_engine->getMetrics().render();
+  }
+
+  std::string response = fmt::format("HTTP/1.1 {}\r\n"
+                                     "Content-Type: {}\r\n"
+                                     "Content-Length: {}\r\n"
+                                     "{}"
+                                     "Connection: close\r\n"
+                                     "\r\n",
+                                     status, type, body.size(), extra);
+  if (method != "HEAD") {
+    response += body;
+  }
+  return response;
+}
+
+} // namespace whatmud
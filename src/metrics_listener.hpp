@@ -0,0 +1,44 @@
+#ifndef WHATMUD_METRICS_LISTENER_HPP
+#define WHATMUD_METRICS_LISTENER_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+#include "listener.hpp"
+#include "uv/tcp.hpp"
+
+namespace whatmud {
+
+/**
+ * A minimal HTTP server for Prometheus to scrape the engine's metrics from.
+ * `GET /metrics` gets the rendered metrics, anything else a 404. Each
+ * connection serves one request and is closed once the response is written,
+ * or after REQUEST_TIMEOUT_MS if that takes too long.
+ * The listener has no authentication, so it should only be bound to a local
+ * or otherwise private address.
+ */
+class MetricsListener : public Listener, protected uv::TCP {
+public:
+  // Requests with longer heads are dropped
+  static constexpr std::size_t MAX_REQUEST_SIZE = 8192;
+  // Connections still open after this long are closed
+  static constexpr std::uint64_t REQUEST_TIMEOUT_MS = 5000;
+
+  MetricsListener(Engine *engine, const char *ip, int port);
+  virtual ~MetricsListener() = default;
+
+  virtual void listen() override;
+
+private:
+  struct Client;
+
+  void onNewConnection();
+  // Build the whole response to a request head
+  std::string respond(std::string_view request);
+};
+
+} // namespace whatmud
+
+#endif
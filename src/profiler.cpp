@@ -0,0 +1,267 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+#include <fmt/core.h>
+
+#include "connection.hpp"
+#include "engine.hpp"
+#include "log.hpp"
+#include "lua/helpers.hpp"
+#include "profiler.hpp"
+
+namespace whatmud {
+
+Profiler::Profiler(Engine *engine)
+    : m_log(log::get("profiler")), m_engine(engine) {}
+
+void Profiler::start(std::uint64_t interval_ns) {
+  m_interval_ns = std::max<std::uint64_t>(interval_ns, 1000);
+  if (m_running) {
+    return;
+  }
+  m_log->info("Profiling Lua every {} us", m_interval_ns / 1000);
+  m_running = true;
+  m_next_sample = 0;
+  hookAll(true);
+}
+
+void Profiler::stop() {
+  if (!m_running) {
+    return;
+  }
+  m_log->info("Stopped profiling after {} samples", m_samples);
+  m_running = false;
+  // Coroutines that inherited the hook remove it themselves
+  hookAll(false);
+}
+
+void Profiler::reset() {
+  m_stacks.clear();
+  m_samples = 0;
+  m_sampled_us = 0;
+}
+
+void Profiler::hookAll(bool on) {
+  lua_Hook fn = on ? hook : nullptr;
+  int mask = on ? LUA_MASKCOUNT : 0;
+  lua_State *L = m_engine->getLuaState();
+  lua_sethook(L, fn, mask, HOOK_COUNT);
+
+  // Each connection's coroutine is its first uservalue
+  m_engine->getConnections().push(L);
+  int table = lua_gettop(L);
+  lua_pushnil(L);
+  while (lua_next(L, table)) {
+    if (lua::test_userdata<Connection>(L, -1) != nullptr &&
+        lua_getiuservalue(L, -1, 1) == LUA_TTHREAD) {
+      lua_sethook(lua_tothread(L, -1), fn, mask, HOOK_COUNT);
+    }
+    lua_settop(L, table + 1); // Leave the key
+  }
+  lua_pop(L, 1);
+}
+
+void Profiler::hook(lua_State *L, lua_Debug *ar) {
+  (void)ar;
+  Profiler *profiler = Engine::fromLua(L)->getProfiler();
+  if (!profiler->m_running) {
+    lua_sethook(L, nullptr, 0, 0);
+    return;
+  }
+  std::uint64_t now = uv_hrtime();
+  if (now < profiler->m_next_sample) {
+    return;
+  }
+  profiler->m_next_sample = now + profiler->m_interval_ns;
+  profiler->sample(L);
+}
+
+// Append a frame's name, with its definition so same-named locals differ.
+// Semicolons separate frames in the folded format, so can't appear in one
+static void append_frame(std::string &out, const lua_Debug &ar) {
+  std::size_t start = out.size();
+  const char *name = ar.name != nullptr ? ar.name : "?";
+  if (*ar.what == 'C') {
+    fmt::format_to(std::back_inserter(out), "{} [C]", name);
+  } else if (*ar.what == 'm') {
+    fmt::format_to(std::back_inserter(out), "main chunk ({})", ar.short_src);
+  } else {
+    fmt::format_to(std::back_inserter(out), "{} ({}:{})", name, ar.short_src,
+                   ar.linedefined);
+  }
+  std::replace(out.begin() + static_cast<std::ptrdiff_t>(start), out.end(),
+               ';', ':');
+}
+
+void Profiler::sample(lua_State *L) {
+  // Innermost frame first
+  lua_Debug frames[MAX_DEPTH];
+  int depth = 0;
+  while (depth < MAX_DEPTH && lua_getstack(L, depth, &frames[depth])) {
+    lua_getinfo(L, "Sn", &frames[depth]);
+    ++depth;
+  }
+
+  std::string stack;
+  for (int i = depth - 1; i >= 0; --i) {
+    if (!stack.empty()) {
+      stack += ';';
+    }
+    append_frame(stack, frames[i]);
+  }
+  std::uint64_t us = m_interval_ns / 1000;
+  m_stacks[std::move(stack)] += us;
+  ++m_samples;
+  m_sampled_us += us;
+}
+
+std::string Profiler::getFolded() const {
+  std::string out;
+  for (const auto &[stack, us] : m_stacks) {
+    fmt::format_to(std::back_inserter(out), "{} {}\n", stack, us);
+  }
+  return out;
+}
+
+std::vector<Profiler::FunctionStats> Profiler::getFunctions() const {
+  std::unordered_map<std::string_view, FunctionStats> functions;
+  std::vector<std::string_view> seen;
+  for (const auto &[stack, us] : m_stacks) {
+    seen.clear();
+    std::string_view rest(stack);
+    while (!rest.empty()) {
+      std::size_t end = rest.find(';');
+      std::string_view frame = rest.substr(0, end);
+      rest = end == std::string_view::npos ? std::string_view()
+                                           : rest.substr(end + 1);
+      FunctionStats &stats = functions[frame];
+      // Recursive functions only count once towards their total
+      if (std::find(seen.begin(), seen.end(), frame) == seen.end()) {
+        seen.push_back(frame);
+        stats.total_us += us;
+      }
+      if (rest.empty()) {
+        stats.self_us += us;
+      }
+    }
+  }
+
+  std::vector<FunctionStats> sorted;
+  sorted.reserve(functions.size());
+  for (auto &[name, stats] : functions) {
+    stats.name.assign(name);
+    sorted.push_back(std::move(stats));
+  }
+  std::sort(sorted.begin(), sorted.end(),
+            [](const FunctionStats &a, const FunctionStats &b) {
+              return a.self_us != b.self_us ? a.self_us > b.self_us
+                                            : a.total_us > b.total_us;
+            });
+  return sorted;
+}
+
+// Lua library
+
+// profiler.start([interval_ms])
+// Starts sampling every interval_ms milliseconds of Lua running, 1 by default.
+// Samples add to those already taken until profiler.reset()
+int Profiler::l_start(lua_State *L) {
+  lua_Number ms = luaL_optnumber(L, 1, 1);
+  luaL_argcheck(L, ms > 0, 1, "interval must be positive");
+  Engine::fromLua(L)->getProfiler()->start(
+      static_cast<std::uint64_t>(ms * 1e6));
+  return 0;
+}
+
+// profiler.stop()
+int Profiler::l_stop(lua_State *L) {
+  Engine::fromLua(L)->getProfiler()->stop();
+  return 0;
+}
+
+// profiler.running() -> boolean
+int Profiler::l_running(lua_State *L) {
+  lua_pushboolean(L, Engine::fromLua(L)->getProfiler()->isRunning());
+  return 1;
+}
+
+// profiler.reset()
+int Profiler::l_reset(lua_State *L) {
+  Engine::fromLua(L)->getProfiler()->reset();
+  return 0;
+}
+
+// profiler.report([limit]) -> {samples, time, functions}
+// functions lists up to limit (default 20) functions with the most self
+// time, each as {name, self, total}. Times are in milliseconds
+int Profiler::l_report(lua_State *L) {
+  lua_Integer limit = luaL_optinteger(L, 1, 20);
+  Profiler *profiler = Engine::fromLua(L)->getProfiler();
+  {
+    std::vector<FunctionStats> functions = profiler->getFunctions();
+    std::size_t count =
+        std::min(functions.size(),
+                 static_cast<std::size_t>(std::max<lua_Integer>(limit, 0)));
+    lua_createtable(L, 0, 3);
+    lua::push(L, static_cast<lua_Integer>(profiler->m_samples));
+    lua_setfield(L, -2, "samples");
+    lua_pushnumber(L, profiler->m_sampled_us / 1e3);
+    lua_setfield(L, -2, "time");
+    lua_createtable(L, static_cast<int>(count), 0);
+    for (std::size_t i = 0; i < count; ++i) {
+      lua_createtable(L, 0, 3);
+      lua::push(L, functions[i].name);
+      lua_setfield(L, -2, "name");
+      lua_pushnumber(L, functions[i].self_us / 1e3);
+      lua_setfield(L, -2, "self");
+      lua_pushnumber(L, functions[i].total_us / 1e3);
+      lua_setfield(L, -2, "total");
+      lua_rawseti(L, -2, static_cast<lua_Integer>(i + 1));
+    }
+    lua_setfield(L, -2, "functions");
+  }
+  return 1;
+}
+
+// profiler.write(path) -> number of stacks
+// Writes the folded stacks for flamegraph.pl or similar, weighted in
+// microseconds. Relative paths are in the game directory
+int Profiler::l_write(lua_State *L) {
+  std::string_view path;
+  lua::arg(L, 1, path);
+  Engine *engine = Engine::fromLua(L);
+  Profiler *profiler = engine->getProfiler();
+  bool ok;
+  {
+    std::string full_path = engine->resolvePath(path);
+    std::string folded = profiler->getFolded();
+    FILE *file = std::fopen(full_path.c_str(), "wb");
+    ok = file != nullptr &&
+         std::fwrite(folded.data(), 1, folded.size(), file) == folded.size();
+    if (file != nullptr && std::fclose(file) != 0) {
+      ok = false;
+    }
+    if (!ok) {
+      lua_pushfstring(L, "could not write %s: %s", full_path.c_str(),
+                      std::strerror(errno));
+    }
+  }
+  if (!ok) {
+    return lua_error(L);
+  }
+  lua::push(L, static_cast<lua_Integer>(profiler->m_stacks.size()));
+  return 1;
+}
+
+int Profiler::luaopen(lua_State *L) {
+  static const luaL_Reg funcs[]{{"start", l_start},   {"stop", l_stop},
+                                {"running", l_running}, {"reset", l_reset},
+                                {"report", l_report}, {"write", l_write},
+                                {nullptr, nullptr}};
+  luaL_newlib(L, funcs);
+  return 1;
+}
+
+} // namespace whatmud
@@ -0,0 +1,105 @@
+#ifndef WHATMUD_PROFILER_HPP
+#define WHATMUD_PROFILER_HPP
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <lua.hpp>
+#include <spdlog/spdlog.h>
+
+namespace whatmud {
+
+// Forward declarations:
+class Engine;
+
+/**
+ * A sampling profiler for Lua running on the loop thread.
+ * A count hook runs every HOOK_COUNT VM instructions and, once per sampling
+ * interval, records the running coroutine's call stack. Stacks are kept
+ * folded, root first and separated by semicolons, weighted by the time they
+ * stand for, which is the input format of flamegraph.pl and most other
+ * flame graph tools.
+ *
+ * Hooks are per coroutine. Starting hooks the main state and every
+ * connection's coroutine, and coroutines created by hooked ones inherit the
+ * hook; the engine also hooks anything it resumes. When stopped, each hook
+ * removes itself the next time it runs, so there's no cost once stopped.
+ */
+class Profiler {
+public:
+  // VM instructions between checks of the clock
+  static constexpr int HOOK_COUNT = 1000;
+  // Deeper stacks are cut off at the root end
+  static constexpr int MAX_DEPTH = 64;
+
+  struct FunctionStats {
+    std::string name;
+    // Time spent in the function itself, and in it or anything it called
+    std::uint64_t self_us = 0;
+    std::uint64_t total_us = 0;
+  };
+
+  Profiler(Engine *engine);
+
+  // No copy
+  Profiler(const Profiler &) = delete;
+  Profiler &operator=(const Profiler &) = delete;
+
+  bool isRunning() const { return m_running; }
+
+  void start(std::uint64_t interval_ns);
+  void stop();
+  // Drop every sample taken so far
+  void reset();
+
+  // Hook a coroutine about to be resumed, if the profiler is running
+  void attach(lua_State *co) {
+    if (m_running) {
+      lua_sethook(co, hook, LUA_MASKCOUNT, HOOK_COUNT);
+    }
+  }
+
+  std::uint64_t getSamples() const { return m_samples; }
+  // Time the samples stand for, in microseconds
+  std::uint64_t getSampledTime() const { return m_sampled_us; }
+
+  // Folded stacks, one `frame;frame;frame microseconds` line per stack
+  std::string getFolded() const;
+  // Self and total time per function, most self time first
+  std::vector<FunctionStats> getFunctions() const;
+
+  // Register the `profiler` library in Lua
+  static int luaopen(lua_State *L);
+
+private:
+  static void hook(lua_State *L, lua_Debug *ar);
+  void sample(lua_State *L);
+  // Set or clear the hook on the main state and every connection coroutine
+  void hookAll(bool on);
+
+  static int l_start(lua_State *L);
+  static int l_stop(lua_State *L);
+  static int l_running(lua_State *L);
+  static int l_reset(lua_State *L);
+  static int l_report(lua_State *L);
+  static int l_write(lua_State *L);
+
+private:
+  std::shared_ptr<spdlog::logger> m_log;
+  Engine *m_engine;
+  bool m_running = false;
+  std::uint64_t m_interval_ns = 1'000'000;
+  // uv_hrtime() after which the next hook takes a sample
+  std::uint64_t m_next_sample = 0;
+  // Folded stack to the microseconds sampled in it
+  std::unordered_map<std::string, std::uint64_t> m_stacks;
+  std::uint64_t m_samples = 0;
+  std::uint64_t m_sampled_us = 0;
+};
+
+} // namespace whatmud
+
+#endif
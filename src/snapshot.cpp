@@ -0,0 +1,489 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+
+#include <fmt/core.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+#include "engine.hpp"
+#include "log.hpp"
+#include "lua/helpers.hpp"
+#include "lua/serialize.hpp"
+#include "snapshot.hpp"
+#include "uv/error.hpp"
+
+namespace whatmud {
+
+struct Snapshotter::Job {
+  Job(uv_loop_t *loop) : pipe(loop) {}
+
+  uv::Pipe pipe;
+  Snapshotter *owner = nullptr;
+  uv_pid_t pid = -1;
+  std::string path;
+  // Coroutine to resume once the child exits
+  lua::Ref co;
+  char read_buf[512];
+  // Report text not yet ending in a newline
+  std::string partial;
+
+  // Progress, as reported by the child
+  const char *phase = "serialize";
+  std::uint64_t written = 0;
+  std::uint64_t total = 0;
+
+  std::uint64_t started_at = 0;
+  std::uint64_t fork_ns = 0;
+  long faults_before = 0;
+
+  // From the child's final report
+  bool done = false;
+  std::uint64_t serialize_ns = 0;
+  std::uint64_t write_ns = 0;
+  long child_faults = 0;
+  std::string error;
+};
+
+Snapshotter::Snapshotter(Engine *engine)
+    : m_log(log::get("snapshot")), m_engine(engine) {}
+
+// Snapshots need fork(), everything from here to the Lua library is POSIX
+// only
+#ifndef _WIN32
+
+static long minor_faults() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_minflt;
+}
+
+// Write everything or fail, for blocking file descriptors in the child
+static bool write_all(int fd, const char *buf, std::size_t size) {
+  while (size > 0) {
+    ssize_t n = ::write(fd, buf, size);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    buf += n;
+    size -= static_cast<std::size_t>(n);
+  }
+  return true;
+}
+
+Snapshotter::~Snapshotter() {
+  // Only reached if the loop stopped early; don't leave the child behind
+  if (m_job != nullptr) {
+    kill(m_job->pid, SIGKILL);
+    waitpid(m_job->pid, nullptr, 0);
+    // Closing the pipe closes its descriptor straight away. The job is only
+    // freed if the loop runs again, so release its coroutine while Lua is
+    // still open
+    m_job->co = lua::Ref();
+    m_job->pipe.close(
+        [](uv_handle_t *handle) { delete static_cast<Job *>(handle->data); });
+    m_job = nullptr;
+  }
+}
+
+// Close every descriptor inherited from the parent except stdio and `keep`.
+// A client socket the parent closes would otherwise stay open until the child
+// exits
+static void close_inherited(int keep) {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 34)
+  close_range(3, keep - 1, 0);
+  close_range(keep + 1, ~0U, 0);
+#else
+  for (long fd = 3, max = sysconf(_SC_OPEN_MAX); fd < max; ++fd) {
+    if (fd != keep) {
+      ::close(static_cast<int>(fd));
+    }
+  }
+#endif
+}
+
+void Snapshotter::runChild(lua_State *L, int index, const std::string &path,
+                           int fd) {
+  // An exception must not unwind into the parent's copy of the event loop
+  try {
+    close_inherited(fd);
+    // Finalizers could touch handles and sockets the parent still uses
+    lua_gc(L, LUA_GCSTOP);
+
+    auto report = [fd](std::string line) {
+      std::replace(line.begin(), line.end(), '\n', ' ');
+      line += '\n';
+      write_all(fd, line.data(), line.size());
+    };
+    auto fail = [&](const std::string &what) {
+      int err = errno;
+      report(fmt::format("error {}: {}", what, std::strerror(err)));
+      _exit(1);
+    };
+
+    std::uint64_t start = uv_hrtime();
+    std::string data(MAGIC);
+    if (!lua::serialize(L, index, 1, data)) {
+      report(fmt::format("error {}", lua_tostring(L, -1)));
+      _exit(1);
+    }
+    std::uint64_t serialized = uv_hrtime();
+    report(fmt::format("write {}", data.size()));
+
+    std::string tmp = path + ".tmp";
+    int out = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (out < 0) {
+      fail("could not create " + tmp);
+    }
+    for (std::size_t offset = 0; offset < data.size(); offset += CHUNK_SIZE) {
+      std::size_t size = std::min(CHUNK_SIZE, data.size() - offset);
+      if (!write_all(out, data.data() + offset, size)) {
+        fail("could not write " + tmp);
+      }
+      report(fmt::format("progress {}", offset + size));
+    }
+    if (fsync(out) != 0 || ::close(out) != 0) {
+      fail("could not write " + tmp);
+    }
+    if (std::rename(tmp.c_str(), path.c_str()) != 0) {
+      fail("could not rename " + tmp);
+    }
+
+    report(fmt::format("done {} {} {}", serialized - start,
+                       uv_hrtime() - serialized, minor_faults()));
+    _exit(0);
+  } catch (...) {
+    _exit(1);
+  }
+}
+
+void Snapshotter::start(lua_State *L, int index, std::string path,
+                        lua::Ref co) {
+  if (m_job != nullptr) {
+    throw std::logic_error("A snapshot is already running");
+  }
+  // Both ends close-on-exec
+  uv_file fds[2];
+  int res = uv_pipe(fds, 0, 0);
+  uv::check_error(res, "Could not create snapshot pipe");
+
+  long faults_before = minor_faults();
+  std::uint64_t started_at = uv_hrtime();
+  pid_t pid = fork();
+  if (pid == 0) {
+    ::close(fds[0]);
+    runChild(L, index, path, fds[1]);
+  }
+  std::uint64_t fork_ns = uv_hrtime() - started_at;
+  ::close(fds[1]);
+  if (pid < 0) {
+    int err = errno;
+    ::close(fds[0]);
+    throw std::system_error(err, std::generic_category(),
+                            "Could not fork snapshot process");
+  }
+
+  Job *job = new Job(m_engine->getLoop());
+  job->owner = this;
+  job->pid = pid;
+  job->path = std::move(path);
+  job->co = std::move(co);
+  job->faults_before = faults_before;
+  job->started_at = started_at;
+  job->fork_ns = fork_ns;
+  job->pipe.setData(job);
+  try {
+    job->pipe.open(fds[0]);
+    job->pipe.readStart(
+        [](uv_handle_t *handle, std::size_t, uv_buf_t *buf) {
+          Job *job = static_cast<Job *>(handle->data);
+          *buf = uv_buf_init(job->read_buf, sizeof(job->read_buf));
+        },
+        [](uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf) {
+          Job *job = static_cast<Job *>(stream->data);
+          if (nread < 0) {
+            job->owner->onEof();
+            return;
+          }
+          job->partial.append(buf->base, static_cast<std::size_t>(nread));
+          std::size_t end;
+          while ((end = job->partial.find('\n')) != std::string::npos) {
+            std::string_view line(job->partial.data(), end);
+            job->owner->onLine(line);
+            job->partial.erase(0, end + 1);
+          }
+        });
+  } catch (...) {
+    kill(pid, SIGKILL);
+    waitpid(pid, nullptr, 0);
+    job->pipe.close(
+        [](uv_handle_t *handle) { delete static_cast<Job *>(handle->data); });
+    throw;
+  }
+
+  m_fork_time.observe(job->fork_ns);
+  m_log->info("Writing snapshot to {} in process {}, paused for {:.3f} ms",
+              job->path, pid, job->fork_ns / 1e6);
+  m_job = job;
+}
+
+void Snapshotter::onLine(std::string_view line) {
+  std::size_t space = line.find(' ');
+  std::string_view kind = line.substr(0, space);
+  std::string args(space == line.npos ? "" : line.substr(space + 1));
+
+  unsigned long long a = 0, b = 0;
+  long c = 0;
+  if (kind == "write") {
+    std::sscanf(args.c_str(), "%llu", &a);
+    m_job->phase = "write";
+    m_job->total = a;
+  } else if (kind == "progress") {
+    std::sscanf(args.c_str(), "%llu", &a);
+    m_job->written = a;
+  } else if (kind == "done") {
+    std::sscanf(args.c_str(), "%llu %llu %ld", &a, &b, &c);
+    m_job->done = true;
+    m_job->serialize_ns = a;
+    m_job->write_ns = b;
+    m_job->child_faults = c;
+  } else if (kind == "error") {
+    m_job->error = std::move(args);
+  }
+}
+
+void Snapshotter::onEof() {
+  Job *job = m_job;
+  m_job = nullptr;
+  job->pipe.readStop();
+
+  int status = 0;
+  while (waitpid(job->pid, &status, 0) < 0 && errno == EINTR) {
+  }
+  std::uint64_t duration = uv_hrtime() - job->started_at;
+  // Faults taken by the parent while the child ran are mostly pages copied
+  // because the game wrote to memory the child still shared
+  long parent_faults = minor_faults() - job->faults_before;
+
+  bool ok = job->done && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+  if (!ok && job->error.empty()) {
+    job->error = WIFSIGNALED(status)
+                     ? fmt::format("snapshot process killed by signal {}",
+                                   WTERMSIG(status))
+                     : "snapshot process exited before finishing";
+  }
+  if (ok) {
+    ++m_completed;
+    m_duration.observe(duration);
+    m_log->info("Saved {} bytes to {} in {:.1f} ms, {} pages copied",
+                job->total, job->path, duration / 1e6, parent_faults);
+  } else {
+    ++m_failed;
+    m_log->error("Could not save snapshot to {}: {}", job->path, job->error);
+  }
+
+  lua_State *L = m_engine->getLuaState();
+  job->co.push(L); // Keeps the coroutine alive until it's been resumed
+  lua_State *co = lua_tothread(L, -1);
+  lua_pushboolean(co, ok);
+  if (ok) {
+    lua_createtable(co, 0, 9);
+    lua::push(co, job->path);
+    lua_setfield(co, -2, "path");
+    lua::push(co, static_cast<lua_Integer>(job->total));
+    lua_setfield(co, -2, "bytes");
+    lua::push(co, job->fork_ns / 1e6);
+    lua_setfield(co, -2, "fork_ms");
+    lua::push(co, duration / 1e6);
+    lua_setfield(co, -2, "duration_ms");
+    lua::push(co, job->serialize_ns / 1e6);
+    lua_setfield(co, -2, "serialize_ms");
+    lua::push(co, job->write_ns / 1e6);
+    lua_setfield(co, -2, "write_ms");
+    lua::push(co, static_cast<lua_Integer>(parent_faults));
+    lua_setfield(co, -2, "parent_page_faults");
+    lua::push(co, static_cast<lua_Integer>(job->child_faults));
+    lua_setfield(co, -2, "child_page_faults");
+    lua::push(co, static_cast<lua_Integer>(parent_faults) *
+                      static_cast<lua_Integer>(sysconf(_SC_PAGESIZE)));
+    lua_setfield(co, -2, "copied_bytes");
+  } else {
+    lua::push(co, job->error);
+  }
+
+  job->pipe.close(
+      [](uv_handle_t *handle) { delete static_cast<Job *>(handle->data); });
+  m_engine->resume(co, 2);
+  lua_pop(L, 1); // Pop coroutine
+}
+
+#else
+
+Snapshotter::~Snapshotter() = default;
+
+void Snapshotter::start(lua_State *, int, std::string, lua::Ref) {
+  throw std::runtime_error("Snapshots are not supported on this platform");
+}
+
+#endif
+
+// Lua library
+
+static int afterSave(lua_State *L, int status, lua_KContext ctx) {
+  (void)status;
+  (void)ctx;
+  // 1 = ok, 2 = stats or error
+  if (!lua_toboolean(L, 1)) {
+    return lua_error(L);
+  }
+  return 1;
+}
+
+// snapshot.save(path, value) -> stats
+// Writes value to path from a forked process, relative to the game directory.
+// The game keeps running; the calling coroutine is suspended until the
+// snapshot is on disk
+int Snapshotter::l_save(lua_State *L) {
+  std::string_view path;
+  lua::arg(L, 1, path);
+  luaL_checkany(L, 2);
+  if (!lua_isyieldable(L)) {
+    return luaL_error(L, "snapshot.save must be called from a coroutine");
+  }
+  Engine *engine = Engine::fromLua(L);
+  Snapshotter *snapshotter = engine->getSnapshotter();
+  if (snapshotter->isRunning()) {
+    return luaL_error(L, "a snapshot is already running");
+  }
+
+  lua_settop(L, 2);
+  bool started = true;
+  {
+    std::string error;
+    try {
+      lua_pushthread(L);
+      lua::Ref co(L);
+      snapshotter->start(L, 2, engine->resolvePath(path), std::move(co));
+    } catch (const std::exception &e) {
+      error = e.what();
+      started = false;
+    }
+    if (!started) {
+      lua::push(L, error);
+    }
+  }
+  // Raised outside the block so no C++ objects are alive
+  if (!started) {
+    return lua_error(L);
+  }
+
+  lua_settop(L, 0);
+  return lua_yieldk(L, 0, 0, afterSave);
+}
+
+// snapshot.status() -> nil, or the running snapshot's progress
+int Snapshotter::l_status(lua_State *L) {
+  const Job *job = Engine::fromLua(L)->getSnapshotter()->m_job;
+  if (job == nullptr) {
+    lua_pushnil(L);
+    return 1;
+  }
+  lua_createtable(L, 0, 6);
+  lua::push(L, job->path);
+  lua_setfield(L, -2, "path");
+  lua::push(L, static_cast<lua_Integer>(job->pid));
+  lua_setfield(L, -2, "pid");
+  lua_pushstring(L, job->phase);
+  lua_setfield(L, -2, "phase");
+  lua::push(L, static_cast<lua_Integer>(job->written));
+  lua_setfield(L, -2, "written");
+  lua::push(L, static_cast<lua_Integer>(job->total));
+  lua_setfield(L, -2, "total");
+  lua::push(L, (uv_hrtime() - job->started_at) / 1e6);
+  lua_setfield(L, -2, "elapsed_ms");
+  return 1;
+}
+
+// snapshot.load(path) -> value
+// Reads a snapshot back, blocking. Meant for startup
+int Snapshotter::l_load(lua_State *L) {
+  std::string_view path;
+  lua::arg(L, 1, path);
+  Engine *engine = Engine::fromLua(L);
+
+  int nvalues = -1;
+  {
+    std::string full_path = engine->resolvePath(path);
+    std::string data;
+    FILE *file = std::fopen(full_path.c_str(), "rb");
+    // Kept from the failing call, fclose() may change errno
+    int err = errno;
+    if (file != nullptr) {
+      char buf[1 << 16];
+      std::size_t n;
+      while ((n = std::fread(buf, 1, sizeof(buf), file)) > 0) {
+        data.append(buf, n);
+      }
+      bool failed = std::ferror(file) != 0;
+      err = errno;
+      std::fclose(file);
+      if (failed) {
+        file = nullptr;
+      }
+    }
+
+    if (file == nullptr) {
+      lua_pushfstring(L, "could not read %s: %s", full_path.c_str(),
+                      std::strerror(err));
+    } else if (std::string_view(data).substr(0, MAGIC.size()) != MAGIC) {
+      lua_pushfstring(L, "%s is not a snapshot", full_path.c_str());
+    } else {
+      nvalues =
+          lua::deserialize(L, std::string_view(data).substr(MAGIC.size()));
+    }
+  }
+  if (nvalues < 0) {
+    return lua_error(L);
+  }
+  return nvalues;
+}
+
+// snapshot.stats() -> table of snapshot statistics
+int Snapshotter::l_stats(lua_State *L) {
+  Snapshotter *snapshotter = Engine::fromLua(L)->getSnapshotter();
+  lua_createtable(L, 0, 5);
+  lua_pushboolean(L, snapshotter->isRunning());
+  lua_setfield(L, -2, "running");
+  lua::push(L, static_cast<lua_Integer>(snapshotter->m_completed));
+  lua_setfield(L, -2, "completed");
+  lua::push(L, static_cast<lua_Integer>(snapshotter->m_failed));
+  lua_setfield(L, -2, "failed");
+  push_stats(L, snapshotter->m_fork_time);
+  lua_setfield(L, -2, "fork_time");
+  push_stats(L, snapshotter->m_duration);
+  lua_setfield(L, -2, "duration");
+  return 1;
+}
+
+int Snapshotter::luaopen(lua_State *L) {
+  static const luaL_Reg funcs[]{{"save", l_save},
+                                {"status", l_status},
+                                {"load", l_load},
+                                {"stats", l_stats},
+                                {nullptr, nullptr}};
+  luaL_newlib(L, funcs);
+  return 1;
+}
+
+} // namespace whatmud
@@ -0,0 +1,94 @@
+#ifndef WHATMUD_SNAPSHOT_HPP
+#define WHATMUD_SNAPSHOT_HPP
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+
+#include <lua.hpp>
+#include <spdlog/spdlog.h>
+
+#include "histogram.hpp"
+#include "lua/ref.hpp"
+#include "uv/pipe.hpp"
+
+namespace whatmud {
+
+// Forward declarations:
+class Engine;
+
+/**
+ * Consistent world snapshots without pausing the game.
+ * The process forks, and the child serializes a Lua value from its frozen
+ * copy-on-write image of the heap and writes it to disk, reporting progress
+ * over a pipe. The parent only pays for fork() itself and for copying the
+ * pages it writes to while the child runs, which is measured with the
+ * parent's minor page fault count.
+ *
+ * The child only runs the calling thread, so it must not touch libuv, the
+ * loggers or anything else another thread may hold a lock on. Lua and the
+ * serializer only need malloc(), which glibc makes safe after fork().
+ * Without fork(), on Windows, start() throws.
+ */
+class Snapshotter {
+public:
+  // Written at the start of every snapshot file
+  static constexpr std::string_view MAGIC = "WHATMUD-SNAPSHOT 1\n";
+  // Bytes written between progress reports
+  static constexpr std::size_t CHUNK_SIZE = 1 << 20;
+
+  Snapshotter(Engine *engine);
+  ~Snapshotter();
+
+  // No copy
+  Snapshotter(const Snapshotter &) = delete;
+  Snapshotter &operator=(const Snapshotter &) = delete;
+
+  bool isRunning() const { return m_job != nullptr; }
+
+  /**
+   * Fork and write the value at `index` on L's stack to `path` in the child.
+   * The file is written beside `path` and renamed over it once complete, so
+   * a crash never leaves a partial snapshot. `co` is resumed with
+   * (true, stats) or (false, error) once the child exits.
+   */
+  void start(lua_State *L, int index, std::string path, lua::Ref co);
+
+  // Register the `snapshot` library in Lua
+  static int luaopen(lua_State *L);
+
+private:
+  struct Job;
+
+  // Runs in the forked child and never returns
+  [[noreturn]] static void runChild(lua_State *L, int index,
+                                    const std::string &path, int fd);
+
+  // Handle one line of the child's report
+  void onLine(std::string_view line);
+  // Called once the child has closed its end of the pipe
+  void onEof();
+
+  static int l_save(lua_State *L);
+  static int l_status(lua_State *L);
+  static int l_load(lua_State *L);
+  static int l_stats(lua_State *L);
+
+private:
+  std::shared_ptr<spdlog::logger> m_log;
+  Engine *m_engine;
+  // The running snapshot, if any. Only one runs at a time
+  Job *m_job = nullptr;
+
+  std::uint64_t m_completed = 0;
+  std::uint64_t m_failed = 0;
+  // How long the game was paused in fork()
+  Histogram m_fork_time;
+  // Time from fork to the child exiting
+  Histogram m_duration;
+};
+
+} // namespace whatmud
+
+#endif
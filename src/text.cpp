@@ -0,0 +1,313 @@
+#include <algorithm>
+#include <iterator>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+// vmaxvq_u8() is AArch64 only, 32-bit ARM uses the scalar loops
+#include <arm_neon.h>
+#endif
+
+#include "text.hpp"
+
+namespace whatmud {
+
+static constexpr std::string_view REPLACEMENT_CHARACTER = "\xEF\xBF\xBD";
+
+// Index of the first non-ASCII byte at or after `pos`, or str.size()
+static std::size_t find_non_ascii(std::string_view str, std::size_t pos) {
+  const char *data = str.data();
+  std::size_t size = str.size();
+#if defined(__SSE2__)
+  for (; pos + 32 <= size; pos += 32) {
+    __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + pos));
+    __m128i b =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + pos + 16));
+    if (_mm_movemask_epi8(_mm_or_si128(a, b))) {
+      break;
+    }
+  }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+  for (; pos + 16 <= size; pos += 16) {
+    uint8x16_t v = vld1q_u8(reinterpret_cast<const std::uint8_t *>(data + pos));
+    if (vmaxvq_u8(v) >= 0x80) {
+      break;
+    }
+  }
+#endif
+  while (pos < size && static_cast<unsigned char>(data[pos]) < 0x80) {
+    ++pos;
+  }
+  return pos;
+}
+
+// Index of the first byte at or after `pos` that isn't printable ASCII, or
+// str.size()
+static std::size_t find_special(std::string_view str, std::size_t pos) {
+  const char *data = str.data();
+  std::size_t size = str.size();
+#if defined(__SSE2__)
+  // Bytes >= 0x80 are negative as signed chars, so one signed comparison
+  // catches them along with the C0 controls
+  const __m128i space = _mm_set1_epi8(0x20);
+  const __m128i del = _mm_set1_epi8(0x7F);
+  for (; pos + 16 <= size; pos += 16) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + pos));
+    __m128i special =
+        _mm_or_si128(_mm_cmplt_epi8(v, space), _mm_cmpeq_epi8(v, del));
+    if (_mm_movemask_epi8(special)) {
+      break;
+    }
+  }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+  for (; pos + 16 <= size; pos += 16) {
+    uint8x16_t v = vld1q_u8(reinterpret_cast<const std::uint8_t *>(data + pos));
+    // Printable ASCII is 0x20 - 0x7E; wrap it round to 0 - 0x5E
+    uint8x16_t shifted = vsubq_u8(v, vdupq_n_u8(0x20));
+    if (vmaxvq_u8(shifted) > 0x5E) {
+      break;
+    }
+  }
+#endif
+  while (pos < size) {
+    auto c = static_cast<unsigned char>(data[pos]);
+    if (c < 0x20 || c >= 0x7F) {
+      break;
+    }
+    ++pos;
+  }
+  return pos;
+}
+
+bool is_ascii(std::string_view str) {
+  return find_non_ascii(str, 0) == str.size();
+}
+
+std::size_t decode_utf8(std::string_view str, std::size_t pos,
+                        std::uint32_t &codepoint) {
+  auto byte = [&](std::size_t i) {
+    return static_cast<unsigned char>(str[pos + i]);
+  };
+  std::size_t avail = str.size() - pos;
+  unsigned char lead = byte(0);
+  std::size_t len;
+  std::uint32_t min;
+  if (lead < 0x80) {
+    codepoint = lead;
+    return 1;
+  } else if (lead >= 0xC2 && lead <= 0xDF) {
+    len = 2;
+    min = 0x80;
+    codepoint = lead & 0x1F;
+  } else if (lead >= 0xE0 && lead <= 0xEF) {
+    len = 3;
+    min = 0x800;
+    codepoint = lead & 0x0F;
+  } else if (lead >= 0xF0 && lead <= 0xF4) {
+    len = 4;
+    min = 0x10000;
+    codepoint = lead & 0x07;
+  } else {
+    return 0; // Continuation byte, or a lead byte that can only be overlong
+  }
+  if (avail < len) {
+    return 0;
+  }
+  for (std::size_t i = 1; i < len; ++i) {
+    if ((byte(i) & 0xC0) != 0x80) {
+      return 0;
+    }
+    codepoint = (codepoint << 6) | (byte(i) & 0x3F);
+  }
+  if (codepoint < min || codepoint > 0x10FFFF ||
+      (codepoint >= 0xD800 && codepoint <= 0xDFFF)) {
+    return 0;
+  }
+  return len;
+}
+
+void sanitize_input(std::string &line, bool utf8) {
+  std::size_t pos = find_special(line, 0);
+  if (pos == line.size()) {
+    return;
+  }
+
+  std::string out;
+  out.reserve(line.size() + 8);
+  out.append(line, 0, pos);
+  while (pos < line.size()) {
+    auto c = static_cast<unsigned char>(line[pos]);
+    if (c < 0x80) {
+      if (c == '\t') {
+        out += ' ';
+      }
+      ++pos; // Other controls and DEL are dropped
+    } else if (!utf8) {
+      // Latin-1 maps straight onto U+0080 - U+00FF. C1 controls are dropped
+      if (c >= 0xA0) {
+        out += static_cast<char>(0xC0 | (c >> 6));
+        out += static_cast<char>(0x80 | (c & 0x3F));
+      }
+      ++pos;
+    } else {
+      std::uint32_t codepoint;
+      std::size_t len = decode_utf8(line, pos, codepoint);
+      if (len == 0) {
+        out += REPLACEMENT_CHARACTER;
+        ++pos;
+      } else {
+        if (codepoint >= 0xA0) {
+          out.append(line, pos, len);
+        }
+        pos += len;
+      }
+    }
+    std::size_t next = find_special(line, pos);
+    out.append(line, pos, next - pos);
+    pos = next;
+  }
+  line = std::move(out);
+}
+
+// U+00A0 - U+00FF
+static constexpr std::string_view LATIN1[96]{
+    // U+00A0
+    " ", "!", "c", "L", "$", "Y", "|", "S", "\"", "(c)", "a", "<<", "!", "-",
+    "(R)", "-",
+    // U+00B0
+    "o", "+-", "2", "3", "'", "u", "P", ".", ",", "1", "o", ">>", "1/4", "1/2",
+    "3/4", "?",
+    // U+00C0
+    "A", "A", "A", "A", "A", "A", "AE", "C", "E", "E", "E", "E", "I", "I", "I",
+    "I",
+    // U+00D0
+    "D", "N", "O", "O", "O", "O", "O", "x", "O", "U", "U", "U", "U", "Y", "Th",
+    "ss",
+    // U+00E0
+    "a", "a", "a", "a", "a", "a", "ae", "c", "e", "e", "e", "e", "i", "i", "i",
+    "i",
+    // U+00F0
+    "d", "n", "o", "o", "o", "o", "o", "/", "o", "u", "u", "u", "u", "y", "th",
+    "y"};
+
+// U+0100 - U+017F, one letter each apart from the ligatures
+static constexpr std::string_view LATIN_EXTENDED_A =
+    "AaAaAaCcCcCcCcDdDdEeEeEeEeEeGgGgGgGgHhHhIiIiIiIiIi??JjKkkLlLlLlLlLlNnNnN"
+    "nnNnOoOoOo??RrRrRrSsSsSsSsTtTtTtUuUuUuUuUuUuWwYyYZzZzZzs";
+
+struct Transliteration {
+  std::uint32_t codepoint;
+  std::string_view ascii;
+};
+
+// Sorted by codepoint
+static constexpr Transliteration TRANSLITERATIONS[]{
+    {0x0132, "IJ"},  {0x0133, "ij"},   {0x0152, "OE"},  {0x0153, "oe"},
+    {0x2010, "-"},   {0x2011, "-"},    {0x2012, "-"},   {0x2013, "-"},
+    {0x2014, "--"},  {0x2015, "--"},   {0x2018, "'"},   {0x2019, "'"},
+    {0x201A, ","},   {0x201B, "'"},    {0x201C, "\""},  {0x201D, "\""},
+    {0x201E, "\""},  {0x2020, "+"},    {0x2022, "*"},   {0x2026, "..."},
+    {0x2032, "'"},   {0x2033, "\""},   {0x2039, "<"},   {0x203A, ">"},
+    {0x20AC, "EUR"}, {0x2122, "(TM)"}, {0x2190, "<-"},  {0x2191, "^"},
+    {0x2192, "->"},  {0x2193, "v"},    {0x2194, "<->"}, {0x2212, "-"},
+    {0x25A0, "#"},   {0x25CB, "o"},    {0x25CF, "o"}};
+
+static bool isBoxHorizontal(std::uint32_t c) {
+  switch (c) {
+  case 0x2500:
+  case 0x2501:
+  case 0x2504:
+  case 0x2505:
+  case 0x2508:
+  case 0x2509:
+  case 0x254C:
+  case 0x254D:
+  case 0x2574:
+  case 0x2576:
+  case 0x2578:
+  case 0x257A:
+    return true;
+  default:
+    return false;
+  }
+}
+
+static bool isBoxVertical(std::uint32_t c) {
+  switch (c) {
+  case 0x2502:
+  case 0x2503:
+  case 0x2506:
+  case 0x2507:
+  case 0x250A:
+  case 0x250B:
+  case 0x254E:
+  case 0x254F:
+  case 0x2551:
+  case 0x2575:
+  case 0x2577:
+  case 0x2579:
+  case 0x257B:
+    return true;
+  default:
+    return false;
+  }
+}
+
+static std::string_view transliterate(std::uint32_t c) {
+  if (c >= 0xA0 && c <= 0xFF) {
+    return LATIN1[c - 0xA0];
+  }
+  if (c >= 0x100 && c <= 0x17F && LATIN_EXTENDED_A[c - 0x100] != '?') {
+    return LATIN_EXTENDED_A.substr(c - 0x100, 1);
+  }
+  if (c >= 0x300 && c <= 0x36F) {
+    return ""; // Combining diacritics just disappear
+  }
+  if (c >= 0x2500 && c <= 0x257F) { // Box drawing
+    if (c == 0x2550) {
+      return "=";
+    } else if (isBoxHorizontal(c)) {
+      return "-";
+    } else if (isBoxVertical(c)) {
+      return "|";
+    }
+    return "+";
+  }
+  if (c >= 0x2580 && c <= 0x259F) { // Block elements
+    return "#";
+  }
+  const auto *end = std::end(TRANSLITERATIONS);
+  const auto *it = std::lower_bound(
+      std::begin(TRANSLITERATIONS), end, c,
+      [](const Transliteration &t, std::uint32_t c) {
+        return t.codepoint < c;
+      });
+  if (it != end && it->codepoint == c) {
+    return it->ascii;
+  }
+  return "?";
+}
+
+void transliterate_ascii(std::string_view str, std::string &out) {
+  out.reserve(out.size() + str.size());
+  std::size_t pos = 0;
+  while (pos < str.size()) {
+    std::size_t next = find_non_ascii(str, pos);
+    out.append(str, pos, next - pos);
+    pos = next;
+    if (pos == str.size()) {
+      break;
+    }
+    std::uint32_t codepoint;
+    std::size_t len = decode_utf8(str, pos, codepoint);
+    if (len == 0) {
+      out += '?';
+      ++pos;
+    } else {
+      out += transliterate(codepoint);
+      pos += len;
+    }
+  }
+}
+
+} // namespace whatmud
@@ -0,0 +1,40 @@
+#ifndef WHATMUD_TEXT_HPP
+#define WHATMUD_TEXT_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+namespace whatmud {
+
+// Whether every byte of `str` is 7-bit ASCII. Checks 32 bytes at a time with
+// SSE2, or 16 with AArch64 NEON
+bool is_ascii(std::string_view str);
+
+/**
+ * Decode the UTF-8 sequence starting at `str[pos]` into `codepoint`.
+ * Returns its length, or 0 if it's invalid, overlong, a surrogate or beyond
+ * U+10FFFF.
+ */
+std::size_t decode_utf8(std::string_view str, std::size_t pos,
+                        std::uint32_t &codepoint);
+
+/**
+ * Clean up a line of input in place, so Lua only ever sees valid UTF-8
+ * without control characters. Tabs become spaces, other C0 and C1 controls
+ * are removed, and invalid sequences become U+FFFD. Input from clients that
+ * don't use UTF-8 is taken to be Latin-1.
+ * Lines of printable ASCII, the common case, are left untouched after a
+ * vectorised scan.
+ */
+void sanitize_input(std::string &line, bool utf8);
+
+// Append `str` to `out` as ASCII, approximating accented letters, typographic
+// punctuation and box drawing characters, and replacing anything else with
+// '?'
+void transliterate_ascii(std::string_view str, std::string &out);
+
+} // namespace whatmud
+
+#endif
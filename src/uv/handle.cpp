@@ -3,7 +3,7 @@
 namespace whatmud::uv {
 
 std::ostream &operator<<(std::ostream &out, const Handle &handle) {
-  out << handle.getTypeName() << "@" << &handle;
+  out << handle.getTypeName() << "@" << handle.asHandle();
   if (handle.isActive()) {
     out << " (active)";
   }
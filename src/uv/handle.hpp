@@ -41,6 +41,18 @@ public:
   friend std::ostream &operator<<(std::ostream &out, const Handle &handle);
 };
 
+// A handle owned by something else, E.G. one found by uv_walk()
+class HandleView : public Handle {
+public:
+  explicit HandleView(uv_handle_t *handle) : m_handle(handle) {}
+
+  virtual uv_handle_t *asHandle() override { return m_handle; }
+  virtual const uv_handle_t *asHandle() const override { return m_handle; }
+
+private:
+  uv_handle_t *m_handle;
+};
+
 } // namespace whatmud::uv
 
 #endif
@@ -0,0 +1,25 @@
+#include "uv/pipe.hpp"
+#include "uv/error.hpp"
+
+namespace whatmud::uv {
+
+Pipe::Pipe(uv_loop_t *loop, bool ipc) {
+  int res = uv_pipe_init(loop, &m_handle, ipc);
+  uv::check_error(res);
+}
+
+void Pipe::open(uv_file file) {
+  int res = uv_pipe_open(&m_handle, file);
+  uv::check_error(res);
+}
+
+void Pipe::bind(const char *name) {
+  int res = uv_pipe_bind(&m_handle, name);
+  uv::check_error(res, "Could not bind pipe");
+}
+
+void Pipe::connect(uv_connect_t *req, const char *name, uv_connect_cb cb) {
+  uv_pipe_connect(req, &m_handle, name, cb);
+}
+
+} // namespace whatmud::uv
@@ -0,0 +1,35 @@
+#ifndef WHATMUD_UV_PIPE_HPP
+#define WHATMUD_UV_PIPE_HPP
+
+#include "uv/stream.hpp"
+
+namespace whatmud::uv {
+
+class Pipe : public Stream {
+public:
+  Pipe(uv_loop_t *loop, bool ipc = false);
+
+  virtual ~Pipe() = default;
+
+  virtual uv_stream_t *asStream() override { return (uv_stream_t *)&m_handle; }
+  virtual const uv_stream_t *asStream() const override {
+    return (uv_stream_t *)&m_handle;
+  }
+
+  uv_pipe_t *operator*() { return &m_handle; }
+  const uv_pipe_t *operator*() const { return &m_handle; }
+  uv_pipe_t *operator->() { return &m_handle; }
+  const uv_pipe_t *operator->() const { return &m_handle; }
+
+  void open(uv_file file);
+
+  void bind(const char *name);
+  void connect(uv_connect_t *req, const char *name, uv_connect_cb cb);
+
+private:
+  uv_pipe_t m_handle;
+};
+
+} // namespace whatmud::uv
+
+#endif
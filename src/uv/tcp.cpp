@@ -36,14 +36,16 @@ void TCP::bind(const struct sockaddr *addr, unsigned int flags) {
 }
 
 int TCP::getSockName(struct sockaddr *name) const {
-  int namelen;
+  // Callers pass a sockaddr_storage, which any address fits in
+  int namelen = sizeof(struct sockaddr_storage);
   int res = uv_tcp_getsockname(&m_handle, name, &namelen);
   uv::check_error(res);
   return namelen;
 }
 
 int TCP::getPeerName(struct sockaddr *name) const {
-  int namelen;
+  // Callers pass a sockaddr_storage, which any address fits in
+  int namelen = sizeof(struct sockaddr_storage);
   int res = uv_tcp_getpeername(&m_handle, name, &namelen);
   uv::check_error(res);
   return namelen;
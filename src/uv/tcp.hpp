@@ -30,6 +30,7 @@ public:
 
   void bind(const struct sockaddr *addr, unsigned int flags = 0);
 
+  // `name` must point to a sockaddr_storage. Returns the address's length
   int getSockName(struct sockaddr *name) const;
   int getPeerName(struct sockaddr *name) const;
 
@@ -0,0 +1,23 @@
+#include "uv/timer.hpp"
+#include "uv/error.hpp"
+
+namespace whatmud::uv {
+
+Timer::Timer(uv_loop_t *loop) { uv_timer_init(loop, &m_handle); }
+
+Timer::~Timer() { stop(); }
+
+void Timer::start(uv_timer_cb cb, std::uint64_t timeout,
+                  std::uint64_t repeat) {
+  int res = uv_timer_start(&m_handle, cb, timeout, repeat);
+  uv::check_error(res, "Could not start timer");
+}
+
+void Timer::stop() { uv_timer_stop(&m_handle); }
+
+void Timer::again() {
+  int res = uv_timer_again(&m_handle);
+  uv::check_error(res, "Could not restart timer");
+}
+
+} // namespace whatmud::uv
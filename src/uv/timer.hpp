@@ -0,0 +1,38 @@
+#ifndef WHATMUD_UV_TIMER_HPP
+#define WHATMUD_UV_TIMER_HPP
+
+#include <cstdint>
+
+#include "uv/handle.hpp"
+
+namespace whatmud::uv {
+
+class Timer : public uv::Handle {
+public:
+  Timer(uv_loop_t *loop);
+  virtual ~Timer();
+
+  virtual uv_handle_t *asHandle() override {
+    return reinterpret_cast<uv_handle_t *>(&m_handle);
+  }
+  virtual const uv_handle_t *asHandle() const override {
+    return reinterpret_cast<const uv_handle_t *>(&m_handle);
+  }
+
+  // Timeout and repeat are in milliseconds
+  void start(uv_timer_cb cb, std::uint64_t timeout, std::uint64_t repeat = 0);
+  void stop();
+  void again();
+
+  void setRepeat(std::uint64_t repeat) {
+    uv_timer_set_repeat(&m_handle, repeat);
+  }
+  std::uint64_t getRepeat() const { return uv_timer_get_repeat(&m_handle); }
+
+private:
+  uv_timer_t m_handle;
+};
+
+} // namespace whatmud::uv
+
+#endif
@@ -0,0 +1,239 @@
+#include <fmt/core.h>
+
+#include "engine.hpp"
+#include "lua/helpers.hpp"
+#include "lua/serialize.hpp"
+#include "uv/error.hpp"
+#include "worker_pool.hpp"
+
+namespace whatmud {
+
+// Continuation for spawn_job(), called when the coroutine is resumed with
+// (ok, results...)
+static int afterJob(lua_State *L, int status, lua_KContext ctx);
+
+WorkerPool::WorkerPool(Engine *engine, std::size_t size)
+    : m_engine(engine), m_workers(), m_idle(), m_queue() {
+  std::string path(fmt::format("{0}/?.lua;{0}/?/init.lua",
+                               engine->getGameDir()));
+  for (std::size_t i = 0; i < size; ++i) {
+    auto worker = std::make_unique<Worker>();
+    lua_State *L = worker->L;
+    // Workers find modules in the game directory, like the main state
+    lua_getglobal(L, "package");
+    lua::push(L, path);
+    lua_setfield(L, -2, "path");
+    lua_pop(L, 1);
+    m_idle.push_back(worker.get());
+    m_workers.emplace_back(std::move(worker));
+  }
+
+  Metrics &metrics = engine->getMetrics();
+  metrics.addGauge("whatmud_worker_jobs_queued",
+                   "Jobs waiting for a free Lua worker",
+                   [this] { return static_cast<double>(getQueued()); });
+  metrics.addHistogram("whatmud_worker_wait_seconds",
+                       "Time jobs spent waiting for a Lua worker",
+                       m_wait_time);
+  metrics.addHistogram("whatmud_worker_run_seconds",
+                       "Time jobs spent running on a Lua worker", m_run_time);
+}
+
+WorkerPool::~WorkerPool() {
+  for (Job *job : m_queue) {
+    delete job;
+  }
+}
+
+void WorkerPool::submit(Job *job) {
+  job->pool = this;
+  job->queued_at = uv_hrtime();
+  m_queue.push_back(job);
+  dispatch();
+}
+
+void WorkerPool::dispatch() {
+  while (!m_idle.empty() && !m_queue.empty()) {
+    Job *job = m_queue.front();
+    m_queue.pop_front();
+    job->worker = m_idle.back();
+    m_idle.pop_back();
+    job->req.data = job;
+    int res = uv_queue_work(m_engine->getLoop(), &job->req, runJob, finishJob);
+    uv::check_error(res, "Could not queue job");
+  }
+}
+
+// Runs in protected mode on the worker's state
+// Upvalue 1 is the Job, returns the function's results
+static int callJob(lua_State *L) {
+  auto *job_module = static_cast<const std::string *>(
+      lua_touserdata(L, lua_upvalueindex(1)));
+  auto *job_function = static_cast<const std::string *>(
+      lua_touserdata(L, lua_upvalueindex(2)));
+  auto *job_args = static_cast<const std::string *>(
+      lua_touserdata(L, lua_upvalueindex(3)));
+
+  // require(module)[function]
+  lua_getglobal(L, "require");
+  lua::push(L, *job_module);
+  lua_call(L, 1, 1);
+  if (lua_getfield(L, -1, job_function->c_str()) != LUA_TFUNCTION) {
+    return luaL_error(L, "module '%s' has no function '%s'",
+                      job_module->c_str(), job_function->c_str());
+  }
+  lua_remove(L, -2);
+  int base = lua_gettop(L);
+
+  int nargs = lua::deserialize(L, *job_args);
+  if (nargs < 0) {
+    return lua_error(L);
+  }
+  lua_call(L, nargs, LUA_MULTRET);
+  return lua_gettop(L) - base + 1;
+}
+
+void WorkerPool::runJob(uv_work_t *req) {
+  Job *job = reinterpret_cast<Job *>(req->data);
+  lua_State *L = job->worker->L;
+  job->started_at = uv_hrtime();
+
+  lua_settop(L, 0);
+  lua_pushcfunction(L, lua::traceback);
+  lua_pushlightuserdata(L, &job->module);
+  lua_pushlightuserdata(L, &job->function);
+  lua_pushlightuserdata(L, &job->args);
+  lua_pushcclosure(L, callJob, 3);
+  job->ok = lua_pcall(L, 0, LUA_MULTRET, 1) == LUA_OK;
+  if (job->ok) {
+    job->ok = lua::serialize(L, 2, lua_gettop(L) - 1, job->results);
+  }
+  if (!job->ok) {
+    std::string_view err;
+    lua::get(L, -1, err);
+    job->results.assign(err.data(), err.size());
+  }
+  lua_settop(L, 0);
+  // Don't let garbage from one job linger until the next
+  lua_gc(L, LUA_GCSTEP, 0);
+
+  job->finished_at = uv_hrtime();
+}
+
+void WorkerPool::finishJob(uv_work_t *req, int status) {
+  Job *job = reinterpret_cast<Job *>(req->data);
+  WorkerPool *pool = job->pool;
+  pool->m_idle.push_back(job->worker);
+  if (status == UV_ECANCELED) {
+    job->ok = false;
+    job->results = "job was cancelled";
+  } else {
+    pool->m_wait_time.observe(job->started_at - job->queued_at);
+    pool->m_run_time.observe(job->finished_at - job->started_at);
+  }
+  if (job->ok) {
+    ++pool->m_completed;
+  } else {
+    ++pool->m_failed;
+  }
+
+  // Hand the results to the waiting coroutine
+  lua_State *L = pool->m_engine->getLuaState();
+  job->co.push(L); // Keeps the coroutine alive until it's been resumed
+  lua_State *co = lua_tothread(L, -1);
+  lua_pushboolean(co, job->ok);
+  int nresults;
+  if (job->ok) {
+    nresults = lua::deserialize(L, job->results);
+    if (nresults < 0) {
+      lua_pushboolean(co, false);
+      lua_replace(co, -2);
+      nresults = 1;
+    }
+    lua_xmove(L, co, nresults);
+  } else {
+    lua::push(co, job->results);
+    nresults = 1;
+  }
+  delete job;
+
+  // Start the next job before running more Lua, which may queue others
+  pool->dispatch();
+  pool->m_engine->resume(co, nresults + 1);
+  lua_pop(L, 1); // Pop coroutine
+}
+
+static int afterJob(lua_State *L, int status, lua_KContext ctx) {
+  (void)status;
+  (void)ctx;
+  // 1 = ok, 2... = results or error
+  if (!lua_toboolean(L, 1)) {
+    return lua_error(L);
+  }
+  return lua_gettop(L) - 1;
+}
+
+// spawn_job(module, function, ...)
+// Runs require(module)[function](...) on a worker thread, and returns its
+// results. Must be called from a coroutine, which is suspended until the job
+// completes
+int WorkerPool::l_spawn_job(lua_State *L) {
+  luaL_checkstring(L, 1);
+  luaL_checkstring(L, 2);
+  if (!lua_isyieldable(L)) {
+    return luaL_error(L, "spawn_job must be called from a coroutine");
+  }
+  WorkerPool *pool = Engine::fromLua(L)->getWorkerPool();
+  if (pool == nullptr || pool->getSize() == 0) {
+    return luaL_error(L, "no worker threads, set worker_threads in init.lua");
+  }
+
+  Job *job = new Job();
+  lua::get(L, 1, job->module);
+  lua::get(L, 2, job->function);
+  if (!lua::serialize(L, 3, lua_gettop(L) - 2, job->args)) {
+    delete job;
+    return lua_error(L);
+  }
+  lua_pushthread(L);
+  job->co = lua::Ref(L);
+  pool->submit(job);
+
+  lua_settop(L, 0);
+  return lua_yieldk(L, 0, 0, afterJob);
+}
+
+// job_stats()
+// Returns a table describing the worker pool
+int WorkerPool::l_job_stats(lua_State *L) {
+  WorkerPool *pool = Engine::fromLua(L)->getWorkerPool();
+  if (pool == nullptr) {
+    lua_pushnil(L);
+    return 1;
+  }
+  lua_createtable(L, 0, 8);
+  lua::push(L, static_cast<lua_Integer>(pool->getSize()));
+  lua_setfield(L, -2, "workers");
+  lua::push(L, static_cast<lua_Integer>(pool->getRunning()));
+  lua_setfield(L, -2, "running");
+  lua::push(L, static_cast<lua_Integer>(pool->getQueued()));
+  lua_setfield(L, -2, "queued");
+  lua::push(L, static_cast<lua_Integer>(pool->m_completed));
+  lua_setfield(L, -2, "completed");
+  lua::push(L, static_cast<lua_Integer>(pool->m_failed));
+  lua_setfield(L, -2, "failed");
+  push_stats(L, pool->getWaitTime());
+  lua_setfield(L, -2, "wait_time");
+  push_stats(L, pool->getRunTime());
+  lua_setfield(L, -2, "run_time");
+  return 1;
+}
+
+void WorkerPool::registerBuiltins(lua_State *L) {
+  lua_pushcfunction(L, l_spawn_job);
+  lua_setglobal(L, "spawn_job");
+  lua_pushcfunction(L, l_job_stats);
+  lua_setglobal(L, "job_stats");
+}
+
+} // namespace whatmud
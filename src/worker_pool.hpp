@@ -0,0 +1,99 @@
+#ifndef WHATMUD_WORKER_POOL_HPP
+#define WHATMUD_WORKER_POOL_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <uv.h>
+
+#include "histogram.hpp"
+#include "lua/ref.hpp"
+#include "lua/state.hpp"
+
+namespace whatmud {
+
+// Forward declarations:
+class Engine;
+
+/**
+ * Runs CPU-heavy Lua functions on libuv's thread pool.
+ * Each worker owns a separate lua_State with the game directory on its
+ * package.path. A worker is only ever used by one thread at a time, and is
+ * handed out and returned on the loop thread, so no locking is needed.
+ * Arguments and results cross between states with lua::serialize().
+ */
+class WorkerPool {
+public:
+  WorkerPool(Engine *engine, std::size_t size);
+  ~WorkerPool();
+
+  // No copy
+  WorkerPool(const WorkerPool &) = delete;
+  WorkerPool &operator=(const WorkerPool &) = delete;
+
+  std::size_t getSize() const { return m_workers.size(); }
+  std::size_t getIdle() const { return m_idle.size(); }
+  // Jobs waiting for a free worker
+  std::size_t getQueued() const { return m_queue.size(); }
+  std::size_t getRunning() const { return getSize() - getIdle(); }
+
+  // Time spent waiting for a worker, and running on one
+  const Histogram &getWaitTime() const { return m_wait_time; }
+  const Histogram &getRunTime() const { return m_run_time; }
+
+  // Register spawn_job() and job_stats() in the main Lua state
+  static void registerBuiltins(lua_State *L);
+
+private:
+  struct Worker {
+    lua::State L;
+  };
+
+  struct Job {
+    uv_work_t req;
+    WorkerPool *pool;
+    Worker *worker;
+    // Coroutine to resume once the job completes
+    lua::Ref co;
+    std::string module;
+    std::string function;
+    // Serialized arguments, then results or error message
+    std::string args;
+    std::string results;
+    bool ok;
+    std::uint64_t queued_at;
+    std::uint64_t started_at;
+    std::uint64_t finished_at;
+  };
+
+  // Queue a job, it will run when a worker is free
+  void submit(Job *job);
+  // Start queued jobs on any idle workers
+  void dispatch();
+
+  // Called on a pool thread
+  static void runJob(uv_work_t *req);
+  // Called on the loop thread once a job has finished
+  static void finishJob(uv_work_t *req, int status);
+
+  static int l_spawn_job(lua_State *L);
+  static int l_job_stats(lua_State *L);
+
+private:
+  Engine *m_engine;
+  std::vector<std::unique_ptr<Worker>> m_workers;
+  std::vector<Worker *> m_idle;
+  std::deque<Job *> m_queue;
+  Histogram m_wait_time;
+  Histogram m_run_time;
+  std::uint64_t m_completed = 0;
+  std::uint64_t m_failed = 0;
+};
+
+} // namespace whatmud
+
+#endif
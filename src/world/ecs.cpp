@@ -0,0 +1,671 @@
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <optional>
+#include <type_traits>
+
+#include "lua/helpers.hpp"
+#include "world/ecs.hpp"
+
+namespace whatmud::world {
+
+static constexpr Entity SLOT_MASK = 0xFFFFFFFF;
+
+static std::uint32_t slotOf(Entity e) {
+  return static_cast<std::uint32_t>(e & SLOT_MASK);
+}
+
+// ComponentStore
+
+ComponentStore::ComponentStore(std::string name)
+    : m_name(std::move(name)), m_sparse(), m_entities(), m_columns() {}
+
+void ComponentStore::addField(std::string name, FieldType type) {
+  Column col{std::move(name), type, {}, {}};
+  if (type == FieldType::Number) {
+    col.nums.resize(m_entities.size());
+  } else {
+    col.ints.resize(m_entities.size());
+  }
+  m_columns.emplace_back(std::move(col));
+}
+
+int ComponentStore::findField(std::string_view name) const {
+  for (std::size_t i = 0; i < m_columns.size(); ++i) {
+    if (m_columns[i].name == name) {
+      return static_cast<int>(i);
+    }
+  }
+  return -1;
+}
+
+std::ptrdiff_t ComponentStore::indexOf(Entity e) const {
+  std::uint32_t slot = slotOf(e);
+  if (slot >= m_sparse.size() || m_sparse[slot] == 0) {
+    return -1;
+  }
+  std::size_t index = m_sparse[slot] - 1;
+  // A stale handle shares the slot but not the generation
+  return m_entities[index] == e ? static_cast<std::ptrdiff_t>(index) : -1;
+}
+
+std::size_t ComponentStore::add(Entity e) {
+  std::ptrdiff_t existing = indexOf(e);
+  if (existing >= 0) {
+    return existing;
+  }
+  std::uint32_t slot = slotOf(e);
+  if (slot >= m_sparse.size()) {
+    m_sparse.resize(slot + 1);
+  }
+  m_entities.push_back(e);
+  for (Column &col : m_columns) {
+    if (col.type == FieldType::Number) {
+      col.nums.push_back(0);
+    } else {
+      col.ints.push_back(0);
+    }
+  }
+  m_sparse[slot] = static_cast<std::uint32_t>(m_entities.size());
+  return m_entities.size() - 1;
+}
+
+bool ComponentStore::remove(Entity e) {
+  std::ptrdiff_t index = indexOf(e);
+  if (index < 0) {
+    return false;
+  }
+  // Swap-remove, keeping the columns dense
+  std::size_t last = m_entities.size() - 1;
+  if (static_cast<std::size_t>(index) != last) {
+    m_entities[index] = m_entities[last];
+    m_sparse[slotOf(m_entities[index])] = static_cast<std::uint32_t>(index + 1);
+    for (Column &col : m_columns) {
+      if (col.type == FieldType::Number) {
+        col.nums[index] = col.nums[last];
+      } else {
+        col.ints[index] = col.ints[last];
+      }
+    }
+  }
+  m_entities.pop_back();
+  for (Column &col : m_columns) {
+    if (col.type == FieldType::Number) {
+      col.nums.pop_back();
+    } else {
+      col.ints.pop_back();
+    }
+  }
+  m_sparse[slotOf(e)] = 0;
+  return true;
+}
+
+// World
+
+Entity World::create() {
+  std::uint32_t slot;
+  if (!m_free_slots.empty()) {
+    slot = m_free_slots.back();
+    m_free_slots.pop_back();
+  } else {
+    slot = static_cast<std::uint32_t>(m_generations.size());
+    // Generations start at 1, so no live entity is 0
+    m_generations.push_back(1);
+  }
+  return (static_cast<Entity>(m_generations[slot]) << 32) | slot;
+}
+
+bool World::isAlive(Entity e) const {
+  std::uint32_t slot = slotOf(e);
+  return slot < m_generations.size() &&
+         static_cast<Entity>(m_generations[slot]) == (e >> 32);
+}
+
+void World::destroy(Entity e) {
+  if (!isAlive(e)) {
+    return;
+  }
+  for (auto &component : m_components) {
+    component->remove(e);
+  }
+  std::uint32_t slot = slotOf(e);
+  // Skip 0 when the generation wraps around
+  if (++m_generations[slot] == 0) {
+    m_generations[slot] = 1;
+  }
+  m_free_slots.push_back(slot);
+}
+
+ComponentStore &World::defineComponent(std::string name) {
+  m_components.emplace_back(std::make_unique<ComponentStore>(std::move(name)));
+  return *m_components.back();
+}
+
+ComponentStore *World::findComponent(std::string_view name) {
+  for (auto &component : m_components) {
+    if (component->getName() == name) {
+      return component.get();
+    }
+  }
+  return nullptr;
+}
+
+// Lua bindings
+
+static const char *const FIELD_TYPES[]{"integer", "number", "boolean",
+                                       nullptr};
+
+static ComponentStore *checkComponent(lua_State *L, World *world, int index) {
+  std::string_view name;
+  lua::arg(L, index, name);
+  ComponentStore *store = world->findComponent(name);
+  if (store == nullptr) {
+    luaL_error(L, "no component named '%s'", name.data());
+  }
+  return store;
+}
+
+static std::size_t checkField(lua_State *L, ComponentStore *store, int index) {
+  // Checked explicitly, converting a number in place would confuse lua_next()
+  luaL_checktype(L, index, LUA_TSTRING);
+  std::string_view name;
+  lua::get(L, index, name);
+  int field = store->findField(name);
+  if (field < 0) {
+    luaL_error(L, "component '%s' has no field '%s'", store->getName().c_str(),
+               name.data());
+  }
+  return static_cast<std::size_t>(field);
+}
+
+static Entity checkEntity(lua_State *L, World *world, int index) {
+  lua_Integer e;
+  lua::arg(L, index, e);
+  luaL_argcheck(L, world->isAlive(e), index, "entity does not exist");
+  return e;
+}
+
+static void pushField(lua_State *L, const ComponentStore::Column &col,
+                      std::size_t row) {
+  switch (col.type) {
+  case FieldType::Integer:
+    lua_pushinteger(L, col.ints[row]);
+    break;
+  case FieldType::Number:
+    lua_pushnumber(L, col.nums[row]);
+    break;
+  case FieldType::Boolean:
+    lua_pushboolean(L, col.ints[row] != 0);
+    break;
+  }
+}
+
+// Raise if the value at `index` can't be stored in the column
+static void checkValue(lua_State *L, const ComponentStore::Column &col,
+                       int index) {
+  switch (col.type) {
+  case FieldType::Integer:
+    if (!lua_isinteger(L, index)) {
+      luaL_error(L, "field '%s' expects an integer", col.name.c_str());
+    }
+    break;
+  case FieldType::Number:
+    if (lua_type(L, index) != LUA_TNUMBER) {
+      luaL_error(L, "field '%s' expects a number", col.name.c_str());
+    }
+    break;
+  case FieldType::Boolean:
+    break;
+  }
+}
+
+static void setField(lua_State *L, ComponentStore::Column &col,
+                     std::size_t row, int index) {
+  checkValue(L, col, index);
+  switch (col.type) {
+  case FieldType::Integer:
+    col.ints[row] = lua_tointeger(L, index);
+    break;
+  case FieldType::Number:
+    col.nums[row] = lua_tonumber(L, index);
+    break;
+  case FieldType::Boolean:
+    col.ints[row] = lua_toboolean(L, index);
+    break;
+  }
+}
+
+// Push a sequence of entities
+static int pushEntities(lua_State *L, std::span<const Entity> entities) {
+  lua_createtable(L, static_cast<int>(entities.size()), 0);
+  for (std::size_t i = 0; i < entities.size(); ++i) {
+    lua_pushinteger(L, entities[i]);
+    lua_rawseti(L, -2, static_cast<lua_Integer>(i + 1));
+  }
+  return 1;
+}
+
+// world:spawn() -> entity
+static int l_spawn(lua_State *L) {
+  World *world = lua::check_userdata<World>(L, 1);
+  lua_pushinteger(L, world->create());
+  return 1;
+}
+
+// world:destroy(entity)
+// Removes the entity and all of its components
+static int l_destroy(lua_State *L) {
+  World *world = lua::check_userdata<World>(L, 1);
+  lua_Integer e;
+  lua::arg(L, 2, e);
+  world->destroy(e);
+  return 0;
+}
+
+// world:alive(entity)
+static int l_alive(lua_State *L) {
+  World *world = lua::check_userdata<World>(L, 1);
+  lua_Integer e;
+  lua::arg(L, 2, e);
+  lua_pushboolean(L, world->isAlive(e));
+  return 1;
+}
+
+// world:component(name, {field = "integer" | "number" | "boolean", ...})
+static int l_component(lua_State *L) {
+  World *world = lua::check_userdata<World>(L, 1);
+  std::string_view name;
+  lua::arg(L, 2, name);
+  luaL_checktype(L, 3, LUA_TTABLE);
+  if (world->findComponent(name) != nullptr) {
+    return luaL_error(L, "component '%s' already exists", name.data());
+  }
+  // Validate every field before creating anything
+  lua_pushnil(L);
+  while (lua_next(L, 3)) {
+    if (lua_type(L, -2) != LUA_TSTRING) {
+      return luaL_error(L, "field names must be strings");
+    }
+    luaL_checkoption(L, lua_gettop(L), nullptr, FIELD_TYPES);
+    lua_pop(L, 1);
+  }
+
+  ComponentStore &store = world->defineComponent(std::string(name));
+  lua_pushnil(L);
+  while (lua_next(L, 3)) {
+    int type = luaL_checkoption(L, lua_gettop(L), nullptr, FIELD_TYPES);
+    std::string_view field;
+    lua::get(L, -2, field);
+    store.addField(std::string(field), static_cast<FieldType>(type));
+    lua_pop(L, 1);
+  }
+  return 0;
+}
+
+// world:set(entity, component[, {field = value, ...}])
+// Adds the component if the entity doesn't have it, and assigns the fields
+static int l_set(lua_State *L) {
+  World *world = lua::check_userdata<World>(L, 1);
+  Entity e = checkEntity(L, world, 2);
+  ComponentStore *store = checkComponent(L, world, 3);
+  if (lua_isnoneornil(L, 4)) {
+    store->add(e);
+    return 0;
+  }
+  luaL_checktype(L, 4, LUA_TTABLE);
+  // Check every field first, so errors don't leave the component half set
+  lua_pushnil(L);
+  while (lua_next(L, 4)) {
+    std::size_t field = checkField(L, store, lua_gettop(L) - 1);
+    checkValue(L, store->getColumn(field), lua_gettop(L));
+    lua_pop(L, 1);
+  }
+  std::size_t row = store->add(e);
+  lua_pushnil(L);
+  while (lua_next(L, 4)) {
+    std::size_t field = checkField(L, store, lua_gettop(L) - 1);
+    setField(L, store->getColumn(field), row, lua_gettop(L));
+    lua_pop(L, 1);
+  }
+  return 0;
+}
+
+// world:get(entity, component) -> view or nil
+// The view reads and writes the entity's fields in place
+static int l_get(lua_State *L) {
+  World *world = lua::check_userdata<World>(L, 1);
+  lua_Integer e;
+  lua::arg(L, 2, e);
+  ComponentStore *store = checkComponent(L, world, 3);
+  if (!store->has(e)) {
+    lua_pushnil(L);
+    return 1;
+  }
+  lua::new_userdata_uv<ComponentView>(L, 1, store, e);
+  // Keep the world alive for as long as the view is
+  lua_pushvalue(L, 1);
+  lua_setiuservalue(L, -2, 1);
+  return 1;
+}
+
+// world:has(entity, component)
+static int l_has(lua_State *L) {
+  World *world = lua::check_userdata<World>(L, 1);
+  lua_Integer e;
+  lua::arg(L, 2, e);
+  lua_pushboolean(L, checkComponent(L, world, 3)->has(e));
+  return 1;
+}
+
+// world:remove(entity, component)
+static int l_remove(lua_State *L) {
+  World *world = lua::check_userdata<World>(L, 1);
+  lua_Integer e;
+  lua::arg(L, 2, e);
+  lua_pushboolean(L, checkComponent(L, world, 3)->remove(e));
+  return 1;
+}
+
+// world:count(component)
+static int l_count(lua_State *L) {
+  World *world = lua::check_userdata<World>(L, 1);
+  ComponentStore *store = checkComponent(L, world, 2);
+  lua_pushinteger(L, static_cast<lua_Integer>(store->size()));
+  return 1;
+}
+
+// world:each(component, fn)
+// Calls fn(entity) for each entity with the component. The callback may
+// remove the component from the entity it is given
+static int l_each(lua_State *L) {
+  World *world = lua::check_userdata<World>(L, 1);
+  ComponentStore *store = checkComponent(L, world, 2);
+  luaL_checktype(L, 3, LUA_TFUNCTION);
+  // Walk backwards, swap-removal only moves entities we've already visited
+  std::size_t i = store->size();
+  while (i > 0) {
+    // The callback may have shrunk the component
+    i = std::min(i, store->size());
+    if (i == 0) {
+      break;
+    }
+    --i;
+    lua_pushvalue(L, 3);
+    lua_pushinteger(L, store->getEntities()[i]);
+    lua_call(L, 1, 0);
+  }
+  return 0;
+}
+
+// world:query(component, ...) -> {entities...}
+// Entities having all the given components
+static int l_query(lua_State *L) {
+  static constexpr int MAX_COMPONENTS = 16;
+  World *world = lua::check_userdata<World>(L, 1);
+  int count = lua_gettop(L) - 1;
+  luaL_argcheck(L, count >= 1 && count <= MAX_COMPONENTS, 2,
+                "expected 1 to 16 components");
+  ComponentStore *stores[MAX_COMPONENTS];
+  for (int i = 0; i < count; ++i) {
+    stores[i] = checkComponent(L, world, i + 2);
+  }
+  // Iterate the smallest component, probe the others
+  std::sort(stores, stores + count,
+            [](auto *a, auto *b) { return a->size() < b->size(); });
+  std::vector<Entity> result;
+  for (Entity e : stores[0]->getEntities()) {
+    if (std::all_of(stores + 1, stores + count,
+                    [e](auto *store) { return store->has(e); })) {
+      result.push_back(e);
+    }
+  }
+  return pushEntities(L, result);
+}
+
+// A column to read from, or a constant
+template <class T> struct Operand {
+  const T *column = nullptr;
+  T constant = 0;
+  T operator[](std::size_t i) const { return column ? column[i] : constant; }
+};
+
+template <class T>
+static Operand<T> checkOperand(lua_State *L, ComponentStore *store, int index,
+                               FieldType type) {
+  if (lua_type(L, index) == LUA_TSTRING) {
+    const auto &col = store->getColumn(checkField(L, store, index));
+    luaL_argcheck(L, col.type == type, index, "field types differ");
+    if constexpr (std::is_same_v<T, double>) {
+      return Operand<T>{col.nums.data(), 0};
+    } else {
+      return Operand<T>{col.ints.data(), 0};
+    }
+  }
+  if constexpr (std::is_same_v<T, double>) {
+    return Operand<T>{nullptr, luaL_checknumber(L, index)};
+  } else {
+    return Operand<T>{nullptr, luaL_checkinteger(L, index)};
+  }
+}
+
+// Whether a + b overflows, without relying on __builtin_add_overflow, which
+// MSVC doesn't have
+template <class T> static bool addOverflows(T a, T b) {
+  if (b > 0) {
+    return a > std::numeric_limits<T>::max() - b;
+  }
+  return a < std::numeric_limits<T>::min() - b;
+}
+
+// Returns false if an integer sum overflows, checked before anything changes
+// so the column is left as it was. A sum too large is fine if it's capped
+template <class T>
+static bool addColumn(std::vector<T> &dst, Operand<T> amount,
+                      std::optional<Operand<T>> cap) {
+  std::size_t size = dst.size();
+  if constexpr (std::is_integral_v<T>) {
+    for (std::size_t i = 0; i < size; ++i) {
+      if (addOverflows(dst[i], amount[i]) && !(cap && amount[i] > 0)) {
+        return false;
+      }
+    }
+  }
+  if (cap) {
+    for (std::size_t i = 0; i < size; ++i) {
+      if constexpr (std::is_integral_v<T>) {
+        // Only a positive amount gets here overflowing, past any cap
+        if (addOverflows(dst[i], amount[i])) {
+          dst[i] = (*cap)[i];
+          continue;
+        }
+      }
+      dst[i] = std::min(dst[i] + amount[i], (*cap)[i]);
+    }
+  } else {
+    for (std::size_t i = 0; i < size; ++i) {
+      dst[i] += amount[i];
+    }
+  }
+  return true;
+}
+
+// world:add(component, field, amount[, cap])
+// For every entity: field = min(field + amount, cap). `amount` and `cap` are
+// numbers, or names of fields of the same type. Runs as one C++ loop. An
+// integer field that would overflow raises an error, with nothing changed
+static int l_add(lua_State *L) {
+  World *world = lua::check_userdata<World>(L, 1);
+  ComponentStore *store = checkComponent(L, world, 2);
+  auto &col = store->getColumn(checkField(L, store, 3));
+  bool has_cap = !lua_isnoneornil(L, 5);
+  switch (col.type) {
+  case FieldType::Integer: {
+    auto amount = checkOperand<std::int64_t>(L, store, 4, col.type);
+    std::optional<Operand<std::int64_t>> cap;
+    if (has_cap) {
+      cap = checkOperand<std::int64_t>(L, store, 5, col.type);
+    }
+    if (!addColumn(col.ints, amount, cap)) {
+      return luaL_error(L, "integer overflow adding to '%s'",
+                        lua_tostring(L, 3));
+    }
+    break;
+  }
+  case FieldType::Number: {
+    auto amount = checkOperand<double>(L, store, 4, col.type);
+    std::optional<Operand<double>> cap;
+    if (has_cap) {
+      cap = checkOperand<double>(L, store, 5, col.type);
+    }
+    addColumn(col.nums, amount, cap);
+    break;
+  }
+  case FieldType::Boolean:
+    return luaL_argerror(L, 3, "cannot add to a boolean field");
+  }
+  return 0;
+}
+
+// world:scale(component, field, factor)
+// Multiplies a number field by a factor for every entity
+static int l_scale(lua_State *L) {
+  World *world = lua::check_userdata<World>(L, 1);
+  ComponentStore *store = checkComponent(L, world, 2);
+  auto &col = store->getColumn(checkField(L, store, 3));
+  luaL_argcheck(L, col.type == FieldType::Number, 3, "expected number field");
+  auto factor = checkOperand<double>(L, store, 4, col.type);
+  for (std::size_t i = 0; i < col.nums.size(); ++i) {
+    col.nums[i] *= factor[i];
+  }
+  return 0;
+}
+
+// world:select(component, field, op, value) -> {entities...}
+// Entities where `field op value` holds, op is one of < <= > >= == ~=
+static int l_select(lua_State *L) {
+  static const char *const ops[]{"<", "<=", ">", ">=", "==", "~=", nullptr};
+  World *world = lua::check_userdata<World>(L, 1);
+  ComponentStore *store = checkComponent(L, world, 2);
+  const auto &col = store->getColumn(checkField(L, store, 3));
+  int op = luaL_checkoption(L, 4, nullptr, ops);
+  double value;
+  if (col.type == FieldType::Boolean) {
+    luaL_argcheck(L, op >= 4, 4, "booleans only support == and ~=");
+    value = lua_toboolean(L, 5);
+  } else {
+    value = luaL_checknumber(L, 5);
+  }
+
+  auto entities = store->getEntities();
+  std::vector<Entity> result;
+  auto filter = [&](const auto &values) {
+    for (std::size_t i = 0; i < values.size(); ++i) {
+      double v = static_cast<double>(values[i]);
+      bool match = false;
+      switch (op) {
+      case 0:
+        match = v < value;
+        break;
+      case 1:
+        match = v <= value;
+        break;
+      case 2:
+        match = v > value;
+        break;
+      case 3:
+        match = v >= value;
+        break;
+      case 4:
+        match = v == value;
+        break;
+      case 5:
+        match = v != value;
+        break;
+      }
+      if (match) {
+        result.push_back(entities[i]);
+      }
+    }
+  };
+  if (col.type == FieldType::Number) {
+    filter(col.nums);
+  } else {
+    filter(col.ints);
+  }
+  return pushEntities(L, result);
+}
+
+const luaL_Reg World::LUA_METHODS[]{{"spawn", l_spawn},
+                                    {"destroy", l_destroy},
+                                    {"alive", l_alive},
+                                    {"component", l_component},
+                                    {"set", l_set},
+                                    {"get", l_get},
+                                    {"has", l_has},
+                                    {"remove", l_remove},
+                                    {"count", l_count},
+                                    {"each", l_each},
+                                    {"query", l_query},
+                                    {"add", l_add},
+                                    {"scale", l_scale},
+                                    {"select", l_select},
+                                    {nullptr, nullptr}};
+
+// Returns the view's row, raising an error if the entity has lost the
+// component since the view was created
+static std::size_t checkViewRow(lua_State *L, ComponentView *view) {
+  std::ptrdiff_t row = view->getStore()->indexOf(view->getEntity());
+  if (row < 0) {
+    luaL_error(L, "entity no longer has component '%s'",
+               view->getStore()->getName().c_str());
+  }
+  return static_cast<std::size_t>(row);
+}
+
+// view.field
+static int l_view_index(lua_State *L) {
+  auto *view = lua::check_userdata<ComponentView>(L, 1);
+  ComponentStore *store = view->getStore();
+  std::size_t row = checkViewRow(L, view);
+  std::string_view name;
+  lua::arg(L, 2, name);
+  if (name == "entity") {
+    lua_pushinteger(L, view->getEntity());
+    return 1;
+  }
+  int field = store->findField(name);
+  if (field < 0) {
+    lua_pushnil(L);
+    return 1;
+  }
+  pushField(L, store->getColumn(field), row);
+  return 1;
+}
+
+// view.field = value
+static int l_view_newindex(lua_State *L) {
+  auto *view = lua::check_userdata<ComponentView>(L, 1);
+  ComponentStore *store = view->getStore();
+  std::size_t row = checkViewRow(L, view);
+  setField(L, store->getColumn(checkField(L, store, 2)), row, 3);
+  return 0;
+}
+
+const luaL_Reg ComponentView::LUA_METAMETHODS[]{
+    {"__index", l_view_index},
+    {"__newindex", l_view_newindex},
+    {nullptr, nullptr}};
+
+// ecs.world()
+static int l_world(lua_State *L) {
+  lua::new_userdata_uv<World>(L, 0);
+  return 1;
+}
+
+int luaopen_ecs(lua_State *L) {
+  static const luaL_Reg funcs[]{{"world", l_world}, {nullptr, nullptr}};
+  luaL_newlib(L, funcs);
+  return 1;
+}
+
+} // namespace whatmud::world
@@ -0,0 +1,129 @@
+#ifndef WHATMUD_WORLD_ECS_HPP
+#define WHATMUD_WORLD_ECS_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <lua.hpp>
+
+namespace whatmud::world {
+
+// Entity handles pack a slot index in the low 32 bits and the slot's
+// generation in the high bits, so stale handles to destroyed entities are
+// detected when their slot is reused
+using Entity = lua_Integer;
+
+enum class FieldType { Integer, Number, Boolean };
+
+/**
+ * Storage for one component type, as a sparse set.
+ * Each field is a contiguous column, indexed by the entity's position in the
+ * dense entity array, so a sweep over a component touches only the entities
+ * that have it, in memory order.
+ */
+class ComponentStore {
+public:
+  struct Column {
+    std::string name;
+    FieldType type;
+    // Integer and Boolean fields use `ints`, Number fields use `nums`
+    std::vector<std::int64_t> ints;
+    std::vector<double> nums;
+  };
+
+  ComponentStore(std::string name);
+
+  const std::string &getName() const { return m_name; }
+
+  void addField(std::string name, FieldType type);
+  // Index of the named field, or -1
+  int findField(std::string_view name) const;
+  Column &getColumn(std::size_t field) { return m_columns[field]; }
+  const Column &getColumn(std::size_t field) const { return m_columns[field]; }
+  std::size_t getFieldCount() const { return m_columns.size(); }
+
+  bool has(Entity e) const { return indexOf(e) >= 0; }
+  // Dense index of the entity, or -1 if it doesn't have this component
+  std::ptrdiff_t indexOf(Entity e) const;
+  // Adds the component with zeroed fields if it's missing. Returns the dense
+  // index
+  std::size_t add(Entity e);
+  bool remove(Entity e);
+
+  std::size_t size() const { return m_entities.size(); }
+  std::span<const Entity> getEntities() const { return m_entities; }
+
+private:
+  std::string m_name;
+  // Slot index -> dense index + 1, 0 when absent
+  std::vector<std::uint32_t> m_sparse;
+  std::vector<Entity> m_entities;
+  std::vector<Column> m_columns;
+};
+
+/**
+ * An entity-component store.
+ * Entities are plain IDs, and components are registered at runtime with a
+ * fixed set of typed fields.
+ */
+class World {
+public:
+  World() = default;
+
+  Entity create();
+  void destroy(Entity e);
+  bool isAlive(Entity e) const;
+
+  ComponentStore &defineComponent(std::string name);
+  ComponentStore *findComponent(std::string_view name);
+
+  /**
+   * Call `f(entity, index)` for every entity with component `c`.
+   * `index` is the entity's row in that component's columns.
+   */
+  template <class F> void each(const ComponentStore &c, F &&f) const {
+    auto entities = c.getEntities();
+    for (std::size_t i = 0; i < entities.size(); ++i) {
+      f(entities[i], i);
+    }
+  }
+
+  // Methods available on World objects in Lua
+  static const luaL_Reg LUA_METHODS[];
+
+private:
+  std::vector<std::uint32_t> m_generations;
+  std::vector<std::uint32_t> m_free_slots;
+  std::vector<std::unique_ptr<ComponentStore>> m_components;
+};
+
+/**
+ * A Lua handle to one entity's component, reading and writing its fields in
+ * place.
+ */
+class ComponentView {
+public:
+  ComponentView(ComponentStore *store, Entity e)
+      : m_store(store), m_entity(e) {}
+
+  ComponentStore *getStore() const { return m_store; }
+  Entity getEntity() const { return m_entity; }
+
+  static const luaL_Reg LUA_METAMETHODS[];
+
+private:
+  ComponentStore *m_store;
+  Entity m_entity;
+};
+
+// Opens the `ecs` library, with a world() constructor
+int luaopen_ecs(lua_State *L);
+
+} // namespace whatmud::world
+
+#endif
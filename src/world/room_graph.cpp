@@ -0,0 +1,657 @@
+#include <algorithm>
+#include <cmath>
+#include <queue>
+#include <utility>
+
+#include "async.hpp"
+#include "lua/helpers.hpp"
+#include "world/room_graph.hpp"
+
+namespace whatmud::world {
+
+// Per-thread search state. Entries are only valid when their stamp matches
+// the current search, so nothing needs clearing between searches
+struct SearchScratch {
+  std::vector<std::uint32_t> stamp;
+  std::vector<std::uint32_t> via; // Edge used to reach each room
+  std::vector<std::uint32_t> depth;
+  std::vector<double> cost;
+  std::vector<std::uint32_t> queue;
+  std::uint32_t current = 0;
+
+  void begin(std::size_t rooms) {
+    if (stamp.size() < rooms) {
+      stamp.resize(rooms, 0);
+      via.resize(rooms);
+      depth.resize(rooms);
+      cost.resize(rooms);
+    }
+    if (++current == 0) {
+      std::fill(stamp.begin(), stamp.end(), 0);
+      current = 1;
+    }
+    queue.clear();
+  }
+  bool seen(std::uint32_t room) const { return stamp[room] == current; }
+  void visit(std::uint32_t room, std::uint32_t edge, std::uint32_t d) {
+    stamp[room] = current;
+    via[room] = edge;
+    depth[room] = d;
+  }
+};
+
+static thread_local SearchScratch scratch;
+
+static double distance(const Point &a, const Point &b) {
+  double dx = a.x - b.x, dy = a.y - b.y, dz = a.z - b.z;
+  return std::sqrt(dx * dx + dy * dy + dz * dz);
+}
+
+// Walk `via` back from `to`, filling `edges` in travel order
+static void unwind(const CompiledGraph &graph, std::uint32_t from,
+                   std::uint32_t to, std::vector<std::uint32_t> &edges) {
+  edges.clear();
+  for (std::uint32_t room = to; room != from;) {
+    std::uint32_t edge = scratch.via[room];
+    edges.push_back(edge);
+    // Find the room owning this edge
+    auto it = std::upper_bound(graph.offsets.begin(), graph.offsets.end(),
+                               edge);
+    room = static_cast<std::uint32_t>(it - graph.offsets.begin() - 1);
+  }
+  std::reverse(edges.begin(), edges.end());
+}
+
+bool CompiledGraph::findPath(std::uint32_t from, std::uint32_t to,
+                             const PathOptions &opts,
+                             std::vector<std::uint32_t> &edges) const {
+  if (from == to) {
+    edges.clear();
+    return true;
+  }
+  if (opts.astar && has_coords) {
+    return astar(from, to, opts, edges);
+  }
+  return bfs(from, to, opts, edges);
+}
+
+bool CompiledGraph::bfs(std::uint32_t from, std::uint32_t to,
+                        const PathOptions &opts,
+                        std::vector<std::uint32_t> &edges) const {
+  scratch.begin(room_ids.size());
+  scratch.visit(from, NONE, 0);
+  scratch.queue.push_back(from);
+  for (std::size_t head = 0; head < scratch.queue.size(); ++head) {
+    std::uint32_t room = scratch.queue[head];
+    std::uint32_t d = scratch.depth[room];
+    if (d >= opts.max_depth) {
+      continue;
+    }
+    for (std::uint32_t e = offsets[room]; e < offsets[room + 1]; ++e) {
+      std::uint32_t next = targets[e];
+      if ((flags[e] & opts.avoid) || scratch.seen(next)) {
+        continue;
+      }
+      scratch.visit(next, e, d + 1);
+      if (next == to) {
+        unwind(*this, from, to, edges);
+        return true;
+      }
+      scratch.queue.push_back(next);
+    }
+  }
+  return false;
+}
+
+bool CompiledGraph::astar(std::uint32_t from, std::uint32_t to,
+                          const PathOptions &opts,
+                          std::vector<std::uint32_t> &edges) const {
+  using Entry = std::pair<double, std::uint32_t>; // Estimated total, room
+  std::priority_queue<Entry, std::vector<Entry>, std::greater<>> open;
+
+  scratch.begin(room_ids.size());
+  scratch.visit(from, NONE, 0);
+  scratch.cost[from] = 0;
+  open.emplace(distance(coords[from], coords[to]), from);
+  while (!open.empty()) {
+    auto [estimate, room] = open.top();
+    open.pop();
+    if (room == to) {
+      unwind(*this, from, to, edges);
+      return true;
+    }
+    double cost = scratch.cost[room];
+    // Skip stale entries superseded by a cheaper route
+    if (estimate > cost + distance(coords[room], coords[to]) ||
+        scratch.depth[room] >= opts.max_depth) {
+      continue;
+    }
+    for (std::uint32_t e = offsets[room]; e < offsets[room + 1]; ++e) {
+      std::uint32_t next = targets[e];
+      if (flags[e] & opts.avoid) {
+        continue;
+      }
+      double next_cost = cost + distance(coords[room], coords[next]);
+      if (scratch.seen(next) && scratch.cost[next] <= next_cost) {
+        continue;
+      }
+      scratch.visit(next, e, scratch.depth[room] + 1);
+      scratch.cost[next] = next_cost;
+      open.emplace(next_cost + distance(coords[next], coords[to]), next);
+    }
+  }
+  return false;
+}
+
+void CompiledGraph::reachable(std::uint32_t from, const PathOptions &opts,
+                              std::vector<std::uint32_t> &rooms) const {
+  scratch.begin(room_ids.size());
+  scratch.visit(from, NONE, 0);
+  scratch.queue.push_back(from);
+  for (std::size_t head = 0; head < scratch.queue.size(); ++head) {
+    std::uint32_t room = scratch.queue[head];
+    std::uint32_t d = scratch.depth[room];
+    if (d >= opts.max_depth) {
+      continue;
+    }
+    for (std::uint32_t e = offsets[room]; e < offsets[room + 1]; ++e) {
+      std::uint32_t next = targets[e];
+      if (!(flags[e] & opts.avoid) && !scratch.seen(next)) {
+        scratch.visit(next, e, d + 1);
+        scratch.queue.push_back(next);
+      }
+    }
+  }
+  rooms = scratch.queue;
+}
+
+// RoomGraph
+
+void RoomGraph::addRoom(RoomId id, std::optional<Point> coords) {
+  m_rooms[id].coords = coords;
+  invalidate();
+}
+
+bool RoomGraph::removeRoom(RoomId id) {
+  if (!m_rooms.erase(id)) {
+    return false;
+  }
+  // Exits leading here are dropped when compiling
+  invalidate();
+  return true;
+}
+
+void RoomGraph::addExit(RoomId from, RoomId to, std::string name,
+                        std::uint32_t flags) {
+  auto &exits = m_rooms[from].exits;
+  auto it = std::find_if(exits.begin(), exits.end(),
+                         [&](const Exit &e) { return e.name == name; });
+  if (it != exits.end()) {
+    it->to = to;
+    it->flags = flags;
+  } else {
+    exits.push_back(Exit{to, std::move(name), flags});
+  }
+  invalidate();
+}
+
+bool RoomGraph::removeExit(RoomId from, std::string_view name) {
+  auto room = m_rooms.find(from);
+  if (room == m_rooms.end()) {
+    return false;
+  }
+  auto &exits = room->second.exits;
+  auto it = std::find_if(exits.begin(), exits.end(),
+                         [&](const Exit &e) { return e.name == name; });
+  if (it == exits.end()) {
+    return false;
+  }
+  exits.erase(it);
+  invalidate();
+  return true;
+}
+
+bool RoomGraph::setExitFlags(RoomId from, std::string_view name,
+                             std::uint32_t flags) {
+  auto room = m_rooms.find(from);
+  if (room == m_rooms.end()) {
+    return false;
+  }
+  for (auto &exit : room->second.exits) {
+    if (exit.name == name) {
+      if (exit.flags != flags) {
+        exit.flags = flags;
+        invalidate();
+      }
+      return true;
+    }
+  }
+  return false;
+}
+
+void RoomGraph::clear() {
+  m_rooms.clear();
+  invalidate();
+}
+
+void RoomGraph::invalidate() {
+  m_compiled.reset();
+  m_cache.clear();
+  m_lru.clear();
+}
+
+std::shared_ptr<const CompiledGraph> RoomGraph::getCompiled() {
+  if (m_compiled) {
+    return m_compiled;
+  }
+
+  auto graph = std::make_shared<CompiledGraph>();
+  graph->room_ids.reserve(m_rooms.size());
+  for (const auto &[id, room] : m_rooms) {
+    graph->room_ids.push_back(id);
+  }
+  // Sorted so rooms that are numbered together end up near each other
+  std::sort(graph->room_ids.begin(), graph->room_ids.end());
+  graph->index_of.reserve(graph->room_ids.size());
+  for (std::uint32_t i = 0; i < graph->room_ids.size(); ++i) {
+    graph->index_of.emplace(graph->room_ids[i], i);
+  }
+
+  std::unordered_map<std::string_view, std::uint32_t> name_index;
+  graph->coords.resize(graph->room_ids.size());
+  graph->offsets.reserve(graph->room_ids.size() + 1);
+  for (std::uint32_t i = 0; i < graph->room_ids.size(); ++i) {
+    const Room &room = m_rooms.at(graph->room_ids[i]);
+    if (room.coords) {
+      graph->coords[i] = *room.coords;
+    } else {
+      graph->has_coords = false;
+    }
+    graph->offsets.push_back(static_cast<std::uint32_t>(graph->targets.size()));
+    for (const auto &exit : room.exits) {
+      std::uint32_t to = graph->find(exit.to);
+      if (to == CompiledGraph::NONE) {
+        continue;
+      }
+      auto [it, inserted] = name_index.emplace(
+          exit.name, static_cast<std::uint32_t>(graph->exit_names.size()));
+      if (inserted) {
+        graph->exit_names.push_back(exit.name);
+      }
+      graph->targets.push_back(to);
+      graph->flags.push_back(exit.flags);
+      graph->names.push_back(it->second);
+    }
+  }
+  graph->offsets.push_back(static_cast<std::uint32_t>(graph->targets.size()));
+
+  m_compiled = std::move(graph);
+  return m_compiled;
+}
+
+RoomGraph::CacheKey RoomGraph::makeKey(std::uint32_t from, std::uint32_t to,
+                                       const PathOptions &opts) {
+  return CacheKey{from, to, opts.avoid, opts.max_depth, opts.astar};
+}
+
+const std::optional<std::vector<std::uint32_t>> *
+RoomGraph::findCached(std::uint32_t from, std::uint32_t to,
+                      const PathOptions &opts) {
+  auto it = m_cache.find(makeKey(from, to, opts));
+  if (it == m_cache.end()) {
+    ++m_cache_misses;
+    return nullptr;
+  }
+  ++m_cache_hits;
+  m_lru.splice(m_lru.begin(), m_lru, it->second.lru);
+  return &it->second.edges;
+}
+
+void RoomGraph::cache(const CompiledGraph *graph, std::uint32_t from,
+                      std::uint32_t to, const PathOptions &opts,
+                      std::optional<std::vector<std::uint32_t>> edges) {
+  if (graph != m_compiled.get()) {
+    return;
+  }
+  CacheKey key = makeKey(from, to, opts);
+  auto it = m_cache.find(key);
+  if (it != m_cache.end()) {
+    it->second.edges = std::move(edges);
+    m_lru.splice(m_lru.begin(), m_lru, it->second.lru);
+    return;
+  }
+  if (m_cache.size() >= CACHE_SIZE) {
+    m_cache.erase(m_lru.back());
+    m_lru.pop_back();
+  }
+  m_lru.push_front(key);
+  m_cache.emplace(key, CacheEntry{std::move(edges), m_lru.begin()});
+}
+
+// Lua library
+
+static RoomId checkRoom(lua_State *L, int index) {
+  lua_Integer id;
+  lua::arg(L, index, id);
+  return id;
+}
+
+// Reads {avoid = flags, max_depth = n, astar = bool}
+static PathOptions checkOptions(lua_State *L, int index) {
+  PathOptions opts;
+  if (lua_isnoneornil(L, index)) {
+    return opts;
+  }
+  luaL_checktype(L, index, LUA_TTABLE);
+  if (lua_getfield(L, index, "avoid") != LUA_TNIL) {
+    opts.avoid = static_cast<std::uint32_t>(luaL_checkinteger(L, -1));
+  }
+  if (lua_getfield(L, index, "max_depth") != LUA_TNIL) {
+    lua_Integer depth = luaL_checkinteger(L, -1);
+    luaL_argcheck(L, depth >= 0, index, "max_depth must not be negative");
+    opts.max_depth =
+        static_cast<std::uint32_t>(std::min<lua_Integer>(depth, UINT32_MAX));
+  }
+  lua_getfield(L, index, "astar");
+  opts.astar = lua_toboolean(L, -1);
+  lua_pop(L, 3);
+  return opts;
+}
+
+// Pushes {rooms...}, {exit names...} for a path starting at `from`
+static int pushPath(lua_State *L, const CompiledGraph &graph,
+                    std::uint32_t from,
+                    const std::vector<std::uint32_t> &edges) {
+  int n = static_cast<int>(edges.size());
+  lua_createtable(L, n + 1, 0);
+  lua_pushinteger(L, graph.room_ids[from]);
+  lua_rawseti(L, -2, 1);
+  lua_createtable(L, n, 0);
+  for (int i = 0; i < n; ++i) {
+    std::uint32_t e = edges[i];
+    lua_pushinteger(L, graph.room_ids[graph.targets[e]]);
+    lua_rawseti(L, -3, i + 2);
+    lua::push(L, graph.exit_names[graph.names[e]]);
+    lua_rawseti(L, -2, i + 1);
+  }
+  return 2;
+}
+
+// graph:add_room(id[, x, y[, z]])
+static int l_add_room(lua_State *L) {
+  auto *graph = lua::check_userdata<RoomGraph>(L, 1);
+  RoomId id = checkRoom(L, 2);
+  std::optional<Point> coords;
+  if (!lua_isnoneornil(L, 3)) {
+    coords = Point{luaL_checknumber(L, 3), luaL_checknumber(L, 4),
+                   luaL_optnumber(L, 5, 0)};
+  }
+  graph->addRoom(id, coords);
+  return 0;
+}
+
+// graph:remove_room(id)
+static int l_remove_room(lua_State *L) {
+  auto *graph = lua::check_userdata<RoomGraph>(L, 1);
+  lua_pushboolean(L, graph->removeRoom(checkRoom(L, 2)));
+  return 1;
+}
+
+// graph:add_exit(from, to, name[, flags])
+static int l_add_exit(lua_State *L) {
+  auto *graph = lua::check_userdata<RoomGraph>(L, 1);
+  RoomId from = checkRoom(L, 2), to = checkRoom(L, 3);
+  std::string name;
+  lua::arg(L, 4, name);
+  auto flags = static_cast<std::uint32_t>(luaL_optinteger(L, 5, 0));
+  graph->addExit(from, to, std::move(name), flags);
+  return 0;
+}
+
+// graph:remove_exit(from, name)
+static int l_remove_exit(lua_State *L) {
+  auto *graph = lua::check_userdata<RoomGraph>(L, 1);
+  RoomId from = checkRoom(L, 2);
+  std::string_view name;
+  lua::arg(L, 3, name);
+  lua_pushboolean(L, graph->removeExit(from, name));
+  return 1;
+}
+
+// graph:set_exit_flags(from, name, flags)
+static int l_set_exit_flags(lua_State *L) {
+  auto *graph = lua::check_userdata<RoomGraph>(L, 1);
+  RoomId from = checkRoom(L, 2);
+  std::string_view name;
+  lua::arg(L, 3, name);
+  auto flags = static_cast<std::uint32_t>(luaL_checkinteger(L, 4));
+  lua_pushboolean(L, graph->setExitFlags(from, name, flags));
+  return 1;
+}
+
+// graph:load{[id] = {x = , y = , z = , exits = {name = to or {to, flags}}}}
+// Adds to the graph without clearing it
+static int l_load(lua_State *L) {
+  auto *graph = lua::check_userdata<RoomGraph>(L, 1);
+  luaL_checktype(L, 2, LUA_TTABLE);
+  lua_pushnil(L);
+  while (lua_next(L, 2)) {
+    if (!lua_isinteger(L, -2) || !lua_istable(L, -1)) {
+      return luaL_error(L, "rooms must be tables keyed by integer ID");
+    }
+    RoomId id = lua_tointeger(L, -2);
+    int room = lua_gettop(L);
+    std::optional<Point> coords;
+    if (lua_getfield(L, room, "x") != LUA_TNIL) {
+      lua_getfield(L, room, "y");
+      lua_getfield(L, room, "z");
+      coords = Point{luaL_checknumber(L, -3), luaL_checknumber(L, -2),
+                     luaL_optnumber(L, -1, 0)};
+      lua_pop(L, 2);
+    }
+    lua_pop(L, 1);
+    graph->addRoom(id, coords);
+
+    if (lua_getfield(L, room, "exits") == LUA_TTABLE) {
+      int exits = lua_gettop(L);
+      lua_pushnil(L);
+      while (lua_next(L, exits)) {
+        if (lua_type(L, -2) != LUA_TSTRING) {
+          return luaL_error(L, "exit names must be strings");
+        }
+        lua_Integer to, flags = 0;
+        if (lua_istable(L, -1)) {
+          lua_rawgeti(L, -1, 1);
+          lua_rawgeti(L, -2, 2);
+          to = luaL_checkinteger(L, -2);
+          flags = luaL_optinteger(L, -1, 0);
+          lua_pop(L, 2);
+        } else {
+          to = luaL_checkinteger(L, -1);
+        }
+        graph->addExit(id, to, lua_tostring(L, -2),
+                       static_cast<std::uint32_t>(flags));
+        lua_pop(L, 1);
+      }
+    }
+    lua_pop(L, 2); // Pop exits and room
+  }
+  return 0;
+}
+
+// graph:path(from, to[, opts]) -> {rooms...}, {exits...} or nil
+static int l_path(lua_State *L) {
+  auto *graph = lua::check_userdata<RoomGraph>(L, 1);
+  RoomId from_id = checkRoom(L, 2), to_id = checkRoom(L, 3);
+  PathOptions opts = checkOptions(L, 4);
+  auto compiled = graph->getCompiled();
+  std::uint32_t from = compiled->find(from_id), to = compiled->find(to_id);
+  if (from == CompiledGraph::NONE || to == CompiledGraph::NONE) {
+    lua_pushnil(L);
+    return 1;
+  }
+
+  if (auto *cached = graph->findCached(from, to, opts)) {
+    if (!*cached) {
+      lua_pushnil(L);
+      return 1;
+    }
+    return pushPath(L, *compiled, from, **cached);
+  }
+  std::vector<std::uint32_t> edges;
+  if (!compiled->findPath(from, to, opts, edges)) {
+    graph->cache(compiled.get(), from, to, opts, std::nullopt);
+    lua_pushnil(L);
+    return 1;
+  }
+  pushPath(L, *compiled, from, edges);
+  graph->cache(compiled.get(), from, to, opts, std::move(edges));
+  return 2;
+}
+
+// graph:paths({{from, to}...}[, opts]) -> {{rooms, exits} or false...}
+// Searches on a worker thread; must be called from a coroutine
+static int l_paths(lua_State *L) {
+  struct Query {
+    std::uint32_t from, to;
+    bool found = false;
+    std::vector<std::uint32_t> edges;
+  };
+
+  auto *graph = lua::check_userdata<RoomGraph>(L, 1);
+  luaL_checktype(L, 2, LUA_TTABLE);
+  PathOptions opts = checkOptions(L, 3);
+
+  // Read every pair into Lua's memory first, so a bad one can raise an error
+  // before any C++ objects exist
+  lua_Integer n = luaL_len(L, 2);
+  luaL_argcheck(L, n >= 0, 2, "invalid length");
+  auto *ids = static_cast<RoomId *>(lua_newuserdatauv(
+      L, static_cast<std::size_t>(n) * 2 * sizeof(RoomId), 0));
+  for (lua_Integer i = 0; i < n; ++i) {
+    lua_geti(L, 2, i + 1);
+    luaL_argcheck(L, lua_istable(L, -1), 2, "expected {from, to} pairs");
+    lua_rawgeti(L, -1, 1);
+    lua_rawgeti(L, -2, 2);
+    ids[i * 2] = checkRoom(L, -2);
+    ids[i * 2 + 1] = checkRoom(L, -1);
+    lua_pop(L, 3);
+  }
+
+  auto compiled = graph->getCompiled();
+  auto queries = std::make_shared<std::vector<Query>>();
+  queries->reserve(static_cast<std::size_t>(n));
+  for (lua_Integer i = 0; i < n; ++i) {
+    queries->push_back(Query{compiled->find(ids[i * 2]),
+                             compiled->find(ids[i * 2 + 1]), false, {}});
+  }
+  // Keep the graph alive while the coroutine waits
+  lua_pushvalue(L, 1);
+  auto graph_ref = std::make_shared<lua::Ref>(L);
+
+  auto work = [compiled, queries, opts] {
+    for (auto &q : *queries) {
+      if (q.from != CompiledGraph::NONE && q.to != CompiledGraph::NONE) {
+        q.found = compiled->findPath(q.from, q.to, opts, q.edges);
+      }
+    }
+  };
+  auto done = [graph, graph_ref = std::move(graph_ref),
+               compiled = std::move(compiled), queries = std::move(queries),
+               opts](lua_State *L, int status) {
+    if (status < 0) {
+      lua_pushnil(L);
+      return;
+    }
+    lua_createtable(L, static_cast<int>(queries->size()), 0);
+    for (std::size_t i = 0; i < queries->size(); ++i) {
+      Query &q = (*queries)[i];
+      if (!q.found) {
+        lua_pushboolean(L, false);
+      } else {
+        lua_createtable(L, 2, 0);
+        pushPath(L, *compiled, q.from, q.edges);
+        lua_rawseti(L, -3, 2);
+        lua_rawseti(L, -2, 1);
+      }
+      lua_rawseti(L, -2, static_cast<lua_Integer>(i + 1));
+      if (q.from != CompiledGraph::NONE && q.to != CompiledGraph::NONE) {
+        graph->cache(compiled.get(), q.from, q.to, opts,
+                     q.found ? std::optional(std::move(q.edges))
+                             : std::nullopt);
+      }
+    }
+  };
+  // Everything is moved into the request, so nothing left here needs
+  // destroying when yield_work() raises an error or yields
+  return yield_work(L, std::move(work), std::move(done));
+}
+
+// graph:reachable(from[, opts]) -> {rooms...}
+static int l_reachable(lua_State *L) {
+  auto *graph = lua::check_userdata<RoomGraph>(L, 1);
+  RoomId from_id = checkRoom(L, 2);
+  PathOptions opts = checkOptions(L, 3);
+  auto compiled = graph->getCompiled();
+  std::uint32_t from = compiled->find(from_id);
+  std::vector<std::uint32_t> rooms;
+  if (from != CompiledGraph::NONE) {
+    compiled->reachable(from, opts, rooms);
+  }
+  lua_createtable(L, static_cast<int>(rooms.size()), 0);
+  for (std::size_t i = 0; i < rooms.size(); ++i) {
+    lua_pushinteger(L, compiled->room_ids[rooms[i]]);
+    lua_rawseti(L, -2, static_cast<lua_Integer>(i + 1));
+  }
+  return 1;
+}
+
+// graph:stats() -> {rooms, exits, cache_hits, cache_misses}
+static int l_stats(lua_State *L) {
+  auto *graph = lua::check_userdata<RoomGraph>(L, 1);
+  auto compiled = graph->getCompiled();
+  lua_createtable(L, 0, 4);
+  lua_pushinteger(L, static_cast<lua_Integer>(compiled->room_ids.size()));
+  lua_setfield(L, -2, "rooms");
+  lua_pushinteger(L, static_cast<lua_Integer>(compiled->targets.size()));
+  lua_setfield(L, -2, "exits");
+  lua_pushinteger(L, static_cast<lua_Integer>(graph->getCacheHits()));
+  lua_setfield(L, -2, "cache_hits");
+  lua_pushinteger(L, static_cast<lua_Integer>(graph->getCacheMisses()));
+  lua_setfield(L, -2, "cache_misses");
+  return 1;
+}
+
+const luaL_Reg RoomGraph::LUA_METHODS[]{{"add_room", l_add_room},
+                                        {"remove_room", l_remove_room},
+                                        {"add_exit", l_add_exit},
+                                        {"remove_exit", l_remove_exit},
+                                        {"set_exit_flags", l_set_exit_flags},
+                                        {"load", l_load},
+                                        {"path", l_path},
+                                        {"paths", l_paths},
+                                        {"reachable", l_reachable},
+                                        {"stats", l_stats},
+                                        {nullptr, nullptr}};
+
+// roomgraph.new()
+static int l_new(lua_State *L) {
+  lua::new_userdata_uv<RoomGraph>(L, 0);
+  return 1;
+}
+
+int luaopen_roomgraph(lua_State *L) {
+  static const luaL_Reg funcs[]{{"new", l_new}, {nullptr, nullptr}};
+  luaL_newlib(L, funcs);
+  lua_pushinteger(L, EXIT_DOOR);
+  lua_setfield(L, -2, "DOOR");
+  lua_pushinteger(L, EXIT_CLOSED);
+  lua_setfield(L, -2, "CLOSED");
+  lua_pushinteger(L, EXIT_LOCKED);
+  lua_setfield(L, -2, "LOCKED");
+  lua_pushinteger(L, EXIT_HIDDEN);
+  lua_setfield(L, -2, "HIDDEN");
+  return 1;
+}
+
+} // namespace whatmud::world
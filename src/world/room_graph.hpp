@@ -0,0 +1,163 @@
+#ifndef WHATMUD_WORLD_ROOM_GRAPH_HPP
+#define WHATMUD_WORLD_ROOM_GRAPH_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <lua.hpp>
+
+#include "world/spatial_index.hpp"
+
+namespace whatmud::world {
+
+using RoomId = lua_Integer;
+
+// Exit flags understood by the engine. Games may use the higher bits freely
+enum ExitFlags : std::uint32_t {
+  EXIT_DOOR = 1 << 0,
+  EXIT_CLOSED = 1 << 1,
+  EXIT_LOCKED = 1 << 2,
+  EXIT_HIDDEN = 1 << 3,
+};
+
+struct PathOptions {
+  // Exits with any of these flags can't be used
+  std::uint32_t avoid = EXIT_LOCKED;
+  // Longest path to consider, in exits
+  std::uint32_t max_depth = UINT32_MAX;
+  // Use A* over room coordinates instead of fewest-exits BFS
+  bool astar = false;
+};
+
+/**
+ * An immutable room graph in compressed sparse row form.
+ * Rooms are numbered densely; room i's exits are edges
+ * offsets[i] .. offsets[i + 1]. Safe to search from any thread.
+ */
+struct CompiledGraph {
+  static constexpr std::uint32_t NONE = UINT32_MAX;
+
+  std::vector<RoomId> room_ids;
+  std::unordered_map<RoomId, std::uint32_t> index_of;
+  std::vector<Point> coords;
+  // Whether every room has coordinates, required for A*
+  bool has_coords = true;
+  std::vector<std::uint32_t> offsets;
+  std::vector<std::uint32_t> targets;
+  std::vector<std::uint32_t> flags;
+  std::vector<std::uint32_t> names; // Index into exit_names
+  std::vector<std::string> exit_names;
+
+  std::uint32_t find(RoomId id) const {
+    auto it = index_of.find(id);
+    return it == index_of.end() ? NONE : it->second;
+  }
+
+  /**
+   * Find a path, filling `edges` with the exits to take in order.
+   * Returns false if `to` can't be reached.
+   */
+  bool findPath(std::uint32_t from, std::uint32_t to, const PathOptions &opts,
+                std::vector<std::uint32_t> &edges) const;
+  // All rooms reachable from `from` within `opts.max_depth` exits
+  void reachable(std::uint32_t from, const PathOptions &opts,
+                 std::vector<std::uint32_t> &rooms) const;
+
+private:
+  bool bfs(std::uint32_t from, std::uint32_t to, const PathOptions &opts,
+           std::vector<std::uint32_t> &edges) const;
+  bool astar(std::uint32_t from, std::uint32_t to, const PathOptions &opts,
+             std::vector<std::uint32_t> &edges) const;
+};
+
+/**
+ * An editable room graph. Edits are cheap and mark the graph dirty; it is
+ * recompiled to CSR form on the next query. Recent query results are cached
+ * until the next edit.
+ */
+class RoomGraph {
+public:
+  static constexpr std::size_t CACHE_SIZE = 1024;
+
+  struct Exit {
+    RoomId to;
+    std::string name;
+    std::uint32_t flags;
+  };
+  struct Room {
+    std::optional<Point> coords;
+    std::vector<Exit> exits;
+  };
+
+  void addRoom(RoomId id, std::optional<Point> coords);
+  bool removeRoom(RoomId id);
+  // Replaces any exit from `from` with the same name
+  void addExit(RoomId from, RoomId to, std::string name, std::uint32_t flags);
+  bool removeExit(RoomId from, std::string_view name);
+  bool setExitFlags(RoomId from, std::string_view name, std::uint32_t flags);
+  void clear();
+
+  // The compiled graph, rebuilt if there have been edits since last time.
+  // Searches on other threads keep the graph they were given alive
+  std::shared_ptr<const CompiledGraph> getCompiled();
+
+  // Look up a cached path. Null if it isn't cached
+  const std::optional<std::vector<std::uint32_t>> *
+  findCached(std::uint32_t from, std::uint32_t to, const PathOptions &opts);
+  // Cache a result (nullopt for unreachable) computed on `graph`. Ignored if
+  // the graph has been edited since
+  void cache(const CompiledGraph *graph, std::uint32_t from, std::uint32_t to,
+             const PathOptions &opts,
+             std::optional<std::vector<std::uint32_t>> edges);
+
+  std::size_t getRoomCount() const { return m_rooms.size(); }
+  std::uint64_t getCacheHits() const { return m_cache_hits; }
+  std::uint64_t getCacheMisses() const { return m_cache_misses; }
+
+  // Methods available on RoomGraph objects in Lua
+  static const luaL_Reg LUA_METHODS[];
+
+private:
+  struct CacheKey {
+    std::uint32_t from, to, avoid, max_depth;
+    bool astar;
+    bool operator==(const CacheKey &) const = default;
+  };
+  struct CacheKeyHash {
+    std::size_t operator()(const CacheKey &k) const {
+      std::uint64_t h = (std::uint64_t(k.from) << 32) | k.to;
+      h ^= (std::uint64_t(k.avoid) << 33) ^ (std::uint64_t(k.max_depth) << 1);
+      h ^= k.astar;
+      return std::hash<std::uint64_t>()(h);
+    }
+  };
+  struct CacheEntry {
+    std::optional<std::vector<std::uint32_t>> edges;
+    std::list<CacheKey>::iterator lru;
+  };
+
+  void invalidate();
+  static CacheKey makeKey(std::uint32_t from, std::uint32_t to,
+                          const PathOptions &opts);
+
+  std::unordered_map<RoomId, Room> m_rooms;
+  std::shared_ptr<const CompiledGraph> m_compiled;
+  std::unordered_map<CacheKey, CacheEntry, CacheKeyHash> m_cache;
+  // Most recently used at the front
+  std::list<CacheKey> m_lru;
+  std::uint64_t m_cache_hits = 0;
+  std::uint64_t m_cache_misses = 0;
+};
+
+// Opens the `roomgraph` library, with a new() constructor and flag constants
+int luaopen_roomgraph(lua_State *L);
+
+} // namespace whatmud::world
+
+#endif
@@ -0,0 +1,533 @@
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include "lua/helpers.hpp"
+#include "world/spatial_index.hpp"
+
+namespace whatmud::world {
+
+static double distanceSq(const Point &a, const Point &b) {
+  double dx = a.x - b.x, dy = a.y - b.y, dz = a.z - b.z;
+  return dx * dx + dy * dy + dz * dz;
+}
+
+static Box boxAround(const Point &centre, double radius) {
+  return Box{{centre.x - radius, centre.y - radius, centre.z - radius},
+             {centre.x + radius, centre.y + radius, centre.z + radius}};
+}
+
+static Box emptyBox() {
+  constexpr double inf = std::numeric_limits<double>::infinity();
+  return Box{{inf, inf, inf}, {-inf, -inf, -inf}};
+}
+
+static void extend(Box &box, const Box &other) {
+  box.min.x = std::min(box.min.x, other.min.x);
+  box.min.y = std::min(box.min.y, other.min.y);
+  box.min.z = std::min(box.min.z, other.min.z);
+  box.max.x = std::max(box.max.x, other.max.x);
+  box.max.y = std::max(box.max.y, other.max.y);
+  box.max.z = std::max(box.max.z, other.max.z);
+}
+
+static void extend(Box &box, const Point &p) { extend(box, Box{p, p}); }
+
+// Volume, with a small floor per axis so flat boxes still compare sensibly
+static double volume(const Box &box) {
+  return (box.max.x - box.min.x + 1) * (box.max.y - box.min.y + 1) *
+         (box.max.z - box.min.z + 1);
+}
+
+std::optional<Point> SpatialIndex::getPosition(EntityId id) const {
+  auto it = m_positions.find(id);
+  if (it == m_positions.end()) {
+    return {};
+  }
+  return it->second;
+}
+
+// GridIndex
+
+GridIndex::GridIndex(double cell_size) : m_inv_cell_size(1.0 / cell_size) {}
+
+// Far-flung coordinates share the outermost cells rather than overflowing
+// the cast, and NaN goes to the lowest
+static std::int32_t cellCoord(double v) {
+  constexpr double lo = std::numeric_limits<std::int32_t>::min();
+  constexpr double hi = std::numeric_limits<std::int32_t>::max();
+  v = std::floor(v);
+  if (!(v > lo)) {
+    return std::numeric_limits<std::int32_t>::min();
+  }
+  if (v >= hi) {
+    return std::numeric_limits<std::int32_t>::max();
+  }
+  return static_cast<std::int32_t>(v);
+}
+
+GridIndex::Cell GridIndex::cellOf(const Point &p) const {
+  return Cell{cellCoord(p.x * m_inv_cell_size),
+              cellCoord(p.y * m_inv_cell_size),
+              cellCoord(p.z * m_inv_cell_size)};
+}
+
+void GridIndex::eraseFromCell(const Cell &cell, EntityId id) {
+  auto it = m_cells.find(cell);
+  auto &entries = it->second;
+  auto entry = std::find_if(entries.begin(), entries.end(),
+                            [id](const Entry &e) { return e.id == id; });
+  // Order within a cell doesn't matter, so swap-remove
+  *entry = entries.back();
+  entries.pop_back();
+  if (entries.empty()) {
+    m_cells.erase(it);
+  }
+}
+
+void GridIndex::insert(EntityId id, Point p) {
+  if (move(id, p)) {
+    return;
+  }
+  m_positions.emplace(id, p);
+  m_cells[cellOf(p)].push_back(Entry{id, p});
+}
+
+bool GridIndex::move(EntityId id, Point p) {
+  auto it = m_positions.find(id);
+  if (it == m_positions.end()) {
+    return false;
+  }
+  Cell from = cellOf(it->second), to = cellOf(p);
+  it->second = p;
+  if (from == to) {
+    for (Entry &e : m_cells[from]) {
+      if (e.id == id) {
+        e.pos = p;
+        break;
+      }
+    }
+  } else {
+    eraseFromCell(from, id);
+    m_cells[to].push_back(Entry{id, p});
+  }
+  return true;
+}
+
+bool GridIndex::remove(EntityId id) {
+  auto it = m_positions.find(id);
+  if (it == m_positions.end()) {
+    return false;
+  }
+  eraseFromCell(cellOf(it->second), id);
+  m_positions.erase(it);
+  return true;
+}
+
+template <class F> void GridIndex::visitBox(const Box &box, F &&visit) const {
+  Cell lo = cellOf(box.min), hi = cellOf(box.max);
+  double span = (double(hi.x) - lo.x + 1) * (double(hi.y) - lo.y + 1) *
+                (double(hi.z) - lo.z + 1);
+  if (span > static_cast<double>(m_cells.size())) {
+    // Cheaper to look at every occupied cell than every cell in range
+    for (const auto &[cell, entries] : m_cells) {
+      if (cell.x >= lo.x && cell.x <= hi.x && cell.y >= lo.y &&
+          cell.y <= hi.y && cell.z >= lo.z && cell.z <= hi.z) {
+        for (const Entry &e : entries) {
+          visit(e);
+        }
+      }
+    }
+    return;
+  }
+  // 64 bit, so the outermost cells don't overflow the loops
+  for (std::int64_t z = lo.z; z <= hi.z; ++z) {
+    for (std::int64_t y = lo.y; y <= hi.y; ++y) {
+      for (std::int64_t x = lo.x; x <= hi.x; ++x) {
+        auto it = m_cells.find(Cell{static_cast<std::int32_t>(x),
+                                    static_cast<std::int32_t>(y),
+                                    static_cast<std::int32_t>(z)});
+        if (it != m_cells.end()) {
+          for (const Entry &e : it->second) {
+            visit(e);
+          }
+        }
+      }
+    }
+  }
+}
+
+void GridIndex::queryBox(const Box &box, std::vector<EntityId> &out) const {
+  visitBox(box, [&](const Entry &e) {
+    if (box.contains(e.pos)) {
+      out.push_back(e.id);
+    }
+  });
+}
+
+void GridIndex::queryRadius(const Point &centre, double radius,
+                            std::vector<EntityId> &out) const {
+  double radius_sq = radius * radius;
+  visitBox(boxAround(centre, radius), [&](const Entry &e) {
+    if (distanceSq(e.pos, centre) <= radius_sq) {
+      out.push_back(e.id);
+    }
+  });
+}
+
+// RTreeIndex
+
+RTreeIndex::RTreeIndex() : m_root(std::make_unique<Node>()) {
+  m_root->bounds = emptyBox();
+}
+
+RTreeIndex::~RTreeIndex() = default;
+
+RTreeIndex::Node *RTreeIndex::chooseLeaf(const Point &p) {
+  Node *node = m_root.get();
+  while (!node->leaf) {
+    // Descend into the child needing the least enlargement, then the smallest
+    Node *best = nullptr;
+    double best_growth = 0, best_volume = 0;
+    for (auto &child : node->children) {
+      Box grown = child->bounds;
+      extend(grown, p);
+      double vol = volume(child->bounds);
+      double growth = volume(grown) - vol;
+      if (best == nullptr || growth < best_growth ||
+          (growth == best_growth && vol < best_volume)) {
+        best = child.get();
+        best_growth = growth;
+        best_volume = vol;
+      }
+    }
+    node = best;
+  }
+  return node;
+}
+
+void RTreeIndex::recomputeBounds(Node *node) {
+  for (; node != nullptr; node = node->parent) {
+    Box bounds = emptyBox();
+    if (node->leaf) {
+      for (const Entry &e : node->entries) {
+        extend(bounds, e.pos);
+      }
+    } else {
+      for (const auto &child : node->children) {
+        extend(bounds, child->bounds);
+      }
+    }
+    node->bounds = bounds;
+  }
+}
+
+void RTreeIndex::split(Node *node) {
+  // Split along the longest axis of the node, half the entries each side
+  const Box &b = node->bounds;
+  double dx = b.max.x - b.min.x, dy = b.max.y - b.min.y,
+         dz = b.max.z - b.min.z;
+  auto axis = dx >= dy && dx >= dz ? &Point::x
+              : dy >= dz           ? &Point::y
+                                   : &Point::z;
+  auto sibling = std::make_unique<Node>();
+  sibling->leaf = node->leaf;
+  if (node->leaf) {
+    auto &entries = node->entries;
+    auto mid = entries.begin() + entries.size() / 2;
+    std::nth_element(entries.begin(), mid, entries.end(),
+                     [axis](const Entry &a, const Entry &b) {
+                       return a.pos.*axis < b.pos.*axis;
+                     });
+    sibling->entries.assign(mid, entries.end());
+    entries.erase(mid, entries.end());
+    for (const Entry &e : sibling->entries) {
+      m_leaf_of[e.id] = sibling.get();
+    }
+  } else {
+    auto &children = node->children;
+    auto mid = children.begin() + children.size() / 2;
+    std::nth_element(children.begin(), mid, children.end(),
+                     [axis](const auto &a, const auto &b) {
+                       return a->bounds.min.*axis + a->bounds.max.*axis <
+                              b->bounds.min.*axis + b->bounds.max.*axis;
+                     });
+    for (auto it = mid; it != children.end(); ++it) {
+      (*it)->parent = sibling.get();
+      sibling->children.emplace_back(std::move(*it));
+    }
+    children.erase(mid, children.end());
+  }
+
+  if (node->parent == nullptr) {
+    // Splitting the root grows the tree by a level
+    auto root = std::make_unique<Node>();
+    root->leaf = false;
+    node->parent = root.get();
+    root->children.emplace_back(std::move(m_root));
+    m_root = std::move(root);
+  }
+  Node *parent = node->parent;
+  sibling->parent = parent;
+  Node *sibling_ptr = sibling.get();
+  parent->children.emplace_back(std::move(sibling));
+  recomputeBounds(node);
+  recomputeBounds(sibling_ptr);
+  if (parent->children.size() > MAX_ENTRIES) {
+    split(parent);
+  }
+}
+
+void RTreeIndex::insert(EntityId id, Point p) {
+  if (move(id, p)) {
+    return;
+  }
+  m_positions.emplace(id, p);
+  Node *leaf = chooseLeaf(p);
+  leaf->entries.push_back(Entry{id, p});
+  m_leaf_of[id] = leaf;
+  for (Node *node = leaf; node != nullptr; node = node->parent) {
+    extend(node->bounds, p);
+  }
+  if (leaf->entries.size() > MAX_ENTRIES) {
+    split(leaf);
+  }
+}
+
+bool RTreeIndex::move(EntityId id, Point p) {
+  auto it = m_leaf_of.find(id);
+  if (it == m_leaf_of.end()) {
+    return false;
+  }
+  Node *leaf = it->second;
+  if (leaf->bounds.contains(p)) {
+    // Small moves stay in the same leaf, just shrink its bounds if needed
+    for (Entry &e : leaf->entries) {
+      if (e.id == id) {
+        e.pos = p;
+        break;
+      }
+    }
+    m_positions[id] = p;
+    recomputeBounds(leaf);
+    return true;
+  }
+  remove(id);
+  insert(id, p);
+  return true;
+}
+
+bool RTreeIndex::remove(EntityId id) {
+  auto it = m_leaf_of.find(id);
+  if (it == m_leaf_of.end()) {
+    return false;
+  }
+  Node *node = it->second;
+  m_leaf_of.erase(it);
+  m_positions.erase(id);
+
+  auto &entries = node->entries;
+  auto entry = std::find_if(entries.begin(), entries.end(),
+                            [id](const Entry &e) { return e.id == id; });
+  *entry = entries.back();
+  entries.pop_back();
+
+  // Prune nodes left empty, rather than re-inserting underfull ones. Points
+  // don't overlap, so the looser tree is still cheap to query
+  while (node->parent != nullptr &&
+         (node->leaf ? node->entries.empty() : node->children.empty())) {
+    Node *parent = node->parent;
+    std::erase_if(parent->children,
+                  [node](const auto &child) { return child.get() == node; });
+    node = parent;
+  }
+  recomputeBounds(node);
+  // Collapse a root with a single child
+  while (!m_root->leaf && m_root->children.size() == 1) {
+    std::unique_ptr<Node> child = std::move(m_root->children.front());
+    child->parent = nullptr;
+    m_root = std::move(child);
+  }
+  if (!m_root->leaf && m_root->children.empty()) {
+    m_root->leaf = true;
+  }
+  return true;
+}
+
+template <class F>
+void RTreeIndex::visitBox(const Node *node, const Box &box, F &&visit) const {
+  if (!node->bounds.intersects(box)) {
+    return;
+  }
+  if (node->leaf) {
+    for (const Entry &e : node->entries) {
+      visit(e);
+    }
+    return;
+  }
+  for (const auto &child : node->children) {
+    visitBox(child.get(), box, visit);
+  }
+}
+
+void RTreeIndex::queryBox(const Box &box, std::vector<EntityId> &out) const {
+  visitBox(m_root.get(), box, [&](const Entry &e) {
+    if (box.contains(e.pos)) {
+      out.push_back(e.id);
+    }
+  });
+}
+
+void RTreeIndex::queryRadius(const Point &centre, double radius,
+                             std::vector<EntityId> &out) const {
+  double radius_sq = radius * radius;
+  visitBox(m_root.get(), boxAround(centre, radius), [&](const Entry &e) {
+    if (distanceSq(e.pos, centre) <= radius_sq) {
+      out.push_back(e.id);
+    }
+  });
+}
+
+// Lua bindings
+
+static SpatialIndex *checkIndex(lua_State *L, int index) {
+  if (auto *grid = lua::test_userdata<GridIndex>(L, index)) {
+    return grid;
+  }
+  if (auto *rtree = lua::test_userdata<RTreeIndex>(L, index)) {
+    return rtree;
+  }
+  luaL_typeerror(L, index, "spatial index");
+  return nullptr;
+}
+
+static double checkCoord(lua_State *L, int index) {
+  lua_Number val;
+  lua::arg(L, index, val);
+  luaL_argcheck(L, std::isfinite(val), index, "coordinate must be finite");
+  return val;
+}
+
+// Reads x, y[, z] starting at `index`, where z defaults to 0
+static Point checkPoint(lua_State *L, int index, bool has_z) {
+  return Point{checkCoord(L, index), checkCoord(L, index + 1),
+               has_z ? checkCoord(L, index + 2) : 0.0};
+}
+
+// Push query results as a sequence
+static int pushIds(lua_State *L, const std::vector<EntityId> &ids) {
+  lua_createtable(L, static_cast<int>(ids.size()), 0);
+  for (std::size_t i = 0; i < ids.size(); ++i) {
+    lua_pushinteger(L, ids[i]);
+    lua_rawseti(L, -2, static_cast<lua_Integer>(i + 1));
+  }
+  return 1;
+}
+
+// index:insert(id, x, y[, z])
+static int l_insert(lua_State *L) {
+  SpatialIndex *idx = checkIndex(L, 1);
+  lua_Integer id;
+  lua::arg(L, 2, id);
+  idx->insert(id, checkPoint(L, 3, !lua_isnoneornil(L, 5)));
+  return 0;
+}
+
+// index:move(id, x, y[, z])
+// Returns false if the entity isn't in the index
+static int l_move(lua_State *L) {
+  SpatialIndex *idx = checkIndex(L, 1);
+  lua_Integer id;
+  lua::arg(L, 2, id);
+  lua_pushboolean(L, idx->move(id, checkPoint(L, 3, !lua_isnoneornil(L, 5))));
+  return 1;
+}
+
+// index:remove(id)
+static int l_remove(lua_State *L) {
+  SpatialIndex *idx = checkIndex(L, 1);
+  lua_Integer id;
+  lua::arg(L, 2, id);
+  lua_pushboolean(L, idx->remove(id));
+  return 1;
+}
+
+// index:position(id) -> x, y, z or nil
+static int l_position(lua_State *L) {
+  SpatialIndex *idx = checkIndex(L, 1);
+  lua_Integer id;
+  lua::arg(L, 2, id);
+  auto pos = idx->getPosition(id);
+  if (!pos) {
+    lua_pushnil(L);
+    return 1;
+  }
+  lua_pushnumber(L, pos->x);
+  lua_pushnumber(L, pos->y);
+  lua_pushnumber(L, pos->z);
+  return 3;
+}
+
+// index:radius(x, y[, z], r) -> {ids...}
+static int l_radius(lua_State *L) {
+  SpatialIndex *idx = checkIndex(L, 1);
+  bool has_z = lua_gettop(L) >= 5;
+  Point centre = checkPoint(L, 2, has_z);
+  double radius = checkCoord(L, has_z ? 5 : 4);
+  std::vector<EntityId> ids;
+  idx->queryRadius(centre, radius, ids);
+  return pushIds(L, ids);
+}
+
+// index:box(x1, y1[, z1], x2, y2[, z2]) -> {ids...}
+static int l_box(lua_State *L) {
+  SpatialIndex *idx = checkIndex(L, 1);
+  bool has_z = lua_gettop(L) >= 7;
+  Point a = checkPoint(L, 2, has_z), b = checkPoint(L, has_z ? 5 : 4, has_z);
+  Box box{{std::min(a.x, b.x), std::min(a.y, b.y), std::min(a.z, b.z)},
+          {std::max(a.x, b.x), std::max(a.y, b.y), std::max(a.z, b.z)}};
+  std::vector<EntityId> ids;
+  idx->queryBox(box, ids);
+  return pushIds(L, ids);
+}
+
+// index:count()
+static int l_count(lua_State *L) {
+  SpatialIndex *idx = checkIndex(L, 1);
+  lua_pushinteger(L, static_cast<lua_Integer>(idx->size()));
+  return 1;
+}
+
+const luaL_Reg SpatialIndex::LUA_METHODS[]{{"insert", l_insert},
+                                           {"move", l_move},
+                                           {"remove", l_remove},
+                                           {"position", l_position},
+                                           {"radius", l_radius},
+                                           {"box", l_box},
+                                           {"count", l_count},
+                                           {nullptr, nullptr}};
+
+// spatial.grid(cell_size)
+static int l_grid(lua_State *L) {
+  lua_Number cell_size;
+  lua::arg(L, 1, cell_size);
+  luaL_argcheck(L, cell_size > 0 && std::isfinite(cell_size), 1,
+                "cell size must be positive");
+  lua::new_userdata_uv<GridIndex>(L, 0, cell_size);
+  return 1;
+}
+
+// spatial.rtree()
+static int l_rtree(lua_State *L) {
+  lua::new_userdata_uv<RTreeIndex>(L, 0);
+  return 1;
+}
+
+int luaopen_spatial(lua_State *L) {
+  static const luaL_Reg funcs[]{
+      {"grid", l_grid}, {"rtree", l_rtree}, {nullptr, nullptr}};
+  luaL_newlib(L, funcs);
+  return 1;
+}
+
+} // namespace whatmud::world
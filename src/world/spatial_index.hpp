@@ -0,0 +1,154 @@
+#ifndef WHATMUD_WORLD_SPATIAL_INDEX_HPP
+#define WHATMUD_WORLD_SPATIAL_INDEX_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+#include <lua.hpp>
+
+namespace whatmud::world {
+
+using EntityId = lua_Integer;
+
+struct Point {
+  double x = 0, y = 0, z = 0;
+};
+
+struct Box {
+  Point min, max;
+
+  bool contains(const Point &p) const {
+    return p.x >= min.x && p.x <= max.x && p.y >= min.y && p.y <= max.y &&
+           p.z >= min.z && p.z <= max.z;
+  }
+  bool intersects(const Box &b) const {
+    return b.min.x <= max.x && b.max.x >= min.x && b.min.y <= max.y &&
+           b.max.y >= min.y && b.min.z <= max.z && b.max.z >= min.z;
+  }
+};
+
+/**
+ * Maps entity IDs to positions, answering box and radius queries without
+ * scanning every entity.
+ * Inserting an existing ID moves it.
+ */
+class SpatialIndex {
+public:
+  virtual ~SpatialIndex() = default;
+
+  virtual void insert(EntityId id, Point p) = 0;
+  // Returns false if `id` isn't in the index
+  virtual bool move(EntityId id, Point p) = 0;
+  virtual bool remove(EntityId id) = 0;
+
+  // Append the IDs of all entities inside `box` (inclusive) to `out`
+  virtual void queryBox(const Box &box, std::vector<EntityId> &out) const = 0;
+  // Append the IDs of all entities within `radius` of `centre` to `out`
+  virtual void queryRadius(const Point &centre, double radius,
+                           std::vector<EntityId> &out) const = 0;
+
+  std::optional<Point> getPosition(EntityId id) const;
+  std::size_t size() const { return m_positions.size(); }
+
+  // Methods available on both index types in Lua
+  static const luaL_Reg LUA_METHODS[];
+
+protected:
+  std::unordered_map<EntityId, Point> m_positions;
+};
+
+/**
+ * A uniform grid of cubic cells, best for dense worlds where most queries
+ * cover a handful of cells.
+ */
+class GridIndex : public SpatialIndex {
+public:
+  explicit GridIndex(double cell_size);
+
+  virtual void insert(EntityId id, Point p) override;
+  virtual bool move(EntityId id, Point p) override;
+  virtual bool remove(EntityId id) override;
+  virtual void queryBox(const Box &box,
+                        std::vector<EntityId> &out) const override;
+  virtual void queryRadius(const Point &centre, double radius,
+                           std::vector<EntityId> &out) const override;
+
+private:
+  struct Cell {
+    std::int32_t x, y, z;
+    bool operator==(const Cell &) const = default;
+  };
+  struct CellHash {
+    std::size_t operator()(const Cell &c) const {
+      std::uint64_t h = static_cast<std::uint32_t>(c.x);
+      h = h * 0x9E3779B97F4A7C15ull ^ static_cast<std::uint32_t>(c.y);
+      h = h * 0x9E3779B97F4A7C15ull ^ static_cast<std::uint32_t>(c.z);
+      return static_cast<std::size_t>(h ^ (h >> 29));
+    }
+  };
+  struct Entry {
+    EntityId id;
+    Point pos;
+  };
+
+  Cell cellOf(const Point &p) const;
+  void eraseFromCell(const Cell &cell, EntityId id);
+  template <class F> void visitBox(const Box &box, F &&visit) const;
+
+  double m_inv_cell_size;
+  std::unordered_map<Cell, std::vector<Entry>, CellHash> m_cells;
+};
+
+/**
+ * An R-tree over points, best for sparse worlds with far-flung coordinates
+ * where a grid would be mostly empty cells.
+ */
+class RTreeIndex : public SpatialIndex {
+public:
+  RTreeIndex();
+  virtual ~RTreeIndex() override;
+
+  virtual void insert(EntityId id, Point p) override;
+  virtual bool move(EntityId id, Point p) override;
+  virtual bool remove(EntityId id) override;
+  virtual void queryBox(const Box &box,
+                        std::vector<EntityId> &out) const override;
+  virtual void queryRadius(const Point &centre, double radius,
+                           std::vector<EntityId> &out) const override;
+
+private:
+  static constexpr std::size_t MAX_ENTRIES = 16;
+
+  struct Entry {
+    EntityId id;
+    Point pos;
+  };
+  struct Node {
+    Box bounds;
+    Node *parent = nullptr;
+    bool leaf = true;
+    std::vector<std::unique_ptr<Node>> children;
+    std::vector<Entry> entries;
+  };
+
+  Node *chooseLeaf(const Point &p);
+  void split(Node *node);
+  void recomputeBounds(Node *node);
+  template <class F>
+  void visitBox(const Node *node, const Box &box, F &&visit) const;
+
+  std::unique_ptr<Node> m_root;
+  // Leaf holding each entity, so removal doesn't need a search
+  std::unordered_map<EntityId, Node *> m_leaf_of;
+};
+
+// Opens the `spatial` library, with grid() and rtree() constructors
+int luaopen_spatial(lua_State *L);
+
+} // namespace whatmud::world
+
+#endif
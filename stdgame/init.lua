@@ -8,5 +8,141 @@ connection_count = 0
 
 client_handler = "client_handler"
 
+-- Number of Lua states used to run spawn_job() calls off the main thread
+worker_threads = 2
+
+-- SQLite database, relative to the game directory, and how many connections
+-- to run queries on. Queries run off the main thread; db.query(), db.exec()
+-- and db.script() suspend the calling coroutine until they complete
+database = "game.db"
+database_connections = 2
+
+-- Write-behind persistence. persist.mark(kind, id, value) only records that
+-- an object changed; every persist_interval seconds the oldest changes, up to
+-- persist_max_objects objects or persist_max_bytes serialized bytes, are
+-- saved in one transaction. A crash loses at most the unsaved changes, see
+-- oldest_dirty_ms in persist.stats()
+persist_interval = 5
+persist_max_objects = 500
+persist_max_bytes = 4194304
+
+-- persist.load(kind, id) and persist.proxy(kind, id) load objects on demand,
+-- suspending the calling coroutine. Clean objects stay cached, least recently
+-- used first out, up to this many serialized bytes
+persist_cache_bytes = 33554432
+
+-- World heartbeat rate in Hz, and how many missed ticks to run back to back
+-- before skipping them
+tick_rate = 10
+tick_max_catchup = 5
+
+-- "async" hands log messages to a background thread through a queue of
+-- log_queue_size messages, dropping them when it's full rather than stalling
+-- the game on a slow stderr. log_format "json" writes one object per line
+log_mode = "async"
+log_queue_size = 4096
+log_format = "text"
+
+-- Event loop iterations and Lua resumes taking longer than this many
+-- milliseconds are logged as slow, resumes with a traceback. 0 turns it off
+loop_slow_ms = 50
+
+-- Serve metrics in the Prometheus text format at http://address:port/metrics.
+-- Off unless a port is set. There's no authentication, so keep it local
+-- metrics_port = 9100
+metrics_address = "127.0.0.1"
+
+-- Unix socket for inspecting and managing the running game, relative to this
+-- directory. Connect with E.G. `socat - UNIX-CONNECT:admin.sock` and send
+-- `help`. Only the user running the game can connect. Off if unset
+admin_socket = "admin.sock"
+
+-- Record everything clients send to a new capture file in this directory,
+-- relative to this one, for replaying against another build with
+-- `whatmud-replay <game-directory> <capture>`. Each start and copyover begins
+-- a new file. Off if unset; `capture start` on the admin socket starts one
+-- while the game runs
+-- capture_dir = "captures"
+
+-- Commands. Handlers run on their own coroutine as
+-- handler(connection, args, rest, verb), where args is the rest of the line
+-- split into words. Abbreviations resolve to the highest priority match
+-- Colour markup is compiled once and rendered to suit each client
+local you_say = markup.compile("{c}You say:{x} ")
+
+commands.add("say", function(conn, args, rest)
+  conn:writeln(you_say, rest)
+end, {aliases = {"'"}})
+
+commands.add("alias", function(conn, args, rest)
+  local word = args[1]
+  if not word then
+    for word, expansion in pairs(conn:aliases()) do
+      conn:writef("{} = {}\n", word, expansion)
+    end
+    return
+  end
+  local expansion = rest:match("^%S+%s+(.+)$")
+  conn:alias(word, expansion)
+end)
+
+-- Commands for running the game. There are no accounts yet to restrict them
+-- to administrators, so they only exist when this is set
+debug_commands = false
+
+if debug_commands then
+  -- profile on [interval ms] | off | reset | top [n] | write [file]
+  commands.add("profile", function(conn, args)
+    local action = args[1] or "top"
+    if action == "on" then
+      profiler.start(tonumber(args[2]))
+      conn:writeln("Profiling started.")
+    elseif action == "off" then
+      profiler.stop()
+      conn:writeln("Profiling stopped.")
+    elseif action == "reset" then
+      profiler.reset()
+      conn:writeln("Samples cleared.")
+    elseif action == "write" then
+      -- Only a plain file name, so it can't write outside the game directory
+      local file = args[2] or "profile.folded"
+      if not file:find("^[%w_%-][%w_%.%-]*$") then
+        conn:writeln("The file must be a plain file name.")
+        return
+      end
+      conn:writef("Wrote {} stacks to {}\n", profiler.write(file), file)
+    else
+      local report = profiler.report(tonumber(args[2]) or 10)
+      conn:writef("{} samples, {} ms\n", report.samples, report.time)
+      for _, fn in ipairs(report.functions) do
+        conn:writef("{:>10.1f} {:>10.1f}  {}\n", fn.self, fn.total, fn.name)
+      end
+    end
+  end)
+
+  -- census [diff] [n]: Lua memory by type, module and owner, or the change
+  -- since the last census
+  local last_census
+  commands.add("census", function(conn, args)
+    local diff = args[1] == "diff"
+    local limit = tonumber(diff and args[2] or args[1]) or 10
+    if diff and not last_census then
+      conn:writeln("Take a census first.")
+      return
+    end
+    -- The last census is kept alive by this function, so leave it out
+    local now = census.take(last_census)
+    if diff then
+      conn:write(census.diff(last_census, now, limit))
+    else
+      conn:write(census.report(now, limit))
+    end
+    last_census = now
+  end)
+end
+
+commands.fallback(function(conn, args, rest, verb)
+  conn:writef("Unknown command: {}\n", verb)
+end)
 
 listen()
@@ -0,0 +1,669 @@
+// whatmud-loadgen: load test a whatmud server with a swarm of telnet bots.
+// Each bot connects, negotiates like a MUD client and sends commands picked
+// from a weighted mix at random intervals, one at a time. A command's latency
+// is the time until the first output after sending it.
+
+#include <algorithm>
+#include <charconv>
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
+#include <fstream>
+#include <random>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+#include <vector>
+
+#include <fmt/core.h>
+#include <libtelnet.h>
+#include <uv.h>
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+#include "histogram.hpp"
+#include "uv/error.hpp"
+#include "uv/loop.hpp"
+#include "uv/tcp.hpp"
+#include "uv/timer.hpp"
+
+namespace whatmud::loadgen {
+
+struct Options {
+  std::string host = "127.0.0.1";
+  int port = 4000;
+  // Resolved from host and port
+  struct sockaddr_storage addr;
+  unsigned connections = 100;
+  // Connections opened per second
+  double ramp = 100;
+  // Seconds to keep sending commands once every bot has started connecting
+  double duration = 30;
+  // Commands per second per bot, on average
+  double rate = 1;
+  // Milliseconds to wait for a response before giving up on it
+  std::uint64_t timeout_ms = 5000;
+  std::uint32_t seed = 1;
+  bool json = false;
+  const char *script = nullptr;
+};
+
+// One line of the command mix
+struct Command {
+  std::string text;
+  double weight;
+  Histogram latency;
+  std::uint64_t sent = 0;
+  std::uint64_t timeouts = 0;
+};
+
+class Swarm;
+
+// One simulated client
+class Bot {
+public:
+  Bot(Swarm *swarm);
+  ~Bot();
+
+  void connect(const struct sockaddr *addr);
+  // Close the bot's handles, deleting it once they have closed
+  void close();
+
+private:
+  struct WriteReq {
+    uv_write_t req;
+    std::string data;
+  };
+
+  void onConnect(int status);
+  void onRead(ssize_t nread, const uv_buf_t *buf);
+  void onEvent(telnet_event_t &ev);
+  void onTimer();
+  void schedule();
+  void write(const char *buf, std::size_t size);
+
+  Swarm *m_swarm;
+  uv::TCP m_tcp;
+  uv::Timer m_timer;
+  uv_connect_t m_connect_req;
+  telnet_t *m_telnet;
+  std::uint64_t m_connect_start = 0;
+  bool m_connected = false;
+  bool m_got_data = false;
+  // The command awaiting a response, and when it was sent
+  Command *m_pending = nullptr;
+  std::uint64_t m_sent_at = 0;
+  int m_open_handles = 2;
+  char m_buf[4096];
+};
+
+class Swarm {
+public:
+  Swarm(Options options, std::deque<Command> &commands);
+
+  void run();
+
+  void print() const;
+  void printJson() const;
+
+private:
+  friend class Bot;
+
+  void onRampTimer();
+  void stop();
+  Command &pickCommand() { return m_commands[m_pick(m_rng)]; }
+  // Milliseconds until a bot's next command
+  std::uint64_t nextDelay() {
+    return static_cast<std::uint64_t>(m_delay(m_rng) * 1000);
+  }
+
+  Options m_options;
+  std::deque<Command> &m_commands;
+  uv::Loop m_loop;
+  uv::Timer m_ramp_timer;
+  uv::Timer m_stop_timer;
+  uv_signal_t m_sigint;
+  std::mt19937 m_rng;
+  std::discrete_distribution<std::size_t> m_pick;
+  std::exponential_distribution<double> m_delay;
+  // Bots not yet deleted, and how many have been started
+  std::unordered_set<Bot *> m_bots;
+  unsigned m_started = 0;
+  bool m_stopping = false;
+  std::uint64_t m_start = 0;
+  std::uint64_t m_elapsed = 0;
+
+  Histogram m_connect_time;
+  // Time from connecting to the first output, usually the login banner
+  Histogram m_first_byte;
+  std::uint64_t m_connected = 0;
+  std::uint64_t m_connect_failed = 0;
+  std::uint64_t m_disconnected = 0;
+  std::uint64_t m_bytes_sent = 0;
+  std::uint64_t m_bytes_received = 0;
+  // Commands not sent because the last was still waiting for a response
+  std::uint64_t m_skipped = 0;
+};
+
+// Telnet charset negotiation, not yet in libtelnet
+#ifndef TELNET_TELOPT_CHARSET
+#define TELNET_TELOPT_CHARSET 42
+#define TELNET_CHARSET_REQUEST 1
+#define TELNET_CHARSET_ACCEPTED 2
+#endif
+
+// Options a typical MUD client supports
+static const telnet_telopt_t TELNET_OPTS[]{
+    {TELNET_TELOPT_TTYPE, TELNET_WILL, TELNET_DONT},
+    {TELNET_TELOPT_CHARSET, TELNET_WONT, TELNET_DO},
+    {-1, 0, 0}};
+
+Bot::Bot(Swarm *swarm)
+    : m_swarm(swarm), m_tcp(swarm->m_loop.asLoop()),
+      m_timer(swarm->m_loop.asLoop()),
+      m_telnet(telnet_init(
+          TELNET_OPTS,
+          [](telnet_t *, telnet_event_t *ev, void *data) {
+            static_cast<Bot *>(data)->onEvent(*ev);
+          },
+          0, this)) {
+  m_tcp.setData(this);
+  m_timer.setData(this);
+  m_connect_req.data = this;
+}
+
+Bot::~Bot() {
+  m_swarm->m_bots.erase(this);
+  telnet_free(m_telnet);
+}
+
+void Bot::connect(const struct sockaddr *addr) {
+  m_connect_start = uv_hrtime();
+  try {
+    m_tcp.connect(&m_connect_req, addr, [](uv_connect_t *req, int status) {
+      static_cast<Bot *>(req->data)->onConnect(status);
+    });
+  } catch (const uv::Error &) {
+    // E.G. out of file descriptors, the callback won't run
+    ++m_swarm->m_connect_failed;
+    close();
+  }
+}
+
+void Bot::close() {
+  auto on_close = [](uv_handle_t *handle) {
+    Bot *bot = static_cast<Bot *>(handle->data);
+    if (--bot->m_open_handles == 0) {
+      delete bot;
+    }
+  };
+  if (!m_tcp.isClosing()) {
+    m_tcp.close(on_close);
+  }
+  if (!m_timer.isClosing()) {
+    m_timer.close(on_close);
+  }
+}
+
+void Bot::onConnect(int status) {
+  if (status == UV_ECANCELED) {
+    return;
+  }
+  if (status < 0) {
+    ++m_swarm->m_connect_failed;
+    close();
+    return;
+  }
+  m_connected = true;
+  ++m_swarm->m_connected;
+  m_swarm->m_connect_time.observe(uv_hrtime() - m_connect_start);
+  m_tcp.setNodelay(true);
+  m_tcp.readStart(
+      [](uv_handle_t *handle, std::size_t, uv_buf_t *buf) {
+        Bot *bot = static_cast<Bot *>(handle->data);
+        *buf = uv_buf_init(bot->m_buf, sizeof(bot->m_buf));
+      },
+      [](uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf) {
+        static_cast<Bot *>(stream->data)->onRead(nread, buf);
+      });
+  // Spread the first commands out
+  m_timer.start(
+      [](uv_timer_t *handle) { static_cast<Bot *>(handle->data)->onTimer(); },
+      m_swarm->nextDelay());
+}
+
+void Bot::onRead(ssize_t nread, const uv_buf_t *buf) {
+  if (nread == 0) {
+    return; // EAGAIN
+  } else if (nread < 0) {
+    if (!m_swarm->m_stopping) {
+      ++m_swarm->m_disconnected;
+    }
+    close();
+    return;
+  }
+  m_swarm->m_bytes_received += static_cast<std::uint64_t>(nread);
+  telnet_recv(m_telnet, buf->base, static_cast<std::size_t>(nread));
+}
+
+void Bot::onEvent(telnet_event_t &ev) {
+  switch (ev.type) {
+  case TELNET_EV_SEND:
+    write(ev.data.buffer, ev.data.size);
+    break;
+  case TELNET_EV_DATA:
+    if (!m_got_data) {
+      m_got_data = true;
+      m_swarm->m_first_byte.observe(uv_hrtime() - m_connect_start);
+    }
+    if (m_pending != nullptr) {
+      m_pending->latency.observe(uv_hrtime() - m_sent_at);
+      m_pending = nullptr;
+    }
+    break;
+  case TELNET_EV_TTYPE:
+    if (ev.ttype.cmd == TELNET_TTYPE_SEND) {
+      telnet_ttype_is(m_telnet, "WHATMUD-LOADGEN");
+    }
+    break;
+  case TELNET_EV_SUBNEGOTIATION:
+    if (ev.sub.telopt == TELNET_TELOPT_CHARSET && ev.sub.size > 0 &&
+        ev.sub.buffer[0] == TELNET_CHARSET_REQUEST) {
+      telnet_begin_sb(m_telnet, TELNET_TELOPT_CHARSET);
+      telnet_printf(m_telnet, "%cUTF-8", TELNET_CHARSET_ACCEPTED);
+      telnet_finish_sb(m_telnet);
+    }
+    break;
+  case TELNET_EV_ERROR:
+    close();
+    break;
+  default:
+    break;
+  }
+}
+
+void Bot::onTimer() {
+  if (m_swarm->m_stopping) {
+    return;
+  }
+  schedule();
+  if (m_pending != nullptr) {
+    if (uv_hrtime() - m_sent_at < m_swarm->m_options.timeout_ms * 1000000) {
+      // Like a player waiting for the game to catch up
+      ++m_swarm->m_skipped;
+      return;
+    }
+    ++m_pending->timeouts;
+  }
+  Command &command = m_swarm->pickCommand();
+  ++command.sent;
+  m_pending = &command;
+  m_sent_at = uv_hrtime();
+  telnet_send_text(m_telnet, command.text.data(), command.text.size());
+  telnet_send_text(m_telnet, "\r\n", 2);
+}
+
+void Bot::schedule() {
+  m_timer.start(
+      [](uv_timer_t *handle) { static_cast<Bot *>(handle->data)->onTimer(); },
+      m_swarm->nextDelay());
+}
+
+void Bot::write(const char *buf, std::size_t size) {
+  if (!m_connected || m_tcp.isClosing()) {
+    return;
+  }
+  m_swarm->m_bytes_sent += size;
+  WriteReq *wr = new WriteReq{{}, std::string(buf, size)};
+  uv_buf_t out = uv_buf_init(wr->data.data(), wr->data.size());
+  try {
+    m_tcp.write(&wr->req, &out, [](uv_write_t *req, int) {
+      delete reinterpret_cast<WriteReq *>(req);
+    });
+  } catch (const uv::Error &) {
+    delete wr;
+    close();
+  }
+}
+
+Swarm::Swarm(Options options, std::deque<Command> &commands)
+    : m_options(std::move(options)), m_commands(commands),
+      m_ramp_timer(m_loop.asLoop()), m_stop_timer(m_loop.asLoop()),
+      m_rng(m_options.seed), m_delay(m_options.rate) {
+  std::vector<double> weights;
+  for (const Command &command : m_commands) {
+    weights.push_back(command.weight);
+  }
+  m_pick = std::discrete_distribution<std::size_t>(weights.begin(),
+                                                   weights.end());
+
+  m_ramp_timer.setData(this);
+  m_stop_timer.setData(this);
+  uv_signal_init(m_loop.asLoop(), &m_sigint);
+  m_sigint.data = this;
+}
+
+void Swarm::run() {
+  m_start = uv_hrtime();
+  m_ramp_timer.start(
+      [](uv_timer_t *handle) {
+        static_cast<Swarm *>(handle->data)->onRampTimer();
+      },
+      0, 10);
+  uv_signal_start(
+      &m_sigint,
+      [](uv_signal_t *handle, int) {
+        static_cast<Swarm *>(handle->data)->stop();
+      },
+      SIGINT);
+  m_loop.run();
+}
+
+void Swarm::onRampTimer() {
+  double elapsed = (uv_hrtime() - m_start) / 1e9;
+  auto due = static_cast<std::size_t>(elapsed * m_options.ramp) + 1;
+  while (m_started < m_options.connections && m_started < due) {
+    Bot *bot = new Bot(this);
+    m_bots.insert(bot);
+    ++m_started;
+    bot->connect((const struct sockaddr *)&m_options.addr);
+  }
+  if (m_started == m_options.connections) {
+    m_ramp_timer.stop();
+    m_stop_timer.start(
+        [](uv_timer_t *handle) { static_cast<Swarm *>(handle->data)->stop(); },
+        static_cast<std::uint64_t>(m_options.duration * 1000));
+  }
+}
+
+void Swarm::stop() {
+  if (m_stopping) {
+    return;
+  }
+  m_stopping = true;
+  m_elapsed = uv_hrtime() - m_start;
+  // Bots delete themselves once closed
+  std::vector<Bot *> bots(m_bots.begin(), m_bots.end());
+  for (Bot *bot : bots) {
+    bot->close();
+  }
+  m_ramp_timer.close();
+  m_stop_timer.close();
+  uv_close((uv_handle_t *)&m_sigint, nullptr);
+}
+
+static std::uint64_t total_sent(const std::deque<Command> &commands) {
+  std::uint64_t sent = 0;
+  for (const Command &command : commands) {
+    sent += command.sent;
+  }
+  return sent;
+}
+
+static std::uint64_t total_answered(const std::deque<Command> &commands) {
+  std::uint64_t answered = 0;
+  for (const Command &command : commands) {
+    answered += command.latency.getCount();
+  }
+  return answered;
+}
+
+// One line of p50/p90/p99/p99.9/max in milliseconds
+static std::string percentiles(const Histogram &hist) {
+  if (hist.getCount() == 0) {
+    return "-";
+  }
+  return fmt::format("p50 {:.2f}  p90 {:.2f}  p99 {:.2f}  p99.9 {:.2f}  "
+                     "max {:.2f} ms",
+                     hist.getPercentile(50) / 1e6,
+                     hist.getPercentile(90) / 1e6,
+                     hist.getPercentile(99) / 1e6,
+                     hist.getPercentile(99.9) / 1e6, hist.getMax() / 1e6);
+}
+
+void Swarm::print() const {
+  double seconds = m_elapsed / 1e9;
+  std::uint64_t answered = total_answered(m_commands);
+  fmt::print("{} of {} connected, {} failed, {} dropped by the server, "
+             "{:.1f} s\n",
+             m_connected, m_options.connections, m_connect_failed,
+             m_disconnected, seconds);
+  fmt::print("connect      {}\n", percentiles(m_connect_time));
+  fmt::print("first byte   {}\n", percentiles(m_first_byte));
+  fmt::print("{} commands sent, {} answered ({:.1f}/s), {} skipped while "
+             "waiting\n",
+             total_sent(m_commands), answered, answered / seconds, m_skipped);
+  fmt::print("{} bytes sent, {} received\n", m_bytes_sent, m_bytes_received);
+  for (const Command &command : m_commands) {
+    fmt::print("\n\"{}\": {} sent, {} timed out\n  {}\n", command.text,
+               command.sent, command.timeouts, percentiles(command.latency));
+  }
+}
+
+static std::string json_string(std::string_view str) {
+  std::string out = "\"";
+  for (char c : str) {
+    if (c == '"' || c == '\\') {
+      out += '\\';
+      out += c;
+    } else if (static_cast<unsigned char>(c) < 0x20) {
+      out += fmt::format("\\u{:04x}", c);
+    } else {
+      out += c;
+    }
+  }
+  out += '"';
+  return out;
+}
+
+// A histogram as a JSON object, in milliseconds
+static std::string json_histogram(const Histogram &hist) {
+  return fmt::format("{{\"count\":{},\"p50\":{:.3f},\"p90\":{:.3f},"
+                     "\"p99\":{:.3f},\"p999\":{:.3f},\"max\":{:.3f}}}",
+                     hist.getCount(), hist.getPercentile(50) / 1e6,
+                     hist.getPercentile(90) / 1e6,
+                     hist.getPercentile(99) / 1e6,
+                     hist.getPercentile(99.9) / 1e6, hist.getMax() / 1e6);
+}
+
+void Swarm::printJson() const {
+  double seconds = m_elapsed / 1e9;
+  std::string commands;
+  for (const Command &command : m_commands) {
+    commands += fmt::format(
+        "{}{{\"command\":{},\"sent\":{},\"timeouts\":{},\"latency_ms\":{}}}",
+        commands.empty() ? "" : ",", json_string(command.text), command.sent,
+        command.timeouts, json_histogram(command.latency));
+  }
+  fmt::print("{{\"seconds\":{:.3f},\"connections\":{},\"connected\":{},"
+             "\"connect_failed\":{},\"disconnected\":{},"
+             "\"connect_ms\":{},\"first_byte_ms\":{},\"sent\":{},"
+             "\"answered\":{},\"per_second\":{:.3f},\"skipped\":{},"
+             "\"bytes_sent\":{},\"bytes_received\":{},\"commands\":[{}]}}\n",
+             seconds, m_options.connections, m_connected, m_connect_failed,
+             m_disconnected, json_histogram(m_connect_time),
+             json_histogram(m_first_byte), total_sent(m_commands),
+             total_answered(m_commands),
+             total_answered(m_commands) / seconds, m_skipped, m_bytes_sent,
+             m_bytes_received, commands);
+}
+
+// Read a command mix: one `weight command` per line, # starts a comment
+static bool load_script(const char *path, std::deque<Command> &commands) {
+  std::ifstream file(path);
+  if (!file) {
+    return false;
+  }
+  std::string line;
+  while (std::getline(file, line)) {
+    std::string_view rest(line);
+    while (!rest.empty() && (rest.back() == '\r' || rest.back() == ' ')) {
+      rest.remove_suffix(1);
+    }
+    std::size_t start = rest.find_first_not_of(" \t");
+    if (start == std::string_view::npos || rest[start] == '#') {
+      continue;
+    }
+    rest.remove_prefix(start);
+    double weight;
+    auto [end, ec] =
+        std::from_chars(rest.data(), rest.data() + rest.size(), weight);
+    if (ec != std::errc() || weight <= 0) {
+      return false;
+    }
+    rest.remove_prefix(static_cast<std::size_t>(end - rest.data()));
+    rest.remove_prefix(std::min(rest.find_first_not_of(" \t"), rest.size()));
+    Command &command = commands.emplace_back();
+    command.text = rest;
+    command.weight = weight;
+  }
+  return !commands.empty();
+}
+
+// Every bot needs a socket, so raise the limit on open files as far as it
+// goes, warning if that still isn't enough
+static void raise_file_limit(unsigned connections) {
+#ifdef _WIN32
+  // Windows has no per-process socket limit to raise
+  (void)connections;
+#else
+  // Spare for the loop's own descriptors
+  rlim_t wanted = static_cast<rlim_t>(connections) + 32;
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) != 0 || limit.rlim_cur >= wanted) {
+    return;
+  }
+  limit.rlim_cur = std::min(wanted, limit.rlim_max);
+  if (setrlimit(RLIMIT_NOFILE, &limit) != 0) {
+    getrlimit(RLIMIT_NOFILE, &limit);
+  }
+  if (limit.rlim_cur < wanted) {
+    fmt::print(stderr,
+               "Warning: only {} files can be open, some bots will fail to "
+               "connect\n",
+               static_cast<std::uint64_t>(limit.rlim_cur));
+  }
+#endif
+}
+
+} // namespace whatmud::loadgen
+
+namespace loadgen = whatmud::loadgen;
+
+[[noreturn]] static void usage(char *argv[], const char *errmsg) {
+  const char *prog = argv[0] ? argv[0] : "whatmud-loadgen";
+  fmt::print(stderr, "Error: {}\n", errmsg);
+  fmt::print(
+      stderr,
+      "Usage: {} [options] [host] [port]\n"
+      "  -c <n>     connections to open (100)\n"
+      "  -r <n>     connections opened per second (100)\n"
+      "  -d <s>     seconds to run once every connection is open (30)\n"
+      "  -R <n>     commands per second per connection, on average (1)\n"
+      "  -t <ms>    response timeout (5000)\n"
+      "  -s <file>  command mix, `weight command` per line (1 say hello)\n"
+      "  -S <n>     random seed (1)\n"
+      "  --json     print the results as JSON\n",
+      prog);
+  std::exit(EXIT_FAILURE);
+}
+
+template <class T> static T parse_number(char *argv[], const char *arg) {
+  T value{};
+  std::string_view str(arg);
+  auto [end, ec] = std::from_chars(str.data(), str.data() + str.size(), value);
+  if (ec != std::errc() || end != str.data() + str.size() || value <= 0) {
+    usage(argv, "Expected a positive number");
+  }
+  return value;
+}
+
+int main(int argc, char **argv) {
+  loadgen::Options options;
+  int positional = 0;
+  for (int i = 1; i < argc; ++i) {
+    std::string_view arg(argv[i]);
+    if (arg == "--json") {
+      options.json = true;
+      continue;
+    }
+    if (arg.size() == 2 && arg[0] == '-') {
+      if (++i == argc) {
+        usage(argv, "Missing option value");
+      }
+      switch (arg[1]) {
+      case 'c':
+        options.connections = parse_number<unsigned>(argv, argv[i]);
+        break;
+      case 'r':
+        options.ramp = parse_number<double>(argv, argv[i]);
+        break;
+      case 'd':
+        options.duration = parse_number<double>(argv, argv[i]);
+        break;
+      case 'R':
+        options.rate = parse_number<double>(argv, argv[i]);
+        break;
+      case 't':
+        options.timeout_ms = parse_number<std::uint64_t>(argv, argv[i]);
+        break;
+      case 's':
+        options.script = argv[i];
+        break;
+      case 'S':
+        options.seed = parse_number<std::uint32_t>(argv, argv[i]);
+        break;
+      default:
+        usage(argv, "Unknown option");
+      }
+      continue;
+    }
+    if (positional == 0) {
+      options.host = argv[i];
+    } else if (positional == 1) {
+      options.port = parse_number<int>(argv, argv[i]);
+    } else {
+      usage(argv, "Too many arguments were given");
+    }
+    ++positional;
+  }
+
+  // Histograms can't move, so commands live in a deque
+  std::deque<loadgen::Command> commands;
+  if (options.script != nullptr) {
+    if (!loadgen::load_script(options.script, commands)) {
+      usage(argv, "Could not read the command mix");
+    }
+  } else {
+    loadgen::Command &command = commands.emplace_back();
+    command.text = "say hello";
+    command.weight = 1;
+  }
+
+  int res = uv_ip4_addr(options.host.c_str(), options.port,
+                        (struct sockaddr_in *)&options.addr);
+  if (res < 0) {
+    res = uv_ip6_addr(options.host.c_str(), options.port,
+                      (struct sockaddr_in6 *)&options.addr);
+  }
+  if (res < 0) {
+    usage(argv, "Could not parse the server address");
+  }
+
+  loadgen::raise_file_limit(options.connections);
+  try {
+    bool json = options.json;
+    loadgen::Swarm swarm(std::move(options), commands);
+    swarm.run();
+    if (json) {
+      swarm.printJson();
+    } else {
+      swarm.print();
+    }
+  } catch (const std::exception &e) {
+    fmt::print(stderr, "Error: {}\n", e.what());
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,517 @@
+// whatmud-replay: feed a capture of real client traffic back into an engine
+// running a game, to compare builds under the same load.
+//
+// Every captured connection gets a socket pair, the engine accepting one end
+// as if a client had connected and the replay writing the captured bytes into
+// the other. By default input is replayed as fast as the engine handles it:
+// each record waits until every connection has finished with the input it
+// was given, its commands have run and their output has been written, so
+// runs are repeatable. With --realtime records are sent at their captured
+// times instead, optionally sped up, reproducing bursts and overlap.
+//
+// A command's latency is the time from writing input containing a line until
+// the engine has finished with it. A connection diverges if the engine sent
+// it a different amount of output than when it was captured. The replay's
+// own work is cheap, but its CPU time is included in the total.
+//
+// The game's init script runs as usual, so point this at a copy of the game
+// directory rather than a live one: its database is opened too. The engine
+// runs offline, without listeners, the metrics listener, the admin socket or
+// a capture.
+
+#include <charconv>
+#include <cstdint>
+#include <cstdlib>
+#include <exception>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include <fmt/core.h>
+#include <uv.h>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#include "capture.hpp"
+#include "connection.hpp"
+#include "engine.hpp"
+#include "histogram.hpp"
+#include "lua/helpers.hpp"
+#include "uv/error.hpp"
+#include "uv/pipe.hpp"
+#include "uv/prepare.hpp"
+#include "uv/timer.hpp"
+
+namespace whatmud::replay {
+
+struct Options {
+  const char *game_dir = nullptr;
+  const char *capture = nullptr;
+  // Replay at the captured pace, multiplied by speed
+  bool realtime = false;
+  double speed = 1;
+  bool json = false;
+};
+
+// One captured connection
+struct Session {
+  Session(uv_loop_t *loop, std::uint32_t id, bool joined)
+      : id(id), joined(joined), client(loop) {}
+
+  std::uint32_t id;
+  // Opened before the capture started, so its output can't be compared
+  bool joined;
+  // The engine's end, kept alive to the end of the replay
+  lua::Ref ref;
+  Connection *conn = nullptr;
+  // The client's end
+  uv::Pipe client;
+  bool client_open = false;
+  // The capture closed the connection
+  bool closed = false;
+  std::uint64_t written = 0;
+  // When the oldest input the engine hasn't finished with was written, and
+  // whether any of it completed a line
+  std::uint64_t busy_since = 0;
+  bool has_line = false;
+  char buf[4096];
+};
+
+class Replay {
+public:
+  Replay(Engine *engine, Options options);
+
+  // Start feeding the capture into the engine's loop, stopping the loop
+  // once it's all been handled
+  void start();
+
+  void print() const;
+  void printJson() const;
+
+private:
+  struct WriteReq {
+    uv_write_t req;
+    std::string data;
+  };
+
+  // Record latencies of input the engine has finished with
+  void onPrepare();
+  void onTimer();
+  // Whether the engine has finished with everything sent to a session
+  bool isIdle(Session &session);
+
+  // Read the next record into m_next, if there is one
+  bool readNext();
+  void apply(CaptureRecord &record);
+  void open(const CaptureRecord &record);
+  void send(Session &session, std::string &&data);
+  void close(Session &session);
+  void finish();
+
+  // Microseconds into the capture that the replay has reached
+  std::uint64_t getCaptureTime() const {
+    return static_cast<std::uint64_t>((uv_hrtime() - m_start) / 1e3 *
+                                      m_options.speed);
+  }
+
+  Engine *m_engine;
+  Options m_options;
+  CaptureReader m_reader;
+  CaptureRecord m_next;
+  bool m_have_next = false;
+  bool m_finished = false;
+  uv::Prepare m_prepare;
+  uv::Timer m_timer;
+  std::unordered_map<std::uint32_t, std::unique_ptr<Session>> m_sessions;
+  // Sessions given input the engine hasn't finished with
+  std::unordered_set<Session *> m_busy;
+
+  std::uint64_t m_start = 0;
+  std::uint64_t m_elapsed = 0;
+  uv_rusage_t m_rusage_start;
+  double m_user_cpu = 0;
+  double m_system_cpu = 0;
+
+  Histogram m_latency;
+  std::uint64_t m_records = 0;
+  std::uint64_t m_connections = 0;
+  std::uint64_t m_joined = 0;
+  std::uint64_t m_bytes_in = 0;
+  std::uint64_t m_bytes_out = 0;
+  // Records for connections that were never opened or were already closed,
+  // by the capture or by the engine
+  std::uint64_t m_orphaned = 0;
+  // Closed connections whose output was compared, and the ones that differed
+  std::uint64_t m_compared = 0;
+  std::vector<std::pair<std::uint32_t, std::int64_t>> m_diverged;
+};
+
+Replay::Replay(Engine *engine, Options options)
+    : m_engine(engine), m_options(options), m_reader(options.capture),
+      m_prepare(engine->getLoop()), m_timer(engine->getLoop()) {
+  m_prepare.setData(this);
+  m_timer.setData(this);
+}
+
+void Replay::start() {
+  m_start = uv_hrtime();
+  uv::check_error(uv_getrusage(&m_rusage_start), "Could not get CPU usage");
+  m_prepare.start([](uv_prepare_t *handle) {
+    static_cast<Replay *>(handle->data)->onPrepare();
+  });
+  if (m_options.realtime) {
+    onTimer();
+  }
+}
+
+void Replay::onPrepare() {
+  // Runs just before the loop waits for IO, after commands have run
+  std::uint64_t now = uv_hrtime();
+  for (auto it = m_busy.begin(); it != m_busy.end();) {
+    Session &session = **it;
+    if (!isIdle(session)) {
+      ++it;
+      continue;
+    }
+    if (session.has_line) {
+      m_latency.observe(now - session.busy_since);
+    }
+    session.busy_since = 0;
+    session.has_line = false;
+    it = m_busy.erase(it);
+  }
+
+  if (!m_options.realtime) {
+    // Only move on once the engine has caught up
+    while (m_busy.empty() && readNext()) {
+      m_have_next = false;
+      apply(m_next);
+    }
+  }
+  if (m_busy.empty() && !m_have_next && !readNext()) {
+    finish();
+  }
+}
+
+void Replay::onTimer() {
+  std::uint64_t now = getCaptureTime();
+  while (readNext() && m_next.time <= now) {
+    m_have_next = false;
+    apply(m_next);
+  }
+  if (m_have_next) {
+    std::uint64_t wait_us = m_next.time - now;
+    m_timer.start(
+        [](uv_timer_t *handle) {
+          static_cast<Replay *>(handle->data)->onTimer();
+        },
+        static_cast<std::uint64_t>(wait_us / m_options.speed / 1e3));
+  }
+}
+
+bool Replay::isIdle(Session &session) {
+  Connection *conn = session.conn;
+  return !conn->isOpen() ||
+         (conn->getBytesReceived() == session.written &&
+          conn->getQueuedLines() == 0 && !conn->isCommandRunning() &&
+          conn->getPendingOutput() == 0);
+}
+
+bool Replay::readNext() {
+  if (!m_have_next && !m_finished) {
+    m_have_next = m_reader.next(m_next);
+  }
+  return m_have_next;
+}
+
+void Replay::apply(CaptureRecord &record) {
+  ++m_records;
+  if (record.kind == CaptureRecord::Kind::OPEN) {
+    try {
+      open(record);
+    } catch (const std::exception &e) {
+      fmt::print(stderr, "Could not open connection {}: {}\n",
+                 record.connection, e.what());
+      // Its records are skipped from here on
+      ++m_orphaned;
+      close(*m_sessions.at(record.connection));
+    }
+    return;
+  }
+  auto it = m_sessions.find(record.connection);
+  if (it == m_sessions.end() || it->second->closed) {
+    ++m_orphaned;
+    return;
+  }
+  Session &session = *it->second;
+  if (record.kind == CaptureRecord::Kind::DATA) {
+    if (session.client_open) {
+      send(session, std::move(record.data));
+    } else {
+      ++m_orphaned;
+    }
+    return;
+  }
+
+  // The connection closed, compare the output it got
+  if (!session.joined) {
+    ++m_compared;
+    std::int64_t difference =
+        static_cast<std::int64_t>(session.conn->getBytesSent()) -
+        static_cast<std::int64_t>(record.bytes_sent);
+    if (difference != 0) {
+      m_diverged.emplace_back(session.id, difference);
+    }
+  }
+  close(session);
+}
+
+void Replay::open(const CaptureRecord &record) {
+  if (m_sessions.contains(record.connection)) {
+    ++m_orphaned;
+    return;
+  }
+  std::unique_ptr<Session> &slot = m_sessions[record.connection];
+  slot = std::make_unique<Session>(m_engine->getLoop(), record.connection,
+                                   record.joined);
+  Session &session = *slot;
+  ++m_connections;
+  if (record.joined) {
+    ++m_joined;
+  }
+
+  uv_os_sock_t socks[2];
+  int res = uv_socketpair(SOCK_STREAM, 0, socks, 0, 0);
+  uv::check_error(res, "Could not create a socket pair");
+  try {
+    session.client.open(socks[1]);
+  } catch (const uv::Error &) {
+#ifdef _WIN32
+    closesocket(socks[0]);
+    closesocket(socks[1]);
+#else
+    ::close(socks[0]);
+    ::close(socks[1]);
+#endif
+    throw;
+  }
+  session.client.setData(&session);
+  session.client_open = true;
+  session.client.readStart(
+      [](uv_handle_t *handle, std::size_t, uv_buf_t *buf) {
+        Session *session = static_cast<Session *>(handle->data);
+        *buf = uv_buf_init(session->buf, sizeof(session->buf));
+      },
+      [](uv_stream_t *stream, ssize_t nread, const uv_buf_t *) {
+        Session *session = static_cast<Session *>(stream->data);
+        if (nread < 0) {
+          // The engine closed the connection
+          session->client_open = false;
+          session->client.close();
+        }
+      });
+
+  // Accept the engine's end as a new client
+  lua_State *L = m_engine->getLuaState();
+  session.conn = Connection::create(m_engine, L);
+  m_engine->getConnections().push(L);
+  lua_rawgetp(L, -1, session.conn);
+  session.ref = lua::Ref(L);
+  lua_pop(L, 1); // Connections table
+  session.conn->accept(socks[0]);
+  session.conn->startClientHandler(L);
+}
+
+void Replay::send(Session &session, std::string &&data) {
+  std::uint64_t now = uv_hrtime();
+  m_bytes_in += data.size();
+  session.written += data.size();
+  if (session.busy_since == 0) {
+    session.busy_since = now;
+    m_busy.insert(&session);
+  }
+  if (data.find('\n') != std::string::npos) {
+    session.has_line = true;
+  }
+
+  WriteReq *req = new WriteReq{{}, std::move(data)};
+  uv_buf_t buf = uv_buf_init(req->data.data(), req->data.size());
+  session.client.write(&req->req, &buf, [](uv_write_t *req, int) {
+    // Fails if the engine closed the connection first, which is fine
+    delete reinterpret_cast<WriteReq *>(req);
+  });
+}
+
+void Replay::close(Session &session) {
+  session.closed = true;
+  m_busy.erase(&session);
+  if (session.client_open) {
+    session.client_open = false;
+    session.client.close();
+  }
+}
+
+void Replay::finish() {
+  if (m_finished) {
+    return;
+  }
+  m_finished = true;
+  m_elapsed = uv_hrtime() - m_start;
+  uv_rusage_t rusage;
+  uv::check_error(uv_getrusage(&rusage), "Could not get CPU usage");
+  auto seconds = [](const uv_timeval_t &end, const uv_timeval_t &start) {
+    return (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+  };
+  m_user_cpu = seconds(rusage.ru_utime, m_rusage_start.ru_utime);
+  m_system_cpu = seconds(rusage.ru_stime, m_rusage_start.ru_stime);
+
+  for (auto &[id, session] : m_sessions) {
+    if (session->conn != nullptr) {
+      m_bytes_out += session->conn->getBytesSent();
+    }
+    close(*session);
+  }
+  m_prepare.stop();
+  m_timer.stop();
+  uv_stop(m_engine->getLoop());
+}
+
+static std::string percentiles(const Histogram &hist) {
+  if (hist.getCount() == 0) {
+    return "-";
+  }
+  return fmt::format("p50 {:.2f}  p90 {:.2f}  p99 {:.2f}  p99.9 {:.2f}  "
+                     "max {:.2f} ms",
+                     hist.getPercentile(50) / 1e6,
+                     hist.getPercentile(90) / 1e6,
+                     hist.getPercentile(99) / 1e6,
+                     hist.getPercentile(99.9) / 1e6, hist.getMax() / 1e6);
+}
+
+void Replay::print() const {
+  double seconds = m_elapsed / 1e9;
+  fmt::print("{} records, {} connections ({} joined mid-session) in {:.2f} s "
+             "{}\n",
+             m_records, m_connections, m_joined, seconds,
+             m_options.realtime
+                 ? fmt::format("at {}x captured speed", m_options.speed)
+                 : "as fast as possible");
+  if (m_reader.isTruncated()) {
+    fmt::print("The capture was cut short, its last record was skipped\n");
+  }
+  fmt::print("CPU {:.2f} s user, {:.2f} s system, {:.0f}% of one core\n",
+             m_user_cpu, m_system_cpu,
+             100 * (m_user_cpu + m_system_cpu) / seconds);
+  fmt::print("{} commands ({:.1f}/s)\n  {}\n", m_latency.getCount(),
+             m_latency.getCount() / seconds, percentiles(m_latency));
+  fmt::print("{} bytes in, {} bytes out\n", m_bytes_in, m_bytes_out);
+  fmt::print("{} of {} connections compared diverged\n", m_diverged.size(),
+             m_compared);
+  for (std::size_t i = 0; i < m_diverged.size() && i < 20; ++i) {
+    fmt::print("  connection {}: {:+} bytes of output\n", m_diverged[i].first,
+               m_diverged[i].second);
+  }
+  if (m_orphaned > 0) {
+    fmt::print("{} records for unknown connections were skipped\n",
+               m_orphaned);
+  }
+}
+
+void Replay::printJson() const {
+  double seconds = m_elapsed / 1e9;
+  std::string diverged;
+  for (const auto &[id, difference] : m_diverged) {
+    diverged += fmt::format("{}{{\"connection\":{},\"bytes\":{}}}",
+                            diverged.empty() ? "" : ",", id, difference);
+  }
+  const Histogram &hist = m_latency;
+  fmt::print(
+      "{{\"seconds\":{:.3f},\"realtime\":{},\"speed\":{},\"records\":{},"
+      "\"truncated\":{},\"connections\":{},\"joined\":{},"
+      "\"cpu\":{{\"user\":{:.3f},\"system\":{:.3f}}},"
+      "\"commands\":{},\"per_second\":{:.3f},"
+      "\"latency_ms\":{{\"p50\":{:.3f},\"p90\":{:.3f},\"p99\":{:.3f},"
+      "\"p999\":{:.3f},\"max\":{:.3f}}},"
+      "\"bytes_in\":{},\"bytes_out\":{},\"orphaned\":{},\"compared\":{},"
+      "\"diverged\":[{}]}}\n",
+      seconds, m_options.realtime, m_options.speed, m_records,
+      m_reader.isTruncated(), m_connections, m_joined, m_user_cpu,
+      m_system_cpu, hist.getCount(), hist.getCount() / seconds,
+      hist.getPercentile(50) / 1e6, hist.getPercentile(90) / 1e6,
+      hist.getPercentile(99) / 1e6, hist.getPercentile(99.9) / 1e6,
+      hist.getMax() / 1e6, m_bytes_in, m_bytes_out, m_orphaned, m_compared,
+      diverged);
+}
+
+} // namespace whatmud::replay
+
+namespace replay = whatmud::replay;
+
+[[noreturn]] static void usage(char *argv[], const char *errmsg) {
+  const char *prog = argv[0] ? argv[0] : "whatmud-replay";
+  fmt::print(stderr, "Error: {}\n", errmsg);
+  fmt::print(stderr,
+             "Usage: {} [options] <game-directory> <capture>\n"
+             "  --realtime     send input at its captured times\n"
+             "  --speed <n>    with --realtime, run this many times faster\n"
+             "  --json         print the results as JSON\n",
+             prog);
+  std::exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+  argv = uv_setup_args(argc, argv);
+
+  replay::Options options;
+  for (int i = 1; i < argc; ++i) {
+    std::string_view arg(argv[i]);
+    if (arg == "--realtime") {
+      options.realtime = true;
+    } else if (arg == "--json") {
+      options.json = true;
+    } else if (arg == "--speed") {
+      if (++i == argc) {
+        usage(argv, "Missing option value");
+      }
+      std::string_view value(argv[i]);
+      auto [end, ec] = std::from_chars(
+          value.data(), value.data() + value.size(), options.speed);
+      if (ec != std::errc() || end != value.data() + value.size() ||
+          options.speed <= 0) {
+        usage(argv, "Expected a positive number");
+      }
+      options.realtime = true;
+    } else if (options.game_dir == nullptr) {
+      options.game_dir = argv[i];
+    } else if (options.capture == nullptr) {
+      options.capture = argv[i];
+    } else {
+      usage(argv, "Too many arguments were given");
+    }
+  }
+  if (options.capture == nullptr) {
+    usage(argv, "Please specify a game directory and a capture to replay");
+  }
+
+  try {
+    // Neither is destroyed, the engine's handles are never closed
+    auto *engine = new whatmud::Engine(options.game_dir, true);
+    auto *replay = new replay::Replay(engine, options);
+    replay->start();
+    engine->run();
+    if (options.json) {
+      replay->printJson();
+    } else {
+      replay->print();
+    }
+  } catch (const std::exception &e) {
+    fmt::print(stderr, "Error: {}\n", e.what());
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}